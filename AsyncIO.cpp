@@ -0,0 +1,415 @@
+#include "pch.h"
+#include "AsyncIO.h"
+
+#include <algorithm>
+
+AsyncIO::Counters AsyncIO::counters() const
+{
+	Counters counters;
+	counters.reads = reads.load(std::memory_order_relaxed);
+	counters.submissions = submissions.load(std::memory_order_relaxed);
+	counters.resubmitted = resubmitted.load(std::memory_order_relaxed);
+	return counters;
+}
+
+void AsyncIO::read(Request* request)
+{
+	request->done = 0;
+	request->result = S_OK;
+	in_flight++;
+	reads.fetch_add(1, std::memory_order_relaxed);
+	issue(request);
+}
+
+void AsyncIO::complete(Request* request, HRESULT hr)
+{
+	request->result = hr;
+	in_flight--;
+}
+
+bool AsyncIO::progress(Request* request, HRESULT hr, UINT32 bytes)
+{
+	if (FAILED(hr)) {
+		complete(request, hr);
+		return true;
+	}
+	if (bytes == 0) {
+		complete(request, HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
+		return true;
+	}
+
+	request->done += bytes;
+	if (request->done >= request->length) {
+		complete(request, S_OK);
+		return true;
+	}
+
+	resubmitted.fetch_add(1, std::memory_order_relaxed);
+	issue(request);
+	return false;
+}
+
+#ifdef _WIN32
+
+AsyncIO::AsyncIO() :
+	ring_depth(0),
+	in_flight(0),
+	reads(0),
+	submissions(0),
+	resubmitted(0),
+	port(NULL)
+{
+}
+
+AsyncIO::~AsyncIO()
+{
+	stop();
+}
+
+HRESULT AsyncIO::start(UINT32 depth)
+{
+	port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (port == NULL) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	ring_depth = depth;
+	ready.reserve(depth);
+	return S_OK;
+}
+
+void AsyncIO::stop()
+{
+	if (port != NULL) {
+		CloseHandle(port);
+		port = NULL;
+	}
+}
+
+bool AsyncIO::running() const
+{
+	return port != NULL;
+}
+
+// Handles must be opened for overlapped I/O and bound to the port before their first read
+HRESULT AsyncIO::openFile(const std::wstring& path, SourceFileSystem::FileHandle& file)
+{
+	HRESULT hr = SourceFileSystem::openForReading(path, file, true);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	if (CreateIoCompletionPort(file, port, 0, 0) == NULL) {
+		hr = HRESULT_FROM_WIN32(GetLastError());
+		SourceFileSystem::closeFile(file);
+	}
+	return hr;
+}
+
+void AsyncIO::issue(Request* request)
+{
+	UINT64 offset = request->offset + request->done;
+	ZeroMemory(&request->overlapped, sizeof(request->overlapped));
+	request->overlapped.Offset = static_cast<DWORD>(offset);
+	request->overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+	submissions.fetch_add(1, std::memory_order_relaxed);
+	if (!ReadFile(
+		request->file,
+		static_cast<BYTE*>(request->buffer) + request->done,
+		request->length - request->done,
+		NULL,
+		&request->overlapped
+	)) {
+		// A read which fails to start posts no completion
+		DWORD error = GetLastError();
+		if (error != ERROR_IO_PENDING) {
+			complete(request, HRESULT_FROM_WIN32(error));
+			ready.push_back(request);
+		}
+	}
+}
+
+// ReadFile starts each read as it is queued
+HRESULT AsyncIO::submit()
+{
+	return S_OK;
+}
+
+size_t AsyncIO::reap(Request** completed, size_t max, bool wait)
+{
+	size_t count = 0;
+	while (count < max && !ready.empty()) {
+		completed[count++] = ready.back();
+		ready.pop_back();
+	}
+
+	OVERLAPPED_ENTRY entries[64];
+	while (count < max) {
+		ULONG removed = 0;
+		DWORD timeout = wait && count == 0 && in_flight > 0 ? INFINITE : 0;
+		ULONG wanted = static_cast<ULONG>(std::min<size_t>(max - count, 64));
+		if (!GetQueuedCompletionStatusEx(port, entries, wanted, &removed, timeout, FALSE)) {
+			break;
+		}
+
+		for (ULONG i = 0; i < removed; i++) {
+			Request* request = reinterpret_cast<Request*>(entries[i].lpOverlapped);
+			HRESULT hr = S_OK;
+			DWORD bytes = entries[i].dwNumberOfBytesTransferred;
+			if (entries[i].lpOverlapped->Internal != 0 &&
+				!GetOverlappedResult(request->file, &request->overlapped, &bytes, FALSE)
+			) {
+				hr = HRESULT_FROM_WIN32(GetLastError());
+			}
+
+			if (progress(request, hr, bytes)) {
+				completed[count++] = request;
+			}
+		}
+
+		if (count > 0 || !wait || in_flight == 0) {
+			break;
+		}
+	}
+	return count;
+}
+
+const char* AsyncIO::backendName()
+{
+	return "I/O completion port";
+}
+
+#else
+
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// liburing is not a dependency; the ring is driven through its two system calls
+static int ioUringSetup(unsigned entries, struct io_uring_params* params) {
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+	return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0));
+}
+
+AsyncIO::AsyncIO() :
+	ring_depth(0),
+	in_flight(0),
+	reads(0),
+	submissions(0),
+	resubmitted(0),
+	ring_fd(-1),
+	sq_ring(MAP_FAILED),
+	sq_ring_bytes(0),
+	cq_ring(MAP_FAILED),
+	cq_ring_bytes(0),
+	sqes(MAP_FAILED),
+	sqes_bytes(0),
+	sq_tail(NULL),
+	sq_mask(0),
+	sq_array(NULL),
+	cq_head(NULL),
+	cq_tail(NULL),
+	cq_mask(0),
+	cqes(NULL),
+	queued(0)
+{
+}
+
+AsyncIO::~AsyncIO()
+{
+	stop();
+}
+
+HRESULT AsyncIO::start(UINT32 depth)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring_fd = ioUringSetup(depth, &params);
+	if (ring_fd < 0) {
+		return SourceFileSystem::errorFromErrno(errno);
+	}
+
+	sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single) {
+		sq_ring_bytes = cq_ring_bytes = std::max(sq_ring_bytes, cq_ring_bytes);
+	}
+
+	sq_ring = mmap(NULL, sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ring != MAP_FAILED) {
+		cq_ring = single ? sq_ring :
+			mmap(NULL, cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	}
+	if (cq_ring != MAP_FAILED) {
+		sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+		sqes = mmap(NULL, sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	}
+	if (sqes == MAP_FAILED) {
+		HRESULT hr = SourceFileSystem::errorFromErrno(errno);
+		stop();
+		return hr;
+	}
+
+	char* sq = static_cast<char*>(sq_ring);
+	char* cq = static_cast<char*>(cq_ring);
+	sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	cqes = cq + params.cq_off.cqes;
+
+	// The kernel rounds the queues up to a power of two, and the completion queue is twice as
+	// long again, so neither fills while no more than depth reads are in flight
+	ring_depth = depth;
+	ready.reserve(depth);
+	return S_OK;
+}
+
+void AsyncIO::stop()
+{
+	if (sqes != MAP_FAILED) {
+		munmap(sqes, sqes_bytes);
+		sqes = MAP_FAILED;
+	}
+	if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+		munmap(cq_ring, cq_ring_bytes);
+	}
+	cq_ring = MAP_FAILED;
+	if (sq_ring != MAP_FAILED) {
+		munmap(sq_ring, sq_ring_bytes);
+		sq_ring = MAP_FAILED;
+	}
+	if (ring_fd >= 0) {
+		close(ring_fd);
+		ring_fd = -1;
+	}
+}
+
+bool AsyncIO::running() const
+{
+	return ring_fd >= 0;
+}
+
+HRESULT AsyncIO::openFile(const std::wstring& path, SourceFileSystem::FileHandle& file)
+{
+	return SourceFileSystem::openForReading(path, file, true);
+}
+
+void AsyncIO::issue(Request* request)
+{
+	// Only this thread moves the tail, so it can be read plainly
+	unsigned tail = *sq_tail;
+	unsigned index = tail & sq_mask;
+
+	struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(sqes) + index;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = request->file;
+	sqe->off = request->offset + request->done;
+	sqe->addr = reinterpret_cast<UINT64>(static_cast<char*>(request->buffer) + request->done);
+	sqe->len = request->length - request->done;
+	sqe->user_data = reinterpret_cast<UINT64>(request);
+
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	queued++;
+}
+
+/*
+	A submission the kernel refuses outright leaves its entries in the queue; they are taken back
+	and completed with the failure, so no request is left waiting for a completion that will never
+	come.
+*/
+HRESULT AsyncIO::submit()
+{
+	while (queued > 0) {
+		int submitted = ioUringEnter(ring_fd, queued, 0, 0);
+		if (submitted >= 0) {
+			queued -= static_cast<UINT32>(submitted);
+			submissions.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		// Completions are still to be reaped; reap() submits the rest
+		if (errno == EAGAIN || errno == EBUSY) {
+			return S_OK;
+		}
+
+		HRESULT hr = SourceFileSystem::errorFromErrno(errno);
+		unsigned tail = *sq_tail;
+		for (unsigned i = tail - queued; i != tail; i++) {
+			struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(sqes) + (i & sq_mask);
+			Request* request = reinterpret_cast<Request*>(sqe->user_data);
+			complete(request, hr);
+			ready.push_back(request);
+		}
+		__atomic_store_n(sq_tail, tail - queued, __ATOMIC_RELEASE);
+		queued = 0;
+		return hr;
+	}
+	return S_OK;
+}
+
+size_t AsyncIO::reap(Request** completed, size_t max, bool wait)
+{
+	size_t count = 0;
+	while (count < max && !ready.empty()) {
+		completed[count++] = ready.back();
+		ready.pop_back();
+	}
+
+	struct io_uring_cqe* entries = static_cast<struct io_uring_cqe*>(cqes);
+	for (;;) {
+		unsigned head = *cq_head;
+		unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail && count < max) {
+			struct io_uring_cqe* cqe = &entries[head & cq_mask];
+			Request* request = reinterpret_cast<Request*>(cqe->user_data);
+			int res = cqe->res;
+			head++;
+
+			if (res == -EINTR || res == -EAGAIN) {
+				resubmitted.fetch_add(1, std::memory_order_relaxed);
+				issue(request);
+			} else if (progress(request, res < 0 ? SourceFileSystem::errorFromErrno(-res) : S_OK, res < 0 ? 0 : static_cast<UINT32>(res))) {
+				completed[count++] = request;
+			}
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+		if (count > 0 || !wait || in_flight == 0) {
+			break;
+		}
+
+		// Hands over any resubmitted reads and sleeps until something completes
+		int submitted = ioUringEnter(ring_fd, queued, 1, IORING_ENTER_GETEVENTS);
+		if (submitted > 0) {
+			queued -= static_cast<UINT32>(submitted);
+			submissions.fetch_add(1, std::memory_order_relaxed);
+		} else if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			break;
+		}
+	}
+
+	submit();
+	return count;
+}
+
+const char* AsyncIO::backendName()
+{
+	return "io_uring";
+}
+
+#endif // _WIN32
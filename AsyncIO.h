@@ -0,0 +1,122 @@
+#pragma once
+
+#include "pch.h"
+#include "SourceFileSystem.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+/*
+	A ring of asynchronous reads from source files: io_uring on Linux, driven through the raw
+	system calls, and an I/O completion port on Windows. Reads are queued with read(), handed to
+	the kernel together by submit() and collected as they complete by reap(), so one thread keeps
+	many reads in flight with a system call per batch rather than per read.
+
+	A ring belongs to the one thread that uses it. A request completes once its whole range has
+	been read, it runs into the end of the file, or it fails; short reads are resubmitted for the
+	rest of the range.
+*/
+class AsyncIO
+{
+public:
+	class Request {
+	public:
+#ifdef _WIN32
+		// First, so the OVERLAPPED a completion names leads back to its request
+		OVERLAPPED overlapped;
+#endif
+		SourceFileSystem::FileHandle file;
+		UINT64 offset;
+		UINT32 length;
+		void* buffer;
+		// For the caller, to find what the read was for
+		void* owner;
+
+		// Filled in by the ring
+		UINT32 done;
+		HRESULT result;
+	};
+
+	class Counters {
+	public:
+		UINT64 reads;
+		UINT64 submissions;
+		UINT64 resubmitted;
+	};
+
+protected:
+	UINT32 ring_depth;
+	UINT32 in_flight;
+	// Requests which finished without reaching the kernel, returned by the next reap()
+	std::vector<Request*> ready;
+
+	std::atomic<UINT64> reads;
+	std::atomic<UINT64> submissions;
+	std::atomic<UINT64> resubmitted;
+
+#ifdef _WIN32
+	HANDLE port;
+#else
+	int ring_fd;
+	// The mappings of the submission queue, completion queue and submission entries
+	void* sq_ring;
+	size_t sq_ring_bytes;
+	void* cq_ring;
+	size_t cq_ring_bytes;
+	void* sqes;
+	size_t sqes_bytes;
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	void* cqes;
+	// Entries placed in the submission queue but not yet handed to the kernel
+	UINT32 queued;
+#endif
+
+	// Starts the read of the rest of a request's range
+	void issue(Request* request);
+
+	// Accounts for bytes read, or the failure; returns true once the request is complete, and
+	// resubmits it otherwise
+	bool progress(Request* request, HRESULT hr, UINT32 bytes);
+
+	void complete(Request* request, HRESULT hr);
+
+public:
+	AsyncIO();
+	~AsyncIO();
+
+	AsyncIO(const AsyncIO&) = delete;
+	AsyncIO& operator=(const AsyncIO&) = delete;
+
+	// Sets the ring up for depth reads in flight; fails where the system has no such reads
+	HRESULT start(UINT32 depth);
+	void stop();
+
+	bool running() const;
+	UINT32 depth() const { return ring_depth; }
+	UINT32 inFlight() const { return in_flight; }
+
+	// Opens a file for this ring's reads; the caller closes it with SourceFileSystem::closeFile
+	HRESULT openFile(const std::wstring& path, SourceFileSystem::FileHandle& file);
+
+	// Queues the read of a request's range; no more than depth() may be in flight
+	void read(Request* request);
+
+	// Hands the queued reads to the kernel
+	HRESULT submit();
+
+	/*
+		Fills completed with up to max completed requests and returns how many. With wait set,
+		blocks until at least one completes, unless none are in flight.
+	*/
+	size_t reap(Request** completed, size_t max, bool wait);
+
+	Counters counters() const;
+
+	// The name of the platform's implementation
+	static const char* backendName();
+};
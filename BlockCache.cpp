@@ -0,0 +1,379 @@
+#include "pch.h"
+#include "BlockCache.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Default budget for cached file data
+static const size_t BLOCK_CACHE_DEFAULT_BYTES = 64 * 1024 * 1024;
+
+size_t BlockCache::KeyHash::operator()(const Key& key) const
+{
+	UINT64 hash = key.file * 0x9e3779b97f4a7c15ull;
+	hash ^= key.block + 0x632be59bd9b4e019ull + (hash << 6) + (hash >> 2);
+	hash ^= static_cast<UINT64>(key.version) + (hash << 6) + (hash >> 2);
+	hash ^= key.volume + (hash << 6) + (hash >> 2);
+	return static_cast<size_t>(hash);
+}
+
+BlockCache::BlockCache() :
+	shards(new Shard[SHARD_COUNT]),
+	capacity_bytes(0),
+	hits(0),
+	misses(0),
+	shared(0),
+	ghost_hits(0),
+	evictions(0),
+	invalidated(0),
+	source_bytes(0)
+{
+	setCapacity(BLOCK_CACHE_DEFAULT_BYTES);
+}
+
+void BlockCache::setCapacity(size_t bytes)
+{
+	for (size_t i = 0; i < SHARD_COUNT; i++) {
+		std::lock_guard<std::mutex> lock(shards[i].mutex);
+		shards[i].capacity = bytes / SHARD_COUNT;
+		shards[i].target = std::min(shards[i].target, shards[i].capacity);
+	}
+	capacity_bytes.store(bytes, std::memory_order_relaxed);
+}
+
+BlockCache::Shard& BlockCache::shardOf(const Key& key)
+{
+	size_t hash = KeyHash()(key);
+	hash ^= hash >> 29;
+	hash *= 0xbf58476d1ce4e5b9ull;
+	hash ^= hash >> 32;
+	return shards[hash & (SHARD_COUNT - 1)];
+}
+
+void BlockCache::move(Shard& shard, Slot& slot, const Key& key, ListId list)
+{
+	shard.lists[slot.list].erase(slot.position);
+	shard.bytes[slot.list] -= slot.size;
+	shard.lists[list].push_front(key);
+	shard.bytes[list] += slot.size;
+	slot.list = list;
+	slot.position = shard.lists[list].begin();
+	if (list == LIST_B1 || list == LIST_B2) {
+		slot.block.reset();
+	}
+}
+
+void BlockCache::link(Shard& shard, const Key& key, ListId list, const std::shared_ptr<const Block>& block)
+{
+	shard.lists[list].push_front(key);
+	shard.bytes[list] += block->size();
+
+	Slot& slot = shard.slots[key];
+	slot.list = list;
+	slot.position = shard.lists[list].begin();
+	slot.block = block;
+	slot.size = block->size();
+}
+
+// Forgets the least recently used key of a list entirely
+void BlockCache::dropLast(Shard& shard, ListId list)
+{
+	if (shard.lists[list].empty()) {
+		return;
+	}
+
+	auto it = shard.slots.find(shard.lists[list].back());
+	shard.bytes[list] -= it->second.size;
+	shard.slots.erase(it);
+	shard.lists[list].pop_back();
+	if (list == LIST_T1 || list == LIST_T2) {
+		evictions.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void BlockCache::replace(Shard& shard, bool inB2)
+{
+	size_t t1 = shard.bytes[LIST_T1];
+	ListId from = LIST_T2;
+	if (t1 != 0 && (t1 > shard.target || (inB2 && t1 == shard.target) || shard.lists[LIST_T2].empty())) {
+		from = LIST_T1;
+	}
+
+	const Key key = shard.lists[from].back();
+	move(shard, shard.slots[key], key, from == LIST_T1 ? LIST_B1 : LIST_B2);
+	evictions.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::shared_ptr<const BlockCache::Block> BlockCache::claim(const Key& key, std::shared_ptr<Flight>& flight, bool& leader)
+{
+	Shard& shard = shardOf(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto it = shard.slots.find(key);
+	if (it != shard.slots.end() && (it->second.list == LIST_T1 || it->second.list == LIST_T2)) {
+		move(shard, it->second, key, LIST_T2);
+		return it->second.block;
+	}
+
+	std::shared_ptr<Flight>& inFlight = shard.flights[key];
+	leader = inFlight == nullptr;
+	if (leader) {
+		inFlight = std::make_shared<Flight>();
+	}
+	flight = inFlight;
+	return nullptr;
+}
+
+void BlockCache::land(
+	const Key& key,
+	const std::shared_ptr<Flight>& flight,
+	const std::shared_ptr<const Block>& block,
+	HRESULT hr
+) {
+	// Cache the block in the same step that retires the flight, so no reader finds neither
+	{
+		Shard& shard = shardOf(key);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		if (SUCCEEDED(hr)) {
+			insert(shard, key, block);
+		}
+		shard.flights.erase(key);
+	}
+
+	std::lock_guard<std::mutex> lock(flight->mutex);
+	flight->block = block;
+	flight->done = true;
+	flight->landed.notify_all();
+}
+
+void BlockCache::insert(Shard& shard, const Key& key, const std::shared_ptr<const Block>& block)
+{
+	size_t capacity = shard.capacity;
+	size_t size = block->size();
+	if (size == 0 || size > capacity) {
+		return;
+	}
+
+	auto it = shard.slots.find(key);
+	if (it != shard.slots.end() && (it->second.list == LIST_T1 || it->second.list == LIST_T2)) {
+		// Another reader filled it first
+		it->second.block = block;
+		move(shard, it->second, key, LIST_T2);
+		return;
+	}
+
+	bool inB2 = false;
+	if (it != shard.slots.end()) {
+		// A ghost hit: T1 was too small if the key was evicted from it, T2 if from there
+		inB2 = it->second.list == LIST_B2;
+		size_t b1 = std::max<size_t>(1, shard.bytes[LIST_B1]);
+		size_t b2 = std::max<size_t>(1, shard.bytes[LIST_B2]);
+		if (inB2) {
+			size_t delta = std::max(size, size * (b1 / b2));
+			shard.target = shard.target > delta ? shard.target - delta : 0;
+		} else {
+			size_t delta = std::max(size, size * (b2 / b1));
+			shard.target = std::min(capacity, shard.target + delta);
+		}
+		ghost_hits.fetch_add(1, std::memory_order_relaxed);
+
+		// It comes back as a block seen more than once
+		ListId ghost = it->second.list;
+		shard.lists[ghost].erase(it->second.position);
+		shard.bytes[ghost] -= it->second.size;
+		shard.slots.erase(it);
+
+		while (shard.resident() + size > capacity) {
+			replace(shard, inB2);
+		}
+		link(shard, key, LIST_T2, block);
+		return;
+	}
+
+	// A new key: keep T1 and B1 within the capacity, and all four lists within twice it
+	while (shard.bytes[LIST_T1] + shard.bytes[LIST_B1] + size > capacity) {
+		ListId victim = shard.bytes[LIST_T1] + size <= capacity ? LIST_B1 : LIST_T1;
+		if (shard.lists[victim].empty()) {
+			break;
+		}
+		dropLast(shard, victim);
+	}
+	while (shard.resident() + shard.ghosts() + size > 2 * capacity && shard.ghosts() != 0) {
+		dropLast(shard, shard.lists[LIST_B2].empty() ? LIST_B1 : LIST_B2);
+	}
+	while (shard.resident() + size > capacity) {
+		replace(shard, false);
+	}
+
+	link(shard, key, LIST_T1, block);
+}
+
+HRESULT BlockCache::read(
+	const SourceFileSystem::FileIdentity& identity,
+	SourceFileSystem::FileHandle file,
+	UINT64 offset,
+	UINT32 length,
+	void* buffer
+) {
+	if (offset + length > static_cast<UINT64>(identity.size)) {
+		return HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+	}
+	if (length == 0) {
+		return S_OK;
+	}
+
+	Key key;
+	key.volume = identity.volume;
+	key.file = identity.file;
+	key.version = identity.version;
+
+	UINT64 first = offset / BLOCK_SIZE;
+	size_t count = static_cast<size_t>((offset + length - 1) / BLOCK_SIZE - first + 1);
+	std::vector<std::shared_ptr<const Block>> blocks(count);
+	std::vector<std::shared_ptr<Flight>> flights(count);
+	std::vector<bool> leading(count);
+	size_t found = 0;
+	size_t led = 0;
+	for (size_t i = 0; i < count; i++) {
+		bool leader = false;
+		key.block = first + i;
+		blocks[i] = claim(key, flights[i], leader);
+		leading[i] = leader;
+		found += blocks[i] != nullptr;
+		led += leader;
+	}
+	hits.fetch_add(found, std::memory_order_relaxed);
+	misses.fetch_add(led, std::memory_order_relaxed);
+	shared.fetch_add(count - found - led, std::memory_order_relaxed);
+
+	// Read each run of blocks this request leads in one go. Every flight must land, even after
+	// a failure, or the readers waiting on it would never wake
+	HRESULT hr = S_OK;
+	for (size_t i = 0; i < count;) {
+		if (!leading[i]) {
+			i++;
+			continue;
+		}
+
+		size_t end = i;
+		while (end < count && leading[end]) {
+			end++;
+		}
+
+		UINT64 runStart = (first + i) * BLOCK_SIZE;
+		UINT64 runEnd = std::min((first + end) * BLOCK_SIZE, static_cast<UINT64>(identity.size));
+		std::shared_ptr<Block> single;
+		std::vector<char> data;
+
+		// A single block, such as a whole small file, is read straight into place
+		char* target;
+		if (end - i == 1) {
+			single = std::make_shared<Block>(static_cast<size_t>(runEnd - runStart));
+			target = single->data();
+		} else {
+			data.resize(static_cast<size_t>(runEnd - runStart));
+			target = data.data();
+		}
+
+		HRESULT read = FAILED(hr) ? hr :
+			SourceFileSystem::readFile(file, runStart, static_cast<UINT32>(runEnd - runStart), target);
+		if (SUCCEEDED(read)) {
+			source_bytes.fetch_add(runEnd - runStart, std::memory_order_relaxed);
+		} else {
+			hr = read;
+		}
+
+		for (size_t b = i; b < end; b++) {
+			std::shared_ptr<Block> block = single;
+			if (block == nullptr && SUCCEEDED(read)) {
+				size_t from = static_cast<size_t>((b - i) * BLOCK_SIZE);
+				size_t to = std::min(from + BLOCK_SIZE, data.size());
+				block = std::make_shared<Block>(to - from);
+				memcpy(block->data(), data.data() + from, to - from);
+			}
+
+			key.block = first + b;
+			land(key, flights[b], SUCCEEDED(read) ? block : nullptr, read);
+			blocks[b] = block;
+		}
+		i = end;
+	}
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	// Collect the blocks other readers were fetching; if one failed for them, try it here
+	for (size_t i = 0; i < count; i++) {
+		if (blocks[i] != nullptr) {
+			continue;
+		}
+
+		Flight& flight = *flights[i];
+		{
+			std::unique_lock<std::mutex> lock(flight.mutex);
+			flight.landed.wait(lock, [&flight] { return flight.done; });
+			blocks[i] = flight.block;
+		}
+
+		if (blocks[i] == nullptr) {
+			UINT64 blockStart = (first + i) * BLOCK_SIZE;
+			size_t size = static_cast<size_t>(std::min<UINT64>(BLOCK_SIZE, identity.size - blockStart));
+			std::shared_ptr<Block> block = std::make_shared<Block>(size);
+			hr = SourceFileSystem::readFile(file, blockStart, static_cast<UINT32>(size), block->data());
+			if (FAILED(hr)) {
+				return hr;
+			}
+			source_bytes.fetch_add(size, std::memory_order_relaxed);
+			blocks[i] = block;
+		}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		UINT64 blockStart = (first + i) * BLOCK_SIZE;
+		UINT64 from = std::max(offset, blockStart);
+		UINT64 to = std::min(offset + length, blockStart + blocks[i]->size());
+		memcpy(static_cast<char*>(buffer) + (from - offset), blocks[i]->data() + (from - blockStart), static_cast<size_t>(to - from));
+	}
+	return S_OK;
+}
+
+void BlockCache::invalidate(const SourceFileSystem::FileIdentity& identity)
+{
+	// A file's blocks are spread over every shard, and ghosts of it are forgotten too, since the
+	// reads that evicted them say nothing about the file's future
+	for (size_t i = 0; i < SHARD_COUNT; i++) {
+		Shard& shard = shards[i];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		for (auto it = shard.slots.begin(); it != shard.slots.end();) {
+			if (it->first.volume != identity.volume || it->first.file != identity.file) {
+				++it;
+				continue;
+			}
+			Slot& slot = it->second;
+			shard.bytes[slot.list] -= slot.size;
+			shard.lists[slot.list].erase(slot.position);
+			if (slot.list == LIST_T1 || slot.list == LIST_T2) {
+				invalidated.fetch_add(1, std::memory_order_relaxed);
+			}
+			it = shard.slots.erase(it);
+		}
+	}
+}
+
+void BlockCache::printStatistics(FILE* out)
+{
+	size_t blocks = 0;
+	for (size_t i = 0; i < SHARD_COUNT; i++) {
+		std::lock_guard<std::mutex> lock(shards[i].mutex);
+		blocks += shards[i].lists[LIST_T1].size() + shards[i].lists[LIST_T2].size();
+	}
+
+	fprintf(out, "  block cache: %zu blocks, hits %llu, misses %llu, shared in flight %llu, ghost hits %llu, evictions %llu, invalidated %llu, %.1f MB read from source\n",
+		blocks,
+		static_cast<unsigned long long>(hits.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(misses.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(shared.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(ghost_hits.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(evictions.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(invalidated.load(std::memory_order_relaxed)),
+		source_bytes.load(std::memory_order_relaxed) / (1024.0 * 1024.0));
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include "pch.h"
+#include "SourceFileSystem.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+	Size-bounded cache of source file data in fixed-size blocks, keyed by the file's identity and
+	version and the block's index, so the same contents read through different paths, virtualization
+	roots or rehydrations are read from the source once, and a file changed in place is never
+	served from its old blocks.
+
+	Each shard runs ARC (Megiddo and Modha, "ARC: A Self-Tuning, Low Overhead Replacement Cache"):
+	blocks seen once and blocks seen again are kept in separate LRU lists, and ghost lists of
+	recently evicted keys move the split between them. A long sequential read only ever churns the
+	seen-once list, so it cannot flush the blocks that are being reused.
+*/
+class BlockCache
+{
+public:
+	static const UINT32 BLOCK_SIZE = 64 * 1024;
+
+protected:
+	class Key {
+	public:
+		UINT64 volume;
+		UINT64 file;
+		INT64 version;
+		UINT64 block;
+
+		bool operator==(const Key& other) const {
+			return volume == other.volume && file == other.file &&
+				version == other.version && block == other.block;
+		}
+	};
+
+	class KeyHash {
+	public:
+		size_t operator() (const Key& key) const;
+	};
+
+	// Left uninitialized until read into, unlike a vector
+	class Block {
+	public:
+		std::unique_ptr<char[]> bytes;
+		size_t length;
+
+		explicit Block(size_t length) : bytes(new char[length]), length(length) {}
+
+		char* data() { return bytes.get(); }
+		const char* data() const { return bytes.get(); }
+		size_t size() const { return length; }
+	};
+
+	// The four ARC lists: T1 and T2 hold blocks, B1 and B2 only remember evicted keys
+	enum ListId {
+		LIST_T1,
+		LIST_T2,
+		LIST_B1,
+		LIST_B2,
+		LIST_COUNT
+	};
+
+	class Slot {
+	public:
+		ListId list;
+		std::list<Key>::iterator position;
+		std::shared_ptr<const Block> block;
+		// Blocks at the end of a file are short; ghosts remember the size they had
+		size_t size;
+	};
+
+	// A source read of one block in progress; other readers needing the block wait for it
+	class Flight {
+	public:
+		std::mutex mutex;
+		std::condition_variable landed;
+		bool done;
+		// nullptr if the leader's read failed
+		std::shared_ptr<const Block> block;
+
+		Flight() : done(false) {}
+	};
+
+	/*
+		ARC's list lengths are counted in bytes rather than blocks, so the many short blocks of
+		small files are held to the same budget as whole ones.
+	*/
+	class alignas(64) Shard {
+	public:
+		std::mutex mutex;
+		std::unordered_map<Key, Slot, KeyHash> slots;
+		std::unordered_map<Key, std::shared_ptr<Flight>, KeyHash> flights;
+		// Most recently used at the front
+		std::list<Key> lists[LIST_COUNT];
+		size_t bytes[LIST_COUNT];
+		// Bytes the shard may hold, and ARC's target size for T1
+		size_t capacity;
+		size_t target;
+
+		Shard() : bytes(), capacity(0), target(0) {}
+
+		size_t resident() const { return bytes[LIST_T1] + bytes[LIST_T2]; }
+		size_t ghosts() const { return bytes[LIST_B1] + bytes[LIST_B2]; }
+	};
+
+	static const size_t SHARD_COUNT = 16;
+
+	std::unique_ptr<Shard[]> shards;
+	std::atomic<size_t> capacity_bytes;
+
+	std::atomic<UINT64> hits;
+	std::atomic<UINT64> misses;
+	std::atomic<UINT64> shared;
+	std::atomic<UINT64> ghost_hits;
+	std::atomic<UINT64> evictions;
+	std::atomic<UINT64> invalidated;
+	std::atomic<UINT64> source_bytes;
+
+	Shard& shardOf(const Key& key);
+
+	/*
+		Returns the cached block, promoting it to T2. Otherwise returns nullptr with the flight
+		reading the block, which the caller leads if no other reader had started it.
+	*/
+	std::shared_ptr<const Block> claim(const Key& key, std::shared_ptr<Flight>& flight, bool& leader);
+
+	// Ends a flight the caller leads with the block it read, or the failure, caching the block
+	void land(const Key& key, const std::shared_ptr<Flight>& flight, const std::shared_ptr<const Block>& block, HRESULT hr);
+
+	// Adds a block read from the source to a shard whose lock is held, evicting as ARC decides
+	void insert(Shard& shard, const Key& key, const std::shared_ptr<const Block>& block);
+
+	// ARC's REPLACE: demotes the LRU block of T1 or T2 to its ghost list
+	void replace(Shard& shard, bool inB2);
+	void link(Shard& shard, const Key& key, ListId list, const std::shared_ptr<const Block>& block);
+	void move(Shard& shard, Slot& slot, const Key& key, ListId list);
+	void dropLast(Shard& shard, ListId list);
+
+public:
+	BlockCache();
+
+	BlockCache(const BlockCache&) = delete;
+	BlockCache& operator=(const BlockCache&) = delete;
+
+	// Bytes of file data to keep cached; 0 disables the cache. Shrinking takes effect as blocks are added
+	void setCapacity(size_t bytes);
+
+	/*
+		Reads exactly length bytes at offset of the file with identity, as SourceFileSystem::readFile
+		would, taking what it can from the cache and reading the rest from file in whole blocks.
+		Blocks another reader is already fetching are waited for rather than read again, so
+		concurrent requests for overlapping ranges of a file share one source read, whether or not
+		the cache is enabled.
+	*/
+	HRESULT read(
+		const SourceFileSystem::FileIdentity& identity,
+		SourceFileSystem::FileHandle file,
+		UINT64 offset,
+		UINT32 length,
+		void* buffer
+	);
+
+	// Drops every cached block of a file, whatever its version, once it will not be read again
+	void invalidate(const SourceFileSystem::FileIdentity& identity);
+
+	void printStatistics(FILE* out);
+};
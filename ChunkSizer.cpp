@@ -0,0 +1,98 @@
+#include "pch.h"
+#include "ChunkSizer.h"
+
+#include <algorithm>
+
+// Default bounds, and the size used before the source's throughput is known
+static const UINT32 CHUNK_DEFAULT_MINIMUM = 64 * 1024;
+static const UINT32 CHUNK_DEFAULT_MAXIMUM = 8 * 1024 * 1024;
+static const UINT32 CHUNK_INITIAL = 1024 * 1024;
+
+// Reads shorter than this say more about per-call overhead than about throughput
+static const UINT32 CHUNK_SAMPLE_MINIMUM = 16 * 1024;
+
+static UINT32 floorPowerOfTwo(UINT32 value) {
+	UINT32 power = 1;
+	while (power <= value / 2)
+		power *= 2;
+	return power;
+}
+
+ChunkSizer::ChunkSizer() :
+	minimum_size(CHUNK_DEFAULT_MINIMUM),
+	maximum_size(CHUNK_DEFAULT_MAXIMUM),
+	throughput(0),
+	chosen()
+{
+}
+
+void ChunkSizer::setBounds(UINT32 minimum, UINT32 maximum)
+{
+	minimum = floorPowerOfTwo(std::min(std::max(minimum, SMALLEST), LARGEST));
+	maximum = floorPowerOfTwo(std::min(std::max(maximum, minimum), LARGEST));
+	minimum_size.store(minimum, std::memory_order_relaxed);
+	maximum_size.store(maximum, std::memory_order_relaxed);
+}
+
+unsigned ChunkSizer::classOf(UINT32 size)
+{
+	unsigned sizeClass = 0;
+	while ((1u << sizeClass) < size)
+		sizeClass++;
+	return sizeClass;
+}
+
+UINT32 ChunkSizer::choose(UINT32 length, bool random)
+{
+	UINT32 minimum = minimum_size.load(std::memory_order_relaxed);
+	UINT32 maximum = maximum_size.load(std::memory_order_relaxed);
+
+	UINT64 rate = throughput.load(std::memory_order_relaxed);
+	UINT64 target = rate == 0 ? CHUNK_INITIAL : rate * TARGET_MICROSECONDS / 1000000;
+	if (random) {
+		target /= 4;
+	}
+
+	// Clamping first keeps the power of two computed below within 32 bits
+	target = std::min<UINT64>(std::max<UINT64>(target, minimum), maximum);
+	UINT32 size = floorPowerOfTwo(static_cast<UINT32>(target));
+
+	// No bigger than the request, rounded up to a size the buffers come in
+	if (length < size) {
+		size = std::max(minimum, sizeOf(classOf(length)));
+	}
+
+	chosen[classOf(size)].fetch_add(1, std::memory_order_relaxed);
+	return size;
+}
+
+// An exponential moving average, weighting each read by an eighth; racing updates lose a sample
+void ChunkSizer::record(UINT32 bytes, UINT64 nanoseconds)
+{
+	if (bytes < CHUNK_SAMPLE_MINIMUM || nanoseconds == 0) {
+		return;
+	}
+
+	UINT64 sample = static_cast<UINT64>(bytes) * 1000000000ull / nanoseconds;
+	UINT64 rate = throughput.load(std::memory_order_relaxed);
+	rate = rate == 0 ? sample : rate - rate / 8 + sample / 8;
+	throughput.store(rate, std::memory_order_relaxed);
+}
+
+void ChunkSizer::printStatistics(FILE* out)
+{
+	fprintf(out, "  chunk sizes: source %.1f MB/s, bounds %u-%u KB, chosen",
+		throughput.load(std::memory_order_relaxed) / (1024.0 * 1024.0),
+		minimum_size.load(std::memory_order_relaxed) / 1024,
+		maximum_size.load(std::memory_order_relaxed) / 1024);
+
+	bool any = false;
+	for (unsigned i = 0; i < SIZE_CLASSES; i++) {
+		UINT64 count = chosen[i].load(std::memory_order_relaxed);
+		if (count != 0) {
+			fprintf(out, " %uK x%llu", sizeOf(i) / 1024, static_cast<unsigned long long>(count));
+			any = true;
+		}
+	}
+	fprintf(out, any ? "\n" : " none\n");
+}
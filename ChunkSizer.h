@@ -0,0 +1,59 @@
+#pragma once
+
+#include "pch.h"
+#include <atomic>
+#include <cstdio>
+
+/*
+	Picks the size of the pieces file data is read from the source and written to ProjFS in. Each
+	piece should take the source about TARGET_MICROSECONDS to read: long enough that the cost of
+	each read and PrjWriteFileData call stays small against a fast source, short enough that a slow
+	one does not tie up a large buffer. The size therefore follows the source's throughput,
+	averaged over recent reads.
+
+	A request never gets a piece larger than it needs, and a request from a stream being read at
+	random gets a quarter of the size, since it is likely to be followed by another small read
+	elsewhere. Sizes are powers of two within configurable bounds, so buffers can be pooled by size.
+*/
+class ChunkSizer
+{
+public:
+	// Limits on the bounds that may be set
+	static constexpr UINT32 SMALLEST = 4 * 1024;
+	static constexpr UINT32 LARGEST = 64 * 1024 * 1024;
+
+protected:
+	static const UINT64 TARGET_MICROSECONDS = 4000;
+
+	// Sizes are counted by their log2
+	static const unsigned SIZE_CLASSES = 32;
+
+	std::atomic<UINT32> minimum_size;
+	std::atomic<UINT32> maximum_size;
+	// Bytes per second, as a moving average over reads; 0 until the first is measured
+	std::atomic<UINT64> throughput;
+	std::atomic<UINT64> chosen[SIZE_CLASSES];
+
+public:
+	ChunkSizer();
+
+	ChunkSizer(const ChunkSizer&) = delete;
+	ChunkSizer& operator=(const ChunkSizer&) = delete;
+
+	// Bounds of the sizes chosen, rounded down to powers of two within SMALLEST and LARGEST;
+	// equal bounds fix the size
+	void setBounds(UINT32 minimum, UINT32 maximum);
+
+	// The size of the pieces to read length bytes in; random when the stream is not being read
+	// sequentially
+	UINT32 choose(UINT32 length, bool random);
+
+	// Records a read of bytes from the source which took nanoseconds
+	void record(UINT32 bytes, UINT64 nanoseconds);
+
+	// Power of two sizes from a buffer pool's view: the log2 of a size, and the size of a log2
+	static unsigned classOf(UINT32 size);
+	static UINT32 sizeOf(unsigned sizeClass) { return 1u << sizeClass; }
+
+	void printStatistics(FILE* out);
+};
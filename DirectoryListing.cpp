@@ -0,0 +1,226 @@
+#include "pch.h"
+#include "DirectoryListing.h"
+#include "SourceFileSystem.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cwchar>
+#include <iterator>
+
+HRESULT DirectoryListing::load(const std::wstring& path)
+{
+	clear();
+
+	HRESULT hr = SourceFileSystem::listDirectory(
+		path,
+		[this](PCWSTR name, const PRJ_FILE_BASIC_INFO& fileInfo) {
+			add(name, wcslen(name), fileInfo);
+		}
+	);
+
+	if (FAILED(hr)) {
+		clear();
+		return hr;
+	}
+
+	sort();
+	compact();
+	return S_OK;
+}
+
+void DirectoryListing::add(PCWSTR name, size_t length, const PRJ_FILE_BASIC_INFO& fileInfo)
+{
+	Entry entry;
+	entry.name_offset = static_cast<UINT32>(names.size());
+	entry.name_length = static_cast<UINT32>(length);
+	entry.fileInfo = fileInfo;
+
+	names.insert(names.end(), name, name + length);
+	names.push_back(L'\0');
+	entries.push_back(entry);
+}
+
+// A name's collation key and the entry it belongs to
+class CollationItem {
+public:
+	const char* key;
+	UINT32 entry;
+};
+
+// Buckets smaller than this are finished with insertion sort
+static const size_t COLLATION_RADIX_CUTOFF = 32;
+
+static void insertionSort(CollationItem* items, size_t count, size_t depth)
+{
+	for (size_t i = 1; i < count; i++) {
+		CollationItem item = items[i];
+		size_t j = i;
+		while (j > 0 && strcmp(items[j - 1].key + depth, item.key + depth) > 0) {
+			items[j] = items[j - 1];
+			j--;
+		}
+		items[j] = item;
+	}
+}
+
+/*
+	MSD radix sort on one key byte per level. Each level first copies the byte it sorts on into
+	oracle, so counting and distributing read a dense byte array instead of chasing every key
+	again (Karkkainen and Rantala, "Engineering Radix Sort for Strings").
+*/
+static void radixSort(CollationItem* items, CollationItem* scratch, UINT8* oracle, size_t count, size_t depth)
+{
+	if (count < COLLATION_RADIX_CUTOFF) {
+		insertionSort(items, count, depth);
+		return;
+	}
+
+	size_t counts[256] = {};
+	for (size_t i = 0; i < count; i++) {
+		oracle[i] = static_cast<UINT8>(items[i].key[depth]);
+		counts[oracle[i]]++;
+	}
+
+	size_t offsets[256];
+	size_t offset = 0;
+	for (size_t c = 0; c < 256; c++) {
+		offsets[c] = offset;
+		offset += counts[c];
+	}
+
+	for (size_t i = 0; i < count; i++)
+		scratch[offsets[oracle[i]]++] = items[i];
+	memcpy(items, scratch, count * sizeof(CollationItem));
+
+	// Bucket 0 holds keys which ended at this depth; they are equal
+	size_t start = counts[0];
+	for (size_t c = 1; c < 256; c++) {
+		if (counts[c] > 1)
+			radixSort(items + start, scratch, oracle, counts[c], depth + 1);
+		start += counts[c];
+	}
+}
+
+/*
+	PrjFileNameCompare orders names by their code units after upcasing with the volume's table. For
+	ASCII that is plain A-Z folding, so every ASCII name gets a one-byte-per-character key computed
+	once and the keys are radix sorted. Names with other characters are rare and sorted with
+	PrjFileNameCompare itself, then merged in, so the order is exactly the one ProjFS expects.
+*/
+void DirectoryListing::sort()
+{
+	const WCHAR* pool = names.data();
+	std::vector<char> keys;
+	std::vector<size_t> keyOffsets;
+	std::vector<UINT32> asciiEntries;
+	std::vector<UINT32> others;
+	keys.reserve(names.size());
+	keyOffsets.reserve(entries.size());
+	asciiEntries.reserve(entries.size());
+
+	for (UINT32 i = 0; i < static_cast<UINT32>(entries.size()); i++) {
+		const WCHAR* name = pool + entries[i].name_offset;
+		size_t keyStart = keys.size();
+		bool ascii = true;
+
+		for (UINT32 c = 0; c < entries[i].name_length; c++) {
+			UINT32 unit = static_cast<UINT32>(name[c]);
+			if (unit >= 0x80 || unit == 0) {
+				ascii = false;
+				break;
+			}
+			keys.push_back(static_cast<char>(unit >= 'a' && unit <= 'z' ? unit - ('a' - 'A') : unit));
+		}
+
+		if (ascii) {
+			keys.push_back('\0');
+			keyOffsets.push_back(keyStart);
+			asciiEntries.push_back(i);
+		} else {
+			keys.resize(keyStart);
+			others.push_back(i);
+		}
+	}
+
+	// Keys are only addressed once the key pool has stopped growing
+	size_t asciiCount = asciiEntries.size();
+	std::vector<CollationItem> items(asciiCount);
+	for (size_t i = 0; i < asciiCount; i++) {
+		items[i].key = keys.data() + keyOffsets[i];
+		items[i].entry = asciiEntries[i];
+	}
+
+	if (asciiCount > 1) {
+		std::vector<CollationItem> scratch(asciiCount);
+		std::vector<UINT8> oracle(asciiCount);
+		radixSort(items.data(), scratch.data(), oracle.data(), asciiCount, 0);
+	}
+
+	auto less = [pool, this](UINT32 left, UINT32 right) {
+		return PrjFileNameCompare(pool + entries[left].name_offset, pool + entries[right].name_offset) < 0;
+	};
+	std::sort(others.begin(), others.end(), less);
+
+	for (size_t i = 0; i < asciiCount; i++)
+		asciiEntries[i] = items[i].entry;
+
+	std::vector<UINT32> order;
+	if (others.empty()) {
+		order.swap(asciiEntries);
+	} else {
+		order.reserve(entries.size());
+		std::merge(asciiEntries.begin(), asciiEntries.end(), others.begin(), others.end(), std::back_inserter(order), less);
+	}
+
+	std::vector<Entry> sorted;
+	sorted.reserve(entries.size());
+	for (UINT32 index : order)
+		sorted.push_back(entries[index]);
+	entries.swap(sorted);
+}
+
+void DirectoryListing::compact()
+{
+	// Rewrite the pool in sorted order so filling walks names sequentially, sized exactly so a
+	// long-lived listing carries no growth slack
+	std::vector<WCHAR> sorted;
+	sorted.reserve(names.size());
+	for (Entry& entry : entries) {
+		const WCHAR* name = names.data() + entry.name_offset;
+		entry.name_offset = static_cast<UINT32>(sorted.size());
+		sorted.insert(sorted.end(), name, name + entry.name_length + 1);
+	}
+	names.swap(sorted);
+	entries.shrink_to_fit();
+}
+
+void DirectoryListing::clear()
+{
+	entries.clear();
+	names.clear();
+}
+
+void DirectoryListing::assign(const Entry* sortedEntries, size_t count, const WCHAR* namePool, size_t poolLength)
+{
+	entries.assign(sortedEntries, sortedEntries + count);
+	names.assign(namePool, namePool + poolLength);
+}
+
+bool DirectoryListing::find(PCWSTR name, size_t& index) const
+{
+	size_t low = 0;
+	size_t high = entries.size();
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		int order = PrjFileNameCompare(nameOf(middle), name);
+		if (order == 0) {
+			index = middle;
+			return true;
+		}
+		if (order < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return false;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "pch.h"
+#include <string>
+#include <vector>
+
+/*
+	The sorted contents of one source directory, stored flat: a vector of fixed-size entries and
+	one pool holding every name as a NUL-terminated UTF-16 string. Loading a directory costs a
+	handful of allocations however many entries it has, and enumeration resumes from an index.
+*/
+class DirectoryListing
+{
+public:
+	class Entry {
+	public:
+		// Offset and length, in WCHARs, of the entry's name in the name pool
+		UINT32 name_offset;
+		UINT32 name_length;
+		PRJ_FILE_BASIC_INFO fileInfo;
+	};
+
+protected:
+	std::vector<Entry> entries;
+	std::vector<WCHAR> names;
+
+public:
+	DirectoryListing() {}
+
+	// Reads and sorts the contents of a source directory, replacing anything already loaded
+	HRESULT load(const std::wstring& path);
+
+	// Appends an entry; the listing is unsorted until sort() is called
+	void add(PCWSTR name, size_t length, const PRJ_FILE_BASIC_INFO& fileInfo);
+
+	// Sorts the entries into the order ProjFS expects enumerations in
+	void sort();
+
+	// Lays the name pool out in entry order and releases spare capacity; call after sort()
+	void compact();
+
+	void clear();
+
+	// Replaces the contents with entries already sorted, whose names are in namePool
+	void assign(const Entry* sortedEntries, size_t count, const WCHAR* namePool, size_t poolLength);
+
+	// Binary searches a sorted listing for name, compared as PrjFileNameCompare does
+	bool find(PCWSTR name, size_t& index) const;
+
+	size_t size() const { return entries.size(); }
+	PCWSTR nameOf(size_t index) const { return names.data() + entries[index].name_offset; }
+	const Entry& entryAt(size_t index) const { return entries[index]; }
+
+	// The raw arrays, for writing a listing out as it is held
+	const Entry* entryData() const { return entries.data(); }
+	const WCHAR* namePool() const { return names.data(); }
+	size_t namePoolLength() const { return names.size(); }
+
+	// Heap bytes held by the listing
+	size_t bytesUsed() const {
+		return entries.capacity() * sizeof(Entry) + names.capacity() * sizeof(WCHAR);
+	}
+};
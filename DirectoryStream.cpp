@@ -0,0 +1,475 @@
+#include "pch.h"
+#include "DirectoryStream.h"
+#include "ListingCache.h"
+#include "SourceFileSystem.h"
+
+#include <algorithm>
+#include <cwchar>
+
+// stdio buffers for run and index files
+static const size_t LISTING_READ_BUFFER = 64 * 1024;
+static const size_t LISTING_WRITE_BUFFER = 256 * 1024;
+
+// NTFS names are at most 255 UTF-16 units; anything far beyond that is a damaged record
+static const UINT32 LISTING_MAX_NAME = 32768;
+
+HRESULT ListingFileWriter::create(
+	const std::wstring& filePath,
+	const std::wstring& sourcePath,
+	INT64 changeTime,
+	UINT64 entryCount
+) {
+	discard();
+
+	file = SourceFileSystem::openFile(filePath, "wb");
+	if (file == nullptr) {
+		return HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED);
+	}
+	setvbuf(file, nullptr, _IOFBF, LISTING_WRITE_BUFFER);
+	path = filePath;
+	written = 0;
+	failed = false;
+
+	ListingFileHeader header = {};
+	header.magic = ListingFileHeader::MAGIC;
+	header.wchar_size = sizeof(WCHAR);
+	header.change_time = changeTime;
+	header.entry_count = entryCount;
+	header.path_length = static_cast<UINT32>(sourcePath.size());
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+		fwrite(sourcePath.data(), sizeof(WCHAR), sourcePath.size(), file) != sourcePath.size()
+	) {
+		failed = true;
+	}
+	return S_OK;
+}
+
+void ListingFileWriter::write(PCWSTR name, UINT32 length, const PRJ_FILE_BASIC_INFO& fileInfo)
+{
+	if (file == nullptr || failed) {
+		return;
+	}
+
+	if (fwrite(&length, sizeof(length), 1, file) != 1 ||
+		fwrite(&fileInfo, sizeof(fileInfo), 1, file) != 1 ||
+		fwrite(name, sizeof(WCHAR), length, file) != length
+	) {
+		failed = true;
+		return;
+	}
+	written++;
+}
+
+HRESULT ListingFileWriter::close()
+{
+	if (file == nullptr) {
+		return E_UNEXPECTED;
+	}
+
+	bool ok = !failed && fflush(file) == 0;
+	ok = fclose(file) == 0 && ok;
+	file = nullptr;
+
+	if (!ok) {
+		SourceFileSystem::removeFile(path);
+		return HRESULT_FROM_WIN32(ERROR_WRITE_FAULT);
+	}
+	return S_OK;
+}
+
+void ListingFileWriter::discard()
+{
+	if (file != nullptr) {
+		fclose(file);
+		file = nullptr;
+		SourceFileSystem::removeFile(path);
+	}
+}
+
+HRESULT ListingFileReader::open(const std::wstring& filePath, bool removeOnClose)
+{
+	close();
+
+	file = SourceFileSystem::openFile(filePath, "rb");
+	if (file == nullptr) {
+		return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+	}
+	setvbuf(file, nullptr, _IOFBF, LISTING_READ_BUFFER);
+	path = filePath;
+	remove_on_close = removeOnClose;
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+		header.magic != ListingFileHeader::MAGIC ||
+		header.wchar_size != sizeof(WCHAR) ||
+		header.path_length > LISTING_MAX_NAME
+	) {
+		close();
+		return HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT);
+	}
+
+	source_path.resize(header.path_length);
+	if (header.path_length != 0 &&
+		fread(&source_path[0], sizeof(WCHAR), header.path_length, file) != header.path_length
+	) {
+		close();
+		return HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT);
+	}
+
+	data_start = ftell(file);
+	return S_OK;
+}
+
+void ListingFileReader::close()
+{
+	if (file != nullptr) {
+		fclose(file);
+		file = nullptr;
+		if (remove_on_close) {
+			SourceFileSystem::removeFile(path);
+		}
+	}
+}
+
+bool ListingFileReader::next()
+{
+	if (file == nullptr) {
+		return false;
+	}
+
+	UINT32 length;
+	if (fread(&length, sizeof(length), 1, file) != 1 ||
+		length > LISTING_MAX_NAME ||
+		fread(&current_info, sizeof(current_info), 1, file) != 1
+	) {
+		return false;
+	}
+
+	current_name.resize(length + 1);
+	if (fread(current_name.data(), sizeof(WCHAR), length, file) != length) {
+		return false;
+	}
+	current_name[length] = L'\0';
+	return true;
+}
+
+HRESULT ListingFileReader::rewind()
+{
+	if (file == nullptr || fseek(file, data_start, SEEK_SET) != 0) {
+		return HRESULT_FROM_WIN32(ERROR_READ_FAULT);
+	}
+	return S_OK;
+}
+
+DirectoryStream::~DirectoryStream()
+{
+	// An index abandoned part way through is incomplete; the writer removes it
+	index.reset();
+}
+
+// Indexes are named after the source directory, so a newer index replaces an older one
+std::wstring DirectoryStream::indexPathOf(const Options& options, const std::wstring& sourcePath)
+{
+	std::wstring key = ListingCache::keyOf(sourcePath);
+	UINT64 hash = 0xcbf29ce484222325ull;
+	for (WCHAR c : key) {
+		hash ^= static_cast<UINT16>(c);
+		hash *= 0x100000001b3ull;
+	}
+
+	WCHAR name[32];
+	swprintf(name, 32, L"%016llx.idx", static_cast<unsigned long long>(hash));
+	return options.index_directory + L"\\" + name;
+}
+
+// Orders the heap so the run holding the smallest name is at the front
+bool DirectoryStream::laterThan(size_t left, size_t right) const
+{
+	int order = PrjFileNameCompare(runs[left]->name(), runs[right]->name());
+	return order != 0 ? order > 0 : left > right;
+}
+
+void DirectoryStream::buildHeap()
+{
+	heap.clear();
+	for (size_t i = 0; i < runs.size(); i++) {
+		if (runs[i]->next()) {
+			heap.push_back(i);
+		}
+	}
+
+	auto later = [this](size_t left, size_t right) { return laterThan(left, right); };
+	std::make_heap(heap.begin(), heap.end(), later);
+}
+
+bool DirectoryStream::peek(PCWSTR& name, const PRJ_FILE_BASIC_INFO*& fileInfo) const
+{
+	if (heap.empty()) {
+		return false;
+	}
+
+	const ListingFileReader& run = *runs[heap.front()];
+	name = run.name();
+	fileInfo = &run.fileInfo();
+	return true;
+}
+
+void DirectoryStream::next()
+{
+	if (heap.empty()) {
+		return;
+	}
+
+	auto later = [this](size_t left, size_t right) { return laterThan(left, right); };
+	std::pop_heap(heap.begin(), heap.end(), later);
+	size_t consumed = heap.back();
+	ListingFileReader& run = *runs[consumed];
+
+	if (index != nullptr) {
+		index->write(run.name(), static_cast<UINT32>(wcslen(run.name())), run.fileInfo());
+	}
+
+	if (run.next()) {
+		std::push_heap(heap.begin(), heap.end(), later);
+	} else {
+		heap.pop_back();
+	}
+
+	if (heap.empty()) {
+		finishIndex();
+	}
+}
+
+// Publishes the index once every entry has gone through it
+void DirectoryStream::finishIndex()
+{
+	if (index == nullptr) {
+		return;
+	}
+
+	std::unique_ptr<ListingFileWriter> writer = std::move(index);
+	if (writer->entriesWritten() != entry_count) {
+		writer->discard();
+		return;
+	}
+
+	if (SUCCEEDED(writer->close()) && !SourceFileSystem::replaceFile(writer->filePath(), index_path)) {
+		SourceFileSystem::removeFile(writer->filePath());
+	}
+}
+
+HRESULT DirectoryStream::restart()
+{
+	// Entries already returned never went through the index; drop it rather than persist a gap
+	if (index != nullptr) {
+		index->discard();
+		index.reset();
+	}
+
+	for (std::unique_ptr<ListingFileReader>& run : runs) {
+		HRESULT hr = run->rewind();
+		if (FAILED(hr)) {
+			heap.clear();
+			return hr;
+		}
+	}
+
+	buildHeap();
+	return S_OK;
+}
+
+HRESULT DirectoryStream::openRuns(
+	const std::vector<std::wstring>& runPaths,
+	std::unique_ptr<DirectoryStream>& stream
+) {
+	std::unique_ptr<DirectoryStream> opened(new DirectoryStream());
+	HRESULT hr = S_OK;
+
+	for (const std::wstring& runPath : runPaths) {
+		std::unique_ptr<ListingFileReader> run(new ListingFileReader());
+		HRESULT opening = run->open(runPath, true);
+		if (FAILED(opening)) {
+			// Keep going so every run file is still removed
+			SourceFileSystem::removeFile(runPath);
+			hr = opening;
+			continue;
+		}
+		opened->entry_count += run->entryCount();
+		opened->runs.push_back(std::move(run));
+	}
+
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	opened->buildHeap();
+	stream = std::move(opened);
+	return S_OK;
+}
+
+// Merges groups of runs until few enough remain to merge in one pass
+HRESULT DirectoryStream::reduceRuns(
+	const Options& options,
+	const std::wstring& sourcePath,
+	const LARGE_INTEGER& changeTime,
+	std::vector<std::wstring>& runPaths
+) {
+	while (runPaths.size() > MAX_FAN_IN) {
+		std::vector<std::wstring> merged;
+
+		for (size_t first = 0; first < runPaths.size(); first += MAX_FAN_IN) {
+			size_t last = std::min(first + MAX_FAN_IN, runPaths.size());
+			std::vector<std::wstring> group(runPaths.begin() + first, runPaths.begin() + last);
+			if (group.size() == 1) {
+				merged.push_back(group.front());
+				continue;
+			}
+
+			std::unique_ptr<DirectoryStream> stream;
+			HRESULT hr = openRuns(group, stream);
+
+			ListingFileWriter writer;
+			std::wstring mergedPath = SourceFileSystem::uniqueFilePath(options.index_directory, L"run");
+			if (SUCCEEDED(hr)) {
+				hr = writer.create(mergedPath, sourcePath, changeTime.QuadPart, stream->size());
+			}
+			if (SUCCEEDED(hr)) {
+				PCWSTR name;
+				const PRJ_FILE_BASIC_INFO* fileInfo;
+				while (stream->peek(name, fileInfo)) {
+					writer.write(name, static_cast<UINT32>(wcslen(name)), *fileInfo);
+					stream->next();
+				}
+				hr = writer.entriesWritten() == stream->size() ? writer.close() : HRESULT_FROM_WIN32(ERROR_READ_FAULT);
+			}
+
+			if (FAILED(hr)) {
+				// Runs not merged yet are still on disk and must be removed
+				for (size_t i = last; i < runPaths.size(); i++)
+					SourceFileSystem::removeFile(runPaths[i]);
+				for (const std::wstring& done : merged)
+					SourceFileSystem::removeFile(done);
+				return hr;
+			}
+			merged.push_back(mergedPath);
+		}
+
+		runPaths.swap(merged);
+	}
+	return S_OK;
+}
+
+HRESULT DirectoryStream::openIndex(
+	const Options& options,
+	const std::wstring& sourcePath,
+	const LARGE_INTEGER& changeTime,
+	std::unique_ptr<DirectoryStream>& stream
+) {
+	std::unique_ptr<ListingFileReader> indexFile(new ListingFileReader());
+	HRESULT hr = indexFile->open(indexPathOf(options, sourcePath), false);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	// The name is a hash, so check the index really is this directory's, and still current
+	if (indexFile->changeTime() != changeTime.QuadPart ||
+		ListingCache::keyOf(indexFile->sourcePath()) != ListingCache::keyOf(sourcePath)
+	) {
+		return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+	}
+
+	std::unique_ptr<DirectoryStream> opened(new DirectoryStream());
+	opened->entry_count = indexFile->entryCount();
+	opened->runs.push_back(std::move(indexFile));
+	opened->buildHeap();
+	stream = std::move(opened);
+	return S_OK;
+}
+
+HRESULT DirectoryStream::scan(
+	const Options& options,
+	const std::wstring& sourcePath,
+	const LARGE_INTEGER& changeTime,
+	std::shared_ptr<DirectoryListing>& listing,
+	std::unique_ptr<DirectoryStream>& stream
+) {
+	std::shared_ptr<DirectoryListing> run = std::make_shared<DirectoryListing>();
+	std::vector<std::wstring> runPaths;
+	HRESULT spilled = S_OK;
+
+	// Sorts the entries gathered so far and writes them out as a run, keeping the memory for
+	// the next run
+	auto spill = [&]() {
+		if (runPaths.empty()) {
+			SourceFileSystem::createDirectory(options.index_directory);
+		}
+
+		run->sort();
+		ListingFileWriter writer;
+		std::wstring runPath = SourceFileSystem::uniqueFilePath(options.index_directory, L"run");
+		HRESULT hr = writer.create(runPath, sourcePath, changeTime.QuadPart, run->size());
+		if (SUCCEEDED(hr)) {
+			for (size_t i = 0; i < run->size(); i++)
+				writer.write(run->nameOf(i), run->entryAt(i).name_length, run->entryAt(i).fileInfo);
+			hr = writer.close();
+		}
+
+		if (FAILED(hr)) {
+			spilled = hr;
+		} else {
+			runPaths.push_back(runPath);
+		}
+		run->clear();
+	};
+
+	HRESULT hr = SourceFileSystem::listDirectory(
+		sourcePath,
+		[&](PCWSTR name, const PRJ_FILE_BASIC_INFO& fileInfo) {
+			if (FAILED(spilled))
+				return;
+			run->add(name, wcslen(name), fileInfo);
+			if (options.run_entries != 0 && run->size() >= options.run_entries)
+				spill();
+		}
+	);
+
+	if (SUCCEEDED(hr) && runPaths.empty() && SUCCEEDED(spilled)) {
+		// Small enough to keep in memory
+		run->sort();
+		run->compact();
+		listing = run;
+		return S_OK;
+	}
+
+	if (SUCCEEDED(hr) && SUCCEEDED(spilled) && run->size() != 0) {
+		spill();
+	}
+	run.reset();
+
+	if (FAILED(hr) || FAILED(spilled)) {
+		for (const std::wstring& runPath : runPaths)
+			SourceFileSystem::removeFile(runPath);
+		return FAILED(hr) ? hr : spilled;
+	}
+
+	hr = reduceRuns(options, sourcePath, changeTime, runPaths);
+	if (SUCCEEDED(hr)) {
+		hr = openRuns(runPaths, stream);
+	}
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	// Persist the merged order as it is returned, if the runs are known to match changeTime
+	if (ListingCache::unchangedSince(sourcePath, changeTime)) {
+		std::unique_ptr<ListingFileWriter> writer(new ListingFileWriter());
+		std::wstring indexPath = indexPathOf(options, sourcePath);
+		std::wstring tempPath = SourceFileSystem::uniqueFilePath(options.index_directory, L"index");
+		if (SUCCEEDED(writer->create(tempPath, sourcePath, changeTime.QuadPart, stream->size()))) {
+			stream->index = std::move(writer);
+			stream->index_path = indexPath;
+		}
+	}
+
+	return S_OK;
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include "pch.h"
+#include "DirectoryListing.h"
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+	On-disk listing format, used both for the sorted runs a large directory is spilled into and for
+	the persisted index of a directory. A header identifies the source directory and the ChangeTime
+	the entries were read at; each record is the name length, the PRJ_FILE_BASIC_INFO and the name.
+	Files are private to the machine that wrote them, so fields are stored in native layout.
+*/
+class ListingFileHeader {
+public:
+	UINT32 magic;
+	UINT32 wchar_size;
+	INT64 change_time;
+	UINT64 entry_count;
+	UINT32 path_length;
+
+	static const UINT32 MAGIC = 0x31494458; // "XDI1"
+};
+
+class ListingFileWriter
+{
+protected:
+	FILE* file;
+	std::wstring path;
+	UINT64 written;
+	bool failed;
+
+public:
+	ListingFileWriter() : file(nullptr), written(0), failed(false) {}
+	~ListingFileWriter() { discard(); }
+
+	ListingFileWriter(const ListingFileWriter&) = delete;
+	ListingFileWriter& operator=(const ListingFileWriter&) = delete;
+
+	HRESULT create(const std::wstring& filePath, const std::wstring& sourcePath, INT64 changeTime, UINT64 entryCount);
+	void write(PCWSTR name, UINT32 length, const PRJ_FILE_BASIC_INFO& fileInfo);
+
+	// Flushes and closes the file; on failure the file is removed
+	HRESULT close();
+
+	// Closes and removes the file
+	void discard();
+
+	UINT64 entriesWritten() const { return written; }
+	const std::wstring& filePath() const { return path; }
+};
+
+class ListingFileReader
+{
+protected:
+	FILE* file;
+	std::wstring path;
+	bool remove_on_close;
+	ListingFileHeader header;
+	std::wstring source_path;
+	long data_start;
+	std::vector<WCHAR> current_name;
+	PRJ_FILE_BASIC_INFO current_info;
+
+public:
+	ListingFileReader() : file(nullptr), remove_on_close(false), header(), data_start(0), current_info() {}
+	~ListingFileReader() { close(); }
+
+	ListingFileReader(const ListingFileReader&) = delete;
+	ListingFileReader& operator=(const ListingFileReader&) = delete;
+
+	// Opens a listing file; a run file opened with removeOnClose is deleted once read
+	HRESULT open(const std::wstring& filePath, bool removeOnClose);
+	void close();
+
+	// Reads the next record; returns false at the end of the file or on a damaged record
+	bool next();
+
+	// Goes back to before the first record
+	HRESULT rewind();
+
+	PCWSTR name() const { return current_name.data(); }
+	const PRJ_FILE_BASIC_INFO& fileInfo() const { return current_info; }
+
+	const std::wstring& sourcePath() const { return source_path; }
+	INT64 changeTime() const { return header.change_time; }
+	UINT64 entryCount() const { return header.entry_count; }
+};
+
+/*
+	Sorted enumeration of a directory too large to keep in memory. Scanning reads the directory in
+	runs of a bounded number of entries, sorts each run and spills it to disk; the stream then
+	merges the runs on demand, so only one read buffer per run is held while entries are returned.
+	The merged order is written out as the directory's index as a side effect, and while the
+	directory's ChangeTime is unchanged later enumerations stream straight from that index.
+*/
+class DirectoryStream
+{
+public:
+	class Options {
+	public:
+		// Where spill runs and persisted indexes live
+		std::wstring index_directory;
+
+		// Entries held in memory per run; directories no larger than this are returned as an
+		// in-memory listing instead. 0 never spills
+		size_t run_entries;
+
+		Options() : run_entries(0) {}
+	};
+
+protected:
+	// Runs merged at once; more runs are first merged into fewer, larger ones
+	static const size_t MAX_FAN_IN = 128;
+
+	std::vector<std::unique_ptr<ListingFileReader>> runs;
+
+	// Indices of the runs with a current entry, as a min-heap on the entry's name
+	std::vector<size_t> heap;
+
+	// The merged order being persisted as the directory's index, and where it goes once complete
+	std::unique_ptr<ListingFileWriter> index;
+	std::wstring index_path;
+	UINT64 entry_count;
+
+	DirectoryStream() : entry_count(0) {}
+
+	bool laterThan(size_t left, size_t right) const;
+	void buildHeap();
+	void finishIndex();
+
+	static std::wstring indexPathOf(const Options& options, const std::wstring& sourcePath);
+	static HRESULT openRuns(
+		const std::vector<std::wstring>& runPaths,
+		std::unique_ptr<DirectoryStream>& stream
+	);
+	static HRESULT reduceRuns(
+		const Options& options,
+		const std::wstring& sourcePath,
+		const LARGE_INTEGER& changeTime,
+		std::vector<std::wstring>& runPaths
+	);
+
+public:
+	~DirectoryStream();
+
+	DirectoryStream(const DirectoryStream&) = delete;
+	DirectoryStream& operator=(const DirectoryStream&) = delete;
+
+	// Opens the persisted index of a directory; fails if there is none for this ChangeTime
+	static HRESULT openIndex(
+		const Options& options,
+		const std::wstring& sourcePath,
+		const LARGE_INTEGER& changeTime,
+		std::unique_ptr<DirectoryStream>& stream
+	);
+
+	/*
+		Reads a directory. A directory of at most run_entries entries comes back sorted in listing;
+		a larger one is spilled into sorted runs and comes back as stream.
+	*/
+	static HRESULT scan(
+		const Options& options,
+		const std::wstring& sourcePath,
+		const LARGE_INTEGER& changeTime,
+		std::shared_ptr<DirectoryListing>& listing,
+		std::unique_ptr<DirectoryStream>& stream
+	);
+
+	// Gets the current entry without consuming it; returns false once every entry was consumed
+	bool peek(PCWSTR& name, const PRJ_FILE_BASIC_INFO*& fileInfo) const;
+
+	// Consumes the current entry
+	void next();
+
+	// Starts again from the first entry
+	HRESULT restart();
+
+	UINT64 size() const { return entry_count; }
+};
@@ -0,0 +1,390 @@
+/*
+	ExpanderFS_Bench runs the provider against a POSIX source tree through the simulated ProjFS
+	host, so the enumeration, placeholder and data paths can be profiled without Windows.
+
+	Build (Linux):
+		cmake -S . -B build && cmake --build build
+
+	or with checks, as changes to the provider should be before they are merged:
+		cmake -S . -B build-asan -DCMAKE_BUILD_TYPE=Debug -DEXPANDERFS_SANITIZE=address,undefined
+		cmake -S . -B build-tsan -DCMAKE_BUILD_TYPE=Debug -DEXPANDERFS_SANITIZE=thread
+
+	or by hand:
+		g++ -std=c++17 -O2 -pthread -I. ExpanderFS_Bench.cpp FileProvider.cpp SourceFileSystem.cpp \
+			SimProjFS.cpp SimHost.cpp DirectoryListing.cpp DirectoryStream.cpp ListingCache.cpp \
+			SearchExpression.cpp ReadAhead.cpp BlockCache.cpp HandleCache.cpp AsyncIO.cpp \
+			ChunkSizer.cpp MetadataIndex.cpp TreeScanner.cpp SourceWatcher.cpp WriteBackQueue.cpp \
+			IOScheduler.cpp ProcessQoS.cpp Microbench.cpp -o expanderfs_bench
+
+	Usage:
+		expanderfs_bench --src-root {path} [options]
+		expanderfs_bench --bench-queues [--operations {n}]
+		expanderfs_bench --bench-listing [--operations {n}]
+		expanderfs_bench --bench-match [--operations {n}]
+		expanderfs_bench --bench-sort
+*/
+
+#include "pch.h"
+
+#ifndef _WIN32
+
+#include "AsyncIO.h"
+#include "FileProvider.h"
+#include "Microbench.h"
+#include "SimHost.h"
+#include "SourceFileSystem.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+
+static void help(const char* argv0) {
+	printf("ExpanderFS benchmark harness:\n");
+	printf("-s    --src-root      {path}      Source tree to project (required)\n");
+	printf("-v    --virt-root     {path}      Scratch directory used as the virtualization root\n");
+	printf("-t    --threads       {n}         Number of threads issuing callbacks (default 4)\n");
+	printf("-p    --passes        {n}         Number of walks over the namespace (default 1)\n");
+	printf("      --dir-buffer    {bytes}     Size of each directory enumeration buffer (default 16384)\n");
+	printf("      --read-size     {bytes}     Size of each GetFileData request, 0 = whole file (default 0)\n");
+	printf("-w    --workers       {n}         Source worker threads, 0 = read on the callback thread\n");
+	printf("      --io-depth      {n}         Reads each worker keeps in flight through %s, 0 = blocking\n", AsyncIO::backendName());
+	printf("      --reserved-workers {n}      Workers kept from prefetch and write-back for foreground reads (default 1)\n");
+	printf("      --prefetch-deadline {ms}    Wait after which prefetches go ahead of foreground reads (default 200)\n");
+	printf("      --background-deadline {ms}  Wait after which write-back goes ahead of other work (default 1000)\n");
+	printf("      --concurrent    {n}         Callbacks the provider lets run at once (default: cores)\n");
+	printf("      --listing-cache {bytes}     Bytes of directory listings to cache, 0 = off (default 256 MB)\n");
+	printf("      --stream-entries {n}        Stream directories with more entries than this, 0 = never\n");
+	printf("      --index-dir     {path}      Where streamed directories are spilled and indexed\n");
+	printf("      --metadata-index {path}     Memory-mapped index of the source tree kept across runs\n");
+	printf("      --no-metadata-index         Rediscover the source tree on every run\n");
+	printf("      --scan                      Crawl the source tree into the metadata index before the run\n");
+	printf("      --background-scan           Crawl the source tree alongside the run\n");
+	printf("      --scan-threads  {n}         Threads crawling the source tree\n");
+	printf("      --scan-open     {n}         Directories the crawl reads at once\n");
+	printf("      --no-placeholders           Skip GetPlaceholderInfo callbacks\n");
+	printf("      --no-hydrate                Skip GetFileData callbacks\n");
+	printf("      --block-cache   {bytes}     Bytes of source file data to cache, 0 = off (default 64 MB)\n");
+	printf("      --chunk-min     {bytes}     Smallest piece file data is read in (default 64 KB)\n");
+	printf("      --chunk-max     {bytes}     Largest piece file data is read in (default 8 MB)\n");
+	printf("      --handles       {n}         Source files kept open between reads, 0 = none (default 256)\n");
+	printf("      --unbuffered                Read file data bypassing the OS and block caches\n");
+	printf("      --read-ahead    {bytes}     Largest window read ahead of sequential readers, 0 = off (default 8 MB)\n");
+	printf("      --readers       {n}         Streams hydrating each file at once (default 1)\n");
+	printf("      --probes        {n}         Lookups of absent names made in each directory (default 0)\n");
+	printf("      --modifies      {n}         Files in each directory reported modified on close (default 0)\n");
+	printf("      --cancel-after  {us}        Cancel GetFileData requests pending this long, 0 = never (default 0)\n");
+	printf("      --processes     {n}         Simulated processes the threads are spread over (default 1)\n");
+	printf("      --process-weight {image=n}  Share of the source given to an image, such as SimProcess0.exe=4\n");
+	printf("      --process-rate  {image=bytes} File data per second an image may read, 0 = unlimited\n");
+	printf("      --no-notifications          Do not register for ProjFS notifications\n");
+	printf("      --no-source-watch           Do not watch the source tree for direct changes\n");
+	printf("      --write-back                Copy modified files back, overwriting them in the source tree\n");
+	printf("      --no-write-back             Leave modified files in the virtualization root (default)\n");
+	printf("      --write-back-delay {ms}     How long a modified file waits to be copied back (default 500)\n");
+	printf("      --dirty-limit   {bytes}     Modified bytes beyond which files are copied back at once (default 256 MB)\n");
+	printf("      --write-back-sync {policy}  none, file or batch: when copies are synced (default batch)\n");
+	printf("      --metadata-trust {ms}       How long a cached listing answers placeholder lookups, 0 = never\n");
+	printf("      --bench-queues              Run the job queue microbenchmark instead of the provider\n");
+	printf("      --bench-listing             Run the directory listing microbenchmark\n");
+	printf("      --bench-match               Run the search expression microbenchmark\n");
+	printf("      --bench-sort                Run the directory sort microbenchmark\n");
+	printf("      --bench-source-io           Compare blocking and ring reads of the source root, up to 65536 reads\n");
+	printf("      --operations    {n}         Jobs or entries per microbenchmark run (default 1000000)\n");
+	printf("Base usage: %s --src-root {source root}\n", argv0);
+}
+
+int main(int argc, char** argv) {
+	const char* source_path = nullptr;
+	const char* virtualization_path = "/tmp/expanderfs-sim";
+	SimHost::Options options;
+	int workers = -1;
+	long long io_depth = -1;
+	int concurrent = -1;
+	long long reserved_workers = -1;
+	IOSchedulerBase::Options io_options;
+	long long listing_cache = -1;
+	long long stream_entries = -1;
+	const char* index_path = nullptr;
+	const char* metadata_index = nullptr;
+	bool no_metadata_index = false;
+	bool scan = false;
+	bool background_scan = false;
+	long long scan_threads = -1;
+	long long scan_open = -1;
+	long long metadata_trust = -1;
+	long long read_ahead = -1;
+	long long block_cache = -1;
+	long long handles = -1;
+	long long chunk_min = -1;
+	long long chunk_max = -1;
+	bool unbuffered = false;
+	bool no_notifications = false;
+	bool no_source_watch = false;
+	bool write_back_enabled = false;
+	WriteBackQueue::Options write_back;
+	std::map<std::string, ProcessQoS::Policy> process_policies;
+	bool bench_queues = false;
+	bool bench_listing = false;
+	bool bench_match = false;
+	bool bench_sort = false;
+	bool bench_source_io = false;
+	UINT64 operations = 1000000;
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if ((!strcmp(arg, "-s") || !strcmp(arg, "--src-root")) && hasValue) {
+			source_path = argv[++i];
+		} else if ((!strcmp(arg, "-v") || !strcmp(arg, "--virt-root")) && hasValue) {
+			virtualization_path = argv[++i];
+		} else if ((!strcmp(arg, "-t") || !strcmp(arg, "--threads")) && hasValue) {
+			options.threads = static_cast<unsigned>(atoi(argv[++i]));
+		} else if ((!strcmp(arg, "-p") || !strcmp(arg, "--passes")) && hasValue) {
+			options.passes = static_cast<unsigned>(atoi(argv[++i]));
+		} else if (!strcmp(arg, "--dir-buffer") && hasValue) {
+			options.dir_buffer_bytes = static_cast<size_t>(atoll(argv[++i]));
+		} else if (!strcmp(arg, "--read-size") && hasValue) {
+			options.read_size = static_cast<UINT32>(atoll(argv[++i]));
+		} else if ((!strcmp(arg, "-w") || !strcmp(arg, "--workers")) && hasValue) {
+			workers = atoi(argv[++i]);
+		} else if (!strcmp(arg, "--io-depth") && hasValue) {
+			io_depth = atoll(argv[++i]);
+		} else if (!strcmp(arg, "--reserved-workers") && hasValue) {
+			reserved_workers = atoll(argv[++i]);
+		} else if (!strcmp(arg, "--prefetch-deadline") && hasValue) {
+			io_options.deadline[IO_PREFETCH] = static_cast<UINT32>(atoll(argv[++i]));
+		} else if (!strcmp(arg, "--background-deadline") && hasValue) {
+			io_options.deadline[IO_BACKGROUND] = static_cast<UINT32>(atoll(argv[++i]));
+		} else if (!strcmp(arg, "--concurrent") && hasValue) {
+			concurrent = atoi(argv[++i]);
+		} else if (!strcmp(arg, "--listing-cache") && hasValue) {
+			listing_cache = atoll(argv[++i]);
+		} else if (!strcmp(arg, "--stream-entries") && hasValue) {
+			stream_entries = atoll(argv[++i]);
+		} else if (!strcmp(arg, "--index-dir") && hasValue) {
+			index_path = argv[++i];
+		} else if (!strcmp(arg, "--metadata-index") && hasValue) {
+			metadata_index = argv[++i];
+		} else if (!strcmp(arg, "--no-metadata-index")) {
+			no_metadata_index = true;
+		} else if (!strcmp(arg, "--scan")) {
+			scan = true;
+		} else if (!strcmp(arg, "--background-scan")) {
+			background_scan = true;
+		} else if (!strcmp(arg, "--scan-threads") && hasValue) {
+			scan_threads = atoll(argv[++i]);
+		} else if (!strcmp(arg, "--scan-open") && hasValue) {
+			scan_open = atoll(argv[++i]);
+		} else if (!strcmp(arg, "--no-placeholders")) {
+			options.placeholders = false;
+		} else if (!strcmp(arg, "--no-hydrate")) {
+			options.hydrate = false;
+		} else if (!strcmp(arg, "--chunk-min") && hasValue) {
+			chunk_min = atoll(argv[++i]);
+		} else if (!strcmp(arg, "--chunk-max") && hasValue) {
+			chunk_max = atoll(argv[++i]);
+		} else if (!strcmp(arg, "--handles") && hasValue) {
+			handles = atoll(argv[++i]);
+		} else if (!strcmp(arg, "--unbuffered")) {
+			unbuffered = true;
+		} else if (!strcmp(arg, "--readers") && hasValue) {
+			options.readers = static_cast<unsigned>(atoi(argv[++i]));
+		} else if (!strcmp(arg, "--modifies") && hasValue) {
+			options.modifies = static_cast<unsigned>(atoi(argv[++i]));
+		} else if (!strcmp(arg, "--cancel-after") && hasValue) {
+			options.cancel_after = static_cast<UINT64>(atoll(argv[++i]));
+		} else if (!strcmp(arg, "--processes") && hasValue) {
+			options.processes = static_cast<unsigned>(std::max(1, atoi(argv[++i])));
+		} else if ((!strcmp(arg, "--process-weight") || !strcmp(arg, "--process-rate")) && hasValue) {
+			const char* value = argv[++i];
+			const char* equals = strchr(value, '=');
+			if (equals == nullptr || equals == value) {
+				printf("Error: expected {image}={value} for %s, not %s\n", arg, value);
+				return -1;
+			}
+			ProcessQoS::Policy& policy = process_policies[std::string(value, equals)];
+			if (!strcmp(arg, "--process-weight")) {
+				policy.weight = static_cast<UINT32>(std::max(1LL, atoll(equals + 1)));
+			} else {
+				policy.rate_limit = static_cast<UINT64>(atoll(equals + 1));
+			}
+		} else if (!strcmp(arg, "--no-source-watch")) {
+			no_source_watch = true;
+		} else if (!strcmp(arg, "--no-write-back")) {
+			write_back_enabled = false;
+		} else if (!strcmp(arg, "--write-back")) {
+			write_back_enabled = true;
+		} else if (!strcmp(arg, "--write-back-delay") && hasValue) {
+			write_back.delay = static_cast<UINT32>(atoll(argv[++i]));
+		} else if (!strcmp(arg, "--dirty-limit") && hasValue) {
+			write_back.dirty_limit = static_cast<UINT64>(atoll(argv[++i]));
+		} else if (!strcmp(arg, "--write-back-sync") && hasValue) {
+			const char* policy = argv[++i];
+			if (!strcmp(policy, "none")) {
+				write_back.sync = WriteBackQueue::SYNC_NONE;
+			} else if (!strcmp(policy, "file")) {
+				write_back.sync = WriteBackQueue::SYNC_FILE;
+			} else if (!strcmp(policy, "batch")) {
+				write_back.sync = WriteBackQueue::SYNC_BATCH;
+			} else {
+				printf("Error: unknown write-back sync policy %s\n", policy);
+				return -1;
+			}
+		} else if (!strcmp(arg, "--no-notifications")) {
+			no_notifications = true;
+		} else if (!strcmp(arg, "--probes") && hasValue) {
+			options.probes = static_cast<unsigned>(atoi(argv[++i]));
+		} else if (!strcmp(arg, "--block-cache") && hasValue) {
+			block_cache = atoll(argv[++i]);
+		} else if (!strcmp(arg, "--read-ahead") && hasValue) {
+			read_ahead = atoll(argv[++i]);
+		} else if (!strcmp(arg, "--metadata-trust") && hasValue) {
+			metadata_trust = atoll(argv[++i]);
+		} else if (!strcmp(arg, "--bench-queues")) {
+			bench_queues = true;
+		} else if (!strcmp(arg, "--bench-listing")) {
+			bench_listing = true;
+		} else if (!strcmp(arg, "--bench-match")) {
+			bench_match = true;
+		} else if (!strcmp(arg, "--bench-sort")) {
+			bench_sort = true;
+		} else if (!strcmp(arg, "--bench-source-io")) {
+			bench_source_io = true;
+		} else if (!strcmp(arg, "--operations") && hasValue) {
+			operations = static_cast<UINT64>(atoll(argv[++i]));
+		} else {
+			printf("Error: unrecognized command-line parameter %s\n", arg);
+			help(argv[0]);
+			return -1;
+		}
+	}
+
+	if (bench_queues || bench_listing || bench_match || bench_sort) {
+		if (bench_queues)
+			Microbench::jobQueues(stdout, operations);
+		if (bench_listing)
+			Microbench::directoryListings(stdout, static_cast<size_t>(operations));
+		if (bench_match)
+			Microbench::searchExpressions(stdout, static_cast<size_t>(operations));
+		if (bench_sort)
+			Microbench::collation(stdout);
+		return 0;
+	}
+
+	if (source_path == nullptr) {
+		help(argv[0]);
+		return -1;
+	}
+
+	if (bench_source_io) {
+		Microbench::sourceReads(stdout, SourceFileSystem::fromNativePath(source_path),
+			static_cast<size_t>(std::min<UINT64>(operations, 65536)));
+		return 0;
+	}
+
+	FileProvider provider;
+	provider.setVirtualizationPath(SourceFileSystem::fromNativePath(virtualization_path).c_str());
+	provider.setSourcePath(SourceFileSystem::fromNativePath(source_path).c_str());
+	if (workers >= 0) {
+		provider.setSourceWorkerCount(static_cast<unsigned>(workers));
+	}
+	if (io_depth >= 0) {
+		provider.setSourceQueueDepth(static_cast<UINT32>(io_depth));
+	}
+	if (reserved_workers >= 0) {
+		provider.setReservedWorkers(static_cast<unsigned>(reserved_workers));
+	}
+	provider.setIOSchedulerOptions(io_options);
+	for (const auto& policy : process_policies) {
+		provider.setProcessPolicy(SourceFileSystem::fromNativePath(policy.first.c_str()),
+			policy.second.weight, policy.second.rate_limit);
+	}
+	if (concurrent > 0) {
+		provider.setConcurrentThreadCount(static_cast<UINT32>(concurrent));
+	}
+	if (listing_cache >= 0) {
+		provider.setListingCacheBytes(static_cast<size_t>(listing_cache));
+	}
+	if (block_cache >= 0) {
+		provider.setBlockCacheBytes(static_cast<size_t>(block_cache));
+	}
+	if (handles >= 0) {
+		provider.setHandleCacheLimit(static_cast<size_t>(handles));
+	}
+	if (chunk_min >= 0 || chunk_max >= 0) {
+		provider.setChunkBounds(
+			static_cast<UINT32>(chunk_min >= 0 ? chunk_min : 64 * 1024),
+			static_cast<UINT32>(chunk_max >= 0 ? chunk_max : 8 * 1024 * 1024));
+	}
+	provider.setUnbufferedReads(unbuffered);
+	provider.setSourceWatch(!no_source_watch);
+	provider.setWriteBack(write_back_enabled);
+	provider.setWriteBackOptions(write_back);
+	if (no_notifications) {
+		provider.setNotificationMask(PRJ_NOTIFY_NONE);
+	}
+	if (read_ahead >= 0) {
+		provider.setReadAheadBytes(static_cast<UINT32>(read_ahead));
+	}
+	if (metadata_trust >= 0) {
+		provider.setMetadataTrustPeriod(static_cast<UINT32>(metadata_trust));
+	}
+	if (stream_entries >= 0) {
+		provider.setStreamingThreshold(static_cast<size_t>(stream_entries));
+	}
+	if (index_path != nullptr) {
+		provider.setIndexPath(SourceFileSystem::fromNativePath(index_path).c_str());
+	}
+	if (metadata_index != nullptr) {
+		provider.setMetadataIndexPath(SourceFileSystem::fromNativePath(metadata_index).c_str());
+	}
+	provider.setMetadataIndex(!no_metadata_index);
+	if (scan_threads >= 0) {
+		provider.setScanThreads(static_cast<unsigned>(scan_threads));
+	}
+	if (scan_open >= 0) {
+		provider.setScanOpenDirectories(static_cast<size_t>(scan_open));
+	}
+	provider.setBackgroundScan(background_scan);
+
+	const WCHAR* output = provider.checkSanity();
+	if (output == nullptr) {
+		output = provider.startVirtualizing();
+	}
+	if (output != nullptr) {
+		printf("%ls\n", output);
+		return -1;
+	}
+
+	SimVirtualizationInstance* instance =
+		SimFindInstance(SourceFileSystem::fromNativePath(virtualization_path).c_str());
+	if (instance == nullptr) {
+		printf("Error: the provider did not start a virtualization instance\n");
+		return -1;
+	}
+
+	if (scan) {
+		TreeScanner::Result result;
+		HRESULT hr = provider.scanSourceTree(result);
+		result.print(stdout);
+		if (FAILED(hr)) {
+			printf("Error: scanning the source tree failed with 0x%08x\n", static_cast<unsigned>(hr));
+			return -1;
+		}
+	}
+
+	SimHost host(instance, options);
+	bool ok = host.run();
+	host.report(stdout);
+
+	// Modified files wait for the write-back delay; they are copied now so the report counts them
+	provider.flushWriteBack();
+	provider.printStatistics(stdout);
+
+	return ok ? 0 : 1;
+}
+
+#endif // _WIN32
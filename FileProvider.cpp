@@ -1,39 +1,118 @@
 #include "pch.h"
 #include "FileProvider.h"
+#include "SourceFileSystem.h"
 
-#include <Windows.h>
-#include <tchar.h>
+#include <algorithm>
 #include <cassert>
-#include <filesystem>
+#include <chrono>
 #include <cstdio>
+#include <cwchar>
+#include <deque>
+#include <vector>
 
-// Helper functions used to convert types and sort
-inline INT64 FT2I64(FILETIME ft) {
-	return static_cast<INT64>(ft.dwHighDateTime) << 32 | ft.dwLowDateTime;
-}
-inline INT64 MI32I32(DWORD LOW, DWORD HIGH) {
-	return static_cast<INT64>(HIGH) << 32 | LOW;
+static UINT64 nanosecondsSince(std::chrono::steady_clock::time_point start) {
+	return static_cast<UINT64>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count());
 }
 
+const WCHAR* const FileProvider::WRITE_BACK_PREFIX = L"~writeback";
+
 // Initializes the object
 FileProvider::FileProvider() :
-	virtualizing(false)
+	virtualizing(false),
+	metadata_index_enabled(true),
+	reserved_workers(1),
+	sourceJobPool(4096),
+	source_queue_depth(0),
+	sourceWorkersSleeping(0),
+	source_worker_count(std::max(4u, std::thread::hardware_concurrency())),
+	sourceWorkersStopping(false),
+	unbuffered_reads(false),
+	pool_thread_count(0),
+	concurrent_thread_count(std::max(1u, std::thread::hardware_concurrency())),
+	background_scan(false),
+	scanner_cancelled(false),
+	scan_finished(false),
+	notification_mask(DEFAULT_NOTIFICATION_MASK),
+	notified_created(0),
+	notified_modified(0),
+	notified_renamed(0),
+	notified_deleted(0),
+	source_watch_enabled(true),
+	rescan_pending(false),
+	rescan_running(false),
+	source_changes(0),
+	source_rescans(0),
+	commands_cancelled(0),
+	cancels_late(0),
+	jobs_cancelled(0),
+	reads_interrupted(0),
+	cancelled_bytes(0),
+	write_back_enabled(false),
+	volume_sync(false)
 {
+	streamOptions.index_directory = SourceFileSystem::temporaryDirectory() + L"\\ExpanderFS";
+	streamOptions.run_entries = STREAMING_RUN_ENTRIES;
+
+	for (unsigned i = ChunkSizer::classOf(ChunkSizer::SMALLEST); i <= ChunkSizer::classOf(ChunkSizer::LARGEST); i++) {
+		size_t count = std::min(DATA_BUFFER_POOL, std::max<size_t>(2, DATA_BUFFER_POOL_BYTES / ChunkSizer::sizeOf(i)));
+		dataBuffers[i].reset(new BoundedMPMCQueue<void*>(count));
+	}
 }
 
 // Deinitializes the object
 FileProvider::~FileProvider()
 {
+	// Nothing is invalidated once the provider goes, so the watcher stops first
+	sourceWatcher.stop();
+
+	// Background scans and rescans are abandoned; what they read so far is still saved below
+	{
+		std::lock_guard<std::mutex> lock(scannerMutex);
+		scanner_cancelled = true;
+		for (TreeScanner* scanner : scanners) {
+			scanner->cancel();
+		}
+	}
+	if (backgroundScan.joinable()) {
+		backgroundScan.join();
+	}
+	if (rescanThread.joinable()) {
+		rescanThread.join();
+	}
+
+	// Stop ProjFS first so no new jobs arrive while the workers drain
 	if (virtualizing) {
 		PrjStopVirtualizing(instanceHandle);
 		virtualizing = false;
 	}
 
-	for (auto it = open_files.begin(); it != open_files.end(); ++it) {
-		fclose(it->second);
+	// Modified files are copied back before the workers making the copies go
+	if (writeBackFlusher.joinable()) {
+		writeBack.stop(true);
+		writeBackFlusher.join();
+	}
+
+	stopSourceWorkers();
+	metadataIndex.save();
+
+	void* buffer;
+	for (const std::unique_ptr<BoundedMPMCQueue<void*>>& pool : dataBuffers) {
+		while (pool != nullptr && pool->tryPop(buffer)) {
+			PrjFreeAlignedBuffer(buffer);
+		}
 	}
 }
 
+// Joins a path relative to the virtualization root onto the source path
+std::wstring FileProvider::sourcePathOf(PCWSTR relativePath) const
+{
+	if (relativePath == nullptr || relativePath[0] == L'\0') {
+		return source_path;
+	}
+	return source_path + L"\\" + relativePath;
+}
+
 // checkSanity makes sure the virtualization and source directories exist
 const WCHAR* FileProvider::checkSanity() {
 	// Check if any of the paths are undefined
@@ -62,18 +141,12 @@ const WCHAR* FileProvider::checkSanity() {
 
 	// Create directories for both roots if they don't exist
 	
-	if (!CreateDirectoryW(virtualization_path.c_str(), nullptr)) {
-		DWORD err = GetLastError();
-		if (err != ERROR_ALREADY_EXISTS) {
-			return L"Error: could not create directory for the virtualization root";
-		}
+	if (!SourceFileSystem::createDirectory(virtualization_path)) {
+		return L"Error: could not create directory for the virtualization root";
 	}
 
-	if (!CreateDirectoryW(source_path.c_str(), nullptr)) {
-		DWORD err = GetLastError();
-		if (err != ERROR_ALREADY_EXISTS) {
-			return L"Error: could not create directory for the source path";
-		}
+	if (!SourceFileSystem::createDirectory(source_path)) {
+		return L"Error: could not create directory for the source path";
 	}
 
 	return nullptr;
@@ -98,7 +171,26 @@ const WCHAR* FileProvider::startVirtualizing() {
 		return L"Error: unable to mark the virtualization root!";
 	}
 
-	PRJ_CALLBACKS callbacks;
+	// Mapping the index is all loading it takes; a missing or outdated one starts out empty
+	if (metadata_index_enabled) {
+		if (metadata_index_path.empty()) {
+			std::wstring key = ListingCache::keyOf(source_path);
+			UINT64 hash = 0xcbf29ce484222325ull;
+			for (WCHAR c : key) {
+				hash ^= static_cast<UINT16>(c);
+				hash *= 0x100000001b3ull;
+			}
+
+			WCHAR name[48];
+			swprintf(name, 48, L"metadata-%016llx.idx", static_cast<unsigned long long>(hash));
+			metadata_index_path = streamOptions.index_directory + L"\\" + name;
+		}
+		metadataIndex.open(metadata_index_path, source_path);
+	}
+
+	startSourceWorkers();
+
+	PRJ_CALLBACKS callbacks = {};
 	callbacks.StartDirectoryEnumerationCallback = startDirectoryEnumerationCB;
 	callbacks.EndDirectoryEnumerationCallback = endDirectoryEnumerationCB;
 	callbacks.GetDirectoryEnumerationCallback = getDirectoryEnumerationCB;
@@ -107,9 +199,26 @@ const WCHAR* FileProvider::startVirtualizing() {
 	callbacks.QueryFileNameCallback = queryFileNameCallback;
 	callbacks.CancelCommandCallback = cancelCommandCB;
 
+	// One mapping for the whole root. An empty root names the virtualization root itself
+	PRJ_NOTIFICATION_MAPPING notificationMapping = {};
+	notificationMapping.NotificationBitMask = notification_mask;
+	notificationMapping.NotificationRoot = L"";
+
 	PRJ_STARTVIRTUALIZING_OPTIONS options = PRJ_STARTVIRTUALIZING_OPTIONS();
-	options.PoolThreadCount = 1;
-	options.ConcurrentThreadCount = 1;
+	if (notification_mask != PRJ_NOTIFY_NONE) {
+		callbacks.NotificationCallback = notificationCB;
+		options.NotificationMappings = &notificationMapping;
+		options.NotificationMappingsCount = 1;
+	}
+	// Callbacks only share sharded tables and the scheduler's lock-free foreground ring, so they
+	// may run in parallel; only enumerations missing the listing cache, and reads fair queued
+	// between processes, take the scheduler's mutex. As ProjFS does by default, keep twice as
+	// many pool threads as may run at once, so a callback blocked in the source file system does
+	// not idle a core
+	options.ConcurrentThreadCount = std::max(1u, concurrent_thread_count);
+	options.PoolThreadCount = pool_thread_count != 0 ?
+		std::max(pool_thread_count, options.ConcurrentThreadCount) :
+		2 * options.ConcurrentThreadCount;
 
 	hr = PrjStartVirtualizing(
 		virtualization_path.c_str(),
@@ -120,16 +229,552 @@ const WCHAR* FileProvider::startVirtualizing() {
 	);
 
 	if (FAILED(hr)) {
+		stopSourceWorkers();
 		return L"Error: failed to start the virtualization instance!";
 	}
 
 	virtualizing = true;
+
+	if (write_back_enabled) {
+		writeBackFlusher = std::thread(&FileProvider::runWriteBack, this);
+	}
+
+	// Without the watcher, changes made directly to the source are noticed only as the caches
+	// check ChangeTimes
+	if (source_watch_enabled) {
+		SourceWatcher::Options watchOptions;
+		watchOptions.ignore_prefix = WRITE_BACK_PREFIX;
+		sourceWatcher.start(
+			source_path,
+			watchOptions,
+			[this](const std::vector<SourceWatcher::Change>& changes) { applySourceChanges(changes); },
+			[this] { requestRescan(); }
+		);
+	}
+
+	if (background_scan) {
+		backgroundScan = std::thread([this] {
+			scanSourceTree(scanResult);
+			scan_finished = true;
+		});
+	}
 	return 0;
 }
 
+HRESULT FileProvider::scanSourceTree(TreeScanner::Result& result)
+{
+	return crawlSourceTree(false, result);
+}
+
+HRESULT FileProvider::crawlSourceTree(bool reread, TreeScanner::Result& result)
+{
+	TreeScanner::Options options = scanOptions;
+	options.stream_options = streamOptions;
+	TreeScanner crawler(options);
+	{
+		std::lock_guard<std::mutex> lock(scannerMutex);
+		if (scanner_cancelled) {
+			return HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+		}
+		scanners.push_back(&crawler);
+	}
+
+	// Whatever the caches still hold for a directory saves reading it, unless it cannot be trusted
+	HRESULT hr = crawler.scan(
+		source_path,
+		[this, reread](const std::wstring& path, const LARGE_INTEGER& changeTime) {
+			if (reread) {
+				return std::shared_ptr<const DirectoryListing>();
+			}
+			std::shared_ptr<const DirectoryListing> listing = listingCache.lookup(path, changeTime);
+			if (listing == nullptr) {
+				listing = metadataIndex.lookup(path, changeTime);
+				if (listing != nullptr) {
+					listingCache.store(path, changeTime, listing);
+				}
+			}
+			return listing;
+		},
+		[this](const std::wstring& path, const LARGE_INTEGER& changeTime, const std::shared_ptr<const DirectoryListing>& listing) {
+			listingCache.store(path, changeTime, listing);
+			metadataIndex.update(path, changeTime, listing);
+		},
+		result
+	);
+
+	{
+		std::lock_guard<std::mutex> lock(scannerMutex);
+		scanners.erase(std::find(scanners.begin(), scanners.end(), &crawler));
+	}
+
+	HRESULT saved = metadataIndex.save();
+	return FAILED(hr) ? hr : saved;
+}
+
+void FileProvider::flushWriteBack()
+{
+	if (writeBackFlusher.joinable()) {
+		writeBack.flush();
+	}
+}
+
+// Prints the provider's cache and source I/O statistics
+void FileProvider::printStatistics(FILE* out)
+{
+	listingCache.printStatistics(out);
+	metadataIndex.printStatistics(out);
+	readAhead.printStatistics(out);
+	blockCache.printStatistics(out);
+	handleCache.printStatistics(out);
+	chunkSizer.printStatistics(out);
+
+	if (notification_mask != PRJ_NOTIFY_NONE) {
+		fprintf(out, "  notifications: created %llu, modified %llu, renamed %llu, deleted %llu\n",
+			static_cast<unsigned long long>(notified_created.load(std::memory_order_relaxed)),
+			static_cast<unsigned long long>(notified_modified.load(std::memory_order_relaxed)),
+			static_cast<unsigned long long>(notified_renamed.load(std::memory_order_relaxed)),
+			static_cast<unsigned long long>(notified_deleted.load(std::memory_order_relaxed)));
+	}
+
+	fprintf(out, "  cancellation: %llu commands cancelled, %llu after they finished, %llu jobs dropped, %llu reads stopped part way, %.1f MB not read\n",
+		static_cast<unsigned long long>(commands_cancelled.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(cancels_late.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(jobs_cancelled.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(reads_interrupted.load(std::memory_order_relaxed)),
+		cancelled_bytes.load(std::memory_order_relaxed) / (1024.0 * 1024.0));
+
+	if (write_back_enabled) {
+		writeBack.printStatistics(out);
+	}
+
+	if (sourceWatcher.running()) {
+		sourceWatcher.printStatistics(out);
+		fprintf(out, "  source changes: %llu applied, %llu rescans after overflow\n",
+			static_cast<unsigned long long>(source_changes.load(std::memory_order_relaxed)),
+			static_cast<unsigned long long>(source_rescans.load(std::memory_order_relaxed)));
+	}
+
+	// Only once the background scan is over, since its result is written as it finishes
+	if (scan_finished) {
+		scanResult.print(out);
+	}
+
+	if (source_worker_count > 0) {
+		sourceJobs.printStatistics(out);
+	}
+	processQoS.printStatistics(out);
+
+	if (source_queue_depth > 0) {
+		AsyncIO::Counters total = {};
+		unsigned rings = 0;
+		for (const std::unique_ptr<AsyncIO>& ring : sourceRings) {
+			if (ring != nullptr) {
+				AsyncIO::Counters counters = ring->counters();
+				total.reads += counters.reads;
+				total.submissions += counters.submissions;
+				total.resubmitted += counters.resubmitted;
+				rings++;
+			}
+		}
+		fprintf(out, "  source I/O: %s, %u of %zu workers at depth %u, %llu reads in %llu submissions, %llu resubmitted\n",
+			AsyncIO::backendName(),
+			rings,
+			sourceRings.size(),
+			source_queue_depth,
+			static_cast<unsigned long long>(total.reads),
+			static_cast<unsigned long long>(total.submissions),
+			static_cast<unsigned long long>(total.resubmitted));
+	}
+}
+
+FileProvider::SourceFileSystemJob::SourceFileSystemJob() :
+	type(TYPE_READ),
+	offset(0),
+	length(0),
+	context(NULL),
+	command_id(0),
+	data_stream_id(),
+	parent(NULL),
+	pending_chunks(0),
+	result(S_OK),
+	started(),
+	change_time(),
+	write_batch(NULL),
+	write_index(0),
+	issued_to(0),
+	segment_length(0),
+	reads_pending(0),
+	issuing(false),
+	read_result(S_OK)
+{
+}
+
+FileProvider::SourceFileSystemJob::~SourceFileSystemJob()
+{
+}
+
+void FileProvider::SourceFileSystemJob::reset()
+{
+	type = TYPE_READ;
+	file_from.clear();
+	file_to.clear();
+	offset = 0;
+	length = 0;
+	context = NULL;
+	command_id = 0;
+	data_stream_id = GUID();
+	parent = NULL;
+	pending_chunks = 0;
+	result = S_OK;
+	command.reset();
+	account.reset();
+	started = std::chrono::steady_clock::time_point();
+	enumeration.reset();
+	change_time.QuadPart = 0;
+	read_ahead.reset();
+	write_batch = NULL;
+	write_index = 0;
+	issued_to = 0;
+	segment_length = 0;
+	reads_pending = 0;
+	issuing = false;
+	read_result = S_OK;
+}
+
+void FileProvider::startSourceWorkers()
+{
+	// A single worker cannot be kept back; it serves every class in priority order
+	IOSchedulerBase::Options options = ioOptions;
+	if (options.speculative_limit == 0 && reserved_workers > 0) {
+		options.speculative_limit = source_worker_count > reserved_workers ? source_worker_count - reserved_workers : 1;
+	}
+	sourceJobs.setOptions(options);
+
+	sourceWorkersStopping = false;
+	for (unsigned i = 0; i < source_worker_count; i++) {
+		sourceWorkerDeques.emplace_back(new WorkStealingDeque<SourceFileSystemJob>(256));
+	}
+
+	// A worker whose ring cannot be set up, such as where io_uring is disabled, reads one at a time
+	for (unsigned i = 0; i < source_worker_count && source_queue_depth > 0; i++) {
+		std::unique_ptr<AsyncIO> ring(new AsyncIO());
+		if (FAILED(ring->start(source_queue_depth))) {
+			ring.reset();
+		}
+		sourceRings.push_back(std::move(ring));
+	}
+	for (unsigned i = 0; i < source_worker_count; i++) {
+		sourceWorkers.emplace_back(SourceFileSystemWorker, this, i);
+	}
+}
+
+void FileProvider::stopSourceWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(sourceJobsMutex);
+		sourceWorkersStopping = true;
+		sourceJobsCondition.notify_all();
+	}
+
+	for (std::thread& worker : sourceWorkers) {
+		worker.join();
+	}
+	sourceWorkers.clear();
+
+	// ProjFS has stopped, so there is nobody left to complete the remaining jobs for
+	SourceFileSystemJob* job;
+	while (sourceJobs.drain(job)) {
+		discardSourceJob(job);
+	}
+	for (auto& deque : sourceWorkerDeques) {
+		while ((job = deque->steal()) != NULL) {
+			discardSourceJob(job);
+		}
+	}
+	sourceWorkerDeques.clear();
+	sourceRings.clear();
+}
+
+bool FileProvider::queueSourceJob(SourceFileSystemJob* job)
+{
+	// Without workers nothing would take the job; the caller runs it itself
+	if (source_worker_count == 0) {
+		return false;
+	}
+
+	// Once any process has a policy, work for a process is queued fairly against other
+	// processes' by weight, with reads costing their length, and held back while its image is
+	// over its rate limit. Until then every job is the provider's own flow, which foreground
+	// reads queue for without a lock
+	IOSchedulerBase::Flow flow;
+	if (job->account != nullptr && processQoS.sharing()) {
+		ProcessQoS::Account& account = *job->account;
+		flow.id = static_cast<UINT64>(account.process_id) + 1;
+		flow.weight = account.weight.load(std::memory_order_relaxed);
+		if (job->type == SourceFileSystemJob::TYPE_READ) {
+			flow.cost = static_cast<double>(job->length);
+			std::shared_ptr<ProcessQoS::Limiter> limiter = std::atomic_load(&account.limiter);
+			if (limiter != nullptr) {
+				std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+				flow.not_before = limiter->reserve(job->length, now);
+				if (flow.not_before > now) {
+					account.throttled_ns.fetch_add(static_cast<UINT64>(
+						std::chrono::duration_cast<std::chrono::nanoseconds>(flow.not_before - now).count()),
+						std::memory_order_relaxed);
+				}
+			}
+		}
+	}
+
+	if (!sourceJobs.tryPush(job, ioClassOf(job), flow)) {
+		return false;
+	}
+
+	wakeSourceWorker();
+	return true;
+}
+
+IOClass FileProvider::ioClassOf(const SourceFileSystemJob* job)
+{
+	switch (job->type) {
+	case SourceFileSystemJob::TYPE_DIRECTORY_ENUM:
+		return IO_METADATA;
+	case SourceFileSystemJob::TYPE_PREFETCH:
+		return IO_PREFETCH;
+	case SourceFileSystemJob::TYPE_WRITE:
+		return IO_BACKGROUND;
+	default:
+		return IO_FOREGROUND;
+	}
+}
+
+// Chunks come off the workers' deques rather than the scheduler, but are foreground reads, which
+// the scheduler does not count
+void FileProvider::runTakenJob(SourceFileSystemJob* job, unsigned worker)
+{
+	IOClass ioClass = ioClassOf(job);
+	runSourceJob(job, worker);
+	sourceJobs.finished(ioClass);
+}
+
+void FileProvider::wakeSourceWorker()
+{
+	// Pairs with the fence in takeSourceJob: either the sleeper sees the new job or we see the sleeper
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sourceWorkersSleeping.load() > 0) {
+		std::lock_guard<std::mutex> lock(sourceJobsMutex);
+		sourceJobsCondition.notify_one();
+	}
+}
+
+FileProvider::SourceFileSystemJob* FileProvider::findSourceJob(unsigned worker)
+{
+	IOClass ioClass;
+	SourceFileSystemJob* job = sourceWorkerDeques[worker]->pop();
+	if (job != NULL || sourceJobs.tryPop(job, ioClass)) {
+		return job;
+	}
+
+	size_t workers = sourceWorkerDeques.size();
+	for (size_t i = 1; i < workers; i++) {
+		job = sourceWorkerDeques[(worker + i) % workers]->steal();
+		if (job != NULL) {
+			return job;
+		}
+	}
+
+	return NULL;
+}
+
+FileProvider::SourceFileSystemJob* FileProvider::takeSourceJob(unsigned worker)
+{
+	for (;;) {
+		SourceFileSystemJob* job = findSourceJob(worker);
+		if (job != NULL || sourceWorkersStopping) {
+			return job;
+		}
+
+		// Nothing to do; register as a sleeper and look once more before waiting
+		std::unique_lock<std::mutex> lock(sourceJobsMutex);
+		sourceWorkersSleeping++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		job = findSourceJob(worker);
+		std::chrono::steady_clock::time_point held;
+		if (job == NULL && !sourceWorkersStopping && sourceJobs.nextHeld(held)) {
+			// Jobs held by a rate limit wake nobody when their time comes
+			sourceJobsCondition.wait_until(lock, held);
+		} else if (job == NULL && !sourceWorkersStopping) {
+			sourceJobsCondition.wait(lock);
+		}
+		sourceWorkersSleeping--;
+
+		if (job != NULL) {
+			return job;
+		}
+	}
+}
+
+bool FileProvider::splitsSourceJob(SourceFileSystemJob* job) const
+{
+	return job->type == SourceFileSystemJob::TYPE_READ &&
+		job->parent == NULL &&
+		job->length > SOURCE_SPLIT_SIZE &&
+		sourceWorkerDeques.size() > 1;
+}
+
+void FileProvider::runSourceJob(SourceFileSystemJob* job, unsigned worker)
+{
+	if (dropCancelledJob(job)) {
+		return;
+	}
+
+	// Split big reads so that other workers can steal the tail while this one reads the head
+	if (splitsSourceJob(job)) {
+		UINT32 chunks = (job->length + SOURCE_SPLIT_SIZE - 1) / SOURCE_SPLIT_SIZE;
+		job->pending_chunks = chunks;
+		job->result = S_OK;
+
+		// Push in reverse so the owner pops the first chunk and thieves take the later ones
+		for (UINT32 i = chunks; i-- > 0;) {
+			SourceFileSystemJob* chunk = sourceJobPool.acquire();
+			chunk->reset();
+			chunk->type = SourceFileSystemJob::TYPE_READ;
+			chunk->file_from = job->file_from;
+			chunk->offset = job->offset + static_cast<UINT64>(i) * SOURCE_SPLIT_SIZE;
+			chunk->length = std::min(SOURCE_SPLIT_SIZE, job->length - i * SOURCE_SPLIT_SIZE);
+			chunk->context = job->context;
+			chunk->command_id = job->command_id;
+			chunk->data_stream_id = job->data_stream_id;
+			chunk->command = job->command;
+			chunk->parent = job;
+
+			if (sourceWorkerDeques[worker]->push(chunk)) {
+				wakeSourceWorker();
+			} else {
+				runSourceJob(chunk, worker);
+			}
+		}
+		return;
+	}
+
+	// Prefetches complete no command
+	if (job->type == SourceFileSystemJob::TYPE_PREFETCH) {
+		prefetchFileData(job);
+		job->read_ahead.reset();
+		sourceJobPool.release(job);
+		return;
+	}
+
+	// Write-back copies report to their batch rather than to ProjFS
+	if (job->type == SourceFileSystemJob::TYPE_WRITE) {
+		finishWriteJob(job, copyToSource(job));
+		return;
+	}
+
+	HRESULT hr = E_NOTIMPL;
+	if (job->type == SourceFileSystemJob::TYPE_DIRECTORY_ENUM) {
+		hr = readEnumeration(job);
+	} else if (job->type == SourceFileSystemJob::TYPE_READ && job->parent != NULL) {
+		hr = writeFileData(job->context, job->data_stream_id, job->file_from, job->offset, job->length, false, job->command.get());
+	} else if (job->type == SourceFileSystemJob::TYPE_READ) {
+		hr = serveFileData(job->context, job->data_stream_id, job->file_from, job->offset, job->length, job->command.get());
+	}
+	finishSourceJob(job, hr);
+}
+
+void FileProvider::finishSourceJob(SourceFileSystemJob* job, HRESULT hr)
+{
+	SourceFileSystemJob* parent = job->parent;
+	if (parent == NULL) {
+		// Finish the GetFileData or StartDirectoryEnumeration command which returned
+		// ERROR_IO_PENDING; ProjFS has already forgotten a cancelled one, and will not end the
+		// enumeration it started
+		if (job->command != nullptr) {
+			job->command->finished.store(true);
+			pendingCommands.erase(job->command_id);
+		}
+		recordForProcess(job, hr);
+
+		// The session is published before completing, as ProjFS asks for entries as soon as the
+		// start completes; a start cancelled meanwhile is never ended, so it is taken back
+		bool enumerated = job->type == SourceFileSystemJob::TYPE_DIRECTORY_ENUM && SUCCEEDED(hr);
+		if (job->command == nullptr || !job->command->cancelled.load(std::memory_order_relaxed)) {
+			if (enumerated && !enumerations.insert(job->enumeration->enumeration_id, job->enumeration)) {
+				hr = HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+				enumerated = false;
+			}
+			if (FAILED(PrjCompleteCommand(job->context, job->command_id, hr, NULL)) && enumerated) {
+				enumerations.erase(job->enumeration->enumeration_id);
+			}
+		}
+		sourceJobPool.release(job);
+		return;
+	}
+
+	if (FAILED(hr)) {
+		HRESULT expected = S_OK;
+		parent->result.compare_exchange_strong(expected, hr);
+	}
+	sourceJobPool.release(job);
+
+	if (parent->pending_chunks.fetch_sub(1) == 1) {
+		finishSourceJob(parent, parent->result.load());
+	}
+}
+
+void FileProvider::discardSourceJob(SourceFileSystemJob* job)
+{
+	if (job->type == SourceFileSystemJob::TYPE_WRITE) {
+		finishWriteJob(job, HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED));
+		return;
+	}
+
+	SourceFileSystemJob* parent = job->parent;
+	job->read_ahead.reset();
+	sourceJobPool.release(job);
+
+	if (parent != NULL && parent->pending_chunks.fetch_sub(1) == 1) {
+		sourceJobPool.release(parent);
+	}
+}
+
+/*
+	Jobs are not taken out of the queues when their command is cancelled, since the queues cannot
+	remove from the middle; whichever worker takes one next finishes it here instead of reading.
+	A chunk finishes towards its parent as usual, so the parent is recycled once the last one goes.
+*/
+bool FileProvider::dropCancelledJob(SourceFileSystemJob* job)
+{
+	if ((job->type != SourceFileSystemJob::TYPE_READ && job->type != SourceFileSystemJob::TYPE_DIRECTORY_ENUM) ||
+		job->command == nullptr || !job->command->cancelled.load(std::memory_order_relaxed)) {
+		return false;
+	}
+
+	jobs_cancelled.fetch_add(1, std::memory_order_relaxed);
+	cancelled_bytes.fetch_add(job->length, std::memory_order_relaxed);
+	finishSourceJob(job, HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED));
+	return true;
+}
+
+HRESULT FileProvider::interruptRead(UINT64 bytesLeft)
+{
+	reads_interrupted.fetch_add(1, std::memory_order_relaxed);
+	cancelled_bytes.fetch_add(bytesLeft, std::memory_order_relaxed);
+	return HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+}
+
 // The SourceFileSystemWorker performs the I/O on the target disk
-void FileProvider::SourceFileSystemWorker(FileProvider* provider)
+void FileProvider::SourceFileSystemWorker(FileProvider* provider, unsigned worker)
 {
+	if (worker < provider->sourceRings.size() && provider->sourceRings[worker] != nullptr) {
+		provider->runSourceRing(worker);
+		return;
+	}
+
+	SourceFileSystemJob* job;
+	while ((job = provider->takeSourceJob(worker)) != NULL) {
+		provider->runTakenJob(job, worker);
+	}
 }
 
 /*
@@ -153,26 +798,107 @@ HRESULT FileProvider::startDirectoryEnumerationCB(
 	// VirtPath + callbackData->FilePathName = virtualized path
 	// SourcePath + callbackData->FilePathName = source path (most likely)
 
-	// Create a new session object
-	FileProvider::EnumerationSession session;
-	session.virt_path = provider->virtualization_path + L"\\" + callbackData->FilePathName;
-	session.src_path = provider->source_path + L"\\" + callbackData->FilePathName;
+	std::wstring src_path = provider->sourcePathOf(callbackData->FilePathName);
 
-	// Check to make sure the file exists
-	DWORD ftype = GetFileAttributesW(session.src_path.c_str());
-	if (ftype == INVALID_FILE_ATTRIBUTES && !(ftype & FILE_ATTRIBUTE_DIRECTORY))
+	// Check to make sure the directory exists
+	PRJ_FILE_BASIC_INFO dirInfo;
+	if (FAILED(SourceFileSystem::getFileInfo(src_path, dirInfo)) || !dirInfo.IsDirectory)
 		return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
 
-	// Add the session object to the enumerations hash map
-	provider->enumerations[*enumerationId] = session;
+	// Fill the session before publishing it, so no other thread sees it half built
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+	std::shared_ptr<EnumerationSession> session = std::make_shared<EnumerationSession>();
+	session->enumeration_id = *enumerationId;
+	session->virt_path = provider->virtualization_path + L"\\" + callbackData->FilePathName;
+	session->src_path = src_path;
+	std::shared_ptr<ProcessQoS::Account> account = provider->processQoS.accountOf(
+		callbackData->TriggeringProcessId,
+		callbackData->TriggeringProcessImageFileName
+	);
+
+	// A cached listing is shared at once; one read from the source is work for the source
+	// workers, queued fairly against the other processes'
+	session->listing = provider->listingCache.lookup(src_path, dirInfo.ChangeTime);
+	if (session->listing == nullptr && provider->source_worker_count > 0) {
+		SourceFileSystemJob* job = provider->sourceJobPool.acquire();
+		job->reset();
+		job->type = SourceFileSystemJob::TYPE_DIRECTORY_ENUM;
+		job->file_from = src_path;
+		job->context = callbackData->NamespaceVirtualizationContext;
+		job->command_id = callbackData->CommandId;
+		job->account = account;
+		job->started = started;
+		job->enumeration = session;
+		job->change_time = dirInfo.ChangeTime;
+		if (provider->queueCommandJob(job)) {
+			return HRESULT_FROM_WIN32(ERROR_IO_PENDING);
+		}
+		provider->sourceJobPool.release(job);
+	}
 
 	// Enumerate the directory and fill out the data structures
-	session.enumerate();
+	HRESULT hr = session->listing != nullptr ? S_OK : session->enumerate(provider, dirInfo.ChangeTime);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	if (!provider->enumerations.insert(*enumerationId, std::move(session))) {
+		return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+	}
+	account->recordEnumeration(nanosecondsSince(started));
 
 	// Success!
 	return S_OK;
 }
 
+// Reads the directory of a start enumeration command which went pending; finishSourceJob
+// publishes the session
+HRESULT FileProvider::readEnumeration(SourceFileSystemJob* job)
+{
+	return job->enumeration->enumerate(this, job->change_time);
+}
+
+bool FileProvider::queueCommandJob(SourceFileSystemJob* job)
+{
+	std::shared_ptr<PendingCommand> command = std::make_shared<PendingCommand>();
+	INT32 commandId = job->command_id;
+	job->command = command;
+	if (!queueSourceJob(job)) {
+		job->command.reset();
+		return false;
+	}
+
+	// The job may already be done, and recycled, so only the command is looked at from here on.
+	// A cancel arriving before it is tracked finds nothing and lets the command complete
+	pendingCommands.assign(commandId, command);
+	if (command->finished.load()) {
+		pendingCommands.erase(commandId);
+	}
+	return true;
+}
+
+void FileProvider::recordForProcess(SourceFileSystemJob* job, HRESULT hr)
+{
+	if (job->account == nullptr || FAILED(hr)) {
+		return;
+	}
+
+	UINT64 nanoseconds = nanosecondsSince(job->started);
+	if (job->type == SourceFileSystemJob::TYPE_DIRECTORY_ENUM) {
+		job->account->recordEnumeration(nanoseconds);
+	} else if (job->type == SourceFileSystemJob::TYPE_READ) {
+		job->account->recordRead(job->length, nanoseconds);
+	}
+}
+
+void FileProvider::setProcessPolicy(const std::wstring& image, UINT32 weight, UINT64 bytesPerSecond)
+{
+	ProcessQoS::Policy policy;
+	policy.weight = weight;
+	policy.rate_limit = bytesPerSecond;
+	processQoS.setPolicy(image, policy);
+}
+
 /*
 	callbackData holds information about the operation
 	enumerationId holds an ID for the enumeration
@@ -222,98 +948,70 @@ HRESULT FileProvider::getDirectoryEnumerationCB(
 ) {
 	FileProvider* provider = reinterpret_cast<FileProvider*>(callbackData->InstanceContext);
 
-	if (provider->enumerations.find(*enumerationId) == provider->enumerations.end()) {
+	std::shared_ptr<EnumerationSession> found = provider->enumerations.find(*enumerationId);
+	if (found == nullptr) {
 		return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
 	}
-	EnumerationSession& session = provider->enumerations[*enumerationId];
+	EnumerationSession& session = *found;
+	std::lock_guard<std::mutex> lock(session.mutex);
 	if (!session.search_expression_captured ||
 		(callbackData->Flags & PRJ_CB_DATA_FLAG_ENUM_RESTART_SCAN)
 	) {
-		if (searchExpression != NULL) {
-			if (wcsncpy_s(
-				session.search_expression,
-				session.search_expression_max_length,
-				searchExpression,
-				wcslen(searchExpression))
-			) {
-				// failed to copy the search expression; provider should try
-				// reallocating session->SearchExpression
-			}
-		} else {
-			if (wcsncpy_s(
-				session.search_expression,
-				session.search_expression_max_length,
-				L"*",
-				1
-			)) {
-				// Failed to copy the search expression; provider should try reallocating
-				// session->SearchExpression
-			}
-		}
-
+		// Compile the expression once for every entry it is tested against
+		session.search_expression.compile(searchExpression);
 		session.search_expression_captured = TRUE;
 	}
 
-	EnumerationSession::EnumerationEntry* enumHead = NULL;
-
-	// Start from the beginning if we aren't continuing an existing session or if the caller
-	// is requesting a restart
-	if (((session.enum_last == NULL) &&
-		!session.enum_completed) ||
-		(callbackData->Flags & PRJ_CB_DATA_FLAG_ENUM_RESTART_SCAN)
-	) {
-		// Ensure that if the caller is requesting a restart, we reset our current position
-		session.enum_last = NULL;
-
-		// In case we are restarting
+	// Start from the beginning if the caller is requesting a restart
+	if (callbackData->Flags & PRJ_CB_DATA_FLAG_ENUM_RESTART_SCAN) {
+		session.enum_cursor = 0;
 		session.enum_completed = FALSE;
-
-		// Start from the beginning of the list from the store
-		enumHead = session.enum_head;
-	} else {
-		
-		// Resuming an existing enumeration session. Note that session->LastEnumEntry
-		// may be NULL if we got ll the entries the last time this callback was invoked
-
-		// Returning S_OK without adding new entries to the dirEntryBufferHandle buffer
-		// has returend everything it can
-		enumHead = session.enum_head;
+		if (session.stream != nullptr && FAILED(session.stream->restart())) {
+			return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+		}
 	}
 
-	if (enumHead == NULL) {
-		// No items to return; we have returned everything we can
-		session.enum_completed = TRUE;
+	// Insert the entry into the return buffer if it matches the search expression captured for
+	// this enumeration session. Returns false if it doesn't fit; the caller then stays on it
+	bool filledAny = false;
+	auto fill = [&](PCWSTR name, size_t length, const PRJ_FILE_BASIC_INFO& fileInfo) {
+		if (!session.search_expression.matches(name, length)) {
+			return true;
+		}
+
+		PRJ_FILE_BASIC_INFO fileBasicInfo = fileInfo;
+		if (PrjFillDirEntryBuffer(name, &fileBasicInfo, dirEntryBufferHandle) != S_OK) {
+			return false;
+		}
+		filledAny = true;
+		return true;
+	};
+
+	// Resuming past the last entry adds nothing, and returning S_OK without adding new entries
+	// to the dirEntryBufferHandle buffer signals that we have returned everything we can
+	if (session.stream != nullptr) {
+		PCWSTR name;
+		const PRJ_FILE_BASIC_INFO* fileInfo;
+		while (session.stream->peek(name, fileInfo)) {
+			if (!fill(name, wcslen(name), *fileInfo)) {
+				return filledAny ? S_OK : HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+			}
+			session.stream->next();
+		}
 	} else {
-		EnumerationSession::EnumerationEntry* thisEntry = enumHead;
-		while (thisEntry != NULL) {
-
-			// Insert the entry into the return buffer if it matches the search expression
-			// captured for this enumeration session
-			if (PrjFileNameMatch(
-				thisEntry->name.c_str(),
-				session.search_expression
-			)) {
-				PRJ_FILE_BASIC_INFO fileBasicInfo = thisEntry->fileInfo;
-
-				// Format the entry for return to ProjFS
-				if (PrjFillDirEntryBuffer(
-					thisEntry->name.c_str(),
-					&fileBasicInfo,
-					dirEntryBufferHandle
-				) != S_OK) {
-					session.enum_last = thisEntry;
-					return S_OK;
-				}
+		const DirectoryListing& listing = *session.listing;
+		while (session.enum_cursor < listing.size()) {
+			const DirectoryListing::Entry& entry = listing.entryAt(session.enum_cursor);
+			if (!fill(listing.nameOf(session.enum_cursor), entry.name_length, entry.fileInfo)) {
+				return filledAny ? S_OK : HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
 			}
-
-			// Jump to the next entry
-			thisEntry = thisEntry->next;
+			session.enum_cursor++;
 		}
-
-		// Reached the end of the list of entries; returned everything we can
-		session.enum_completed = TRUE;
 	}
 
+	// Reached the end of the listing; returned everything we can
+	session.enum_completed = TRUE;
+
 	return S_OK;
 }
 
@@ -336,33 +1034,39 @@ HRESULT FileProvider::getPlaceholderInfoCB(
 	// Pointer to the virtualization instance object
 	FileProvider* provider = reinterpret_cast<FileProvider*>(callbackData->InstanceContext);
 
-	// Form the backing path
-	std::wstring backing_path = provider->source_path + L"\\" + callbackData->FilePathName;
+	// Split the path into the source directory and the name within it
+	PCWSTR relativePath = callbackData->FilePathName;
+	PCWSTR separator = wcsrchr(relativePath, L'\\');
+	std::wstring directory = separator == NULL ?
+		provider->source_path :
+		provider->source_path + L"\\" + std::wstring(relativePath, separator - relativePath);
+	PCWSTR name = separator == NULL ? relativePath : separator + 1;
+
+	// A recently enumerated parent answers without touching the source, which matters most for
+	// probes of files that do not exist
+	PRJ_PLACEHOLDER_INFO placeholderInfo = {};
+	ListingCache::Presence presence = name[0] != L'\0' ?
+		provider->listingCache.find(directory, name, placeholderInfo.FileBasicInfo) :
+		ListingCache::PRESENCE_UNKNOWN;
+
+	// After a restart the listing cache is empty but the metadata index may know the directory
+	if (presence == ListingCache::PRESENCE_UNKNOWN && name[0] != L'\0' && provider->listingCache.answersLookups()) {
+		presence = provider->findInMetadataIndex(directory, name, placeholderInfo.FileBasicInfo);
+	}
 
-	GET_FILEEX_INFO_LEVELS FileInfosLevel;
-	WIN32_FILE_ATTRIBUTE_DATA attributes;
-	// Get the attributes for the file in the backing path
-	if (!GetFileAttributesExW(backing_path.c_str(), GetFileExInfoStandard, static_cast<LPVOID>(&attributes))) {
+	if (presence == ListingCache::PRESENCE_ABSENT) {
 		return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
 	}
 
-	PRJ_PLACEHOLDER_INFO placeholderInfo = {};
-	placeholderInfo.FileBasicInfo.IsDirectory =
-		attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ? TRUE : FALSE;
-	placeholderInfo.FileBasicInfo.FileSize = MI32I32(attributes.nFileSizeLow, attributes.nFileSizeHigh);
-	placeholderInfo.FileBasicInfo.CreationTime.QuadPart =
-		MI32I32(attributes.ftCreationTime.dwLowDateTime, attributes.ftCreationTime.dwHighDateTime);
-	placeholderInfo.FileBasicInfo.LastAccessTime.QuadPart =
-		MI32I32(attributes.ftLastAccessTime.dwLowDateTime, attributes.ftLastAccessTime.dwHighDateTime);
-	placeholderInfo.FileBasicInfo.LastWriteTime.QuadPart =
-		MI32I32(attributes.ftLastWriteTime.dwLowDateTime, attributes.ftLastWriteTime.dwHighDateTime);
-	placeholderInfo.FileBasicInfo.ChangeTime.QuadPart =
-		MI32I32(attributes.ftLastWriteTime.dwLowDateTime, attributes.ftLastWriteTime.dwHighDateTime);
-	placeholderInfo.FileBasicInfo.FileAttributes = attributes.dwFileAttributes;
+	// Otherwise get the attributes for the file in the backing path
+	if (presence == ListingCache::PRESENCE_UNKNOWN &&
+		FAILED(SourceFileSystem::getFileInfo(directory + L"\\" + name, placeholderInfo.FileBasicInfo))) {
+		return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+	}
 
 	return PrjWritePlaceholderInfo(
 		callbackData->NamespaceVirtualizationContext,
-		backing_path.c_str(),
+		callbackData->FilePathName,
 		&placeholderInfo,
 		sizeof(placeholderInfo));
 }
@@ -395,43 +1099,273 @@ HRESULT FileProvider::getFileDataCB(
 	UINT64 byteOffset,
 	UINT32 length
 ) {
-	HRESULT hr;
 	FileProvider* provider = reinterpret_cast<FileProvider*>(callbackData->InstanceContext);
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+	std::shared_ptr<ProcessQoS::Account> account = provider->processQoS.accountOf(
+		callbackData->TriggeringProcessId,
+		callbackData->TriggeringProcessImageFileName
+	);
 
-	std::wstring path = callbackData->FilePathName;
-
-/*	if (provider->open_files.find(path) == provider->open_files.end()) {
-		LPOFSTRUCT info;
-		provider->open_files[path] = CreateFileW(
-			path.c_str(),
-			GENERIC_READ | GENERIC_WRITE,
-			0,
-			NULL,
-			OPEN_EXISTING,
-			FILE_ATTRIBUTE_NOT_CONTENT_INDEXED,
+	// Without workers the data is read on the callback thread, which nothing can reorder or delay
+	if (provider->source_worker_count == 0) {
+		HRESULT hr = provider->serveFileData(
+			callbackData->NamespaceVirtualizationContext,
+			callbackData->DataStreamId,
+			provider->sourcePathOf(callbackData->FilePathName),
+			byteOffset,
+			length,
+			NULL
+		);
+		if (SUCCEEDED(hr)) {
+			account->recordRead(length, nanosecondsSince(started));
+		}
+		return hr;
+	}
+
+	// Hand the read to the SourceFileSystemWorker pool; it completes the command when done
+	SourceFileSystemJob* job = provider->sourceJobPool.acquire();
+	job->reset();
+	job->type = SourceFileSystemJob::TYPE_READ;
+	job->file_from = provider->sourcePathOf(callbackData->FilePathName);
+	job->offset = byteOffset;
+	job->length = length;
+	job->context = callbackData->NamespaceVirtualizationContext;
+	job->command_id = callbackData->CommandId;
+	job->data_stream_id = callbackData->DataStreamId;
+	job->account = std::move(account);
+	job->started = started;
+
+	// When the queue is full the callback thread does the read itself, which throttles ProjFS;
+	// ProjFS only cancels commands which went pending, so this one is not tracked
+	if (!provider->queueCommandJob(job)) {
+		HRESULT hr = provider->serveFileData(
+			job->context,
+			job->data_stream_id,
+			job->file_from,
+			job->offset,
+			job->length,
 			NULL
 		);
+		provider->recordForProcess(job, hr);
+		provider->sourceJobPool.release(job);
+		return hr;
+	}
+
+	return HRESULT_FROM_WIN32(ERROR_IO_PENDING);
+}
+
+/*
+	Serves byteOffset and length of a stream the way writeFileData does, and for a stream being
+	read sequentially also:
+		- starts from the window prefetched for it, if the request begins where that window does,
+		- otherwise writes the stream's window beyond the request, so ProjFS need not ask for it, and
+		- queues the window after that to be prefetched by a source worker.
+	Only a failure within the requested range fails the request.
+*/
+HRESULT FileProvider::serveFileData(
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT context,
+	const GUID& dataStreamId,
+	const std::wstring& path,
+	UINT64 byteOffset,
+	UINT32 length,
+	const PendingCommand* command
+) {
+	std::shared_ptr<ReadAhead::Stream> stream = readAhead.track(dataStreamId);
+	if (stream == nullptr) {
+		return writeFileData(context, dataStreamId, path, byteOffset, length, false, command);
+	}
+
+	std::unique_lock<std::mutex> lock(stream->mutex);
+	UINT32 window = readAhead.observe(*stream, byteOffset, length);
+	UINT64 end = byteOffset + length;
+	UINT64 served = byteOffset;
+	bool prefetched = false;
+	HRESULT hr;
+
+	if (stream->prefetch_offset == byteOffset && stream->prefetch_state != ReadAhead::PREFETCH_NONE) {
+		if (stream->prefetch_state == ReadAhead::PREFETCH_QUEUED) {
+			// No worker has started on it, so it is quicker to read here
+			stream->prefetch_state = ReadAhead::PREFETCH_NONE;
+		} else {
+			bool waited = stream->prefetch_state == ReadAhead::PREFETCH_RUNNING;
+			stream->prefetched.wait(lock, [&stream] {
+				return stream->prefetch_state != ReadAhead::PREFETCH_RUNNING;
+			});
+			stream->prefetch_state = ReadAhead::PREFETCH_NONE;
+
+			if (SUCCEEDED(stream->prefetch_result) &&
+				SUCCEEDED(PrjWriteFileData(context, &dataStreamId, stream->buffer, byteOffset, stream->prefetch_length))
+			) {
+				served = byteOffset + stream->prefetch_length;
+				prefetched = true;
+				readAhead.countPrefetchUsed(waited);
+			}
+		}
+	}
 
-		if (provider->open_files[path] == INVALID_HANDLE_VALUE) {
-			DWORD err = GetLastError();
-			return err;
+	if (served < end) {
+		hr = writeFileData(context, dataStreamId, path, served, static_cast<UINT32>(end - served), window == 0, command);
+		if (FAILED(hr)) {
+			stream->window = 0;
+			return hr;
+		}
+		served = end;
+	}
+
+	// A reader whose request was cancelled is not coming back for the window beyond it
+	if (command != NULL && command->cancelled.load(std::memory_order_relaxed)) {
+		window = 0;
+	}
+
+	// Read-ahead needs the file's size, so that it stops at the end, and the write alignment,
+	// since only a write ending at the end of the file may be unaligned
+	if (window != 0 && stream->file_size < 0) {
+		PRJ_FILE_BASIC_INFO fileInfo;
+		PRJ_VIRTUALIZATION_INSTANCE_INFO instanceInfo;
+		if (SUCCEEDED(SourceFileSystem::getFileInfo(path, fileInfo)) &&
+			SUCCEEDED(PrjGetVirtualizationInstanceInfo(context, &instanceInfo))
+		) {
+			stream->file_size = fileInfo.FileSize;
+			stream->write_alignment = std::max<UINT32>(1, instanceInfo.WriteAlignment);
+		} else {
+			stream->file_size = 0;
+		}
+	}
+
+	// Where a window starting at offset ends, if written
+	UINT64 fileSize = static_cast<UINT64>(std::max<INT64>(0, stream->file_size));
+	auto windowEnd = [&](UINT64 offset) {
+		UINT64 limit = offset + window;
+		return limit >= fileSize ? fileSize : BlockAlignTruncate(limit, stream->write_alignment);
+	};
+
+	// The prefetched window already ran ahead of the request; otherwise read ahead here
+	if (window != 0 && !prefetched && served < fileSize && served % stream->write_alignment == 0) {
+		UINT64 ahead = windowEnd(served);
+		if (ahead > served &&
+			SUCCEEDED(writeFileData(context, dataStreamId, path, served, static_cast<UINT32>(ahead - served)))
+		) {
+			readAhead.countWrittenAhead(ahead - served);
+			served = ahead;
 		}
 	}
+	stream->next_offset = served;
 
-	HANDLE& h = provider->open_files[path]; */
+	if (stream->file_size >= 0 && served >= fileSize) {
+		lock.unlock();
+		readAhead.forget(dataStreamId);
+		return S_OK;
+	}
 
-	FILE* fil = _wfopen(path.c_str(), "r");
+	// Have a worker read the following window while ProjFS takes this one
+	if (window != 0 && source_worker_count > 0 && stream->prefetch_state == ReadAhead::PREFETCH_NONE) {
+		UINT64 prefetchEnd = windowEnd(served);
+		UINT32 prefetchLength = static_cast<UINT32>(prefetchEnd - served);
+		UINT32 capacity = (prefetchLength + SourceFileSystem::UNBUFFERED_ALIGNMENT - 1) /
+			SourceFileSystem::UNBUFFERED_ALIGNMENT * SourceFileSystem::UNBUFFERED_ALIGNMENT;
+		if (prefetchEnd > served && readAhead.reserve(*stream, context, capacity)) {
+			stream->prefetch_offset = served;
+			stream->prefetch_length = prefetchLength;
+			stream->prefetch_state = ReadAhead::PREFETCH_QUEUED;
+
+			SourceFileSystemJob* job = sourceJobPool.acquire();
+			job->reset();
+			job->type = SourceFileSystemJob::TYPE_PREFETCH;
+			job->file_from = path;
+			job->read_ahead = stream;
+			if (!queueSourceJob(job)) {
+				stream->prefetch_state = ReadAhead::PREFETCH_NONE;
+				job->read_ahead.reset();
+				sourceJobPool.release(job);
+			}
+		}
+	}
+
+	return S_OK;
+}
+
+void FileProvider::prefetchFileData(SourceFileSystemJob* job)
+{
+	ReadAhead::Stream& stream = *job->read_ahead;
+
+	// The request may have taken the window over, or moved elsewhere, since it was queued
+	std::unique_lock<std::mutex> lock(stream.mutex);
+	if (stream.prefetch_state != ReadAhead::PREFETCH_QUEUED) {
+		return;
+	}
+	stream.prefetch_state = ReadAhead::PREFETCH_RUNNING;
+	UINT64 offset = stream.prefetch_offset;
+	UINT32 length = stream.prefetch_length;
+	lock.unlock();
+
+	std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+	HRESULT hr = readSourceFile(job->file_from, offset, length, stream.buffer);
+	if (SUCCEEDED(hr)) {
+		chunkSizer.record(length, nanosecondsSince(started));
+	}
+
+	lock.lock();
+	stream.prefetch_result = hr;
+	stream.prefetch_state = ReadAhead::PREFETCH_READY;
+	stream.prefetched.notify_all();
+}
+
+/*
+	Unbuffered reads go straight into buffer, which must be one from PrjAllocateAlignedBuffer with
+	room for length rounded up to SourceFileSystem::UNBUFFERED_ALIGNMENT, and skip the handle and
+	block caches along with the system's. Otherwise the file is read through a cached handle, and
+	files whose identity cannot be read bypass the block cache and in-flight sharing rather than fail.
+*/
+HRESULT FileProvider::readSourceFile(const std::wstring& path, UINT64 byteOffset, UINT32 length, void* buffer)
+{
+	if (unbuffered_reads) {
+		return SourceFileSystem::readFileUnbuffered(path, byteOffset, length, buffer);
+	}
 
+	HRESULT hr;
+	std::shared_ptr<HandleCache::OpenFile> file = handleCache.acquire(path, hr);
+	if (file == nullptr) {
+		return hr;
+	}
+
+	SourceFileSystem::FileIdentity identity;
+	if (SUCCEEDED(SourceFileSystem::getFileIdentity(file->handle, identity))) {
+		return blockCache.read(identity, file->handle, byteOffset, length, buffer);
+	}
+	return SourceFileSystem::readFile(file->handle, byteOffset, length, buffer);
+}
+
+/*
+	context is the virtualization instance the data is written to
+	dataStreamId is the DataStreamId of the GetFileData request
+	path is the full path of the file in the source
+	byteOffset and length give the range requested by ProjFS
+
+	Returns:
+		S_OK if all the requested data was written
+		The failure from the source read or PrjWriteFileData otherwise
+*/
+HRESULT FileProvider::writeFileData(
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT context,
+	const GUID& dataStreamId,
+	const std::wstring& path,
+	UINT64 byteOffset,
+	UINT32 length,
+	bool random,
+	const PendingCommand* command
+) {
+	HRESULT hr = S_OK;
+
+	UINT32 chunk = chunkSizer.choose(length, random);
 	UINT64 writeStartOffset;
 	UINT32 writeLength;
-	if (length <= 1024 * 1024) {
+	if (length <= chunk) {
 		writeStartOffset = byteOffset;
 		writeLength = length;
 	} else {
 		PRJ_VIRTUALIZATION_INSTANCE_INFO instanceInfo;
-		UINT32 infoSize = sizeof(instanceInfo);
 		hr = PrjGetVirtualizationInstanceInfo(
-			callbackData->NamespaceVirtualizationContext,
+			context,
 			&instanceInfo
 		);
 
@@ -441,45 +1375,256 @@ HRESULT FileProvider::getFileDataCB(
 
 		writeStartOffset = byteOffset;
 		UINT64 writeEndOffset = BlockAlignTruncate(
-			writeStartOffset + 1024 * 1024,
+			writeStartOffset + chunk,
 			instanceInfo.WriteAlignment
 		);
 		assert(writeEndOffset > 0);
 		assert(writeEndOffset > writeStartOffset);
 
-		writeLength = writeEndOffset - writeStartOffset;
+		writeLength = static_cast<UINT32>(writeEndOffset - writeStartOffset);
 	}
 
-	void* writeBuffer = NULL;
-	writeBuffer = PrjAllocateAlignedBuffer(
-		callbackData->NamespaceVirtualizationContext,
-		writeLength
-	);
-
+	void* writeBuffer = acquireDataBuffer(context, chunk);
 	if (writeBuffer == NULL) {
 		return E_OUTOFMEMORY;
 	}
 
 	do {
-		// hr = GetDataFromStore(callbackData->FilePathName,
-		//	writeStartOffset, writeLength, writeBuffer);
-#pragma warning("Error, not implemented!");
+		if (command != NULL && command->cancelled.load(std::memory_order_relaxed)) {
+			releaseDataBuffer(writeBuffer, chunk);
+			return interruptRead(length);
+		}
+
+		std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+		hr = readSourceFile(path, writeStartOffset, writeLength, writeBuffer);
+		if (SUCCEEDED(hr)) {
+			chunkSizer.record(writeLength, nanosecondsSince(started));
+
+			hr = PrjWriteFileData(
+				context,
+				&dataStreamId,
+				writeBuffer,
+				writeStartOffset,
+				writeLength
+			);
+		}
 
 		if (FAILED(hr)) {
-			PrjFreeAlignedBuffer(writeBuffer);
+			releaseDataBuffer(writeBuffer, chunk);
+
+			// ProjFS refuses data for a request it has cancelled
+			if (command != NULL && command->cancelled.load(std::memory_order_relaxed)) {
+				return interruptRead(length - writeLength);
+			}
 			return hr;
 		}
 
+		writeStartOffset += writeLength;
 		length -= writeLength;
 		if (length < writeLength) {
 			writeLength = length;
 		}
 	} while (writeLength > 0);
 
-	PrjFreeAlignedBuffer(writeBuffer);
+	releaseDataBuffer(writeBuffer, chunk);
 	return hr;
 }
 
+ListingCache::Presence FileProvider::findInMetadataIndex(
+	const std::wstring& directory,
+	PCWSTR name,
+	PRJ_FILE_BASIC_INFO& fileInfo
+) {
+	// Checking the directory costs the same as looking the file up, so only do it for one indexed
+	PRJ_FILE_BASIC_INFO dirInfo;
+	if (!metadataIndex.holds(directory) ||
+		FAILED(SourceFileSystem::getFileInfo(directory, dirInfo)) || !dirInfo.IsDirectory) {
+		return ListingCache::PRESENCE_UNKNOWN;
+	}
+
+	std::shared_ptr<const DirectoryListing> listing = metadataIndex.lookup(directory, dirInfo.ChangeTime);
+	if (listing == nullptr) {
+		return ListingCache::PRESENCE_UNKNOWN;
+	}
+	listingCache.store(directory, dirInfo.ChangeTime, listing);
+
+	size_t index;
+	if (!listing->find(name, index)) {
+		return ListingCache::PRESENCE_ABSENT;
+	}
+	fileInfo = listing->entryAt(index).fileInfo;
+	return ListingCache::PRESENCE_PRESENT;
+}
+
+// Buffers are recycled rather than allocated per request, in pools by size
+void* FileProvider::acquireDataBuffer(PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT context, UINT32 size)
+{
+	void* buffer;
+	if (dataBuffers[ChunkSizer::classOf(size)]->tryPop(buffer)) {
+		return buffer;
+	}
+	return PrjAllocateAlignedBuffer(context, size);
+}
+
+void FileProvider::releaseDataBuffer(void* buffer, UINT32 size)
+{
+	if (!dataBuffers[ChunkSizer::classOf(size)]->tryPush(buffer)) {
+		PrjFreeAlignedBuffer(buffer);
+	}
+}
+
+/*
+	Each job's range is read in pieces of up to RING_READ_LIMIT, taking one at a time from each job
+	in turn while the ring has room, so a large read does not hold up the small ones queued behind
+	it. Jobs are only taken while the ring has room and nothing is left to issue, and the worker
+	only sleeps on the job queue when no reads are in flight. Jobs the ring does not serve run as
+	they would on any other worker.
+*/
+void FileProvider::runSourceRing(unsigned worker)
+{
+	AsyncIO& ring = *sourceRings[worker];
+	std::vector<AsyncIO::Request> requests(ring.depth());
+	std::vector<AsyncIO::Request*> idle;
+	for (AsyncIO::Request& request : requests) {
+		idle.push_back(&request);
+	}
+	std::vector<AsyncIO::Request*> completed(ring.depth());
+	std::vector<std::chrono::steady_clock::time_point> issued(ring.depth());
+	std::deque<SourceFileSystemJob*> issuing;
+
+	for (;;) {
+		while (!idle.empty() && !issuing.empty()) {
+			SourceFileSystemJob* job = issuing.front();
+			issuing.pop_front();
+
+			UINT64 end = job->offset + job->length;
+			void* buffer = NULL;
+			if (SUCCEEDED(job->read_result) && job->issued_to < end &&
+				job->command != nullptr && job->command->cancelled.load(std::memory_order_relaxed)) {
+				job->read_result = interruptRead(end - job->issued_to);
+			}
+			if (SUCCEEDED(job->read_result) && job->issued_to < end) {
+				buffer = acquireDataBuffer(job->context, job->buffer_size);
+				if (buffer == NULL) {
+					job->read_result = E_OUTOFMEMORY;
+				}
+			}
+			if (buffer == NULL) {
+				job->issuing = false;
+				if (job->reads_pending == 0) {
+					finishRingJob(job);
+				}
+				continue;
+			}
+
+			AsyncIO::Request* request = idle.back();
+			idle.pop_back();
+			request->file = job->file;
+			request->offset = job->issued_to;
+			request->length = static_cast<UINT32>(std::min<UINT64>(job->segment_length, end - job->issued_to));
+			request->buffer = buffer;
+			request->owner = job;
+			job->issued_to += request->length;
+			job->reads_pending++;
+			issued[request - requests.data()] = std::chrono::steady_clock::now();
+			ring.read(request);
+			issuing.push_back(job);
+		}
+
+		if (!idle.empty() && issuing.empty()) {
+			SourceFileSystemJob* job = ring.inFlight() == 0 ? takeSourceJob(worker) : findSourceJob(worker);
+			if (job != NULL) {
+				if (!startRingRead(job, ring)) {
+					runTakenJob(job, worker);
+				} else if (job->issuing) {
+					issuing.push_back(job);
+				}
+				continue;
+			}
+			if (ring.inFlight() == 0) {
+				break;
+			}
+		}
+
+		ring.submit();
+		size_t count = ring.reap(completed.data(), completed.size(), true);
+		for (size_t i = 0; i < count; i++) {
+			finishRingRead(completed[i], nanosecondsSince(issued[completed[i] - requests.data()]));
+			idle.push_back(completed[i]);
+		}
+	}
+}
+
+/*
+	The ring serves reads of ranges ProjFS asked for, and the chunks of split ones. It reads the
+	source directly, so read-ahead, the block cache and unbuffered reads stay with the blocking
+	path. A job whose file cannot be opened is finished here, and is not left issuing.
+*/
+bool FileProvider::startRingRead(SourceFileSystemJob* job, AsyncIO& ring)
+{
+	if (job->type != SourceFileSystemJob::TYPE_READ || unbuffered_reads || splitsSourceJob(job)) {
+		return false;
+	}
+	if (dropCancelledJob(job)) {
+		return true;
+	}
+
+	// Pieces after the first start on a WriteAlignment boundary, as in writeFileData
+	HRESULT hr = S_OK;
+	job->buffer_size = std::min(chunkSizer.choose(job->length, false), RING_READ_LIMIT);
+	job->segment_length = job->length;
+	if (job->length > job->buffer_size) {
+		PRJ_VIRTUALIZATION_INSTANCE_INFO instanceInfo;
+		hr = PrjGetVirtualizationInstanceInfo(job->context, &instanceInfo);
+		if (SUCCEEDED(hr)) {
+			job->segment_length = static_cast<UINT32>(
+				BlockAlignTruncate(job->offset + job->buffer_size, instanceInfo.WriteAlignment) - job->offset
+			);
+		}
+	}
+	if (SUCCEEDED(hr)) {
+		hr = ring.openFile(job->file_from, job->file);
+	}
+	if (FAILED(hr)) {
+		finishSourceJob(job, hr);
+		return true;
+	}
+
+	job->issued_to = job->offset;
+	job->reads_pending = 0;
+	job->read_result = S_OK;
+	job->issuing = true;
+	return true;
+}
+
+void FileProvider::finishRingRead(AsyncIO::Request* request, UINT64 nanoseconds)
+{
+	SourceFileSystemJob* job = static_cast<SourceFileSystemJob*>(request->owner);
+	HRESULT hr = request->result;
+	if (SUCCEEDED(hr) && job->command != nullptr && job->command->cancelled.load(std::memory_order_relaxed)) {
+		hr = HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+	}
+	if (SUCCEEDED(hr)) {
+		chunkSizer.record(request->length, nanoseconds);
+		hr = PrjWriteFileData(job->context, &job->data_stream_id, request->buffer, request->offset, request->length);
+	}
+	releaseDataBuffer(request->buffer, job->buffer_size);
+
+	if (FAILED(hr) && SUCCEEDED(job->read_result)) {
+		job->read_result = hr;
+	}
+	job->reads_pending--;
+	if (!job->issuing && job->reads_pending == 0) {
+		finishRingJob(job);
+	}
+}
+
+void FileProvider::finishRingJob(SourceFileSystemJob* job)
+{
+	SourceFileSystem::closeFile(job->file);
+	finishSourceJob(job, job->read_result);
+}
+
 /*
 	callbackInfo holds information about the operation
 
@@ -491,7 +1636,7 @@ HRESULT FileProvider::getFileDataCB(
 HRESULT FileProvider::queryFileNameCallback(
 	const PRJ_CALLBACK_DATA* callbackData
 ) {
-	FileProvider* provider = reinterpret_cast<FileProvider*>(callbackData->InstanceContext);
+	UNREFERENCED_PARAMETER(callbackData);
 	return E_NOTIMPL;
 }
 
@@ -532,7 +1677,278 @@ HRESULT FileProvider::notificationCB(
 	PRJ_NOTIFICATION_PARAMETERS* notificationParameters
 ) {
 	FileProvider* provider = reinterpret_cast<FileProvider*>(callbackData->InstanceContext);
-	return E_NOTIMPL;
+	std::wstring path = provider->sourcePathOf(callbackData->FilePathName);
+
+	switch (notificationType) {
+	case PRJ_NOTIFICATION_NEW_FILE_CREATED:
+	case PRJ_NOTIFICATION_HARDLINK_CREATED:
+		provider->notified_created.fetch_add(1, std::memory_order_relaxed);
+		provider->invalidatePath(path, isDirectory, false);
+		if (notificationType == PRJ_NOTIFICATION_NEW_FILE_CREATED) {
+			notificationParameters->PostCreate.NotificationMask = provider->postCreateMask();
+		}
+		break;
+
+	case PRJ_NOTIFICATION_FILE_OVERWRITTEN:
+		provider->notified_modified.fetch_add(1, std::memory_order_relaxed);
+		provider->invalidatePath(path, isDirectory, true);
+		notificationParameters->PostCreate.NotificationMask = provider->postCreateMask();
+		break;
+
+	case PRJ_NOTIFICATION_FILE_HANDLE_CLOSED_FILE_MODIFIED:
+		provider->notified_modified.fetch_add(1, std::memory_order_relaxed);
+		provider->invalidatePath(path, isDirectory, true);
+
+		// Only the size is looked at here; the copy is made later by the flusher
+		if (provider->write_back_enabled && !isDirectory) {
+			PRJ_FILE_BASIC_INFO fileInfo;
+			std::wstring written = provider->virtualization_path + L"\\" + callbackData->FilePathName;
+			if (SUCCEEDED(SourceFileSystem::getFileInfo(written, fileInfo))) {
+				provider->writeBack.markDirty(callbackData->FilePathName, static_cast<UINT64>(fileInfo.FileSize));
+			}
+		}
+		break;
+
+	case PRJ_NOTIFICATION_FILE_RENAMED:
+		// The file is gone from its old name and appears under the new one
+		provider->notified_renamed.fetch_add(1, std::memory_order_relaxed);
+		provider->invalidatePath(path, isDirectory, true);
+		if (destinationFileName != nullptr && destinationFileName[0] != L'\0') {
+			provider->invalidatePath(provider->sourcePathOf(destinationFileName), isDirectory, false);
+			provider->writeBack.rename(callbackData->FilePathName, destinationFileName);
+		}
+		break;
+
+	case PRJ_NOTIFICATION_FILE_HANDLE_CLOSED_FILE_DELETED:
+		// A file deleted unmodified leaves its cached data as good as the source's; only the
+		// listing it was in changes
+		provider->notified_deleted.fetch_add(1, std::memory_order_relaxed);
+		provider->invalidatePath(path, isDirectory,
+			isDirectory || notificationParameters->FileDeletedOnHandleClose.IsFileModified);
+		provider->writeBack.forget(callbackData->FilePathName);
+		break;
+
+	default:
+		break;
+	}
+
+	return S_OK;
+}
+
+void FileProvider::applySourceChanges(const std::vector<SourceWatcher::Change>& changes)
+{
+	for (const SourceWatcher::Change& change : changes) {
+		bool removed = (change.actions & SourceWatcher::ACTION_REMOVED) != 0;
+		bool appeared = (change.actions & SourceWatcher::ACTION_ADDED) != 0;
+
+		// A directory that is only modified keeps what is below it; its own listing is dropped
+		if (change.directory && !removed && !appeared) {
+			invalidatePath(change.path, true, false);
+			listingCache.invalidate(change.path);
+			metadataIndex.invalidate(change.path);
+			continue;
+		}
+
+		invalidatePath(change.path, change.directory, true);
+
+		// A removed path not known to be a file or a directory is treated as both
+		if (removed && !change.directory_known) {
+			listingCache.invalidateTree(change.path);
+			metadataIndex.invalidateTree(change.path);
+		}
+	}
+	source_changes.fetch_add(changes.size(), std::memory_order_relaxed);
+}
+
+void FileProvider::requestRescan()
+{
+	// Open handles may name files replaced without a trace; they are checked again on next use
+	handleCache.invalidateAll();
+
+	// Overflows during a rescan are folded into one more rescan after it
+	std::lock_guard<std::mutex> lock(rescanMutex);
+	rescan_pending = true;
+	if (rescan_running) {
+		return;
+	}
+	if (rescanThread.joinable()) {
+		rescanThread.join();
+	}
+
+	rescan_running = true;
+	rescanThread = std::thread([this] {
+		for (;;) {
+			{
+				std::lock_guard<std::mutex> lock(rescanMutex);
+				if (!rescan_pending) {
+					rescan_running = false;
+					return;
+				}
+				rescan_pending = false;
+			}
+
+			TreeScanner::Result result;
+			if (crawlSourceTree(true, result) == HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED)) {
+				std::lock_guard<std::mutex> lock(rescanMutex);
+				rescan_running = false;
+				return;
+			}
+			source_rescans.fetch_add(1, std::memory_order_relaxed);
+		}
+	});
+}
+
+void FileProvider::runWriteBack()
+{
+	// Where the system cannot sync a volume at once, batched copies are synced one by one
+	if (writeBack.getOptions().sync == WriteBackQueue::SYNC_BATCH) {
+		volume_sync = SourceFileSystem::syncVolume(source_path) != E_NOTIMPL;
+	}
+
+	std::vector<WriteBackQueue::Entry> entries;
+	while (writeBack.takeBatch(entries)) {
+		WriteBackBatch batch;
+		batch.copies.resize(entries.size());
+		batch.pending = entries.size();
+
+		for (size_t i = 0; i < entries.size(); i++) {
+			WriteBackBatch::Copy& copy = batch.copies[i];
+			copy.target = sourcePathOf(entries[i].path.c_str());
+			copy.result = S_OK;
+
+			// A file created in a new directory needs the directory in the source too
+			std::wstring directory = copy.target.substr(0, copy.target.find_last_of(L'\\'));
+			PRJ_FILE_BASIC_INFO fileInfo;
+			if (FAILED(SourceFileSystem::getFileInfo(directory, fileInfo))) {
+				for (size_t end = source_path.size() + 1; end != std::wstring::npos && end <= directory.size();) {
+					end = directory.find(L'\\', end + 1);
+					SourceFileSystem::createDirectory(directory.substr(0, end));
+				}
+			}
+
+			// Copies are made beside their file so replacing it is a rename within the directory
+			copy.temporary = SourceFileSystem::uniqueFilePath(directory, WRITE_BACK_PREFIX);
+
+			SourceFileSystemJob* job = sourceJobPool.acquire();
+			job->reset();
+			job->type = SourceFileSystemJob::TYPE_WRITE;
+			job->file_from = virtualization_path + L"\\" + entries[i].path;
+			job->file_to = copy.temporary;
+			job->write_batch = &batch;
+			job->write_index = i;
+			if (!queueSourceJob(job)) {
+				finishWriteJob(job, copyToSource(job));
+			}
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(batch.mutex);
+			batch.done.wait(lock, [&batch] { return batch.pending == 0; });
+		}
+
+		HRESULT synced = S_OK;
+		if (writeBack.getOptions().sync == WriteBackQueue::SYNC_BATCH && volume_sync) {
+			synced = SourceFileSystem::syncVolume(source_path);
+		}
+
+		for (size_t i = 0; i < entries.size(); i++) {
+			WriteBackBatch::Copy& copy = batch.copies[i];
+			HRESULT hr = FAILED(copy.result) ? copy.result : synced;
+			if (SUCCEEDED(hr)) {
+				// Cached handles would keep reading the file being replaced
+				handleCache.invalidate(copy.target);
+				if (SourceFileSystem::replaceFile(copy.temporary, copy.target)) {
+					invalidatePath(copy.target, false, true);
+				} else {
+					hr = HRESULT_FROM_WIN32(ERROR_WRITE_FAULT);
+				}
+			}
+			if (FAILED(hr)) {
+				SourceFileSystem::removeFile(copy.temporary);
+			}
+			writeBack.finished(entries[i], hr);
+		}
+	}
+}
+
+HRESULT FileProvider::copyToSource(SourceFileSystemJob* job)
+{
+	SourceFileSystem::FileHandle from;
+	HRESULT hr = SourceFileSystem::openForReading(job->file_from, from);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	// The file is copied as long as it was when opened; a later write dirties it again
+	SourceFileSystem::FileIdentity identity;
+	SourceFileSystem::FileHandle to;
+	hr = SourceFileSystem::getFileIdentity(from, identity);
+	if (SUCCEEDED(hr)) {
+		hr = SourceFileSystem::openForWriting(job->file_to, to);
+	}
+	if (FAILED(hr)) {
+		SourceFileSystem::closeFile(from);
+		return hr;
+	}
+
+	UINT64 size = static_cast<UINT64>(identity.size);
+	UINT32 bufferSize = static_cast<UINT32>(std::min<UINT64>(std::max<UINT64>(size, 1), WRITE_BACK_COPY_SIZE));
+	std::unique_ptr<char[]> buffer(new char[bufferSize]);
+	for (UINT64 offset = 0; offset < size && SUCCEEDED(hr); offset += bufferSize) {
+		UINT32 length = static_cast<UINT32>(std::min<UINT64>(bufferSize, size - offset));
+		hr = SourceFileSystem::readFile(from, offset, length, buffer.get());
+		if (SUCCEEDED(hr)) {
+			hr = SourceFileSystem::writeFile(to, offset, length, buffer.get());
+		}
+	}
+
+	WriteBackQueue::SyncPolicy sync = writeBack.getOptions().sync;
+	if (SUCCEEDED(hr) && (sync == WriteBackQueue::SYNC_FILE || (sync == WriteBackQueue::SYNC_BATCH && !volume_sync))) {
+		hr = SourceFileSystem::syncFile(to);
+	}
+
+	SourceFileSystem::closeFile(from);
+	SourceFileSystem::closeFile(to);
+	return hr;
+}
+
+void FileProvider::finishWriteJob(SourceFileSystemJob* job, HRESULT hr)
+{
+	WriteBackBatch* batch = job->write_batch;
+	size_t index = job->write_index;
+	sourceJobPool.release(job);
+
+	std::lock_guard<std::mutex> lock(batch->mutex);
+	batch->copies[index].result = hr;
+	if (--batch->pending == 0) {
+		batch->done.notify_all();
+	}
+}
+
+void FileProvider::invalidatePath(const std::wstring& path, bool isDirectory, bool contentChanged)
+{
+	// The root has no parent, and only changes in what it holds
+	if (path.size() > source_path.size()) {
+		std::wstring parent = path.substr(0, path.find_last_of(L'\\'));
+		listingCache.invalidate(parent);
+		metadataIndex.invalidate(parent);
+	}
+	if (!contentChanged) {
+		return;
+	}
+
+	if (isDirectory) {
+		listingCache.invalidateTree(path);
+		metadataIndex.invalidateTree(path);
+		return;
+	}
+
+	// ProjFS will not ask for the data of a file the user has written to again
+	handleCache.invalidate(path);
+	SourceFileSystem::FileIdentity identity;
+	if (SUCCEEDED(SourceFileSystem::getFileIdentity(path, identity))) {
+		blockCache.invalidate(identity);
+	}
 }
 
 /*
@@ -546,106 +1962,47 @@ void FileProvider::cancelCommandCB(
 	const PRJ_CALLBACK_DATA* callbackData
 ) {
 	FileProvider* provider = reinterpret_cast<FileProvider*>(callbackData->InstanceContext);
-}
-
-/*
-	left contains the left operand GUID
-	right contains the right operand GUID
-
-	Returns:
-		bool - true if left < right; false if left >= right
-*/
-bool FileProvider::GUIDComparer::operator()(const GUID & left, const GUID & right) const
-{
-	// Compare the GUIDs by their data
-	return memcmp(
-		static_cast<const void*>(&left),
-		static_cast<const void*>(&right),
-		sizeof(left)
-	) < 0;
-}
 
-// Holds information temporarily so it can be added to a vector
-static struct TmpTupleEnumerate {
-	std::wstring name;
-	PRJ_FILE_BASIC_INFO fInfo;
-};
-
-static bool lessThan(TmpTupleEnumerate a, TmpTupleEnumerate b) {
-	return PrjFileNameCompare(a.name.c_str(), b.name.c_str()) < 0;
+	// The command may have been completed while ProjFS was cancelling it
+	std::shared_ptr<PendingCommand> command = provider->pendingCommands.find(callbackData->CommandId);
+	if (command == nullptr) {
+		provider->cancels_late.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	if (!command->cancelled.exchange(true)) {
+		provider->commands_cancelled.fetch_add(1, std::memory_order_relaxed);
+	}
 }
 
-HRESULT FileProvider::EnumerationSession::enumerate() {
-	// Get a list of the files and directories in the directory
-	WIN32_FIND_DATA fileData;
-	HANDLE hFind;
+HRESULT FileProvider::EnumerationSession::enumerate(FileProvider* provider, const LARGE_INTEGER& changeTime) {
+	enum_cursor = 0;
+	enum_completed = FALSE;
 
-	// Holds all the data temporarily
-	std::vector<TmpTupleEnumerate> files;
+	// The metadata index holds what an earlier run read, if the directory has not changed since
+	listing = provider->metadataIndex.lookup(src_path, changeTime);
+	if (listing != nullptr) {
+		provider->listingCache.store(src_path, changeTime, listing);
+		return S_OK;
+	}
 
-	// Find the first file/directory
-	hFind = FindFirstFileW(src_path.c_str(), &fileData);
+	// Directories too large for memory may already have a sorted index on disk
+	const DirectoryStream::Options& options = provider->streamOptions;
+	if (options.run_entries != 0 && SUCCEEDED(DirectoryStream::openIndex(options, src_path, changeTime, stream))) {
+		return S_OK;
+	}
 
-	// Check to see if no files or directories exist
-	if (hFind == INVALID_HANDLE_VALUE &&
-		GetLastError() == ERROR_FILE_NOT_FOUND) {
+	// Read the directory: sorted in memory and cached if it is small enough, spilled otherwise
+	std::shared_ptr<DirectoryListing> loaded;
+	HRESULT hr = DirectoryStream::scan(options, src_path, changeTime, loaded, stream);
+	if (FAILED(hr)) {
 		return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
 	}
-	
-	// Add the first file
-	{
-		TmpTupleEnumerate en;
-		en.name = fileData.cFileName;
-		en.fInfo.IsDirectory =
-			(fileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? TRUE : FALSE;
-		en.fInfo.FileSize =
-			(fileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ?
-			0 : MI32I32(fileData.nFileSizeLow, fileData.nFileSizeHigh);
-		en.fInfo.LastAccessTime.QuadPart = FT2I64(fileData.ftLastAccessTime);
-		en.fInfo.LastWriteTime.QuadPart = FT2I64(fileData.ftLastWriteTime);
-		en.fInfo.CreationTime.QuadPart = FT2I64(fileData.ftCreationTime);
-		en.fInfo.ChangeTime.QuadPart = FT2I64(fileData.ftLastWriteTime);
-
-		files.push_back(en);
-	}
-
-	// Add the files
-	while (FindNextFileW(hFind, &fileData)) {
-		TmpTupleEnumerate en;
-		en.name = fileData.cFileName;
-		en.fInfo.IsDirectory =
-			(fileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? TRUE : FALSE;
-		en.fInfo.FileSize =
-			(fileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ?
-			0 : MI32I32(fileData.nFileSizeLow, fileData.nFileSizeHigh);
-		en.fInfo.LastAccessTime.QuadPart = FT2I64(fileData.ftLastAccessTime);
-		en.fInfo.LastWriteTime.QuadPart = FT2I64(fileData.ftLastWriteTime);
-		en.fInfo.CreationTime.QuadPart = FT2I64(fileData.ftCreationTime);
-		en.fInfo.ChangeTime.QuadPart = FT2I64(fileData.ftLastWriteTime);
-
-		files.push_back(en);
-	}
-
-	FindClose(hFind);
-
-	// Sort the files
-	std::sort(files.begin(), files.end(), lessThan);
-
-	// Convert to the linked list
-	for (auto it = files.begin(); it != files.end(); ++it) {
-		EnumerationEntry* entry = new EnumerationEntry;
-		entry->fileInfo = it->fInfo;
-		entry->name = it->name;
-		entry->next = NULL;
-
-		if (enum_head == NULL) {
-			enum_head = entry;
-			enum_back = entry;
-		} else {
-			enum_back->next = entry;
-			enum_back = entry;
-		}
-	}
 
+	// Streamed directories are left out of the metadata index; they keep their own on disk
+	if (loaded != nullptr) {
+		listing = loaded;
+		provider->listingCache.store(src_path, changeTime, listing);
+		provider->metadataIndex.update(src_path, changeTime, listing);
+	}
 	return S_OK;
-}
\ No newline at end of file
+}
@@ -1,11 +1,31 @@
 #pragma once
 
 #include "pch.h"
-#include <map>
+#include "AsyncIO.h"
+#include "BlockCache.h"
+#include "ChunkSizer.h"
+#include "DirectoryListing.h"
+#include "DirectoryStream.h"
+#include "HandleCache.h"
+#include "IOScheduler.h"
+#include "JobQueue.h"
+#include "ListingCache.h"
+#include "MetadataIndex.h"
+#include "ProcessQoS.h"
+#include "ReadAhead.h"
+#include "SearchExpression.h"
+#include "ShardedTable.h"
+#include "SourceWatcher.h"
+#include "TreeScanner.h"
+#include "WriteBackQueue.h"
+#include <atomic>
 #include <mutex>
 #include <string>
 #include <cstdio>
-#include <unordered_map>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <condition_variable>
 
 class FileMetadata {
 };
@@ -14,100 +34,389 @@ class FileProvider
 {
 protected:
 
-	class GUIDComparer {
-	public:
-		bool operator() (const GUID& left, const GUID& right) const;
-	};
-
 	// Classes that hold information used during runtime
 	class EnumerationSession {
 	public:
-
-		class EnumerationEntry {
-		public:
-			EnumerationEntry* next;
-			std::wstring name;
-			PRJ_FILE_BASIC_INFO fileInfo;
-
-			EnumerationEntry() :
-				next(NULL),
-				name(NULL),
-				fileInfo({})
-			{}
-			~EnumerationEntry() {
-				EnumerationEntry* e = next;
-				while (next != NULL) {
-					EnumerationEntry* tmp = e->next;
-					delete next;
-					e = tmp;
-				}
-			}
-		};
-	
 		GUID enumeration_id;
 
 		std::wstring virt_path;
 		std::wstring src_path;
-		PWSTR search_expression;
-		USHORT search_expression_max_length;
+		SearchExpression search_expression;
 
 		BOOLEAN search_expression_captured;
 		BOOLEAN enum_completed;
 
-		EnumerationEntry* enum_head;
-		EnumerationEntry* enum_back;
-		EnumerationEntry* enum_last;
+		// The sorted directory contents, shared with the listing cache, and the index of the next
+		// entry to return; directories too large to hold in memory are streamed instead
+		std::shared_ptr<const DirectoryListing> listing;
+		size_t enum_cursor;
+		std::unique_ptr<DirectoryStream> stream;
+
+		// ProjFS may deliver the callbacks for one enumeration on different pool threads
+		std::mutex mutex;
 
-		HRESULT enumerate();
+		HRESULT enumerate(FileProvider* provider, const LARGE_INTEGER& changeTime);
 
 		EnumerationSession() :
 			enumeration_id(),
-			search_expression(NULL),
-			search_expression_max_length(0),
-			enum_head(NULL),
-			enum_last(NULL),
-			enum_back(NULL)
+			search_expression_captured(FALSE),
+			enum_completed(FALSE),
+			enum_cursor(0)
 		{}
 
-		~EnumerationSession() {
-			if (enum_head)
-				delete enum_head;
-		}
+		EnumerationSession(const EnumerationSession&) = delete;
+		EnumerationSession& operator=(const EnumerationSession&) = delete;
+	};
+
+	/*
+		A GetFileData or StartDirectoryEnumeration command handed to the source workers, tracked
+		by its CommandId until it is completed so that cancelCommandCB can find it. Its jobs check
+		it before they start and between the chunks they read, so a cancelled command stops
+		reading at the next boundary.
+
+		The callback tracks it once the job is queued, so a worker may finish first; finished
+		tells the callback to take back what it tracked too late.
+	*/
+	class PendingCommand {
+	public:
+		std::atomic<bool> cancelled;
+		std::atomic<bool> finished;
+
+		PendingCommand() : cancelled(false), finished(false) {}
+	};
+
+	// The copies of one write-back batch, which the flusher waits on before replacing the source files
+	class WriteBackBatch {
+	public:
+		class Copy {
+		public:
+			std::wstring target;
+			std::wstring temporary;
+			HRESULT result;
+		};
+
+		std::vector<Copy> copies;
+		std::mutex mutex;
+		std::condition_variable done;
+		size_t pending;
+
+		WriteBackBatch() : pending(0) {}
 	};
 
 	class SourceFileSystemJob {
 	public:
-		SourceFileSystemJob* prev;
-		SourceFileSystemJob* next;
 		int type;
-		std::string file_from;
-		std::string file_to;
+		std::wstring file_from;
+		std::wstring file_to;
 		UINT64 offset;
 		UINT32 length;
 
+		// Identifies the ProjFS command the job completes
+		PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT context;
+		INT32 command_id;
+		GUID data_stream_id;
+
+		// Large reads are split into chunk jobs which point back at the job they came from;
+		// the last chunk to finish completes the command with the first failure, if any
+		SourceFileSystemJob* parent;
+		std::atomic<UINT32> pending_chunks;
+		std::atomic<HRESULT> result;
+
+		// The command a TYPE_READ or TYPE_DIRECTORY_ENUM job serves, shared by its chunks; nullptr
+		// when it is untracked
+		std::shared_ptr<PendingCommand> command;
+
+		// The process the command is for, and when ProjFS asked for it
+		std::shared_ptr<ProcessQoS::Account> account;
+		std::chrono::steady_clock::time_point started;
+
+		// The session a TYPE_DIRECTORY_ENUM job reads the directory of, at its ChangeTime
+		std::shared_ptr<EnumerationSession> enumeration;
+		LARGE_INTEGER change_time;
+
+		// The stream a TYPE_PREFETCH job reads ahead for
+		std::shared_ptr<ReadAhead::Stream> read_ahead;
+
+		// A TYPE_WRITE job copies file_from whole to file_to, copy write_index of write_batch;
+		// offset and length are not used
+		WriteBackBatch* write_batch;
+		size_t write_index;
+
+		// A read served through a worker's AsyncIO ring: the file opened for it, how far its range
+		// has been issued, the length of each read and its buffers, and how many are in flight
+		SourceFileSystem::FileHandle file;
+		UINT64 issued_to;
+		UINT32 segment_length;
+		UINT32 buffer_size;
+		UINT32 reads_pending;
+		bool issuing;
+		HRESULT read_result;
+
 		static const int TYPE_READ = 0;
 		static const int TYPE_WRITE = 1;
 		static const int TYPE_DIRECTORY_ENUM = 2;
+		static const int TYPE_PREFETCH = 3;
 
 		SourceFileSystemJob();
 		~SourceFileSystemJob();
+
+		// Jobs are recycled through sourceJobPool, so they are reset rather than reconstructed
+		void reset();
 	};
 
+	// Reads longer than this are split into chunks that idle workers can steal
+	static constexpr UINT32 SOURCE_SPLIT_SIZE = 8 * 1024 * 1024;
+
+	// Reads through a ring are no longer than this; the ring's depth keeps the source busy
+	static constexpr UINT32 RING_READ_LIMIT = 1024 * 1024;
+
+	// The aligned buffers GetFileData reads into and writes from come in ChunkSizer's sizes; of
+	// each size, up to DATA_BUFFER_POOL buffers and DATA_BUFFER_POOL_BYTES are kept for reuse
+	static constexpr size_t DATA_BUFFER_POOL = 64;
+	static constexpr size_t DATA_BUFFER_POOL_BYTES = 64 * 1024 * 1024;
+	static constexpr unsigned DATA_BUFFER_CLASSES = 32;
+
+	// Modified files are copied back to the source this much at a time
+	static const UINT32 WRITE_BACK_COPY_SIZE = 1024 * 1024;
+	// Copies are written beside their file under names starting with this, which the source
+	// watcher ignores
+	static const WCHAR* const WRITE_BACK_PREFIX;
+
+	// Directories with more entries than this are streamed rather than sorted in memory
+	static const size_t STREAMING_RUN_ENTRIES = 131072;
+
+	/*
+		Notifications of changes, each sent once its operation has happened. Opens and unmodified
+		closes are left out, since they come with every read and change nothing, and so are the
+		PRE_ notifications, which hold up the operation until the callback returns
+	*/
+	static const PRJ_NOTIFY_TYPES DEFAULT_NOTIFICATION_MASK = static_cast<PRJ_NOTIFY_TYPES>(
+		PRJ_NOTIFY_NEW_FILE_CREATED |
+		PRJ_NOTIFY_FILE_OVERWRITTEN |
+		PRJ_NOTIFY_FILE_RENAMED |
+		PRJ_NOTIFY_HARDLINK_CREATED |
+		PRJ_NOTIFY_FILE_HANDLE_CLOSED_FILE_MODIFIED |
+		PRJ_NOTIFY_FILE_HANDLE_CLOSED_FILE_DELETED
+	);
+
 	// Shared variables
 	std::wstring virtualization_path;
 	std::wstring source_path;
 	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT instanceHandle;
 	bool virtualizing;
-	std::map<GUID, EnumerationSession, GUIDComparer> enumerations;
-	SourceFileSystemJob* sourceJobsHead;
-	SourceFileSystemJob* sourceJobsEnd;
+	ShardedTable<GUID, EnumerationSession, GUIDHash, GUIDEqual> enumerations;
+	ListingCache listingCache;
+	MetadataIndex metadataIndex;
+	std::wstring metadata_index_path;
+	bool metadata_index_enabled;
+	ReadAhead readAhead;
+	BlockCache blockCache;
+	HandleCache handleCache;
+	DirectoryStream::Options streamOptions;
+	IOScheduler<SourceFileSystemJob> sourceJobs;
+	IOSchedulerBase::Options ioOptions;
+	// Workers kept from prefetch and background jobs, for foreground reads arriving
+	unsigned reserved_workers;
+	ObjectPool<SourceFileSystemJob> sourceJobPool;
+	std::vector<std::unique_ptr<WorkStealingDeque<SourceFileSystemJob>>> sourceWorkerDeques;
+	// One per worker when reads are asynchronous; nullptr where the ring could not be set up
+	std::vector<std::unique_ptr<AsyncIO>> sourceRings;
+	UINT32 source_queue_depth;
 	std::mutex sourceJobsMutex;
-	std::unordered_map<std::wstring, HANDLE> open_files;
+	std::condition_variable sourceJobsCondition;
+	std::atomic<unsigned> sourceWorkersSleeping;
+	std::vector<std::thread> sourceWorkers;
+	unsigned source_worker_count;
+	std::atomic<bool> sourceWorkersStopping;
+	ChunkSizer chunkSizer;
+	std::unique_ptr<BoundedMPMCQueue<void*>> dataBuffers[DATA_BUFFER_CLASSES];
+	bool unbuffered_reads;
+	UINT32 pool_thread_count;
+	UINT32 concurrent_thread_count;
+
+	// The scan of the source tree started with the provider, and the scanner running, if any
+	bool background_scan;
+	TreeScanner::Options scanOptions;
+	std::thread backgroundScan;
+	std::mutex scannerMutex;
+	std::vector<TreeScanner*> scanners;
+	bool scanner_cancelled;
+	TreeScanner::Result scanResult;
+	std::atomic<bool> scan_finished;
+
+	// Notifications asked of ProjFS for the whole virtualization root, and those received
+	PRJ_NOTIFY_TYPES notification_mask;
+	std::atomic<UINT64> notified_created;
+	std::atomic<UINT64> notified_modified;
+	std::atomic<UINT64> notified_renamed;
+	std::atomic<UINT64> notified_deleted;
+
+	// Changes made directly to the source, and the rescan run when the watcher lost some
+	SourceWatcher sourceWatcher;
+	bool source_watch_enabled;
+	std::thread rescanThread;
+	std::mutex rescanMutex;
+	bool rescan_pending;
+	bool rescan_running;
+	std::atomic<UINT64> source_changes;
+	std::atomic<UINT64> source_rescans;
+
+	// The processes reading through the provider, and the weights and limits set for their images
+	ProcessQoS processQoS;
+
+	// GetFileData and StartDirectoryEnumeration commands the workers are serving, and what
+	// cancelling them spared
+	ShardedTable<INT32, PendingCommand> pendingCommands;
+	std::atomic<UINT64> commands_cancelled;
+	std::atomic<UINT64> cancels_late;
+	std::atomic<UINT64> jobs_cancelled;
+	std::atomic<UINT64> reads_interrupted;
+	std::atomic<UINT64> cancelled_bytes;
+
+	// Files modified in the virtualization root, copied back to the source by the flusher
+	WriteBackQueue writeBack;
+	bool write_back_enabled;
+	std::thread writeBackFlusher;
+	// Whether the source's volume can be synced at once, for WriteBackQueue::SYNC_BATCH
+	bool volume_sync;
 
 	// Functions
 
+	// Joins a path relative to the virtualization root onto the source path
+	std::wstring sourcePathOf(PCWSTR relativePath) const;
+
+	/*
+		Drops what the caches hold about a path that changed: the listing of its parent, whose
+		entry for it is out of date, and, unless only its name appeared, the listings below a
+		directory or the open handle and cached blocks of a file
+	*/
+	void invalidatePath(const std::wstring& path, bool isDirectory, bool contentChanged);
+
+	// A file the user created or overwrote holds nothing from the source, so from then on only
+	// what happens to it as a whole is of interest: being renamed, written or deleted
+	PRJ_NOTIFY_TYPES postCreateMask() const {
+		return static_cast<PRJ_NOTIFY_TYPES>(notification_mask & (
+			PRJ_NOTIFY_FILE_RENAMED |
+			PRJ_NOTIFY_FILE_HANDLE_CLOSED_FILE_MODIFIED |
+			PRJ_NOTIFY_FILE_HANDLE_CLOSED_FILE_DELETED));
+	}
+
+	// Applies a batch of changes the source watcher saw
+	void applySourceChanges(const std::vector<SourceWatcher::Change>& changes);
+
+	// Rereads the whole source tree into the caches on a thread of its own, bounded like any scan
+	// by the scan threads and open directories, once the watcher has lost track of changes
+	void requestRescan();
+
+	// Takes batches of dirty files from the write-back queue and copies them to the source
+	void runWriteBack();
+
+	// Runs a TYPE_WRITE job: copies a file from the virtualization root beside its source file
+	HRESULT copyToSource(SourceFileSystemJob* job);
+
+	// Reports a TYPE_WRITE job's result to the flusher waiting on its batch
+	void finishWriteJob(SourceFileSystemJob* job, HRESULT hr);
+
+	// Walks the source tree, rereading every directory or only those the caches cannot answer
+	HRESULT crawlSourceTree(bool reread, TreeScanner::Result& result);
+
 	// SourceFileSystemWorker runs in a thread and performs I/O quickly and efficiently
-	static void SourceFileSystemWorker(FileProvider* provider);
+	static void SourceFileSystemWorker(FileProvider* provider, unsigned worker);
+
+	// Start and stop the pool of SourceFileSystemWorker threads
+	void startSourceWorkers();
+	void stopSourceWorkers();
+
+	// Adds a job to the shared queue under its class; returns false if the class is full
+	bool queueSourceJob(SourceFileSystemJob* job);
+
+	// The scheduling class of a job, by its type
+	static IOClass ioClassOf(const SourceFileSystemJob* job);
+
+	// Runs a job a worker took, and tells the scheduler it is done
+	void runTakenJob(SourceFileSystemJob* job, unsigned worker);
+
+	// Takes a job from the worker's own deque, the shared queue or another worker's deque, in that
+	// order. Blocks until a job is available and returns NULL once the workers are stopping
+	SourceFileSystemJob* takeSourceJob(unsigned worker);
+	SourceFileSystemJob* findSourceJob(unsigned worker);
+	void wakeSourceWorker();
+
+	// Runs a job, splitting large reads across the worker's deque
+	void runSourceJob(SourceFileSystemJob* job, unsigned worker);
+
+	// Whether runSourceJob splits the job into chunks
+	bool splitsSourceJob(SourceFileSystemJob* job) const;
+
+	// The loop of a worker with an AsyncIO ring, which keeps up to its depth of reads in flight
+	void runSourceRing(unsigned worker);
+
+	// Opens the file of a read job for the ring; false if the job is not one the ring serves
+	bool startRingRead(SourceFileSystemJob* job, AsyncIO& ring);
+
+	// Writes a completed read, which took nanoseconds from issue to completion, to ProjFS,
+	// finishing its job after the last one
+	void finishRingRead(AsyncIO::Request* request, UINT64 nanoseconds);
+	void finishRingJob(SourceFileSystemJob* job);
+
+	// Completes the job's command, or its parent's once every chunk is done, and recycles it
+	void finishSourceJob(SourceFileSystemJob* job, HRESULT hr);
+
+	// Drops a job which will never run, recycling its parent when it was the last chunk
+	void discardSourceJob(SourceFileSystemJob* job);
+
+	// Reads the directory of a TYPE_DIRECTORY_ENUM job into its session
+	HRESULT readEnumeration(SourceFileSystemJob* job);
+
+	// Counts a finished read or enumeration towards the process it was for
+	void recordForProcess(SourceFileSystemJob* job, HRESULT hr);
+
+	// Queues a read or enumeration job for a command which then goes pending, tracking the
+	// command for cancelCommandCB; false if the caller must run the job itself
+	bool queueCommandJob(SourceFileSystemJob* job);
+
+	// Finishes a read or enumeration job whose command was cancelled before it started, without reading
+	bool dropCancelledJob(SourceFileSystemJob* job);
+
+	// Counts a read stopped part way for its cancelled command, and returns the error it ends with
+	HRESULT interruptRead(UINT64 bytesLeft);
+
+	// Serves a GetFileData request, writing ahead of sequential readers and queueing their prefetches
+	HRESULT serveFileData(
+		PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT context,
+		const GUID& dataStreamId,
+		const std::wstring& path,
+		UINT64 byteOffset,
+		UINT32 length,
+		const PendingCommand* command
+	);
+
+	// Reads the window queued for a stream into its prefetch buffer
+	void prefetchFileData(SourceFileSystemJob* job);
+
+	// Answers a placeholder lookup from the metadata index, once the directory's ChangeTime shows
+	// its record is current, and caches the directory's listing for the lookups that follow
+	ListingCache::Presence findInMetadataIndex(const std::wstring& directory, PCWSTR name, PRJ_FILE_BASIC_INFO& fileInfo);
+
+	// Reads a range of a source file through the handle and block caches, or unbuffered
+	HRESULT readSourceFile(const std::wstring& path, UINT64 byteOffset, UINT32 length, void* buffer);
+
+	// Takes a buffer of a size ChunkSizer chose, from PrjAllocateAlignedBuffer, out of the pool,
+	// and returns it
+	void* acquireDataBuffer(PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT context, UINT32 size);
+	void releaseDataBuffer(void* buffer, UINT32 size);
+
+	// Reads a range of a source file and hands it to ProjFS in WriteAlignment sized chunks, sized
+	// for a stream read at random if random is set, stopping between chunks once command is cancelled
+	HRESULT writeFileData(
+		PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT context,
+		const GUID& dataStreamId,
+		const std::wstring& path,
+		UINT64 byteOffset,
+		UINT32 length,
+		bool random = false,
+		const PendingCommand* command = NULL
+	);
 
 	// Starts the enumeration of a directory
 	static HRESULT startDirectoryEnumerationCB(
@@ -161,7 +470,91 @@ public:
 
 	void setVirtualizationPath(const WCHAR* path) { virtualization_path = path; }
 	void setSourcePath(const WCHAR* path) { source_path = path; }
+	// Number of threads reading from the source; 0 reads on the ProjFS callback thread
+	void setSourceWorkerCount(unsigned count) { source_worker_count = count; }
+	// Reads each worker keeps in flight through an asynchronous I/O ring; 0 reads one at a time
+	void setSourceQueueDepth(UINT32 depth) { source_queue_depth = depth; }
+	// Deadlines and queue sizes of the classes of source work, and the workers prefetch and
+	// background work may not take
+	void setIOSchedulerOptions(const IOSchedulerBase::Options& options) { ioOptions = options; }
+	void setReservedWorkers(unsigned workers) { reserved_workers = workers; }
+	// The share of the source given to processes of an image, such as "MsMpEng.exe", and the
+	// bytes per second they may read together; 0 does not limit them
+	void setProcessPolicy(const std::wstring& image, UINT32 weight, UINT64 bytesPerSecond);
+	// Threads ProjFS keeps for callbacks, and how many of them may run at once
+	void setPoolThreadCount(UINT32 count) { pool_thread_count = count; }
+	void setConcurrentThreadCount(UINT32 count) { concurrent_thread_count = count; }
+	// Bytes of sorted directory listings kept for reuse across enumerations; 0 disables the cache
+	void setListingCacheBytes(size_t bytes) { listingCache.setCapacity(bytes); }
+	// Reads file data bypassing the system's file cache, and the block cache, since ProjFS keeps
+	// the hydrated data itself
+	void setUnbufferedReads(bool unbuffered) { unbuffered_reads = unbuffered; }
+	// Bytes of source file data cached in blocks; 0 disables the cache
+	void setBlockCacheBytes(size_t bytes) { blockCache.setCapacity(bytes); }
+	// Bounds of the pieces file data is read and written in, which follow the source's throughput
+	void setChunkBounds(UINT32 minimum, UINT32 maximum) { chunkSizer.setBounds(minimum, maximum); }
+	// Source files kept open between reads; 0 opens the file for every read
+	void setHandleCacheLimit(size_t handles) { handleCache.setLimit(handles); }
+	// Largest window read ahead of a sequential reader; 0 serves only what ProjFS asks for
+	void setReadAheadBytes(UINT32 bytes) { readAhead.setMaximumWindow(bytes); }
+	// Milliseconds a cached listing answers placeholder lookups, or a cached handle is read from,
+	// before the source is checked again
+	void setMetadataTrustPeriod(UINT32 milliseconds) {
+		listingCache.setTrustPeriod(milliseconds);
+		handleCache.setTrustPeriod(milliseconds);
+	}
+	// Drops cached and indexed listings after the source has been changed behind the provider's back
+	void invalidateListing(const WCHAR* relativePath) {
+		listingCache.invalidate(sourcePathOf(relativePath));
+		metadataIndex.invalidate(sourcePathOf(relativePath));
+	}
+	void invalidateListings() {
+		listingCache.invalidateAll();
+		metadataIndex.invalidateAll();
+	}
+	// Copies files modified in the virtualization root back to the source, in the background,
+	// overwriting the source files; off unless asked for
+	void setWriteBack(bool enabled) { write_back_enabled = enabled; }
+	// How long files stay dirty, how much dirty data may build up and when copies are synced
+	void setWriteBackOptions(const WriteBackQueue::Options& options) { writeBack.setOptions(options); }
+	const WriteBackQueue::Options& getWriteBackOptions() const { return writeBack.getOptions(); }
+	// Watches the source for changes made directly to it, to keep the caches up to date
+	void setSourceWatch(bool enabled) { source_watch_enabled = enabled; }
+	// Notifications to ask ProjFS for; PRJ_NOTIFY_NONE leaves notificationCB unregistered
+	void setNotificationMask(PRJ_NOTIFY_TYPES mask) { notification_mask = mask; }
+	// Directories with more entries than this are sorted on disk and streamed; 0 never streams
+	void setStreamingThreshold(size_t entries) { streamOptions.run_entries = entries; }
+	// Where streamed directories keep their spill runs and sorted indexes
+	void setIndexPath(const WCHAR* path) { streamOptions.index_directory = path; }
+	// Keeps the metadata of the source tree in a memory-mapped index across runs, by default in
+	// the index directory; it is loaded by startVirtualizing and saved when the provider stops
+	void setMetadataIndex(bool enabled) { metadata_index_enabled = enabled; }
+	void setMetadataIndexPath(const WCHAR* path) { metadata_index_path = path; }
+	// Writes what was learned about the source tree to the metadata index now
+	HRESULT saveMetadataIndex() { return metadataIndex.save(); }
+
+	// Threads crawling the source tree, and how many directories they read at once; 0 for either
+	// takes the scanner's default
+	void setScanThreads(unsigned threads) {
+		scanOptions.threads = threads != 0 ? threads : TreeScanner::Options().threads;
+	}
+	void setScanOpenDirectories(size_t directories) { scanOptions.open_directories = directories; }
+	// Crawls the source tree on a background thread once virtualizing starts
+	void setBackgroundScan(bool enabled) { background_scan = enabled; }
+
+	/*
+		Crawls the whole source tree in parallel, filling the listing cache and metadata index with
+		every directory that changed since the index last saw it, then saves the index. Directories
+		the index still matches are only checked, so a refresh of an unchanged tree is cheap.
+	*/
+	HRESULT scanSourceTree(TreeScanner::Result& result);
+
 	const WCHAR* checkSanity();
 	const WCHAR* startVirtualizing();
 
+	// Copies every modified file back to the source now, returning once all are written
+	void flushWriteBack();
+
+	void printStatistics(FILE* out);
+
 };
\ No newline at end of file
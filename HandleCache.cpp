@@ -0,0 +1,208 @@
+#include "pch.h"
+#include "HandleCache.h"
+
+#include <functional>
+#include <vector>
+
+// Default number of handles kept open, and how long they are trusted, matching the listing cache
+static const size_t HANDLE_CACHE_DEFAULT_LIMIT = 256;
+static const INT64 HANDLE_CACHE_DEFAULT_TRUST_MS = 1000;
+
+HandleCache::OpenFile::OpenFile(SourceFileSystem::FileHandle handle, const SourceFileSystem::FileIdentity& identity) :
+	handle(handle),
+	identity(identity),
+	verified_at(SourceFileSystem::currentFileTime())
+{
+}
+
+HandleCache::OpenFile::~OpenFile()
+{
+	SourceFileSystem::closeFile(handle);
+}
+
+HandleCache::HandleCache() :
+	shards(new Shard[SHARD_COUNT]),
+	limit(0),
+	trust_period(HANDLE_CACHE_DEFAULT_TRUST_MS * 10000LL),
+	hits(0),
+	opens(0),
+	rechecks(0),
+	stale(0),
+	evictions(0)
+{
+	setLimit(HANDLE_CACHE_DEFAULT_LIMIT);
+}
+
+// The shards split the limit, the first ones taking what does not divide evenly, so a limit below
+// SHARD_COUNT leaves some shards keeping nothing open
+void HandleCache::setLimit(size_t handles)
+{
+	for (size_t i = 0; i < SHARD_COUNT; i++) {
+		std::vector<std::shared_ptr<OpenFile>> evicted;
+		Shard& shard = shards[i];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		shard.capacity = handles / SHARD_COUNT + (i < handles % SHARD_COUNT ? 1 : 0);
+		while (shard.entries.size() > shard.capacity) {
+			auto victim = shard.entries.find(shard.order.back());
+			evicted.push_back(std::move(victim->second.file));
+			shard.entries.erase(victim);
+			shard.order.pop_back();
+		}
+	}
+	limit.store(handles, std::memory_order_relaxed);
+}
+
+HandleCache::Shard& HandleCache::shardOf(const std::wstring& path)
+{
+	size_t hash = std::hash<std::wstring>()(path);
+	hash ^= hash >> 29;
+	hash *= 0xbf58476d1ce4e5b9ull;
+	hash ^= hash >> 32;
+	return shards[hash & (SHARD_COUNT - 1)];
+}
+
+HRESULT HandleCache::open(const std::wstring& path, std::shared_ptr<OpenFile>& file)
+{
+	SourceFileSystem::FileHandle handle;
+	HRESULT hr = SourceFileSystem::openForReading(path, handle);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	SourceFileSystem::FileIdentity identity;
+	hr = SourceFileSystem::getFileIdentity(handle, identity);
+	if (FAILED(hr)) {
+		SourceFileSystem::closeFile(handle);
+		return hr;
+	}
+
+	file = std::make_shared<OpenFile>(handle, identity);
+	opens.fetch_add(1, std::memory_order_relaxed);
+	return S_OK;
+}
+
+bool HandleCache::stillValid(const std::wstring& path, OpenFile& file)
+{
+	INT64 now = SourceFileSystem::currentFileTime();
+	if (now - file.verified_at.load(std::memory_order_relaxed) < trust_period) {
+		return true;
+	}
+
+	rechecks.fetch_add(1, std::memory_order_relaxed);
+	SourceFileSystem::FileIdentity identity;
+	if (FAILED(SourceFileSystem::getFileIdentity(path, identity)) ||
+		identity.volume != file.identity.volume || identity.file != file.identity.file) {
+		return false;
+	}
+
+	file.verified_at.store(now, std::memory_order_relaxed);
+	return true;
+}
+
+/*
+	Files are opened and checked without the shard's lock, so a slow source only holds up the
+	readers of that path. Two readers missing on the same path may both open it; the first to
+	finish is cached and the other's handle is closed when it is done with it.
+*/
+std::shared_ptr<HandleCache::OpenFile> HandleCache::acquire(const std::wstring& path, HRESULT& hr)
+{
+	Shard& shard = shardOf(path);
+	std::shared_ptr<OpenFile> file;
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto found = shard.entries.find(path);
+		if (found != shard.entries.end()) {
+			shard.order.splice(shard.order.begin(), shard.order, found->second.position);
+			file = found->second.file;
+		}
+	}
+
+	if (file != nullptr) {
+		if (stillValid(path, *file)) {
+			hits.fetch_add(1, std::memory_order_relaxed);
+			hr = S_OK;
+			return file;
+		}
+
+		stale.fetch_add(1, std::memory_order_relaxed);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto found = shard.entries.find(path);
+		if (found != shard.entries.end() && found->second.file == file) {
+			shard.order.erase(found->second.position);
+			shard.entries.erase(found);
+		}
+	}
+
+	hr = open(path, file);
+	if (FAILED(hr)) {
+		return nullptr;
+	}
+
+	// Closed once the lock is released
+	std::vector<std::shared_ptr<OpenFile>> evicted;
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	if (shard.capacity == 0) {
+		return file;
+	}
+
+	auto inserted = shard.entries.emplace(path, Entry());
+	if (!inserted.second) {
+		evicted.push_back(std::move(file));
+		shard.order.splice(shard.order.begin(), shard.order, inserted.first->second.position);
+		return inserted.first->second.file;
+	}
+
+	shard.order.push_front(path);
+	inserted.first->second.file = file;
+	inserted.first->second.position = shard.order.begin();
+
+	while (shard.entries.size() > shard.capacity) {
+		auto victim = shard.entries.find(shard.order.back());
+		evicted.push_back(std::move(victim->second.file));
+		shard.entries.erase(victim);
+		shard.order.pop_back();
+		evictions.fetch_add(1, std::memory_order_relaxed);
+	}
+	return file;
+}
+
+void HandleCache::invalidate(const std::wstring& path)
+{
+	Shard& shard = shardOf(path);
+	std::shared_ptr<OpenFile> dropped;
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto found = shard.entries.find(path);
+	if (found != shard.entries.end()) {
+		dropped = std::move(found->second.file);
+		shard.order.erase(found->second.position);
+		shard.entries.erase(found);
+	}
+}
+
+void HandleCache::invalidateAll()
+{
+	for (size_t i = 0; i < SHARD_COUNT; i++) {
+		std::unordered_map<std::wstring, Entry> dropped;
+		std::lock_guard<std::mutex> lock(shards[i].mutex);
+		dropped.swap(shards[i].entries);
+		shards[i].order.clear();
+	}
+}
+
+void HandleCache::printStatistics(FILE* out)
+{
+	size_t open_handles = 0;
+	for (size_t i = 0; i < SHARD_COUNT; i++) {
+		std::lock_guard<std::mutex> lock(shards[i].mutex);
+		open_handles += shards[i].entries.size();
+	}
+
+	fprintf(out, "  handle cache: %zu open (limit %zu), hits %llu, opens %llu, rechecks %llu, stale %llu, evictions %llu\n",
+		open_handles,
+		limit.load(std::memory_order_relaxed),
+		static_cast<unsigned long long>(hits.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(opens.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(rechecks.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(stale.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(evictions.load(std::memory_order_relaxed)));
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "pch.h"
+#include "SourceFileSystem.h"
+#include <atomic>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+	Bounded cache of open source files, keyed by source path, so the many chunk reads that hydrate
+	one file share a single open rather than each opening and closing it.
+
+	Readers hold a file through a shared_ptr for as long as they read from it; the handle is closed
+	once the cache has evicted or dropped it and the last reader lets go. Each shard keeps its own
+	LRU list, so the number of handles kept open is the limit, plus any evicted ones still being
+	read.
+
+	A path may be renamed over or deleted while its handle is cached. For a trust period after it
+	was opened or last checked, a cached handle is used as it is; after that, acquiring it checks
+	the path still names the same file and reopens it otherwise.
+*/
+class HandleCache
+{
+public:
+	class OpenFile {
+	public:
+		SourceFileSystem::FileHandle handle;
+		// Which file the handle was opened on; the version is not kept up to date
+		SourceFileSystem::FileIdentity identity;
+		std::atomic<INT64> verified_at;
+
+		OpenFile(SourceFileSystem::FileHandle handle, const SourceFileSystem::FileIdentity& identity);
+		~OpenFile();
+
+		OpenFile(const OpenFile&) = delete;
+		OpenFile& operator=(const OpenFile&) = delete;
+	};
+
+protected:
+	class Entry {
+	public:
+		std::shared_ptr<OpenFile> file;
+		std::list<std::wstring>::iterator position;
+	};
+
+	class alignas(64) Shard {
+	public:
+		std::mutex mutex;
+		std::unordered_map<std::wstring, Entry> entries;
+		// Most recently used at the front
+		std::list<std::wstring> order;
+		size_t capacity;
+
+		Shard() : capacity(0) {}
+	};
+
+	static const size_t SHARD_COUNT = 16;
+
+	std::unique_ptr<Shard[]> shards;
+	std::atomic<size_t> limit;
+	INT64 trust_period;
+
+	std::atomic<UINT64> hits;
+	std::atomic<UINT64> opens;
+	std::atomic<UINT64> rechecks;
+	std::atomic<UINT64> stale;
+	std::atomic<UINT64> evictions;
+
+	Shard& shardOf(const std::wstring& path);
+
+	// Opens path and reads which file it is
+	HRESULT open(const std::wstring& path, std::shared_ptr<OpenFile>& file);
+
+	// Whether path still names the file, once its trust period has run out
+	bool stillValid(const std::wstring& path, OpenFile& file);
+
+public:
+	HandleCache();
+
+	HandleCache(const HandleCache&) = delete;
+	HandleCache& operator=(const HandleCache&) = delete;
+
+	// Handles to keep open; 0 opens a file for each acquire. Shrinking takes effect as files are added
+	void setLimit(size_t handles);
+
+	// Milliseconds a cached handle is used before its path is checked again
+	void setTrustPeriod(UINT32 milliseconds) { trust_period = milliseconds * 10000LL; }
+
+	// Returns the open file for path, opening it if it is not cached; nullptr with hr on failure
+	std::shared_ptr<OpenFile> acquire(const std::wstring& path, HRESULT& hr);
+
+	// Drops the cached handle for a path, once the source has been changed behind the provider's back
+	void invalidate(const std::wstring& path);
+	void invalidateAll();
+
+	void printStatistics(FILE* out);
+};
@@ -0,0 +1,129 @@
+#include "pch.h"
+#include "IOScheduler.h"
+
+IOSchedulerBase::Options::Options() :
+	speculative_limit(0)
+{
+	// Foreground jobs are served first anyway, so only the others age
+	deadline[IO_FOREGROUND] = 0;
+	deadline[IO_METADATA] = 50;
+	deadline[IO_PREFETCH] = 200;
+	deadline[IO_BACKGROUND] = 1000;
+
+	capacity[IO_FOREGROUND] = 4096;
+	capacity[IO_METADATA] = 1024;
+	capacity[IO_PREFETCH] = 1024;
+	capacity[IO_BACKGROUND] = 1024;
+}
+
+IOSchedulerBase::Statistics::Statistics() :
+	queued(0),
+	dispatched(0),
+	aged(0),
+	rejected(0),
+	delayed(0),
+	wait_ns(0),
+	max_wait_ns(0),
+	depth(0),
+	peak_depth(0)
+{
+}
+
+IOSchedulerBase::IOSchedulerBase() :
+	speculative_running(0),
+	last_aged(false)
+{
+}
+
+const char* IOSchedulerBase::nameOf(IOClass ioClass)
+{
+	static const char* const names[] = { "foreground", "metadata", "prefetch", "background" };
+	return ioClass < IO_CLASSES ? names[ioClass] : "none";
+}
+
+void IOSchedulerBase::setOptions(const Options& schedulerOptions)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	options = schedulerOptions;
+}
+
+IOClass IOSchedulerBase::choose(
+	const std::chrono::steady_clock::time_point oldest[],
+	const bool nonempty[],
+	std::chrono::steady_clock::time_point now,
+	bool& aged
+) const {
+	bool speculativeFull = options.speculative_limit != 0 && speculative_running >= options.speculative_limit;
+	auto runnable = [&](int i) {
+		return nonempty[i] && !(speculativeFull && speculative(static_cast<IOClass>(i)));
+	};
+
+	// An overdue class goes first, the highest of them if several are
+	if (!last_aged) {
+		for (int i = IO_FOREGROUND + 1; i < IO_CLASSES; i++) {
+			if (runnable(i) && options.deadline[i] != 0 &&
+				now - oldest[i] >= std::chrono::milliseconds(options.deadline[i])) {
+				aged = true;
+				return static_cast<IOClass>(i);
+			}
+		}
+	}
+
+	aged = false;
+	for (int i = 0; i < IO_CLASSES; i++) {
+		if (runnable(i)) {
+			return static_cast<IOClass>(i);
+		}
+	}
+	return IO_CLASSES;
+}
+
+void IOSchedulerBase::dispatched(IOClass ioClass, UINT64 nanoseconds, bool aged)
+{
+	// Only an aged job served ahead of a higher class counts as out of order
+	bool higherWaiting = false;
+	for (int i = 0; i < ioClass; i++) {
+		higherWaiting = higherWaiting || statistics[i].depth.load(std::memory_order_relaxed) != 0;
+	}
+	last_aged = aged && higherWaiting;
+	if (last_aged) {
+		statistics[ioClass].aged.fetch_add(1, std::memory_order_relaxed);
+	}
+	waited(ioClass, nanoseconds);
+}
+
+void IOSchedulerBase::waited(IOClass ioClass, UINT64 nanoseconds)
+{
+	Statistics& stats = statistics[ioClass];
+	stats.dispatched.fetch_add(1, std::memory_order_relaxed);
+	stats.wait_ns.fetch_add(nanoseconds, std::memory_order_relaxed);
+	if (nanoseconds > stats.max_wait_ns.load(std::memory_order_relaxed)) {
+		stats.max_wait_ns.store(nanoseconds, std::memory_order_relaxed);
+	}
+}
+
+void IOSchedulerBase::printStatistics(FILE* out)
+{
+	fprintf(out, "  io scheduler: %u speculative jobs at once%s\n",
+		options.speculative_limit,
+		options.speculative_limit == 0 ? " (unlimited)" : "");
+
+	for (int i = 0; i < IO_CLASSES; i++) {
+		const Statistics& stats = statistics[i];
+		UINT64 dispatched = stats.dispatched.load(std::memory_order_relaxed);
+		if (stats.queued.load(std::memory_order_relaxed) == 0 && stats.rejected.load(std::memory_order_relaxed) == 0) {
+			continue;
+		}
+
+		fprintf(out, "    %-10s %llu jobs, %llu served early by deadline, %llu held by rate limits, %llu rejected, depth %zu (peak %zu), wait avg %.3f ms, max %.3f ms\n",
+			nameOf(static_cast<IOClass>(i)),
+			static_cast<unsigned long long>(dispatched),
+			static_cast<unsigned long long>(stats.aged.load(std::memory_order_relaxed)),
+			static_cast<unsigned long long>(stats.delayed.load(std::memory_order_relaxed)),
+			static_cast<unsigned long long>(stats.rejected.load(std::memory_order_relaxed)),
+			stats.depth.load(std::memory_order_relaxed),
+			stats.peak_depth.load(std::memory_order_relaxed),
+			dispatched ? stats.wait_ns.load(std::memory_order_relaxed) / 1e6 / dispatched : 0.0,
+			stats.max_wait_ns.load(std::memory_order_relaxed) / 1e6);
+	}
+}
@@ -0,0 +1,387 @@
+#pragma once
+
+#include "pch.h"
+#include "JobQueue.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+// The classes of work competing for the source, highest priority first
+enum IOClass {
+	// Reads a process is blocked on
+	IO_FOREGROUND,
+	// Directory and file information being looked up
+	IO_METADATA,
+	// Data read ahead of sequential readers
+	IO_PREFETCH,
+	// Work nobody waits on, such as writing modified files back
+	IO_BACKGROUND,
+	IO_CLASSES
+};
+
+/*
+	The part of IOScheduler which does not depend on the job type: its options, which class is
+	served next, and the statistics kept for each class.
+*/
+class IOSchedulerBase
+{
+public:
+	class Options {
+	public:
+		// Milliseconds a class's oldest job may wait before it is served ahead of higher classes;
+		// 0 never ages the class
+		UINT32 deadline[IO_CLASSES];
+		// Jobs each class may hold queued before pushes fail
+		size_t capacity[IO_CLASSES];
+		// Prefetch and background jobs allowed to run at once, keeping the other workers free for
+		// foreground and metadata jobs; 0 does not limit them
+		unsigned speculative_limit;
+
+		Options();
+	};
+
+	/*
+		Who a job is done for within its class. Jobs of one flow are served in the order they
+		came, and flows wanting the class at once share it in proportion to their weights,
+		measured in the cost of their jobs. Flow 0 is the provider's own work.
+	*/
+	class Flow {
+	public:
+		UINT64 id;
+		UINT32 weight;
+		double cost;
+		// The job may not run before this, for a flow held to a rate limit
+		std::chrono::steady_clock::time_point not_before;
+
+		Flow() : id(0), weight(1), cost(1), not_before() {}
+	};
+
+	static const char* nameOf(IOClass ioClass);
+
+	// Prefetch and background jobs only run while fewer than the limit already are
+	static bool speculative(IOClass ioClass) { return ioClass == IO_PREFETCH || ioClass == IO_BACKGROUND; }
+
+protected:
+	class Statistics {
+	public:
+		std::atomic<UINT64> queued;
+		std::atomic<UINT64> dispatched;
+		std::atomic<UINT64> aged;
+		std::atomic<UINT64> rejected;
+		std::atomic<UINT64> delayed;
+		std::atomic<UINT64> wait_ns;
+		std::atomic<UINT64> max_wait_ns;
+		std::atomic<size_t> depth;
+		std::atomic<size_t> peak_depth;
+
+		Statistics();
+	};
+
+	Options options;
+	Statistics statistics[IO_CLASSES];
+
+	std::mutex mutex;
+	unsigned speculative_running;
+	// The last job was served out of priority order, so the next one is not
+	bool last_aged;
+
+	/*
+		Picks the class to serve next from the enqueue time of each class's oldest job, with
+		nonempty set for the classes holding any, and says whether it was picked for its age.
+		Returns IO_CLASSES when nothing may run. The caller holds mutex.
+	*/
+	IOClass choose(
+		const std::chrono::steady_clock::time_point oldest[],
+		const bool nonempty[],
+		std::chrono::steady_clock::time_point now,
+		bool& aged
+	) const;
+
+	// Records a job leaving its class's queue after waiting nanoseconds; the caller holds mutex
+	void dispatched(IOClass ioClass, UINT64 nanoseconds, bool aged);
+	// The part of dispatched() which needs no lock
+	void waited(IOClass ioClass, UINT64 nanoseconds);
+
+public:
+	IOSchedulerBase();
+
+	IOSchedulerBase(const IOSchedulerBase&) = delete;
+	IOSchedulerBase& operator=(const IOSchedulerBase&) = delete;
+
+	void setOptions(const Options& schedulerOptions);
+	const Options& getOptions() const { return options; }
+
+	void printStatistics(FILE* out);
+};
+
+/*
+	Queue of jobs for the source workers, in place of a single FIFO: each class of job has a queue
+	of its own and the highest class holding a job is served first, so a process waiting on a
+	read is not queued behind read-ahead or write-back.
+
+	Within a class, flows are served by start-time fair queuing: each job is tagged with the
+	later of the class's virtual time and the tag its flow's previous job finishes at, and the
+	smallest tag goes first. A flow's jobs finish cost / weight after they start, so a flow with
+	twice the weight gets twice the share, and a flow returning from idle starts at the current
+	virtual time rather than with credit saved up. Jobs held back by their flow's rate limit wait
+	aside until their time comes, and are tagged then.
+
+	Foreground jobs of flow 0 which no rate limit holds, which is every read while no process has
+	a policy, skip the mutex and the fair queue: they go through a lock-free ring, so a callback
+	queueing one neither locks nor allocates. While nothing else is queued, workers take them from
+	the ring without the mutex too; otherwise they are served under it, after the foreground jobs
+	tagged for flows. The ring is sized for the foreground capacity when the options are set, and
+	the capacity bounds the ring and the fair queue together, approximately for pushes racing to
+	the ring.
+
+	Lower classes are kept from starving by deadlines: once the oldest job of a class has waited
+	longer than its class's deadline it is served ahead of higher classes, though never twice in a
+	row, so foreground jobs keep at least every other dispatch. Prefetch and background jobs are
+	also limited in how many run at once, which keeps workers free to pick up foreground reads the
+	moment they arrive.
+*/
+template<typename T>
+class IOScheduler : public IOSchedulerBase
+{
+private:
+	class Entry {
+	public:
+		T* job;
+		std::chrono::steady_clock::time_point queued;
+		UINT64 flow;
+		// Cost divided by weight
+		double length;
+	};
+
+	class FlowState {
+	public:
+		double finish;
+		size_t queued;
+
+		FlowState() : finish(0), queued(0) {}
+	};
+
+	// Flows with nothing queued are forgotten once this many are held and virtual time passed them
+	static const size_t FLOW_SWEEP = 1024;
+
+	class ClassQueue {
+	public:
+		// By start tag, then by arrival
+		std::map<std::pair<double, UINT64>, Entry> ready;
+		// By the time they may run
+		std::multimap<std::chrono::steady_clock::time_point, Entry> delayed;
+		std::unordered_map<UINT64, FlowState> flows;
+		double virtual_time;
+		UINT64 arrivals;
+
+		ClassQueue() : virtual_time(0), arrivals(0) {}
+
+		size_t size() const { return ready.size() + delayed.size(); }
+
+		void tag(const Entry& entry) {
+			FlowState& flow = flows[entry.flow];
+			double start = std::max(virtual_time, flow.finish);
+			flow.finish = start + entry.length;
+			ready.emplace(std::make_pair(start, arrivals++), entry);
+		}
+
+		// Moves the held jobs whose time has come among the ready ones
+		void release(std::chrono::steady_clock::time_point now) {
+			while (!delayed.empty() && delayed.begin()->first <= now) {
+				tag(delayed.begin()->second);
+				delayed.erase(delayed.begin());
+			}
+		}
+
+		void forget(UINT64 id) {
+			auto flow = flows.find(id);
+			if (flow != flows.end() && --flow->second.queued == 0 && flow->second.finish <= virtual_time)
+				flows.erase(flow);
+
+			if (flows.size() > FLOW_SWEEP) {
+				for (auto it = flows.begin(); it != flows.end();) {
+					if (it->second.queued == 0 && it->second.finish <= virtual_time)
+						it = flows.erase(it);
+					else
+						++it;
+				}
+			}
+		}
+	};
+
+	ClassQueue queues[IO_CLASSES];
+
+	// Foreground jobs of flow 0, in the order they came, and the jobs queued anywhere else
+	std::unique_ptr<BoundedMPMCQueue<Entry>> fast;
+	std::atomic<size_t> held;
+
+	void queued(Statistics& stats, size_t depth) {
+		stats.queued.fetch_add(1, std::memory_order_relaxed);
+		stats.depth.store(depth, std::memory_order_relaxed);
+		if (depth > stats.peak_depth.load(std::memory_order_relaxed))
+			stats.peak_depth.store(depth, std::memory_order_relaxed);
+	}
+
+public:
+	IOScheduler() : fast(new BoundedMPMCQueue<Entry>(Options().capacity[IO_FOREGROUND])), held(0) {}
+
+	// Replaces the ring, so the options are set before any job is queued
+	void setOptions(const Options& schedulerOptions) {
+		IOSchedulerBase::setOptions(schedulerOptions);
+		fast.reset(new BoundedMPMCQueue<Entry>(schedulerOptions.capacity[IO_FOREGROUND]));
+	}
+
+	// Returns false if the class's queue is full
+	bool tryPush(T* job, IOClass ioClass, const Flow& flow = Flow()) {
+		Statistics& stats = statistics[ioClass];
+		ClassQueue& queue = queues[ioClass];
+
+		Entry entry;
+		entry.job = job;
+		entry.queued = std::chrono::steady_clock::now();
+		entry.flow = flow.id;
+		entry.length = std::max(flow.cost, 1.0) / std::max<UINT32>(flow.weight, 1);
+
+		if (ioClass == IO_FOREGROUND && flow.id == 0 && flow.not_before <= entry.queued &&
+			fast->sizeApprox() < options.capacity[IO_FOREGROUND] && fast->tryPush(entry)) {
+			queued(stats, fast->sizeApprox());
+			return true;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (queue.size() + (ioClass == IO_FOREGROUND ? fast->sizeApprox() : 0) >= options.capacity[ioClass]) {
+			stats.rejected.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		queue.flows[flow.id].queued++;
+		held.fetch_add(1, std::memory_order_release);
+		if (flow.not_before > entry.queued) {
+			queue.delayed.emplace(flow.not_before, entry);
+			stats.delayed.fetch_add(1, std::memory_order_relaxed);
+		} else {
+			queue.tag(entry);
+		}
+
+		queued(stats, queue.size() + (ioClass == IO_FOREGROUND ? fast->sizeApprox() : 0));
+		return true;
+	}
+
+	// Returns false if no job may run now; a prefetch or background job taken must be finished()
+	bool tryPop(T*& job, IOClass& ioClass) {
+		// With only the ring holding jobs, its head is what would be served anyway
+		if (held.load(std::memory_order_acquire) == 0) {
+			Entry entry;
+			if (fast->tryPop(entry)) {
+				job = entry.job;
+				ioClass = IO_FOREGROUND;
+				waited(IO_FOREGROUND, static_cast<UINT64>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - entry.queued).count()));
+				statistics[IO_FOREGROUND].depth.store(fast->sizeApprox(), std::memory_order_relaxed);
+				return true;
+			}
+			if (held.load(std::memory_order_acquire) == 0)
+				return false;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+		// A class ages by the job it would serve next
+		std::chrono::steady_clock::time_point oldest[IO_CLASSES];
+		bool nonempty[IO_CLASSES];
+		for (int i = 0; i < IO_CLASSES; i++) {
+			queues[i].release(now);
+			nonempty[i] = !queues[i].ready.empty();
+			if (nonempty[i])
+				oldest[i] = queues[i].ready.begin()->second.queued;
+		}
+		// Foreground never ages, so how old the ring's jobs are does not matter here
+		if (!nonempty[IO_FOREGROUND] && fast->sizeApprox() != 0) {
+			nonempty[IO_FOREGROUND] = true;
+			oldest[IO_FOREGROUND] = now;
+		}
+
+		bool aged;
+		ioClass = choose(oldest, nonempty, now, aged);
+		if (ioClass == IO_CLASSES)
+			return false;
+
+		ClassQueue& queue = queues[ioClass];
+		Entry entry;
+		if (!queue.ready.empty()) {
+			auto next = queue.ready.begin();
+			entry = next->second;
+			queue.virtual_time = next->first.first;
+			queue.ready.erase(next);
+			queue.forget(entry.flow);
+			held.fetch_sub(1, std::memory_order_relaxed);
+		} else if (!fast->tryPop(entry)) {
+			// A push has taken its slot but not yet filled it, and will wake a worker once it has
+			return false;
+		} else {
+			// Pushed without the mutex, possibly after now was read
+			now = std::chrono::steady_clock::now();
+		}
+		job = entry.job;
+		if (speculative(ioClass))
+			speculative_running++;
+		dispatched(ioClass, static_cast<UINT64>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - entry.queued).count()), aged);
+		statistics[ioClass].depth.store(queue.size() + (ioClass == IO_FOREGROUND ? fast->sizeApprox() : 0), std::memory_order_relaxed);
+		return true;
+	}
+
+	// When the first job held back by a rate limit may run; false if none is
+	bool nextHeld(std::chrono::steady_clock::time_point& when) {
+		std::lock_guard<std::mutex> lock(mutex);
+		bool held = false;
+		for (int i = 0; i < IO_CLASSES; i++) {
+			if (!queues[i].delayed.empty() && (!held || queues[i].delayed.begin()->first < when)) {
+				when = queues[i].delayed.begin()->first;
+				held = true;
+			}
+		}
+		return held;
+	}
+
+	// Takes any queued job regardless of order or limits, for emptying the queues on shutdown
+	bool drain(T*& job) {
+		std::lock_guard<std::mutex> lock(mutex);
+		Entry entry;
+		if (fast->tryPop(entry)) {
+			job = entry.job;
+			statistics[IO_FOREGROUND].depth.store(queues[IO_FOREGROUND].size() + fast->sizeApprox(), std::memory_order_relaxed);
+			return true;
+		}
+		for (int i = 0; i < IO_CLASSES; i++) {
+			ClassQueue& queue = queues[i];
+			if (!queue.ready.empty()) {
+				job = queue.ready.begin()->second.job;
+				queue.ready.erase(queue.ready.begin());
+			} else if (!queue.delayed.empty()) {
+				job = queue.delayed.begin()->second.job;
+				queue.delayed.erase(queue.delayed.begin());
+			} else {
+				continue;
+			}
+			held.fetch_sub(1, std::memory_order_relaxed);
+			statistics[i].depth.store(queue.size(), std::memory_order_relaxed);
+			return true;
+		}
+		return false;
+	}
+
+	// Reports that a job taken by tryPop is done, making room for another speculative job
+	void finished(IOClass ioClass) {
+		if (!speculative(ioClass))
+			return;
+		std::lock_guard<std::mutex> lock(mutex);
+		speculative_running--;
+	}
+};
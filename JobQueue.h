@@ -0,0 +1,232 @@
+#pragma once
+
+#include "pch.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/*
+	Lock-free containers used to hand work between the ProjFS callback threads and the source
+	workers. All of them are bounded: a failed push tells the caller to apply back pressure rather
+	than allocating.
+*/
+
+// Keeps hot atomics on their own cache lines
+static const size_t JOB_QUEUE_CACHE_LINE = 64;
+
+// Rounds up to the next power of two, which the ring buffers need for masking
+inline size_t jobQueueCapacity(size_t requested) {
+	size_t capacity = 2;
+	while (capacity < requested)
+		capacity <<= 1;
+	return capacity;
+}
+
+/*
+	Multi-producer/multi-consumer ring buffer (Vyukov). Every cell carries a sequence number which
+	tells producers and consumers whether it is free for the current lap, so a push or pop costs one
+	CAS on the shared position plus one release store.
+*/
+template<typename T>
+class BoundedMPMCQueue {
+private:
+	class Cell {
+	public:
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> buffer;
+	size_t mask;
+
+	alignas(JOB_QUEUE_CACHE_LINE) std::atomic<size_t> enqueuePos;
+	alignas(JOB_QUEUE_CACHE_LINE) std::atomic<size_t> dequeuePos;
+
+public:
+	explicit BoundedMPMCQueue(size_t capacity) :
+		buffer(new Cell[jobQueueCapacity(capacity)]),
+		mask(jobQueueCapacity(capacity) - 1),
+		enqueuePos(0),
+		dequeuePos(0)
+	{
+		for (size_t i = 0; i <= mask; i++)
+			buffer[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	BoundedMPMCQueue(const BoundedMPMCQueue&) = delete;
+	BoundedMPMCQueue& operator=(const BoundedMPMCQueue&) = delete;
+
+	// Returns false if the queue is full
+	bool tryPush(const T& data) {
+		Cell* cell;
+		size_t pos = enqueuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &buffer[pos & mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+			if (dif == 0) {
+				if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (dif < 0) {
+				return false;
+			} else {
+				pos = enqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->data = data;
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Returns false if the queue is empty
+	bool tryPop(T& data) {
+		Cell* cell;
+		size_t pos = dequeuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &buffer[pos & mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+			if (dif == 0) {
+				if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			} else if (dif < 0) {
+				return false;
+			} else {
+				pos = dequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+
+		data = cell->data;
+		cell->sequence.store(pos + mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Only a hint while other threads are pushing or popping
+	size_t sizeApprox() const {
+		size_t enqueued = enqueuePos.load(std::memory_order_acquire);
+		size_t dequeued = dequeuePos.load(std::memory_order_acquire);
+		return enqueued > dequeued ? enqueued - dequeued : 0;
+	}
+
+	size_t capacity() const { return mask + 1; }
+};
+
+/*
+	Chase-Lev work-stealing deque of pointers with a fixed capacity. Only the owning thread may
+	push and pop (LIFO, at the bottom); any thread may steal (FIFO, from the top). Memory orders
+	follow Le, Pop, Cohen and Zappa Nardelli, "Correct and Efficient Work-Stealing for Weak
+	Memory Models" (PPoPP 2013).
+*/
+template<typename T>
+class WorkStealingDeque {
+private:
+	std::unique_ptr<std::atomic<T*>[]> buffer;
+	INT64 mask;
+
+	alignas(JOB_QUEUE_CACHE_LINE) std::atomic<INT64> top;
+	alignas(JOB_QUEUE_CACHE_LINE) std::atomic<INT64> bottom;
+
+public:
+	explicit WorkStealingDeque(size_t capacity) :
+		buffer(new std::atomic<T*>[jobQueueCapacity(capacity)]),
+		mask(static_cast<INT64>(jobQueueCapacity(capacity)) - 1),
+		top(0),
+		bottom(0)
+	{
+		for (INT64 i = 0; i <= mask; i++)
+			buffer[i].store(nullptr, std::memory_order_relaxed);
+	}
+
+	WorkStealingDeque(const WorkStealingDeque&) = delete;
+	WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+	// Owner only; returns false if the deque is full
+	bool push(T* item) {
+		INT64 b = bottom.load(std::memory_order_relaxed);
+		INT64 t = top.load(std::memory_order_acquire);
+		if (b - t > mask)
+			return false;
+
+		buffer[b & mask].store(item, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom.store(b + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Owner only; returns nullptr if the deque is empty
+	T* pop() {
+		INT64 b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		INT64 t = top.load(std::memory_order_relaxed);
+
+		if (t > b) {
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		T* item = buffer[b & mask].load(std::memory_order_relaxed);
+		if (t == b) {
+			// Last item: race the thieves for it
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				item = nullptr;
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+		return item;
+	}
+
+	// Any thread; returns nullptr if the deque is empty or the steal lost a race
+	T* steal() {
+		INT64 t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		INT64 b = bottom.load(std::memory_order_acquire);
+
+		if (t >= b)
+			return nullptr;
+
+		T* item = buffer[t & mask].load(std::memory_order_relaxed);
+		if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			return nullptr;
+		return item;
+	}
+
+	bool emptyApprox() const {
+		return bottom.load(std::memory_order_acquire) <= top.load(std::memory_order_acquire);
+	}
+};
+
+/*
+	Recycles objects through a lock-free free list so the hot path does not touch the heap. Objects
+	are handed out as they were released; callers reset whatever fields they use.
+*/
+template<typename T>
+class ObjectPool {
+private:
+	BoundedMPMCQueue<T*> freeList;
+
+public:
+	explicit ObjectPool(size_t capacity) : freeList(capacity) {}
+
+	ObjectPool(const ObjectPool&) = delete;
+	ObjectPool& operator=(const ObjectPool&) = delete;
+
+	~ObjectPool() {
+		T* object;
+		while (freeList.tryPop(object))
+			delete object;
+	}
+
+	T* acquire() {
+		T* object;
+		if (freeList.tryPop(object))
+			return object;
+		return new T;
+	}
+
+	void release(T* object) {
+		if (!freeList.tryPush(object))
+			delete object;
+	}
+};
@@ -0,0 +1,292 @@
+#include "pch.h"
+#include "ListingCache.h"
+#include "SourceFileSystem.h"
+
+#include <algorithm>
+#include <cwctype>
+#include <vector>
+
+// Default budget for cached listings
+static const size_t LISTING_CACHE_DEFAULT_BYTES = 256 * 1024 * 1024;
+
+// Default time a verified listing answers placeholder lookups: long enough to cover the lookups
+// ProjFS makes for the children of a directory right after enumerating it
+static const UINT32 LISTING_CACHE_DEFAULT_TRUST_MS = 1000;
+
+// Bloom filter sizing: at least this many bits per name, rounded up to a power of two, and
+// probed this many times, which keeps false positives to a percent or two
+static const size_t NAME_FILTER_BITS_PER_NAME = 8;
+static const unsigned NAME_FILTER_PROBES = 4;
+
+size_t ListingCache::PathHash::operator()(const std::wstring& path) const
+{
+	// FNV-1a over the UTF-16 code units
+	UINT64 hash = 0xcbf29ce484222325ull;
+	for (WCHAR c : path) {
+		hash ^= static_cast<UINT16>(c);
+		hash *= 0x100000001b3ull;
+	}
+	return static_cast<size_t>(hash);
+}
+
+ListingCache::ListingCache() :
+	bytes_cached(0),
+	clock(0),
+	capacity_bytes(LISTING_CACHE_DEFAULT_BYTES),
+	trust_period(LISTING_CACHE_DEFAULT_TRUST_MS * 10000LL),
+	hits(0),
+	misses(0),
+	stale(0),
+	evictions(0),
+	found(0),
+	filtered(0),
+	searched_absent(0),
+	untrusted(0)
+{
+}
+
+bool ListingCache::NameFilter::hashOf(PCWSTR name, UINT64& hash)
+{
+	// FNV-1a over the folded characters
+	hash = 0xcbf29ce484222325ull;
+	for (; *name != L'\0'; name++) {
+		UINT32 c = static_cast<UINT32>(*name);
+		if (c >= 0x80)
+			return false;
+		if (c >= L'a' && c <= L'z')
+			c -= L'a' - L'A';
+		hash ^= c;
+		hash *= 0x100000001b3ull;
+	}
+	return true;
+}
+
+void ListingCache::NameFilter::build(const DirectoryListing& listing)
+{
+	size_t words = 1;
+	while (words * 64 < listing.size() * NAME_FILTER_BITS_PER_NAME)
+		words *= 2;
+	bits.assign(words, 0);
+	complete = true;
+
+	UINT64 mask = words * 64 - 1;
+	for (size_t i = 0; i < listing.size(); i++) {
+		UINT64 hash;
+		if (!hashOf(listing.nameOf(i), hash)) {
+			complete = false;
+			continue;
+		}
+
+		// Derive the probes from the two halves of the hash
+		UINT64 step = (hash >> 32) | 1;
+		for (unsigned probe = 0; probe < NAME_FILTER_PROBES; probe++, hash += step)
+			bits[(hash & mask) / 64] |= 1ull << (hash % 64);
+	}
+}
+
+bool ListingCache::NameFilter::mayContain(UINT64 hash) const
+{
+	UINT64 mask = bits.size() * 64 - 1;
+	UINT64 step = (hash >> 32) | 1;
+	for (unsigned probe = 0; probe < NAME_FILTER_PROBES; probe++, hash += step) {
+		if ((bits[(hash & mask) / 64] & (1ull << (hash % 64))) == 0)
+			return false;
+	}
+	return true;
+}
+
+std::wstring ListingCache::keyOf(const std::wstring& path)
+{
+#ifdef _WIN32
+	std::wstring key(path);
+	for (WCHAR& c : key)
+		c = static_cast<WCHAR>(towupper(c));
+	return key;
+#else
+	return path;
+#endif
+}
+
+std::shared_ptr<const DirectoryListing> ListingCache::lookup(
+	const std::wstring& path,
+	const LARGE_INTEGER& changeTime
+) {
+	if (capacity_bytes == 0) {
+		return nullptr;
+	}
+
+	std::shared_ptr<CachedListing> cached = listings.find(keyOf(path));
+	if (cached == nullptr) {
+		misses.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	if (cached->change_time != changeTime.QuadPart) {
+		stale.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	cached->last_used.store(clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+	cached->verified_at.store(SourceFileSystem::currentFileTime(), std::memory_order_relaxed);
+	hits.fetch_add(1, std::memory_order_relaxed);
+	return cached->listing;
+}
+
+ListingCache::Presence ListingCache::find(
+	const std::wstring& directory,
+	PCWSTR name,
+	PRJ_FILE_BASIC_INFO& fileInfo
+) {
+	if (capacity_bytes == 0 || trust_period == 0) {
+		return PRESENCE_UNKNOWN;
+	}
+
+	std::shared_ptr<CachedListing> cached = listings.find(keyOf(directory));
+	if (cached == nullptr ||
+		SourceFileSystem::currentFileTime() - cached->verified_at.load(std::memory_order_relaxed) > trust_period) {
+		untrusted.fetch_add(1, std::memory_order_relaxed);
+		return PRESENCE_UNKNOWN;
+	}
+	cached->last_used.store(clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+
+	UINT64 hash;
+	if (cached->filter.complete && NameFilter::hashOf(name, hash) && !cached->filter.mayContain(hash)) {
+		filtered.fetch_add(1, std::memory_order_relaxed);
+		return PRESENCE_ABSENT;
+	}
+
+	size_t index;
+	if (!cached->listing->find(name, index)) {
+		searched_absent.fetch_add(1, std::memory_order_relaxed);
+		return PRESENCE_ABSENT;
+	}
+
+	fileInfo = cached->listing->entryAt(index).fileInfo;
+	found.fetch_add(1, std::memory_order_relaxed);
+	return PRESENCE_PRESENT;
+}
+
+bool ListingCache::unchangedSince(const std::wstring& path, const LARGE_INTEGER& changeTime)
+{
+	PRJ_FILE_BASIC_INFO after;
+	return SUCCEEDED(SourceFileSystem::getFileInfo(path, after)) &&
+		after.ChangeTime.QuadPart == changeTime.QuadPart &&
+		SourceFileSystem::currentFileTime() - changeTime.QuadPart >= RACY_WINDOW;
+}
+
+void ListingCache::store(
+	const std::wstring& path,
+	const LARGE_INTEGER& changeTime,
+	const std::shared_ptr<const DirectoryListing>& listing
+) {
+	if (capacity_bytes == 0) {
+		return;
+	}
+
+	// A listing which may not match changeTime must not be cached, and neither may the stale
+	// entry it was meant to replace
+	if (!unchangedSince(path, changeTime)) {
+		invalidate(path);
+		return;
+	}
+
+	std::shared_ptr<CachedListing> entry = std::make_shared<CachedListing>();
+	entry->listing = listing;
+	entry->filter.build(*listing);
+	entry->change_time = changeTime.QuadPart;
+	entry->bytes = listing->bytesUsed() + entry->filter.bytesUsed() +
+		path.size() * sizeof(WCHAR) + sizeof(CachedListing);
+	entry->last_used.store(clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+	entry->verified_at.store(SourceFileSystem::currentFileTime(), std::memory_order_relaxed);
+
+	// Account for the entry this one replaces, if any
+	bytes_cached.fetch_add(entry->bytes, std::memory_order_relaxed);
+	std::shared_ptr<CachedListing> previous = listings.assign(keyOf(path), entry);
+	if (previous != nullptr) {
+		bytes_cached.fetch_sub(previous->bytes, std::memory_order_relaxed);
+	}
+
+	if (bytes_cached.load(std::memory_order_relaxed) > capacity_bytes) {
+		evict();
+	}
+}
+
+/*
+	Evicts the least recently used listings until the cache is down to three quarters of its
+	budget, so the sweep over every shard is paid once per quarter of the budget rather than on
+	every insertion.
+*/
+void ListingCache::evict()
+{
+	std::vector<UINT64> ages;
+	listings.forEach([&ages](const std::wstring&, const CachedListing& cached) {
+		ages.push_back(cached.last_used.load(std::memory_order_relaxed));
+	});
+	if (ages.empty()) {
+		return;
+	}
+
+	// Estimate the age cutoff from the share of entries that must go
+	size_t current = bytes_cached.load(std::memory_order_relaxed);
+	size_t target = capacity_bytes / 4 * 3;
+	if (current <= target) {
+		return;
+	}
+	size_t victims = std::max<size_t>(1, static_cast<size_t>(
+		static_cast<double>(ages.size()) * (current - target) / current));
+	victims = std::min(victims, ages.size());
+	std::nth_element(ages.begin(), ages.begin() + (victims - 1), ages.end());
+	UINT64 cutoff = ages[victims - 1];
+
+	listings.eraseIf([this, cutoff](const std::wstring&, const CachedListing& cached) {
+		if (cached.last_used.load(std::memory_order_relaxed) > cutoff)
+			return false;
+		bytes_cached.fetch_sub(cached.bytes, std::memory_order_relaxed);
+		evictions.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	});
+}
+
+void ListingCache::invalidate(const std::wstring& path)
+{
+	std::shared_ptr<CachedListing> previous = listings.erase(keyOf(path));
+	if (previous != nullptr) {
+		bytes_cached.fetch_sub(previous->bytes, std::memory_order_relaxed);
+	}
+}
+
+void ListingCache::invalidateTree(const std::wstring& path)
+{
+	std::wstring root = keyOf(path);
+	listings.eraseIf([&](const std::wstring& key, const CachedListing& cached) {
+		if (key.compare(0, root.size(), root) != 0 ||
+			(key.size() != root.size() && key[root.size()] != L'\\')) {
+			return false;
+		}
+		bytes_cached.fetch_sub(cached.bytes, std::memory_order_relaxed);
+		return true;
+	});
+}
+
+void ListingCache::invalidateAll()
+{
+	listings.eraseIf([this](const std::wstring&, const CachedListing& cached) {
+		bytes_cached.fetch_sub(cached.bytes, std::memory_order_relaxed);
+		return true;
+	});
+}
+
+void ListingCache::printStatistics(FILE* out)
+{
+	fprintf(out, "  listing cache: %zu directories, %.1f MB, hits %llu, misses %llu, stale %llu, evictions %llu\n",
+		listings.size(),
+		bytes_cached.load(std::memory_order_relaxed) / (1024.0 * 1024.0),
+		static_cast<unsigned long long>(hits.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(misses.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(stale.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(evictions.load(std::memory_order_relaxed)));
+	fprintf(out, "  placeholder lookups: found %llu, filtered out %llu, searched absent %llu, sent to source %llu\n",
+		static_cast<unsigned long long>(found.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(filtered.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(searched_absent.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(untrusted.load(std::memory_order_relaxed)));
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "pch.h"
+#include "DirectoryListing.h"
+#include "ShardedTable.h"
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+	Process-wide cache of sorted directory listings, keyed by source path. Enumeration sessions
+	share the cached listings read-only through shared_ptrs, so evicting or invalidating one never
+	disturbs a session that is still returning it.
+
+	An entry is reused while the directory's ChangeTime is the one it was loaded at. That catches
+	entries being added, removed or renamed, but not a child file changing size in place, so
+	anything which modifies the source must call invalidate() for the directory.
+
+	The cached listings also answer placeholder lookups. For a short trust period after a listing
+	was last checked against its directory's ChangeTime, find() reports a name as present, with
+	the metadata the listing was read with, or absent, without touching the source. Each entry
+	carries a Bloom filter of its names so the common probe for a file that does not exist is
+	usually settled without searching the listing.
+*/
+class ListingCache
+{
+public:
+	// What a cached listing says about a name
+	enum Presence {
+		PRESENCE_UNKNOWN,
+		PRESENCE_PRESENT,
+		PRESENCE_ABSENT
+	};
+
+protected:
+	/*
+		Bloom filter over a listing's names folded to upper case. Names with non-ASCII characters
+		are left out, since their folding is the file system's, and a filter missing any name is
+		not complete and is not consulted.
+	*/
+	class NameFilter {
+	public:
+		std::vector<UINT64> bits;
+		bool complete;
+
+		NameFilter() : complete(false) {}
+
+		void build(const DirectoryListing& listing);
+
+		// false when the name, whose hash was taken by hashOf, is certainly not in the filter
+		bool mayContain(UINT64 hash) const;
+
+		// Hashes a folded ASCII name; returns false for names with other characters
+		static bool hashOf(PCWSTR name, UINT64& hash);
+
+		size_t bytesUsed() const { return bits.capacity() * sizeof(UINT64); }
+	};
+
+	class CachedListing {
+	public:
+		std::shared_ptr<const DirectoryListing> listing;
+		NameFilter filter;
+		INT64 change_time;
+		size_t bytes;
+		std::atomic<UINT64> last_used;
+		// When the directory was last seen to still have change_time
+		std::atomic<INT64> verified_at;
+
+		CachedListing() : change_time(0), bytes(0), last_used(0), verified_at(0) {}
+	};
+
+	class PathHash {
+	public:
+		size_t operator() (const std::wstring& path) const;
+	};
+
+	// Listings whose directory changed this recently are not cached, since a change within the
+	// same timestamp tick as the load would go unnoticed
+	static const INT64 RACY_WINDOW = 2 * 10000000LL;
+
+	ShardedTable<std::wstring, CachedListing, PathHash> listings;
+	std::atomic<size_t> bytes_cached;
+	std::atomic<UINT64> clock;
+	size_t capacity_bytes;
+	INT64 trust_period;
+
+	std::atomic<UINT64> hits;
+	std::atomic<UINT64> misses;
+	std::atomic<UINT64> stale;
+	std::atomic<UINT64> evictions;
+	std::atomic<UINT64> found;
+	std::atomic<UINT64> filtered;
+	std::atomic<UINT64> searched_absent;
+	std::atomic<UINT64> untrusted;
+
+	void evict();
+
+public:
+	ListingCache();
+
+	ListingCache(const ListingCache&) = delete;
+	ListingCache& operator=(const ListingCache&) = delete;
+
+	// Total listing bytes to keep cached; 0 disables the cache
+	void setCapacity(size_t bytes) { capacity_bytes = bytes; }
+
+	// How long, in milliseconds, a verified listing answers find(); 0 sends every lookup to the source
+	void setTrustPeriod(UINT32 milliseconds) { trust_period = milliseconds * 10000LL; }
+
+	// Whether find() can answer at all, so listings stored for it are worth loading
+	bool answersLookups() const { return capacity_bytes != 0 && trust_period != 0; }
+
+	// Returns the cached listing of the directory at path if it was loaded at changeTime
+	std::shared_ptr<const DirectoryListing> lookup(const std::wstring& path, const LARGE_INTEGER& changeTime);
+
+	// Caches a listing loaded at changeTime, unless the directory may have changed since
+	void store(
+		const std::wstring& path,
+		const LARGE_INTEGER& changeTime,
+		const std::shared_ptr<const DirectoryListing>& listing
+	);
+
+	// Looks name up in the cached listing of directory, if one was verified within the trust period
+	Presence find(const std::wstring& directory, PCWSTR name, PRJ_FILE_BASIC_INFO& fileInfo);
+
+	// Drops the cached listing of one directory, of a directory and everything below it, or of
+	// every directory
+	void invalidate(const std::wstring& path);
+	void invalidateTree(const std::wstring& path);
+	void invalidateAll();
+
+	void printStatistics(FILE* out);
+
+	// The form of a source path used as a key; on Windows every spelling maps to one key
+	static std::wstring keyOf(const std::wstring& path);
+
+	/*
+		Whether a listing of path read after observing changeTime is known to be complete: the
+		directory still has that ChangeTime, and it is old enough that a further change could not
+		have landed within the same timestamp tick.
+	*/
+	static bool unchangedSince(const std::wstring& path, const LARGE_INTEGER& changeTime);
+};
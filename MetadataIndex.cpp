@@ -0,0 +1,514 @@
+#include "pch.h"
+#include "MetadataIndex.h"
+#include "ListingCache.h"
+
+#include <unordered_map>
+#include <vector>
+
+// stdio buffer for writing the index
+static const size_t METADATA_WRITE_BUFFER = 1024 * 1024;
+
+// The hash table is kept at most half full
+static const UINT64 METADATA_MIN_SLOTS = 16;
+
+static UINT64 alignUp8(UINT64 value) {
+	return (value + 7) & ~static_cast<UINT64>(7);
+}
+
+MetadataIndex::MetadataIndex() :
+	header(nullptr),
+	hits(0),
+	misses(0),
+	stale(0),
+	updated(0),
+	saves(0),
+	saved_directories(0)
+{
+}
+
+MetadataIndex::~MetadataIndex()
+{
+	unmapIndex();
+}
+
+UINT64 MetadataIndex::hashOf(const std::wstring& key)
+{
+	// FNV-1a over the UTF-16 code units
+	UINT64 hash = 0xcbf29ce484222325ull;
+	for (WCHAR c : key) {
+		hash ^= static_cast<UINT16>(c);
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+bool MetadataIndex::keyOf(const std::wstring& path, std::wstring& key) const
+{
+	std::wstring full = ListingCache::keyOf(path);
+	if (full.compare(0, root_key.size(), root_key) != 0) {
+		return false;
+	}
+	if (full.size() == root_key.size()) {
+		key.clear();
+		return true;
+	}
+	if (full[root_key.size()] != L'\\') {
+		return false;
+	}
+	key = full.substr(root_key.size() + 1);
+	return true;
+}
+
+HRESULT MetadataIndex::open(const std::wstring& indexPath, const std::wstring& sourceRoot)
+{
+	std::unique_lock<std::shared_mutex> lock(mappingMutex);
+	unmapIndex();
+	index_path = indexPath;
+	root_key = ListingCache::keyOf(sourceRoot);
+
+	if (index_path.empty()) {
+		return S_OK;
+	}
+	return mapIndex();
+}
+
+HRESULT MetadataIndex::mapIndex()
+{
+	HRESULT hr = SourceFileSystem::mapFile(index_path, mapping);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	const UINT8* base = static_cast<const UINT8*>(mapping.data);
+	const MetadataIndexHeader* mapped = reinterpret_cast<const MetadataIndexHeader*>(base);
+	UINT64 rootBytes = mapping.size >= sizeof(MetadataIndexHeader) ?
+		static_cast<UINT64>(mapped->root_length) * sizeof(WCHAR) : 0;
+
+	// Only the header is checked here; records are checked as they are looked up
+	if (mapping.size < sizeof(MetadataIndexHeader) ||
+		mapped->magic != MetadataIndexHeader::MAGIC ||
+		mapped->wchar_size != sizeof(WCHAR) ||
+		mapped->entry_size != sizeof(DirectoryListing::Entry) ||
+		mapped->file_size != mapping.size ||
+		sizeof(MetadataIndexHeader) + rootBytes > mapping.size ||
+		mapped->slot_count == 0 ||
+		(mapped->slot_count & (mapped->slot_count - 1)) != 0 ||
+		mapped->slots_offset % 8 != 0 ||
+		mapped->slots_offset > mapping.size ||
+		(mapping.size - mapped->slots_offset) / sizeof(MetadataIndexSlot) != mapped->slot_count
+	) {
+		unmapIndex();
+		return HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT);
+	}
+
+	// An index of another tree is no use; it is replaced on the next save
+	const WCHAR* storedRoot = reinterpret_cast<const WCHAR*>(base + sizeof(MetadataIndexHeader));
+	if (root_key.compare(0, std::wstring::npos, storedRoot, mapped->root_length) != 0) {
+		unmapIndex();
+		return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+	}
+
+	header = mapped;
+	return S_OK;
+}
+
+void MetadataIndex::unmapIndex()
+{
+	header = nullptr;
+	SourceFileSystem::unmapFile(mapping);
+}
+
+UINT64 MetadataIndex::recordSize(const MetadataIndexRecord& record)
+{
+	return sizeof(MetadataIndexRecord) +
+		alignUp8(static_cast<UINT64>(record.path_length) * sizeof(WCHAR)) +
+		static_cast<UINT64>(record.entry_count) * sizeof(DirectoryListing::Entry) +
+		alignUp8(record.names_length * sizeof(WCHAR));
+}
+
+const MetadataIndexRecord* MetadataIndex::findRecord(const std::wstring& key, UINT64 hash) const
+{
+	if (header == nullptr) {
+		return nullptr;
+	}
+
+	const UINT8* base = static_cast<const UINT8*>(mapping.data);
+	const MetadataIndexSlot* slots = reinterpret_cast<const MetadataIndexSlot*>(base + header->slots_offset);
+	UINT64 mask = header->slot_count - 1;
+	UINT64 recordsStart = alignUp8(sizeof(MetadataIndexHeader) + header->root_length * sizeof(WCHAR));
+
+	for (UINT64 i = hash & mask, probes = 0; probes < header->slot_count; i = (i + 1) & mask, probes++) {
+		const MetadataIndexSlot& slot = slots[i];
+		if (slot.offset == 0) {
+			return nullptr;
+		}
+		if (slot.hash != hash) {
+			continue;
+		}
+
+		// A damaged record is treated as absent
+		if (slot.offset < recordsStart || slot.offset % 8 != 0 ||
+			slot.offset + sizeof(MetadataIndexRecord) > header->slots_offset) {
+			return nullptr;
+		}
+		const MetadataIndexRecord* record = reinterpret_cast<const MetadataIndexRecord*>(base + slot.offset);
+		if (record->names_length > header->slots_offset ||
+			recordSize(*record) > header->slots_offset - slot.offset) {
+			return nullptr;
+		}
+
+		const WCHAR* path = reinterpret_cast<const WCHAR*>(record + 1);
+		if (key.compare(0, std::wstring::npos, path, record->path_length) == 0) {
+			return record;
+		}
+	}
+	return nullptr;
+}
+
+const MetadataIndexRecord* MetadataIndex::recordIn(const MetadataIndexSlot& slot, std::wstring& key) const
+{
+	// Look the record up by its own key, which also checks it lies within the file
+	const UINT8* base = static_cast<const UINT8*>(mapping.data);
+	const MetadataIndexRecord* candidate = reinterpret_cast<const MetadataIndexRecord*>(base + slot.offset);
+	if (slot.offset + sizeof(MetadataIndexRecord) > header->slots_offset ||
+		candidate->path_length > header->slots_offset - slot.offset) {
+		return nullptr;
+	}
+	key.assign(reinterpret_cast<const WCHAR*>(candidate + 1), candidate->path_length);
+	return findRecord(key, slot.hash) == candidate ? candidate : nullptr;
+}
+
+std::shared_ptr<DirectoryListing> MetadataIndex::copyRecord(const MetadataIndexRecord& record) const
+{
+	const UINT8* data = reinterpret_cast<const UINT8*>(&record + 1) +
+		alignUp8(static_cast<UINT64>(record.path_length) * sizeof(WCHAR));
+	const DirectoryListing::Entry* entries = reinterpret_cast<const DirectoryListing::Entry*>(data);
+	const WCHAR* names = reinterpret_cast<const WCHAR*>(entries + record.entry_count);
+
+	for (UINT32 i = 0; i < record.entry_count; i++) {
+		UINT64 end = static_cast<UINT64>(entries[i].name_offset) + entries[i].name_length;
+		if (end >= record.names_length || names[end] != L'\0') {
+			return nullptr;
+		}
+	}
+
+	std::shared_ptr<DirectoryListing> listing = std::make_shared<DirectoryListing>();
+	listing->assign(entries, record.entry_count, names, static_cast<size_t>(record.names_length));
+	return listing;
+}
+
+bool MetadataIndex::holds(const std::wstring& path)
+{
+	std::wstring key;
+	if (!enabled() || !keyOf(path, key)) {
+		return false;
+	}
+
+	std::shared_ptr<Update> update = updates.find(key);
+	if (update != nullptr) {
+		return update->listing != nullptr;
+	}
+
+	std::shared_lock<std::shared_mutex> lock(mappingMutex);
+	return findRecord(key, hashOf(key)) != nullptr;
+}
+
+std::shared_ptr<const DirectoryListing> MetadataIndex::lookup(
+	const std::wstring& path,
+	const LARGE_INTEGER& changeTime
+) {
+	std::wstring key;
+	if (!enabled() || !keyOf(path, key)) {
+		return nullptr;
+	}
+
+	// What was read since the file was mapped takes precedence over it
+	std::shared_ptr<Update> update = updates.find(key);
+	if (update != nullptr) {
+		if (update->listing != nullptr && update->change_time == changeTime.QuadPart) {
+			hits.fetch_add(1, std::memory_order_relaxed);
+			return update->listing;
+		}
+		(update->listing != nullptr ? stale : misses).fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	std::shared_lock<std::shared_mutex> lock(mappingMutex);
+	const MetadataIndexRecord* record = findRecord(key, hashOf(key));
+	if (record == nullptr) {
+		misses.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	if (record->change_time != changeTime.QuadPart) {
+		stale.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	std::shared_ptr<DirectoryListing> listing = copyRecord(*record);
+	(listing != nullptr ? hits : misses).fetch_add(1, std::memory_order_relaxed);
+	return listing;
+}
+
+void MetadataIndex::update(
+	const std::wstring& path,
+	const LARGE_INTEGER& changeTime,
+	const std::shared_ptr<const DirectoryListing>& listing
+) {
+	std::wstring key;
+	if (!enabled() || !keyOf(path, key)) {
+		return;
+	}
+
+	// As with the listing cache, a listing which may not match changeTime must not be kept
+	if (!ListingCache::unchangedSince(path, changeTime)) {
+		invalidate(path);
+		return;
+	}
+
+	std::shared_ptr<Update> entry = std::make_shared<Update>();
+	entry->listing = listing;
+	entry->change_time = changeTime.QuadPart;
+	updates.assign(key, entry);
+	updated.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MetadataIndex::invalidate(const std::wstring& path)
+{
+	std::wstring key;
+	if (enabled() && keyOf(path, key)) {
+		updates.assign(key, std::make_shared<Update>());
+	}
+}
+
+void MetadataIndex::invalidateTree(const std::wstring& path)
+{
+	std::wstring root;
+	if (!enabled() || !keyOf(path, root)) {
+		return;
+	}
+	auto below = [&root](const std::wstring& key) {
+		return root.empty() || (key.compare(0, root.size(), root) == 0 &&
+			(key.size() == root.size() || key[root.size()] == L'\\'));
+	};
+
+	// Mapped records need a tombstone each; updates already in memory are simply replaced by one
+	std::vector<std::wstring> dropped;
+	{
+		std::shared_lock<std::shared_mutex> lock(mappingMutex);
+		if (header != nullptr) {
+			const MetadataIndexSlot* slots = reinterpret_cast<const MetadataIndexSlot*>(
+				static_cast<const UINT8*>(mapping.data) + header->slots_offset);
+			for (UINT64 i = 0; i < header->slot_count; i++) {
+				std::wstring key;
+				if (slots[i].offset != 0 && recordIn(slots[i], key) != nullptr && below(key)) {
+					dropped.push_back(std::move(key));
+				}
+			}
+		}
+	}
+	updates.forEach([&](const std::wstring& key, const Update& update) {
+		if (update.listing != nullptr && below(key)) {
+			dropped.push_back(key);
+		}
+	});
+
+	dropped.push_back(root);
+	for (const std::wstring& key : dropped) {
+		updates.assign(key, std::make_shared<Update>());
+	}
+}
+
+void MetadataIndex::invalidateAll()
+{
+	std::unique_lock<std::shared_mutex> lock(mappingMutex);
+	unmapIndex();
+	updates.eraseIf([](const std::wstring&, const Update&) { return true; });
+}
+
+/*
+	Writes the records of the mapped file that have no update, byte for byte, then a record for
+	each update with a listing, and the hash table over all of them. The caller holds the mapping
+	shared, so the mapped records stay put while they are copied.
+*/
+HRESULT MetadataIndex::writeIndex(
+	const std::wstring& filePath,
+	const std::unordered_map<std::wstring, Update>& pending
+) {
+	FILE* file = SourceFileSystem::openFile(filePath, "wb");
+	if (file == nullptr) {
+		return HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED);
+	}
+	setvbuf(file, nullptr, _IOFBF, METADATA_WRITE_BUFFER);
+
+	static const UINT8 padding[8] = {};
+	UINT64 offset = 0;
+	bool ok = true;
+	auto write = [&](const void* data, UINT64 bytes) {
+		if (ok && bytes != 0 && fwrite(data, 1, static_cast<size_t>(bytes), file) != bytes) {
+			ok = false;
+		}
+		offset += bytes;
+	};
+	auto pad = [&]() {
+		write(padding, alignUp8(offset) - offset);
+	};
+
+	MetadataIndexHeader fileHeader = {};
+	fileHeader.magic = MetadataIndexHeader::MAGIC;
+	fileHeader.wchar_size = sizeof(WCHAR);
+	fileHeader.entry_size = sizeof(DirectoryListing::Entry);
+	fileHeader.root_length = static_cast<UINT32>(root_key.size());
+	write(&fileHeader, sizeof(fileHeader));
+	write(root_key.data(), root_key.size() * sizeof(WCHAR));
+	pad();
+
+	std::vector<MetadataIndexSlot> written;
+
+	if (header != nullptr) {
+		const UINT8* base = static_cast<const UINT8*>(mapping.data);
+		const MetadataIndexSlot* slots = reinterpret_cast<const MetadataIndexSlot*>(base + header->slots_offset);
+		for (UINT64 i = 0; i < header->slot_count; i++) {
+			if (slots[i].offset == 0) {
+				continue;
+			}
+
+			std::wstring key;
+			const MetadataIndexRecord* record = recordIn(slots[i], key);
+			if (record == nullptr || pending.count(key) != 0) {
+				continue;
+			}
+
+			MetadataIndexSlot slot = { slots[i].hash, offset };
+			written.push_back(slot);
+			write(record, recordSize(*record));
+		}
+	}
+
+	for (const auto& update : pending) {
+		const DirectoryListing* listing = update.second.listing.get();
+		if (listing == nullptr) {
+			continue;
+		}
+
+		MetadataIndexRecord record = {};
+		record.change_time = update.second.change_time;
+		record.names_length = listing->namePoolLength();
+		record.path_length = static_cast<UINT32>(update.first.size());
+		record.entry_count = static_cast<UINT32>(listing->size());
+
+		MetadataIndexSlot slot = { hashOf(update.first), offset };
+		written.push_back(slot);
+		write(&record, sizeof(record));
+		write(update.first.data(), update.first.size() * sizeof(WCHAR));
+		pad();
+		write(listing->entryData(), listing->size() * sizeof(DirectoryListing::Entry));
+		write(listing->namePool(), listing->namePoolLength() * sizeof(WCHAR));
+		pad();
+	}
+
+	UINT64 slotCount = METADATA_MIN_SLOTS;
+	while (slotCount < written.size() * 2) {
+		slotCount *= 2;
+	}
+	std::vector<MetadataIndexSlot> table(static_cast<size_t>(slotCount));
+	for (const MetadataIndexSlot& slot : written) {
+		UINT64 i = slot.hash & (slotCount - 1);
+		while (table[static_cast<size_t>(i)].offset != 0) {
+			i = (i + 1) & (slotCount - 1);
+		}
+		table[static_cast<size_t>(i)] = slot;
+	}
+
+	fileHeader.slots_offset = offset;
+	fileHeader.slot_count = slotCount;
+	fileHeader.directory_count = written.size();
+	write(table.data(), slotCount * sizeof(MetadataIndexSlot));
+	fileHeader.file_size = offset;
+
+	// The header goes in last, so a file cut short is never taken for a complete one
+	ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&fileHeader, sizeof(fileHeader), 1, file) == 1;
+	ok = fflush(file) == 0 && ok;
+	ok = fclose(file) == 0 && ok;
+	if (!ok) {
+		SourceFileSystem::removeFile(filePath);
+		return HRESULT_FROM_WIN32(ERROR_WRITE_FAULT);
+	}
+
+	saved_directories.store(written.size(), std::memory_order_relaxed);
+	return S_OK;
+}
+
+HRESULT MetadataIndex::save()
+{
+	if (!enabled()) {
+		return S_OK;
+	}
+	std::lock_guard<std::mutex> saving(saveMutex);
+
+	std::unordered_map<std::wstring, Update> pending;
+	updates.forEach([&pending](const std::wstring& key, const Update& update) {
+		pending[key] = update;
+	});
+
+	size_t separator = index_path.find_last_of(L'\\');
+	std::wstring directory = separator == std::wstring::npos ? std::wstring(L".") : index_path.substr(0, separator);
+	SourceFileSystem::createDirectory(directory);
+	std::wstring tempPath = SourceFileSystem::uniqueFilePath(directory, L"metadata");
+
+	HRESULT hr;
+	{
+		std::shared_lock<std::shared_mutex> lock(mappingMutex);
+		hr = writeIndex(tempPath, pending);
+	}
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	// Windows cannot replace a mapped file, so lookups wait while the new one is swapped in
+	std::unique_lock<std::shared_mutex> lock(mappingMutex);
+	unmapIndex();
+	if (!SourceFileSystem::replaceFile(tempPath, index_path)) {
+		SourceFileSystem::removeFile(tempPath);
+		mapIndex();
+		return HRESULT_FROM_WIN32(ERROR_WRITE_FAULT);
+	}
+
+	hr = mapIndex();
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	// Updates made while the file was written stay in memory for the next save
+	updates.eraseIf([&pending](const std::wstring& key, const Update& update) {
+		auto found = pending.find(key);
+		return found != pending.end() &&
+			found->second.listing == update.listing &&
+			found->second.change_time == update.change_time;
+	});
+	saves.fetch_add(1, std::memory_order_relaxed);
+	return S_OK;
+}
+
+void MetadataIndex::printStatistics(FILE* out)
+{
+	UINT64 directories = 0;
+	double megabytes = 0;
+	{
+		std::shared_lock<std::shared_mutex> lock(mappingMutex);
+		if (header != nullptr) {
+			directories = header->directory_count;
+			megabytes = mapping.size / (1024.0 * 1024.0);
+		}
+	}
+
+	fprintf(out, "  metadata index: %llu directories mapped (%.1f MB), %zu updates held, hits %llu, misses %llu, stale %llu, updated %llu, saves %llu (%llu directories)\n",
+		static_cast<unsigned long long>(directories),
+		megabytes,
+		updates.size(),
+		static_cast<unsigned long long>(hits.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(misses.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(stale.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(updated.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(saves.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(saved_directories.load(std::memory_order_relaxed)));
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "pch.h"
+#include "DirectoryListing.h"
+#include "ShardedTable.h"
+#include "SourceFileSystem.h"
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+	On-disk layout of the metadata index. The file starts with a header and the source root it
+	describes, followed by one record per directory and a hash table of the records at the end.
+	Each record holds the directory's ChangeTime, its path relative to the root as a key, its
+	entries as DirectoryListing::Entry in enumeration order, and its name pool. Everything is
+	8-byte aligned, and, like the listing files, private to the machine that wrote it, so fields
+	are stored in native layout and a build with another layout rejects the file.
+*/
+class MetadataIndexHeader {
+public:
+	UINT32 magic;
+	UINT32 wchar_size;
+	UINT32 entry_size;
+	UINT32 root_length;
+	UINT64 file_size;
+	UINT64 directory_count;
+	// Power of two; a slot with offset 0 is empty
+	UINT64 slot_count;
+	UINT64 slots_offset;
+
+	static const UINT32 MAGIC = 0x31494d58; // "XMI1"
+};
+
+class MetadataIndexSlot {
+public:
+	UINT64 hash;
+	UINT64 offset;
+};
+
+class MetadataIndexRecord {
+public:
+	INT64 change_time;
+	UINT64 names_length;
+	UINT32 path_length;
+	UINT32 entry_count;
+};
+
+/*
+	Persistent index of the metadata of the whole source tree, so a process start does not have
+	to rediscover it directory by directory. The file is memory mapped: opening it costs a header
+	check however many directories it holds, and a directory's record is found through the hash
+	table and copied into a DirectoryListing only when it is first asked for.
+
+	A record is used while its directory still has the ChangeTime it was read at, the same test
+	the listing cache applies. As in the listing cache, that does not notice a child file changing
+	in place, so anything which modifies the source must call invalidate() for its directory.
+
+	Directories read or dropped while the provider runs are held in memory over the mapped file.
+	save() writes a new file holding those and, copied as they are, the mapped records of every
+	other directory, then swaps it in for the mapping.
+*/
+class MetadataIndex
+{
+protected:
+	// A directory changed since the file was mapped; a null listing drops the mapped record
+	class Update {
+	public:
+		std::shared_ptr<const DirectoryListing> listing;
+		INT64 change_time;
+
+		Update() : change_time(0) {}
+	};
+
+	class PathHash {
+	public:
+		size_t operator() (const std::wstring& key) const { return static_cast<size_t>(hashOf(key)); }
+	};
+
+	std::wstring index_path;
+	// The source root in key form; keys are paths below it
+	std::wstring root_key;
+
+	// Lookups hold the mapping shared; save() holds it exclusively to swap in the new file
+	std::shared_mutex mappingMutex;
+	SourceFileSystem::MappedFile mapping;
+	const MetadataIndexHeader* header;
+
+	ShardedTable<std::wstring, Update, PathHash> updates;
+	std::mutex saveMutex;
+
+	std::atomic<UINT64> hits;
+	std::atomic<UINT64> misses;
+	std::atomic<UINT64> stale;
+	std::atomic<UINT64> updated;
+	std::atomic<UINT64> saves;
+	std::atomic<UINT64> saved_directories;
+
+	static UINT64 hashOf(const std::wstring& key);
+
+	// The key of a source directory: its path below the root; false if it is not below the root
+	bool keyOf(const std::wstring& path, std::wstring& key) const;
+
+	// Maps the file and checks it describes root; the caller holds mappingMutex exclusively
+	HRESULT mapIndex();
+	void unmapIndex();
+
+	// The mapped record for key, checked to lie within the file; nullptr if there is none
+	const MetadataIndexRecord* findRecord(const std::wstring& key, UINT64 hash) const;
+	// The valid record a slot in use points to, and its key; nullptr if it is damaged
+	const MetadataIndexRecord* recordIn(const MetadataIndexSlot& slot, std::wstring& key) const;
+	static UINT64 recordSize(const MetadataIndexRecord& record);
+	std::shared_ptr<DirectoryListing> copyRecord(const MetadataIndexRecord& record) const;
+
+	// Writes the mapped records not in pending and the listings in pending to a new file
+	HRESULT writeIndex(const std::wstring& filePath, const std::unordered_map<std::wstring, Update>& pending);
+
+public:
+	MetadataIndex();
+	~MetadataIndex();
+
+	MetadataIndex(const MetadataIndex&) = delete;
+	MetadataIndex& operator=(const MetadataIndex&) = delete;
+
+	/*
+		Maps the index at indexPath if it describes sourceRoot; a missing or unusable file leaves
+		the index empty, to be written by save(). An empty indexPath disables the index.
+	*/
+	HRESULT open(const std::wstring& indexPath, const std::wstring& sourceRoot);
+
+	bool enabled() const { return !index_path.empty(); }
+
+	// Whether the index holds a listing of the directory, of whatever ChangeTime
+	bool holds(const std::wstring& path);
+
+	// Returns the directory's listing if the index holds one read at changeTime
+	std::shared_ptr<const DirectoryListing> lookup(const std::wstring& path, const LARGE_INTEGER& changeTime);
+
+	// Records a sorted listing read at changeTime, unless the directory may have changed since
+	void update(
+		const std::wstring& path,
+		const LARGE_INTEGER& changeTime,
+		const std::shared_ptr<const DirectoryListing>& listing
+	);
+
+	// Drops what the index holds for one directory, for a directory and everything below it, or
+	// for every directory
+	void invalidate(const std::wstring& path);
+	void invalidateTree(const std::wstring& path);
+	void invalidateAll();
+
+	// Writes the index, mapped records and updates together, and maps the new file
+	HRESULT save();
+
+	void printStatistics(FILE* out);
+};
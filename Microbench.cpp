@@ -0,0 +1,675 @@
+#include "pch.h"
+#include "Microbench.h"
+#include "AsyncIO.h"
+#include "DirectoryListing.h"
+#include "IOScheduler.h"
+#include "JobQueue.h"
+#include "SearchExpression.h"
+#include "SimHost.h"
+#include "SourceFileSystem.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <malloc.h>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Stand-in for SourceFileSystemJob with a similar footprint
+class BenchJob {
+public:
+	BenchJob* prev;
+	BenchJob* next;
+	UINT64 offset;
+	UINT32 length;
+	std::wstring path;
+
+	BenchJob() : prev(NULL), next(NULL), offset(0), length(0) {}
+};
+
+// The doubly linked list behind one mutex that the worker queue used to be
+class MutexJobList {
+private:
+	std::mutex mutex;
+	BenchJob* head;
+	BenchJob* end;
+
+public:
+	MutexJobList() : head(NULL), end(NULL) {}
+
+	void push(BenchJob* job) {
+		std::lock_guard<std::mutex> lock(mutex);
+		job->next = NULL;
+		job->prev = end;
+		if (end == NULL) {
+			head = job;
+		} else {
+			end->next = job;
+		}
+		end = job;
+	}
+
+	BenchJob* pop() {
+		std::lock_guard<std::mutex> lock(mutex);
+		BenchJob* job = head;
+		if (job != NULL) {
+			head = job->next;
+			if (head == NULL) {
+				end = NULL;
+			} else {
+				head->prev = NULL;
+			}
+		}
+		return job;
+	}
+};
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+	Runs producer and consumer bodies on threads threads (half each, or one thread doing both) and
+	returns the number of jobs moved per second.
+*/
+static double runProducersConsumers(
+	unsigned threads,
+	UINT64 operations,
+	const std::function<void(UINT64)>& produce,
+	const std::function<bool()>& consume
+) {
+	std::atomic<UINT64> consumed(0);
+	auto start = std::chrono::steady_clock::now();
+
+	if (threads == 1) {
+		for (UINT64 i = 0; i < operations; i++) {
+			produce(1);
+			while (!consume()) {
+			}
+		}
+		return operations / secondsSince(start);
+	}
+
+	unsigned producers = threads / 2;
+	unsigned consumers = threads - producers;
+	std::vector<std::thread> pool;
+
+	for (unsigned p = 0; p < producers; p++) {
+		UINT64 share = operations / producers + (p < operations % producers ? 1 : 0);
+		pool.emplace_back([&produce, share] { produce(share); });
+	}
+	for (unsigned c = 0; c < consumers; c++) {
+		pool.emplace_back([&consume, &consumed, operations] {
+			while (consumed.load(std::memory_order_relaxed) < operations) {
+				if (consume()) {
+					consumed.fetch_add(1, std::memory_order_relaxed);
+				} else {
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+
+	for (std::thread& thread : pool)
+		thread.join();
+	return operations / secondsSince(start);
+}
+
+static double benchMutexList(unsigned threads, UINT64 operations) {
+	MutexJobList list;
+	return runProducersConsumers(
+		threads,
+		operations,
+		[&list](UINT64 count) {
+			for (UINT64 i = 0; i < count; i++) {
+				BenchJob* job = new BenchJob;
+				job->offset = i;
+				list.push(job);
+			}
+		},
+		[&list]() {
+			BenchJob* job = list.pop();
+			if (job == NULL)
+				return false;
+			delete job;
+			return true;
+		}
+	);
+}
+
+static double benchLockFree(unsigned threads, UINT64 operations) {
+	BoundedMPMCQueue<BenchJob*> queue(4096);
+	ObjectPool<BenchJob> pool(4096);
+	return runProducersConsumers(
+		threads,
+		operations,
+		[&queue, &pool](UINT64 count) {
+			for (UINT64 i = 0; i < count; i++) {
+				BenchJob* job = pool.acquire();
+				job->offset = i;
+				while (!queue.tryPush(job))
+					std::this_thread::yield();
+			}
+		},
+		[&queue, &pool]() {
+			BenchJob* job;
+			if (!queue.tryPop(job))
+				return false;
+			pool.release(job);
+			return true;
+		}
+	);
+}
+
+/*
+	Foreground jobs through the IOScheduler: as flow 0 they take its lock-free ring, as one of
+	eight flows they are tagged into the fair queue under its mutex
+*/
+static double benchScheduler(unsigned threads, UINT64 operations, bool flows) {
+	IOScheduler<BenchJob> scheduler;
+	ObjectPool<BenchJob> pool(4096);
+	return runProducersConsumers(
+		threads,
+		operations,
+		[&scheduler, &pool, flows](UINT64 count) {
+			for (UINT64 i = 0; i < count; i++) {
+				BenchJob* job = pool.acquire();
+				job->offset = i;
+				IOSchedulerBase::Flow flow;
+				if (flows) {
+					flow.id = i % 8 + 1;
+				}
+				while (!scheduler.tryPush(job, IO_FOREGROUND, flow))
+					std::this_thread::yield();
+			}
+		},
+		[&scheduler, &pool]() {
+			BenchJob* job;
+			IOClass ioClass;
+			if (!scheduler.tryPop(job, ioClass))
+				return false;
+			pool.release(job);
+			return true;
+		}
+	);
+}
+
+/*
+	One owner produces every job onto its own deque, the way a worker splits a large read, and
+	pops them LIFO while every other thread steals.
+*/
+static double benchWorkStealing(unsigned threads, UINT64 operations) {
+	WorkStealingDeque<BenchJob> deque(256);
+	ObjectPool<BenchJob> pool(4096);
+	std::atomic<UINT64> consumed(0);
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> thieves;
+	for (unsigned t = 1; t < threads; t++) {
+		thieves.emplace_back([&] {
+			while (consumed.load(std::memory_order_relaxed) < operations) {
+				BenchJob* job = deque.steal();
+				if (job == NULL) {
+					std::this_thread::yield();
+					continue;
+				}
+				pool.release(job);
+				consumed.fetch_add(1, std::memory_order_relaxed);
+			}
+		});
+	}
+
+	for (UINT64 produced = 0; produced < operations;) {
+		BenchJob* job = pool.acquire();
+		job->offset = produced;
+		if (deque.push(job)) {
+			produced++;
+			continue;
+		}
+
+		// Full: work off some of our own jobs before producing more
+		pool.release(job);
+		for (int i = 0; i < 64; i++) {
+			BenchJob* own = deque.pop();
+			if (own == NULL)
+				break;
+			pool.release(own);
+			consumed.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	while (consumed.load(std::memory_order_relaxed) < operations) {
+		BenchJob* own = deque.pop();
+		if (own == NULL) {
+			std::this_thread::yield();
+			continue;
+		}
+		pool.release(own);
+		consumed.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	for (std::thread& thread : thieves)
+		thread.join();
+	return operations / secondsSince(start);
+}
+
+void Microbench::jobQueues(FILE* out, UINT64 operations)
+{
+	fprintf(out, "Job queues: %llu jobs per run, Mjobs/s\n", static_cast<unsigned long long>(operations));
+	fprintf(out, "  %7s %14s %14s %14s %14s %14s\n", "threads", "mutex list", "mpmc + pool", "work stealing",
+		"scheduler", "fair flows");
+
+	for (unsigned threads = 1; threads <= 64; threads *= 2) {
+		double mutexList = benchMutexList(threads, operations);
+		double lockFree = benchLockFree(threads, operations);
+		double stealing = benchWorkStealing(threads, operations);
+		double scheduler = benchScheduler(threads, operations, false);
+		double fair = benchScheduler(threads, operations, true);
+		fprintf(out, "  %7u %14.2f %14.2f %14.2f %14.2f %14.2f\n",
+			threads, mutexList / 1e6, lockFree / 1e6, stealing / 1e6, scheduler / 1e6, fair / 1e6);
+	}
+	fprintf(out, "  scheduler: foreground jobs of flow 0 through the lock-free ring\n");
+	fprintf(out, "  fair flows: foreground jobs of 8 flows, fair queued under the mutex\n");
+}
+
+// Heap bytes currently allocated, including large blocks served by mmap
+static size_t heapBytesInUse() {
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+}
+
+// Names shaped like a source tree: mixed case, shared prefixes, varied lengths, a few non-ASCII
+static std::vector<std::wstring> syntheticNames(size_t count) {
+	std::vector<std::wstring> names;
+	names.reserve(count);
+	UINT64 state = 0x2545f4914f6cdd1dull;
+	for (size_t i = 0; i < count; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		WCHAR name[64];
+		swprintf(name, 64, L"%ls_%llx%ls",
+			(state & 1) ? L"Module" : (state & 0x3c) ? L"test" : L"Caf\u00e9",
+			static_cast<unsigned long long>(state >> (8 + (state & 31))),
+			(state & 2) ? L".cpp" : L".h");
+		names.push_back(name);
+	}
+	return names;
+}
+
+// The vector-then-linked-list listing that EnumerationSession used to build
+class LegacyListing {
+public:
+	class Entry {
+	public:
+		Entry* next;
+		std::wstring name;
+		PRJ_FILE_BASIC_INFO fileInfo;
+	};
+
+	class Tuple {
+	public:
+		std::wstring name;
+		PRJ_FILE_BASIC_INFO fInfo;
+	};
+
+	Entry* head;
+
+	LegacyListing() : head(NULL) {}
+
+	~LegacyListing() {
+		while (head != NULL) {
+			Entry* next = head->next;
+			delete head;
+			head = next;
+		}
+	}
+
+	void load(const std::vector<std::wstring>& names, const PRJ_FILE_BASIC_INFO& fileInfo) {
+		std::vector<Tuple> files;
+		for (const std::wstring& name : names) {
+			Tuple tuple;
+			tuple.name = name;
+			tuple.fInfo = fileInfo;
+			files.push_back(tuple);
+		}
+
+		std::sort(files.begin(), files.end(), [](Tuple a, Tuple b) {
+			return PrjFileNameCompare(a.name.c_str(), b.name.c_str()) < 0;
+		});
+
+		Entry* back = NULL;
+		for (const Tuple& tuple : files) {
+			Entry* entry = new Entry;
+			entry->next = NULL;
+			entry->name = tuple.name;
+			entry->fileInfo = tuple.fInfo;
+			if (back == NULL) {
+				head = entry;
+			} else {
+				back->next = entry;
+			}
+			back = entry;
+		}
+	}
+};
+
+// Calls fill for every entry, emptying the buffer whenever it is full, and returns entries/s
+static double fillRate(size_t count, SimDirEntryBuffer& buffer, const std::function<void(const std::function<bool(PCWSTR, PRJ_FILE_BASIC_INFO*)>&)>& walk) {
+	auto start = std::chrono::steady_clock::now();
+	walk([&buffer](PCWSTR name, PRJ_FILE_BASIC_INFO* fileInfo) {
+		if (!PrjFileNameMatch(name, L"*"))
+			return true;
+		if (PrjFillDirEntryBuffer(name, fileInfo, &buffer) == S_OK)
+			return true;
+		buffer.used = 0;
+		buffer.entries.clear();
+		return PrjFillDirEntryBuffer(name, fileInfo, &buffer) == S_OK;
+	});
+	return count / secondsSince(start);
+}
+
+void Microbench::directoryListings(FILE* out, size_t count)
+{
+	std::vector<std::wstring> names = syntheticNames(count);
+
+	PRJ_FILE_BASIC_INFO fileInfo = {};
+	fileInfo.FileSize = 4096;
+
+	SimDirEntryBuffer buffer;
+	buffer.capacity = 16384;
+
+	fprintf(out, "Directory listings: %zu entries\n", count);
+	fprintf(out, "  %-16s %12s %14s %14s\n", "layout", "load ms", "bytes/entry", "fill Mentries/s");
+
+	{
+		size_t heapBefore = heapBytesInUse();
+		auto start = std::chrono::steady_clock::now();
+		LegacyListing* legacy = new LegacyListing;
+		legacy->load(names, fileInfo);
+		double loadMs = secondsSince(start) * 1000.0;
+		size_t heapBytes = heapBytesInUse() - heapBefore;
+
+		double rate = fillRate(count, buffer, [legacy](const std::function<bool(PCWSTR, PRJ_FILE_BASIC_INFO*)>& fill) {
+			for (LegacyListing::Entry* entry = legacy->head; entry != NULL; entry = entry->next) {
+				PRJ_FILE_BASIC_INFO info = entry->fileInfo;
+				if (!fill(entry->name.c_str(), &info))
+					break;
+			}
+		});
+		fprintf(out, "  %-16s %12.2f %14.1f %14.2f\n", "linked list", loadMs,
+			static_cast<double>(heapBytes) / count, rate / 1e6);
+		delete legacy;
+	}
+
+	{
+		size_t heapBefore = heapBytesInUse();
+		auto start = std::chrono::steady_clock::now();
+		DirectoryListing* listing = new DirectoryListing;
+		for (const std::wstring& name : names)
+			listing->add(name.c_str(), name.size(), fileInfo);
+		listing->sort();
+		listing->compact();
+		double loadMs = secondsSince(start) * 1000.0;
+		size_t heapBytes = heapBytesInUse() - heapBefore;
+
+		double rate = fillRate(count, buffer, [listing](const std::function<bool(PCWSTR, PRJ_FILE_BASIC_INFO*)>& fill) {
+			for (size_t i = 0; i < listing->size(); i++) {
+				PRJ_FILE_BASIC_INFO info = listing->entryAt(i).fileInfo;
+				if (!fill(listing->nameOf(i), &info))
+					break;
+			}
+		});
+		fprintf(out, "  %-16s %12.2f %14.1f %14.2f\n", "flat + name pool", loadMs,
+			static_cast<double>(heapBytes) / count, rate / 1e6);
+		delete listing;
+	}
+}
+
+void Microbench::searchExpressions(FILE* out, size_t count)
+{
+	std::vector<std::wstring> names = syntheticNames(count);
+	static const WCHAR* const expressions[] = {
+		L"*",
+		L"*.CPP",
+		L"module*",
+		L"test_1f3.h",
+		L"*od*_*.h",
+		L"caf\u00c9*",
+		L"test_??*",
+		L"<.h",
+	};
+
+	fprintf(out, "Search expressions: %zu names, Mnames/s\n", count);
+	fprintf(out, "  %-14s %10s %16s %12s\n", "expression", "matches", "PrjFileNameMatch", "compiled");
+
+	for (const WCHAR* text : expressions) {
+		SearchExpression expression;
+		expression.compile(text);
+
+		size_t reference = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (const std::wstring& name : names)
+			reference += PrjFileNameMatch(name.c_str(), text) ? 1 : 0;
+		double referenceRate = count / secondsSince(start);
+
+		size_t compiled = 0;
+		size_t disagreements = 0;
+		start = std::chrono::steady_clock::now();
+		for (const std::wstring& name : names)
+			compiled += expression.matches(name.c_str(), name.size()) ? 1 : 0;
+		double compiledRate = count / secondsSince(start);
+
+		for (const std::wstring& name : names) {
+			if (expression.matches(name.c_str(), name.size()) != (PrjFileNameMatch(name.c_str(), text) != FALSE))
+				disagreements++;
+		}
+
+		// Print without depending on the C locale; non-ASCII shows as ~
+		char label[32] = {};
+		for (size_t i = 0; text[i] != L'\0' && i + 1 < sizeof(label); i++)
+			label[i] = static_cast<UINT32>(text[i]) < 0x80 ? static_cast<char>(text[i]) : '~';
+
+		fprintf(out, "  %-14s %10zu %16.2f %12.2f%s\n", label, compiled,
+			referenceRate / 1e6, compiledRate / 1e6,
+			disagreements != 0 || compiled != reference ? "  MISMATCH" : "");
+	}
+}
+
+void Microbench::collation(FILE* out)
+{
+	PRJ_FILE_BASIC_INFO fileInfo = {};
+
+	fprintf(out, "Directory sort: ms per sort\n");
+	fprintf(out, "  %9s %18s %18s %18s\n", "names", "tuple comparator", "entry comparator", "collation radix");
+
+	for (size_t count = 10000; count <= 1000000; count *= 10) {
+		std::vector<std::wstring> names = syntheticNames(count);
+
+		// What enumerate() started with: tuples compared by value
+		std::vector<LegacyListing::Tuple> tuples(count);
+		for (size_t i = 0; i < count; i++) {
+			tuples[i].name = names[i];
+			tuples[i].fInfo = fileInfo;
+		}
+		auto start = std::chrono::steady_clock::now();
+		std::sort(tuples.begin(), tuples.end(), [](LegacyListing::Tuple a, LegacyListing::Tuple b) {
+			return PrjFileNameCompare(a.name.c_str(), b.name.c_str()) < 0;
+		});
+		double tupleMs = secondsSince(start) * 1000.0;
+
+		// Flat entries with PrjFileNameCompare on every comparison
+		std::vector<PCWSTR> pointers(count);
+		for (size_t i = 0; i < count; i++)
+			pointers[i] = names[i].c_str();
+		start = std::chrono::steady_clock::now();
+		std::sort(pointers.begin(), pointers.end(), [](PCWSTR a, PCWSTR b) {
+			return PrjFileNameCompare(a, b) < 0;
+		});
+		double comparatorMs = secondsSince(start) * 1000.0;
+
+		DirectoryListing listing;
+		for (const std::wstring& name : names)
+			listing.add(name.c_str(), name.size(), fileInfo);
+		start = std::chrono::steady_clock::now();
+		listing.sort();
+		double radixMs = secondsSince(start) * 1000.0;
+
+		// Names equal under PrjFileNameCompare may come out in either order; anything else must agree
+		bool agree = true;
+		for (size_t i = 0; i < count && agree; i++)
+			agree = PrjFileNameCompare(listing.nameOf(i), tuples[i].name.c_str()) == 0;
+
+		fprintf(out, "  %9zu %18.2f %18.2f %18.2f%s\n", count, tupleMs, comparatorMs, radixMs,
+			agree ? "" : "  MISMATCH");
+	}
+}
+
+// One planned read of the source I/O benchmark
+class SourceRead {
+public:
+	size_t file;
+	UINT64 offset;
+	UINT32 length;
+};
+
+static const UINT32 SOURCE_READ_SIZE = 64 * 1024;
+static const size_t SOURCE_READ_FILES = 1024;
+
+// Adds the files under path, up to SOURCE_READ_FILES of them, with their sizes
+static void collectFiles(const std::wstring& path, std::vector<std::pair<std::wstring, INT64>>& files) {
+	std::vector<std::wstring> directories;
+	SourceFileSystem::listDirectory(path, [&](PCWSTR name, const PRJ_FILE_BASIC_INFO& fileInfo) {
+		if (fileInfo.IsDirectory)
+			directories.push_back(path + L"\\" + name);
+		else if (fileInfo.FileSize > 0 && files.size() < SOURCE_READ_FILES)
+			files.emplace_back(path + L"\\" + name, fileInfo.FileSize);
+	});
+	for (const std::wstring& directory : directories) {
+		if (files.size() >= SOURCE_READ_FILES)
+			break;
+		collectFiles(directory, files);
+	}
+}
+
+static void reportReads(FILE* out, const char* mode, double seconds, UINT64 bytes, std::vector<double>& latencies, size_t errors) {
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&latencies](double p) {
+		return latencies.empty() ? 0.0 : latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+	};
+	fprintf(out, "  %-12s %10.1f %10.1f %10.1f %10.1f%s\n", mode, bytes / 1048576.0 / seconds,
+		percentile(0.5), percentile(0.99), percentile(0.999), errors != 0 ? "  ERRORS" : "");
+}
+
+void Microbench::sourceReads(FILE* out, const std::wstring& root, size_t reads)
+{
+	std::vector<std::pair<std::wstring, INT64>> files;
+	collectFiles(root, files);
+
+	std::vector<SourceFileSystem::FileHandle> handles;
+	for (const auto& file : files) {
+		SourceFileSystem::FileHandle handle;
+		if (FAILED(SourceFileSystem::openForReading(file.first, handle, true))) {
+			fprintf(out, "Source reads: cannot open the files under the source root\n");
+			for (SourceFileSystem::FileHandle opened : handles)
+				SourceFileSystem::closeFile(opened);
+			return;
+		}
+		handles.push_back(handle);
+	}
+	if (handles.empty()) {
+		fprintf(out, "Source reads: no files under the source root\n");
+		return;
+	}
+
+	// The same plan for every mode, of reads aligned the way ProjFS asks for data
+	std::mt19937_64 random(42);
+	std::vector<SourceRead> plan(reads);
+	UINT64 planned = 0;
+	for (SourceRead& read : plan) {
+		read.file = random() % files.size();
+		UINT64 size = static_cast<UINT64>(files[read.file].second);
+		read.offset = (random() % size) & ~static_cast<UINT64>(4095);
+		read.length = static_cast<UINT32>(std::min<UINT64>(SOURCE_READ_SIZE, size - read.offset));
+		planned += read.length;
+	}
+
+	std::vector<char> buffers(static_cast<size_t>(SOURCE_READ_SIZE) * 64);
+	std::vector<double> latencies;
+	latencies.reserve(reads);
+	size_t errors = 0;
+
+	fprintf(out, "Source reads: %zu reads of up to 64 KB from %zu files, warm cache\n", reads, files.size());
+	fprintf(out, "  %-12s %10s %10s %10s %10s\n", "backend", "MB/s", "p50 us", "p99 us", "p99.9 us");
+
+	// One pass to warm the cache, then the measured one
+	for (int pass = 0; pass < 2; pass++) {
+		latencies.clear();
+		errors = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (const SourceRead& read : plan) {
+			auto issued = std::chrono::steady_clock::now();
+			if (FAILED(SourceFileSystem::readFile(handles[read.file], read.offset, read.length, buffers.data())))
+				errors++;
+			latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - issued).count());
+		}
+		if (pass == 1)
+			reportReads(out, "blocking", secondsSince(start), planned, latencies, errors);
+	}
+
+	for (UINT32 depth = 1; depth <= 64; depth *= 4) {
+		AsyncIO ring;
+		if (FAILED(ring.start(depth))) {
+			fprintf(out, "  %s is not available\n", AsyncIO::backendName());
+			break;
+		}
+
+		std::vector<AsyncIO::Request> requests(depth);
+		std::vector<AsyncIO::Request*> idle;
+		for (AsyncIO::Request& request : requests)
+			idle.push_back(&request);
+		std::vector<AsyncIO::Request*> completed(depth);
+		std::vector<std::chrono::steady_clock::time_point> issued(depth);
+		latencies.clear();
+		errors = 0;
+
+		auto start = std::chrono::steady_clock::now();
+		size_t next = 0;
+		while (next < plan.size() || ring.inFlight() > 0) {
+			while (!idle.empty() && next < plan.size()) {
+				AsyncIO::Request* request = idle.back();
+				idle.pop_back();
+				size_t slot = static_cast<size_t>(request - requests.data());
+				const SourceRead& read = plan[next++];
+				request->file = handles[read.file];
+				request->offset = read.offset;
+				request->length = read.length;
+				request->buffer = buffers.data() + slot * SOURCE_READ_SIZE;
+				request->owner = nullptr;
+				issued[slot] = std::chrono::steady_clock::now();
+				ring.read(request);
+			}
+			ring.submit();
+
+			size_t count = ring.reap(completed.data(), completed.size(), true);
+			auto now = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < count; i++) {
+				size_t slot = static_cast<size_t>(completed[i] - requests.data());
+				latencies.push_back(std::chrono::duration<double, std::micro>(now - issued[slot]).count());
+				if (FAILED(completed[i]->result))
+					errors++;
+				idle.push_back(completed[i]);
+			}
+		}
+
+		char mode[32];
+		snprintf(mode, sizeof(mode), "ring, %u", depth);
+		reportReads(out, mode, secondsSince(start), planned, latencies, errors);
+	}
+
+	for (SourceFileSystem::FileHandle handle : handles)
+		SourceFileSystem::closeFile(handle);
+}
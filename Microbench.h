@@ -0,0 +1,29 @@
+#pragma once
+
+#include "pch.h"
+#include <cstdio>
+#include <string>
+
+// Microbenchmarks for the provider's building blocks, run by ExpanderFS_Bench
+class Microbench
+{
+public:
+	// Compares the old mutex-guarded job list with the lock-free queue, job pool, work-stealing
+	// deques and the IOScheduler's foreground path, with and without flows, at 1 to 64 threads
+	static void jobQueues(FILE* out, UINT64 operations);
+
+	// Compares the old linked-list enumeration store with DirectoryListing: load time, heap bytes
+	// per entry and PrjFillDirEntryBuffer throughput
+	static void directoryListings(FILE* out, size_t count);
+
+	// Compares compiled SearchExpressions with PrjFileNameMatch, checking they agree on every name
+	static void searchExpressions(FILE* out, size_t count);
+
+	// Sorts 10k, 100k and 1M names with the original tuple comparator, with PrjFileNameCompare over
+	// flat entries, and with DirectoryListing's collation-key radix sort
+	static void collation(FILE* out);
+
+	// Reads 64 KB at random from the files under root, one at a time with blocking reads and
+	// through an AsyncIO ring at depths 1 to 64, reporting throughput and read latency
+	static void sourceReads(FILE* out, const std::wstring& root, size_t reads);
+};
@@ -0,0 +1,233 @@
+#include "pch.h"
+#include "ProcessQoS.h"
+
+#include <algorithm>
+#include <cwctype>
+#include <vector>
+
+ProcessQoS::Limiter::Limiter(UINT64 bytesPerSecond) :
+	rate(std::max<UINT64>(1, bytesPerSecond)),
+	tokens(static_cast<double>(std::max<UINT64>(1, bytesPerSecond))),
+	refilled(std::chrono::steady_clock::now())
+{
+}
+
+std::chrono::steady_clock::time_point ProcessQoS::Limiter::reserve(UINT64 bytes, std::chrono::steady_clock::time_point now)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (now > refilled) {
+		double seconds = std::chrono::duration<double>(now - refilled).count();
+		tokens = std::min(static_cast<double>(rate), tokens + seconds * rate);
+		refilled = now;
+	}
+
+	// Bytes already owed are read first, so a read waits for all of them to be paid off
+	double owed = tokens < 0 ? -tokens : 0;
+	tokens -= static_cast<double>(bytes);
+	if (owed == 0) {
+		return now;
+	}
+	return now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(owed / rate));
+}
+
+ProcessQoS::Account::Account() :
+	process_id(0),
+	weight(1),
+	reads(0),
+	bytes(0),
+	read_ns(0),
+	max_read_ns(0),
+	enumerations(0),
+	enumeration_ns(0),
+	throttled_ns(0),
+	first_seen(0),
+	last_seen(0)
+{
+}
+
+void ProcessQoS::Account::recordRead(UINT64 byteCount, UINT64 nanoseconds)
+{
+	reads.fetch_add(1, std::memory_order_relaxed);
+	bytes.fetch_add(byteCount, std::memory_order_relaxed);
+	read_ns.fetch_add(nanoseconds, std::memory_order_relaxed);
+	if (nanoseconds > max_read_ns.load(std::memory_order_relaxed)) {
+		max_read_ns.store(nanoseconds, std::memory_order_relaxed);
+	}
+	last_seen.store(ProcessQoS::now(), std::memory_order_relaxed);
+}
+
+void ProcessQoS::Account::recordEnumeration(UINT64 nanoseconds)
+{
+	enumerations.fetch_add(1, std::memory_order_relaxed);
+	enumeration_ns.fetch_add(nanoseconds, std::memory_order_relaxed);
+	last_seen.store(ProcessQoS::now(), std::memory_order_relaxed);
+}
+
+ProcessQoS::ProcessQoS() :
+	policies_set(false),
+	generation(0)
+{
+}
+
+INT64 ProcessQoS::now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::wstring ProcessQoS::imageNameOf(PCWSTR imagePath)
+{
+	if (imagePath == nullptr) {
+		return std::wstring();
+	}
+
+	PCWSTR name = imagePath;
+	for (PCWSTR c = imagePath; *c != L'\0'; c++) {
+		if (*c == L'\\' || *c == L'/') {
+			name = c + 1;
+		}
+	}
+
+	std::wstring upper(name);
+	for (WCHAR& c : upper) {
+		c = static_cast<WCHAR>(towupper(c));
+	}
+	return upper;
+}
+
+void ProcessQoS::setPolicy(const std::wstring& image, const Policy& policy)
+{
+	std::wstring name = imageNameOf(image.c_str());
+	std::shared_ptr<Limiter> limiter;
+	if (policy.rate_limit != 0) {
+		limiter = std::make_shared<Limiter>(policy.rate_limit);
+	}
+
+	std::lock_guard<std::mutex> lock(policyMutex);
+	policies[name] = policy;
+	policies_set.store(true, std::memory_order_relaxed);
+	if (limiter != nullptr) {
+		limiters[name] = limiter;
+	} else {
+		limiters.erase(name);
+	}
+
+	// Accounts are opened under policyMutex too, so none is missed between here and accountOf
+	UINT32 weight = std::max<UINT32>(1, policy.weight);
+	accounts.forEach([&name, weight, &limiter](const UINT32&, Account& account) {
+		if (account.image == name) {
+			account.weight.store(weight, std::memory_order_relaxed);
+			std::atomic_store(&account.limiter, limiter);
+		}
+	});
+	generation.fetch_add(1, std::memory_order_release);
+}
+
+std::shared_ptr<ProcessQoS::Account> ProcessQoS::accountOf(UINT32 processId, PCWSTR imagePath)
+{
+	class Remembered {
+	public:
+		const ProcessQoS* owner;
+		UINT64 generation;
+		std::shared_ptr<Account> account;
+	};
+	static thread_local Remembered remembered = { nullptr, 0, nullptr };
+
+	PCWSTR path = imagePath != nullptr ? imagePath : L"";
+	auto matches = [path](const Account& account) {
+		return path[0] == L'\0' || account.image_path == path;
+	};
+
+	UINT64 current = generation.load(std::memory_order_acquire);
+	if (remembered.owner == this && remembered.generation == current &&
+		remembered.account->process_id == processId && matches(*remembered.account)) {
+		return remembered.account;
+	}
+
+	std::shared_ptr<Account> account = accounts.find(processId);
+	if (account != nullptr && matches(*account)) {
+		remembered = { this, current, account };
+		return account;
+	}
+
+	account = std::make_shared<Account>();
+	account->process_id = processId;
+	account->image_path = path;
+	account->image = imageNameOf(path);
+	account->first_seen = now();
+	account->last_seen = account->first_seen.load();
+
+	// Processes come and go; once too many are held, those idle for longest are forgotten
+	if (accounts.size() >= MAX_ACCOUNTS) {
+		std::vector<INT64> seen;
+		accounts.forEach([&seen](const UINT32&, Account& held) {
+			seen.push_back(held.last_seen.load(std::memory_order_relaxed));
+		});
+		std::nth_element(seen.begin(), seen.begin() + seen.size() / 2, seen.end());
+		INT64 cutoff = seen[seen.size() / 2];
+		accounts.eraseIf([cutoff](const UINT32&, Account& held) {
+			return held.last_seen.load(std::memory_order_relaxed) <= cutoff;
+		});
+	}
+
+	// The policy is looked up and the account published under one lock, so setPolicy either
+	// finds the account or is seen by it
+	{
+		std::lock_guard<std::mutex> lock(policyMutex);
+		auto policy = policies.find(account->image);
+		if (policy != policies.end()) {
+			account->weight = std::max<UINT32>(1, policy->second.weight);
+		}
+		auto limiter = limiters.find(account->image);
+		if (limiter != limiters.end()) {
+			account->limiter = limiter->second;
+		}
+		accounts.assign(processId, account);
+	}
+	generation.fetch_add(1, std::memory_order_release);
+	return account;
+}
+
+void ProcessQoS::printStatistics(FILE* out)
+{
+	// forEach hands out references under a shard lock; the accounts are looked up again to keep them
+	std::vector<std::shared_ptr<Account>> held;
+	std::vector<UINT32> ids;
+	accounts.forEach([&ids](const UINT32& processId, Account&) {
+		ids.push_back(processId);
+	});
+	for (UINT32 id : ids) {
+		std::shared_ptr<Account> account = accounts.find(id);
+		if (account != nullptr) {
+			held.push_back(account);
+		}
+	}
+	if (held.empty()) {
+		return;
+	}
+
+	std::sort(held.begin(), held.end(), [](const std::shared_ptr<Account>& left, const std::shared_ptr<Account>& right) {
+		return left->bytes.load(std::memory_order_relaxed) > right->bytes.load(std::memory_order_relaxed);
+	});
+
+	fprintf(out, "  processes: %zu seen\n", held.size());
+	for (size_t i = 0; i < held.size() && i < REPORTED_ACCOUNTS; i++) {
+		const Account& account = *held[i];
+		UINT64 reads = account.reads.load(std::memory_order_relaxed);
+		UINT64 enumerations = account.enumerations.load(std::memory_order_relaxed);
+		double megabytes = account.bytes.load(std::memory_order_relaxed) / (1024.0 * 1024.0);
+		double seconds = (account.last_seen.load(std::memory_order_relaxed) - account.first_seen.load(std::memory_order_relaxed)) / 1e9;
+		fprintf(out, "    %u %ls: weight %u, %llu reads, %.1f MB (%.1f MB/s), read avg %.3f ms max %.3f ms, %llu enumerations avg %.3f ms, throttled %.1f ms\n",
+			account.process_id,
+			account.image_path.c_str(),
+			account.weight.load(std::memory_order_relaxed),
+			static_cast<unsigned long long>(reads),
+			megabytes,
+			seconds > 0 ? megabytes / seconds : 0.0,
+			reads ? account.read_ns.load(std::memory_order_relaxed) / 1e6 / reads : 0.0,
+			account.max_read_ns.load(std::memory_order_relaxed) / 1e6,
+			static_cast<unsigned long long>(enumerations),
+			enumerations ? account.enumeration_ns.load(std::memory_order_relaxed) / 1e6 / enumerations : 0.0,
+			account.throttled_ns.load(std::memory_order_relaxed) / 1e6);
+	}
+}
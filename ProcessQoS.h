@@ -0,0 +1,121 @@
+#pragma once
+
+#include "pch.h"
+#include "ShardedTable.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+	Accounts for the source work done for each process ProjFS names as triggering a callback, and
+	holds the policies set by image name: a weight, which is the process's share of the source
+	while others want it too, and a limit on the file data per second it may read. The processes
+	of one image share their limit, so a scanner running as several processes is still held to it.
+
+	Image names are matched without case against the last component of the image path, such as
+	"MsMpEng.exe"; processes of images without a policy have weight 1 and no limit. Until any
+	policy is set the processes are only accounted for, not scheduled apart.
+
+	Each thread remembers the last account it looked up, so the callbacks of a busy process find
+	theirs without a lock; the remembered account is looked up again once any process's account
+	has been opened or dropped, or a policy set, since.
+*/
+class ProcessQoS
+{
+public:
+	class Policy {
+	public:
+		UINT32 weight;
+		// Bytes of file data per second, for every process of the image together; 0 is unlimited
+		UINT64 rate_limit;
+
+		Policy() : weight(1), rate_limit(0) {}
+	};
+
+	// Token bucket holding up to a second's worth of bytes; reads beyond it go into debt
+	class Limiter {
+	private:
+		std::mutex mutex;
+		UINT64 rate;
+		double tokens;
+		std::chrono::steady_clock::time_point refilled;
+
+	public:
+		explicit Limiter(UINT64 bytesPerSecond);
+
+		// Charges bytes and returns when they may be read: now, unless the bucket is in debt
+		std::chrono::steady_clock::time_point reserve(UINT64 bytes, std::chrono::steady_clock::time_point now);
+	};
+
+	class Account {
+	public:
+		UINT32 process_id;
+		// As ProjFS reported it, and its last component
+		std::wstring image_path;
+		std::wstring image;
+		// Set again by setPolicy while the account is in use, so the limiter is only read and
+		// replaced through std::atomic_load and std::atomic_store
+		std::atomic<UINT32> weight;
+		std::shared_ptr<Limiter> limiter;
+
+		std::atomic<UINT64> reads;
+		std::atomic<UINT64> bytes;
+		std::atomic<UINT64> read_ns;
+		std::atomic<UINT64> max_read_ns;
+		std::atomic<UINT64> enumerations;
+		std::atomic<UINT64> enumeration_ns;
+		std::atomic<UINT64> throttled_ns;
+		// Nanoseconds on the steady clock of the first and latest callback
+		std::atomic<INT64> first_seen;
+		std::atomic<INT64> last_seen;
+
+		Account();
+
+		// A read of bytes finished nanoseconds after ProjFS asked for it
+		void recordRead(UINT64 byteCount, UINT64 nanoseconds);
+		void recordEnumeration(UINT64 nanoseconds);
+	};
+
+protected:
+	// Accounts beyond this are dropped, the longest idle first
+	static const size_t MAX_ACCOUNTS = 4096;
+	// Processes listed in the statistics, the most bytes first
+	static const size_t REPORTED_ACCOUNTS = 10;
+
+	std::mutex policyMutex;
+	std::unordered_map<std::wstring, Policy> policies;
+	std::unordered_map<std::wstring, std::shared_ptr<Limiter>> limiters;
+
+	ShardedTable<UINT32, Account> accounts;
+	std::atomic<bool> policies_set;
+	// Bumped whenever an account is opened or dropped or a policy set, which invalidates what
+	// threads remember
+	std::atomic<UINT64> generation;
+
+	// The uppercased last component of an image path
+	static std::wstring imageNameOf(PCWSTR imagePath);
+
+	static INT64 now();
+
+public:
+	ProcessQoS();
+
+	ProcessQoS(const ProcessQoS&) = delete;
+	ProcessQoS& operator=(const ProcessQoS&) = delete;
+
+	// Applies to the processes of the image already seen as well as to those seen later
+	void setPolicy(const std::wstring& image, const Policy& policy);
+
+	// The account of a process, opened on its first callback; a reused process ID starts afresh
+	// when it reports another image, while a callback without an image path keeps the account
+	std::shared_ptr<Account> accountOf(UINT32 processId, PCWSTR imagePath);
+
+	// Whether any policy was set, and processes are to share the source by them
+	bool sharing() const { return policies_set.load(std::memory_order_relaxed); }
+
+	void printStatistics(FILE* out);
+};
@@ -0,0 +1,177 @@
+#include "pch.h"
+#include "ReadAhead.h"
+
+#include <algorithm>
+#include <vector>
+
+// Default largest window, and the most prefetch buffer memory all streams may hold together
+static const UINT32 READ_AHEAD_DEFAULT_WINDOW = 8 * 1024 * 1024;
+static const size_t READ_AHEAD_BUFFERS_PER_WINDOW = 8;
+
+ReadAhead::Stream::Stream(ReadAhead* owner) :
+	next_offset(0),
+	window(0),
+	file_size(-1),
+	write_alignment(0),
+	last_used(0),
+	buffer(NULL),
+	buffer_capacity(0),
+	prefetch_state(PREFETCH_NONE),
+	prefetch_offset(0),
+	prefetch_length(0),
+	prefetch_result(S_OK),
+	owner(owner)
+{
+}
+
+ReadAhead::Stream::~Stream()
+{
+	if (prefetch_state == PREFETCH_READY) {
+		owner->prefetched_wasted.fetch_add(1, std::memory_order_relaxed);
+	}
+	if (buffer != NULL) {
+		PrjFreeAlignedBuffer(buffer);
+		owner->buffer_bytes.fetch_sub(buffer_capacity, std::memory_order_relaxed);
+	}
+}
+
+ReadAhead::ReadAhead() :
+	clock(0),
+	max_window(READ_AHEAD_DEFAULT_WINDOW),
+	buffer_budget(static_cast<size_t>(READ_AHEAD_DEFAULT_WINDOW) * READ_AHEAD_BUFFERS_PER_WINDOW),
+	buffer_bytes(0),
+	sequential(0),
+	random(0),
+	written_ahead(0),
+	prefetched_used(0),
+	prefetched_waited(0),
+	prefetched_wasted(0)
+{
+}
+
+void ReadAhead::setMaximumWindow(UINT32 bytes)
+{
+	max_window = bytes;
+	buffer_budget = static_cast<size_t>(bytes) * READ_AHEAD_BUFFERS_PER_WINDOW;
+}
+
+std::shared_ptr<ReadAhead::Stream> ReadAhead::track(const GUID& dataStreamId)
+{
+	if (max_window == 0) {
+		return nullptr;
+	}
+
+	std::shared_ptr<Stream> stream = streams.find(dataStreamId);
+	if (stream == nullptr) {
+		stream = std::make_shared<Stream>(this);
+		if (!streams.insert(dataStreamId, stream)) {
+			// Another request for the stream got there first
+			stream = streams.find(dataStreamId);
+			if (stream == nullptr) {
+				return nullptr;
+			}
+		} else if (streams.size() > MAX_STREAMS) {
+			trim();
+		}
+	}
+
+	stream->last_used.store(clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+	return stream;
+}
+
+void ReadAhead::forget(const GUID& dataStreamId)
+{
+	streams.erase(dataStreamId);
+}
+
+// Drops the least recently used half of the streams
+void ReadAhead::trim()
+{
+	std::vector<UINT64> ages;
+	streams.forEach([&ages](const GUID&, const Stream& stream) {
+		ages.push_back(stream.last_used.load(std::memory_order_relaxed));
+	});
+	if (ages.size() <= MAX_STREAMS / 2) {
+		return;
+	}
+
+	size_t victims = ages.size() - MAX_STREAMS / 2;
+	std::nth_element(ages.begin(), ages.begin() + (victims - 1), ages.end());
+	UINT64 cutoff = ages[victims - 1];
+
+	streams.eraseIf([cutoff](const GUID&, const Stream& stream) {
+		return stream.last_used.load(std::memory_order_relaxed) <= cutoff;
+	});
+}
+
+UINT32 ReadAhead::observe(Stream& stream, UINT64 offset, UINT32 length)
+{
+	if (offset == stream.next_offset) {
+		UINT32 grown = stream.window == 0 ?
+			std::max(INITIAL_WINDOW, length) :
+			(stream.window > max_window / 2 ? max_window : stream.window * 2);
+		stream.window = std::min(grown, max_window);
+		sequential.fetch_add(1, std::memory_order_relaxed);
+	} else {
+		stream.window = 0;
+		random.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// A prefetch the request will not start from is of no further use
+	if (stream.prefetch_offset != offset) {
+		if (stream.prefetch_state == PREFETCH_READY) {
+			prefetched_wasted.fetch_add(1, std::memory_order_relaxed);
+			stream.prefetch_state = PREFETCH_NONE;
+		} else if (stream.prefetch_state == PREFETCH_QUEUED) {
+			stream.prefetch_state = PREFETCH_NONE;
+		}
+	}
+
+	return stream.window;
+}
+
+bool ReadAhead::reserve(Stream& stream, PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT context, UINT32 length)
+{
+	if (stream.buffer_capacity >= length) {
+		return true;
+	}
+
+	size_t growth = length - stream.buffer_capacity;
+	if (buffer_bytes.fetch_add(growth, std::memory_order_relaxed) + growth > buffer_budget) {
+		buffer_bytes.fetch_sub(growth, std::memory_order_relaxed);
+		return false;
+	}
+
+	void* buffer = PrjAllocateAlignedBuffer(context, length);
+	if (buffer == NULL) {
+		buffer_bytes.fetch_sub(growth, std::memory_order_relaxed);
+		return false;
+	}
+
+	if (stream.buffer != NULL) {
+		PrjFreeAlignedBuffer(stream.buffer);
+	}
+	stream.buffer = buffer;
+	stream.buffer_capacity = length;
+	return true;
+}
+
+void ReadAhead::countPrefetchUsed(bool waited)
+{
+	prefetched_used.fetch_add(1, std::memory_order_relaxed);
+	if (waited) {
+		prefetched_waited.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void ReadAhead::printStatistics(FILE* out)
+{
+	fprintf(out, "  read-ahead: %zu streams, sequential %llu, random %llu, written ahead %.1f MB, prefetches used %llu (waited %llu), wasted %llu\n",
+		streams.size(),
+		static_cast<unsigned long long>(sequential.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(random.load(std::memory_order_relaxed)),
+		written_ahead.load(std::memory_order_relaxed) / (1024.0 * 1024.0),
+		static_cast<unsigned long long>(prefetched_used.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(prefetched_waited.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(prefetched_wasted.load(std::memory_order_relaxed)));
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "pch.h"
+#include "ShardedTable.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+
+/*
+	Tracks how each file stream is being hydrated, keyed by DataStreamId, so the provider can run
+	ahead of a sequential reader. A GetFileData request which starts where the stream was last
+	served to is sequential and doubles the stream's window, up to the maximum; a request anywhere
+	else drops the window to nothing, so random access costs no extra I/O.
+
+	The provider writes a stream's window beyond each request, and has a source worker read the
+	window after that into the stream's prefetch buffer, ready for the next request. ProjFS does not
+	ask again for ranges that were written, so a sequential reader makes one callback per window
+	and rarely waits for the source.
+*/
+class ReadAhead
+{
+public:
+	enum PrefetchState {
+		PREFETCH_NONE,
+		PREFETCH_QUEUED,
+		PREFETCH_RUNNING,
+		PREFETCH_READY
+	};
+
+	class Stream {
+	public:
+		// Guards everything below; the prefetch read itself runs without it
+		std::mutex mutex;
+		std::condition_variable prefetched;
+
+		// Where the stream was last served to and the read-ahead it has earned
+		UINT64 next_offset;
+		UINT32 window;
+		// -1 until read-ahead first needs it
+		INT64 file_size;
+		UINT32 write_alignment;
+		std::atomic<UINT64> last_used;
+
+		// The window read ahead of next_offset, allocated with PrjAllocateAlignedBuffer
+		void* buffer;
+		UINT32 buffer_capacity;
+		PrefetchState prefetch_state;
+		UINT64 prefetch_offset;
+		UINT32 prefetch_length;
+		HRESULT prefetch_result;
+
+		explicit Stream(ReadAhead* owner);
+		~Stream();
+
+		Stream(const Stream&) = delete;
+		Stream& operator=(const Stream&) = delete;
+
+	protected:
+		ReadAhead* owner;
+	};
+
+protected:
+	// Windows start at this size, or the request's if larger
+	static constexpr UINT32 INITIAL_WINDOW = 128 * 1024;
+
+	// Streams tracked at once; the least recently used are dropped beyond this, since ProjFS
+	// does not say when a stream is closed
+	static const size_t MAX_STREAMS = 1024;
+
+	ShardedTable<GUID, Stream, GUIDHash, GUIDEqual> streams;
+	std::atomic<UINT64> clock;
+	UINT32 max_window;
+	size_t buffer_budget;
+	std::atomic<size_t> buffer_bytes;
+
+	std::atomic<UINT64> sequential;
+	std::atomic<UINT64> random;
+	std::atomic<UINT64> written_ahead;
+	std::atomic<UINT64> prefetched_used;
+	std::atomic<UINT64> prefetched_waited;
+	std::atomic<UINT64> prefetched_wasted;
+
+	void trim();
+
+public:
+	ReadAhead();
+
+	ReadAhead(const ReadAhead&) = delete;
+	ReadAhead& operator=(const ReadAhead&) = delete;
+
+	// Largest window a sequential stream grows to; 0 turns read-ahead off
+	void setMaximumWindow(UINT32 bytes);
+	UINT32 maximumWindow() const { return max_window; }
+
+	// Returns the stream's state, creating it on first use; nullptr when read-ahead is off
+	std::shared_ptr<Stream> track(const GUID& dataStreamId);
+
+	// Stops tracking a stream, once it has been served to its end
+	void forget(const GUID& dataStreamId);
+
+	/*
+		Records a request against the stream, whose lock must be held, and returns the window to
+		serve beyond it. A prefetch of any other range is dropped, unless a worker is already
+		reading it.
+	*/
+	UINT32 observe(Stream& stream, UINT64 offset, UINT32 length);
+
+	// Makes the stream's prefetch buffer hold length bytes; false if that would exceed the budget
+	bool reserve(Stream& stream, PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT context, UINT32 length);
+
+	void countWrittenAhead(UINT64 bytes) { written_ahead.fetch_add(bytes, std::memory_order_relaxed); }
+	void countPrefetchUsed(bool waited);
+
+	void printStatistics(FILE* out);
+};
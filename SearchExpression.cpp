@@ -0,0 +1,226 @@
+#include "pch.h"
+#include "SearchExpression.h"
+
+#include <cwchar>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SEARCH_EXPRESSION_SSE2 1
+#endif
+
+// Characters PrjDoesNameContainWildCards treats as wildcards, other than *
+static bool isOtherWildCard(WCHAR c) {
+	return c == L'?' || c == L'<' || c == L'>' || c == L'"';
+}
+
+static inline WCHAR upperAscii(WCHAR c) {
+	return (c >= L'a' && c <= L'z') ? static_cast<WCHAR>(c - (L'a' - L'A')) : c;
+}
+
+void SearchExpression::compile(PCWSTR searchExpression)
+{
+	expression = searchExpression != NULL ? searchExpression : L"*";
+	segments.clear();
+	literal_length = 0;
+
+	if (expression.empty() || expression == L"*") {
+		kind = KIND_ALL;
+		return;
+	}
+
+	// Anything beyond * and ASCII literals keeps ProjFS's own matcher
+	bool hasStar = false;
+	for (WCHAR c : expression) {
+		if (static_cast<UINT32>(c) >= 0x80 || isOtherWildCard(c)) {
+			kind = KIND_GENERAL;
+			return;
+		}
+		hasStar = hasStar || c == L'*';
+	}
+
+	// Split on stars; runs of stars act as one
+	std::wstring segment;
+	for (WCHAR c : expression) {
+		if (c == L'*') {
+			if (segments.empty() || !segment.empty())
+				segments.push_back(segment);
+			segment.clear();
+		} else {
+			segment += upperAscii(c);
+			literal_length++;
+		}
+	}
+	segments.push_back(segment);
+
+	if (!hasStar) {
+		kind = KIND_LITERAL;
+	} else if (segments.size() == 2 && segments[1].empty()) {
+		kind = segments[0].empty() ? KIND_ALL : KIND_PREFIX;
+		segments.pop_back();
+	} else if (segments.size() == 2 && segments[0].empty()) {
+		kind = KIND_SUFFIX;
+		segments.erase(segments.begin());
+	} else {
+		kind = KIND_SEGMENTS;
+	}
+}
+
+/*
+	Compares length characters of name, folded to upper case, with an upper-cased ASCII literal.
+	A non-ASCII character in name makes the answer UNKNOWN, since the file system's upcase table
+	may fold it onto an ASCII letter.
+*/
+SearchExpression::Compare SearchExpression::equalFolded(PCWSTR name, const WCHAR* upper, size_t length)
+{
+	size_t i = 0;
+
+#ifdef SEARCH_EXPRESSION_SSE2
+	if (sizeof(WCHAR) == 2) {
+		const __m128i nonAscii = _mm_set1_epi16(static_cast<short>(0xFF80));
+		const __m128i beforeA = _mm_set1_epi16(L'a' - 1);
+		const __m128i afterZ = _mm_set1_epi16(L'z' + 1);
+		const __m128i caseBit = _mm_set1_epi16(0x20);
+		const __m128i zero = _mm_setzero_si128();
+
+		for (; i + 8 <= length; i += 8) {
+			__m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(name + i));
+			__m128i literal = _mm_loadu_si128(reinterpret_cast<const __m128i*>(upper + i));
+
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(chars, nonAscii), zero)) != 0xFFFF)
+				return COMPARE_UNKNOWN;
+
+			__m128i lower = _mm_and_si128(_mm_cmpgt_epi16(chars, beforeA), _mm_cmplt_epi16(chars, afterZ));
+			__m128i folded = _mm_sub_epi16(chars, _mm_and_si128(lower, caseBit));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(folded, literal)) != 0xFFFF)
+				return COMPARE_DIFFERENT;
+		}
+	} else if (sizeof(WCHAR) == 4) {
+		const __m128i nonAscii = _mm_set1_epi32(static_cast<int>(0xFFFFFF80));
+		const __m128i beforeA = _mm_set1_epi32(L'a' - 1);
+		const __m128i afterZ = _mm_set1_epi32(L'z' + 1);
+		const __m128i caseBit = _mm_set1_epi32(0x20);
+		const __m128i zero = _mm_setzero_si128();
+
+		for (; i + 4 <= length; i += 4) {
+			__m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(name + i));
+			__m128i literal = _mm_loadu_si128(reinterpret_cast<const __m128i*>(upper + i));
+
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(chars, nonAscii), zero)) != 0xFFFF)
+				return COMPARE_UNKNOWN;
+
+			__m128i lower = _mm_and_si128(_mm_cmpgt_epi32(chars, beforeA), _mm_cmplt_epi32(chars, afterZ));
+			__m128i folded = _mm_sub_epi32(chars, _mm_and_si128(lower, caseBit));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(folded, literal)) != 0xFFFF)
+				return COMPARE_DIFFERENT;
+		}
+	}
+#endif
+
+	// An ASCII character that differs settles it whatever the other characters fold to
+	for (; i < length; i++) {
+		if (static_cast<UINT32>(name[i]) >= 0x80)
+			return COMPARE_UNKNOWN;
+		if (upperAscii(name[i]) != upper[i])
+			return COMPARE_DIFFERENT;
+	}
+	return COMPARE_EQUAL;
+}
+
+/*
+	Matches first*middle*...*last: the first and last segments are anchored, and each middle
+	segment is taken at its leftmost position after the previous one, which is enough when * is
+	the only wildcard.
+*/
+bool SearchExpression::matchSegments(PCWSTR name, size_t length, bool& unknown) const
+{
+	const std::wstring& first = segments.front();
+	const std::wstring& last = segments.back();
+	if (length < literal_length)
+		return false;
+
+	Compare compare = equalFolded(name, first.data(), first.size());
+	if (compare == COMPARE_EQUAL)
+		compare = equalFolded(name + length - last.size(), last.data(), last.size());
+	if (compare != COMPARE_EQUAL) {
+		unknown = compare == COMPARE_UNKNOWN;
+		return false;
+	}
+
+	size_t position = first.size();
+	size_t end = length - last.size();
+	for (size_t s = 1; s + 1 < segments.size(); s++) {
+		const std::wstring& middle = segments[s];
+		bool found = false;
+
+		for (; position + middle.size() <= end; position++) {
+			WCHAR c = name[position];
+			if (static_cast<UINT32>(c) >= 0x80) {
+				unknown = true;
+				return false;
+			}
+			if (upperAscii(c) != middle[0])
+				continue;
+
+			compare = equalFolded(name + position, middle.data(), middle.size());
+			if (compare == COMPARE_UNKNOWN) {
+				unknown = true;
+				return false;
+			}
+			if (compare == COMPARE_EQUAL) {
+				found = true;
+				break;
+			}
+		}
+
+		if (!found)
+			return false;
+		position += middle.size();
+	}
+
+	return true;
+}
+
+bool SearchExpression::matches(PCWSTR name, size_t length) const
+{
+	Compare compare;
+	bool unknown = false;
+
+	switch (kind) {
+	case KIND_ALL:
+		return true;
+
+	case KIND_LITERAL:
+		if (length != literal_length)
+			return false;
+		compare = equalFolded(name, segments[0].data(), length);
+		break;
+
+	case KIND_PREFIX:
+		if (length < literal_length)
+			return false;
+		compare = equalFolded(name, segments[0].data(), literal_length);
+		break;
+
+	case KIND_SUFFIX:
+		if (length < literal_length)
+			return false;
+		compare = equalFolded(name + length - literal_length, segments[0].data(), literal_length);
+		break;
+
+	case KIND_SEGMENTS: {
+		bool matched = matchSegments(name, length, unknown);
+		if (!unknown)
+			return matched;
+		compare = COMPARE_UNKNOWN;
+		break;
+	}
+
+	default:
+		compare = COMPARE_UNKNOWN;
+		break;
+	}
+
+	if (compare == COMPARE_UNKNOWN)
+		return PrjFileNameMatch(name, expression.c_str()) != FALSE;
+	return compare == COMPARE_EQUAL;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "pch.h"
+#include <string>
+#include <vector>
+
+/*
+	A directory enumeration's search expression, compiled once when it is captured. Common shapes
+	get a dedicated test:
+
+		*               every name
+		name            case-insensitive equality
+		prefix*         case-insensitive prefix
+		*suffix         case-insensitive suffix, which covers *.ext
+		a*b*c           anchored first and last segments with the rest found in order
+
+	Literal segments are stored upper-cased and compared eight or four characters at a time with
+	SSE2 where available. Anything else (?, the DOS wildcards < > ", and non-ASCII characters in
+	either the expression or a compared name) is handed to PrjFileNameMatch, so the result is always
+	the one ProjFS itself would give.
+*/
+class SearchExpression
+{
+protected:
+	enum Kind {
+		KIND_ALL,
+		KIND_LITERAL,
+		KIND_PREFIX,
+		KIND_SUFFIX,
+		KIND_SEGMENTS,
+		KIND_GENERAL
+	};
+
+	// Outcome of comparing ASCII-folded characters; UNKNOWN means a non-ASCII character was seen
+	enum Compare {
+		COMPARE_EQUAL,
+		COMPARE_DIFFERENT,
+		COMPARE_UNKNOWN
+	};
+
+	std::wstring expression;
+	Kind kind;
+
+	// Upper-cased literal text; for KIND_SEGMENTS, the pieces between the stars
+	std::vector<std::wstring> segments;
+	size_t literal_length;
+
+	static Compare equalFolded(PCWSTR name, const WCHAR* upper, size_t length);
+	bool matchSegments(PCWSTR name, size_t length, bool& unknown) const;
+
+public:
+	SearchExpression() : kind(KIND_ALL), literal_length(0) {}
+
+	// Compiles an expression; NULL means every name
+	void compile(PCWSTR searchExpression);
+
+	// Whether a name of length characters matches, as PrjFileNameMatch would decide
+	bool matches(PCWSTR name, size_t length) const;
+
+	const std::wstring& text() const { return expression; }
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "pch.h"
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+	Hash table split into independently locked shards so ProjFS callbacks on different threads
+	rarely contend. Values are handed out as shared_ptrs: a thread that found an entry may keep
+	using it after another thread erases it.
+*/
+template<typename Key, typename Value, typename Hash = std::hash<Key>, typename Equal = std::equal_to<Key>>
+class ShardedTable {
+private:
+	// Each shard sits on its own cache line so neighbouring locks do not false-share
+	class alignas(64) Shard {
+	public:
+		std::mutex mutex;
+		std::unordered_map<Key, std::shared_ptr<Value>, Hash, Equal> entries;
+	};
+
+	static const size_t SHARD_COUNT = 64;
+
+	std::unique_ptr<Shard[]> shards;
+	Hash hasher;
+
+	Shard& shardOf(const Key& key) {
+		// Mix the hash so keys differing only in their high bits still spread across shards
+		size_t hash = hasher(key);
+		hash ^= hash >> 29;
+		hash *= 0xbf58476d1ce4e5b9ull;
+		hash ^= hash >> 32;
+		return shards[hash & (SHARD_COUNT - 1)];
+	}
+
+public:
+	ShardedTable() : shards(new Shard[SHARD_COUNT]) {}
+
+	ShardedTable(const ShardedTable&) = delete;
+	ShardedTable& operator=(const ShardedTable&) = delete;
+
+	// Returns false, leaving the table unchanged, if the key is already present
+	bool insert(const Key& key, std::shared_ptr<Value> value) {
+		Shard& shard = shardOf(key);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		return shard.entries.emplace(key, std::move(value)).second;
+	}
+
+	// Inserts or replaces the value for a key; returns the value replaced, if any
+	std::shared_ptr<Value> assign(const Key& key, std::shared_ptr<Value> value) {
+		Shard& shard = shardOf(key);
+		std::shared_ptr<Value> previous;
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			std::shared_ptr<Value>& slot = shard.entries[key];
+			previous = std::move(slot);
+			slot = std::move(value);
+		}
+		return previous;
+	}
+
+	// Returns nullptr if the key is not present
+	std::shared_ptr<Value> find(const Key& key) {
+		Shard& shard = shardOf(key);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto found = shard.entries.find(key);
+		if (found == shard.entries.end())
+			return nullptr;
+		return found->second;
+	}
+
+	// Returns the erased value, or nullptr if the key was not present
+	std::shared_ptr<Value> erase(const Key& key) {
+		Shard& shard = shardOf(key);
+		std::shared_ptr<Value> value;
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto found = shard.entries.find(key);
+			if (found == shard.entries.end())
+				return nullptr;
+			value = std::move(found->second);
+			shard.entries.erase(found);
+		}
+		// The value may be destroyed here, outside the shard lock
+		return value;
+	}
+
+	// Visits every entry, holding one shard lock at a time
+	template<typename Visitor>
+	void forEach(Visitor visitor) {
+		for (size_t i = 0; i < SHARD_COUNT; i++) {
+			std::lock_guard<std::mutex> lock(shards[i].mutex);
+			for (auto& entry : shards[i].entries)
+				visitor(entry.first, *entry.second);
+		}
+	}
+
+	// Erases every entry the predicate returns true for, one shard at a time; returns how many
+	template<typename Predicate>
+	size_t eraseIf(Predicate predicate) {
+		size_t erased = 0;
+		for (size_t i = 0; i < SHARD_COUNT; i++) {
+			std::vector<std::shared_ptr<Value>> doomed;
+			{
+				std::lock_guard<std::mutex> lock(shards[i].mutex);
+				auto& entries = shards[i].entries;
+				for (auto it = entries.begin(); it != entries.end();) {
+					if (predicate(it->first, *it->second)) {
+						doomed.push_back(std::move(it->second));
+						it = entries.erase(it);
+					} else {
+						++it;
+					}
+				}
+			}
+			erased += doomed.size();
+		}
+		return erased;
+	}
+
+	size_t size() {
+		size_t total = 0;
+		for (size_t i = 0; i < SHARD_COUNT; i++) {
+			std::lock_guard<std::mutex> lock(shards[i].mutex);
+			total += shards[i].entries.size();
+		}
+		return total;
+	}
+};
+
+// Hash and equality for using GUIDs as ShardedTable keys
+class GUIDHash {
+public:
+	size_t operator() (const GUID& guid) const {
+		UINT64 halves[2];
+		memcpy(halves, &guid, sizeof(halves));
+		return static_cast<size_t>(halves[0] ^ (halves[1] * 0x9e3779b97f4a7c15ull));
+	}
+};
+
+class GUIDEqual {
+public:
+	bool operator() (const GUID& left, const GUID& right) const {
+		return memcmp(&left, &right, sizeof(GUID)) == 0;
+	}
+};
@@ -0,0 +1,453 @@
+#include "pch.h"
+
+#ifndef _WIN32
+
+#include "SimHost.h"
+#include "SourceFileSystem.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+// The simulated process the calling thread issues callbacks for
+static thread_local unsigned currentProcess = 0;
+
+static inline UINT64 nowNs()
+{
+	return static_cast<UINT64>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+SimLatencyHistogram::SimLatencyHistogram() :
+	count(0),
+	total_ns(0),
+	max_ns(0)
+{
+	for (int i = 0; i < BUCKETS; i++)
+		buckets[i] = 0;
+}
+
+void SimLatencyHistogram::record(UINT64 ns)
+{
+	int bucket = 0;
+	while (bucket < BUCKETS - 1 && (ns >> (bucket + 1)) != 0)
+		bucket++;
+
+	buckets[bucket]++;
+	count++;
+	total_ns += ns;
+
+	UINT64 seen = max_ns.load();
+	while (ns > seen && !max_ns.compare_exchange_weak(seen, ns)) {
+	}
+}
+
+// Returns the upper bound of the bucket holding the p-th sample, which overestimates by < 2x
+UINT64 SimLatencyHistogram::percentile(double p) const
+{
+	UINT64 total = count.load();
+	if (total == 0)
+		return 0;
+
+	UINT64 target = static_cast<UINT64>(p * static_cast<double>(total));
+	UINT64 seen = 0;
+	for (int i = 0; i < BUCKETS; i++) {
+		seen += buckets[i].load();
+		if (seen > target)
+			return std::min(static_cast<UINT64>(2) << i, max_ns.load());
+	}
+	return max_ns.load();
+}
+
+void SimLatencyHistogram::report(FILE* out, const char* name, double seconds) const
+{
+	UINT64 samples = count.load();
+	if (samples == 0)
+		return;
+
+	fprintf(out, "  %-22s %10llu calls %12.0f/s  avg %9.1fus  p50 %9.1fus  p99 %9.1fus  max %9.1fus\n",
+		name,
+		static_cast<unsigned long long>(samples),
+		seconds > 0 ? samples / seconds : 0.0,
+		total_ns.load() / 1000.0 / samples,
+		percentile(0.50) / 1000.0,
+		percentile(0.99) / 1000.0,
+		max_ns.load() / 1000.0);
+}
+
+SimHost::SimHost(SimVirtualizationInstance* instance, const Options& options) :
+	instance(instance),
+	options(options),
+	directoriesBusy(0),
+	nextCommandId(1),
+	nextGuid(1),
+	directoriesListed(0),
+	entriesListed(0),
+	filesHydrated(0),
+	filesCancelled(0),
+	bytesHydrated(0),
+	probesMade(0),
+	notificationsSent(0),
+	errors(0),
+	elapsed(0)
+{
+	for (unsigned i = 0; i < options.processes; i++)
+		processImages.push_back(L"C:\\Sim\\SimProcess" + std::to_wstring(i) + L".exe");
+}
+
+void SimHost::makeGuid(GUID& guid)
+{
+	guid = GUID();
+	guid.Data1 = nextGuid.fetch_add(1);
+	guid.Data2 = 0x4853;
+}
+
+void SimHost::initCallbackData(PRJ_CALLBACK_DATA& data, PCWSTR path)
+{
+	data = PRJ_CALLBACK_DATA();
+	data.Size = sizeof(data);
+	data.NamespaceVirtualizationContext = instance;
+	data.CommandId = nextCommandId.fetch_add(1);
+	data.FilePathName = path;
+	if (options.processes > 1) {
+		data.TriggeringProcessId = 1000 + currentProcess;
+		data.TriggeringProcessImageFileName = processImages[currentProcess].c_str();
+	} else {
+		data.TriggeringProcessId = 4;
+		data.TriggeringProcessImageFileName = L"SimHost";
+	}
+	data.InstanceContext = instance->instance_context;
+}
+
+// Runs the Start/Get/End enumeration sequence for one directory, like FindFirstFile/FindNextFile
+bool SimHost::listDirectory(const std::wstring& path, std::vector<SimDirEntryBuffer::Entry>& out)
+{
+	GUID enumerationId;
+	makeGuid(enumerationId);
+
+	PRJ_CALLBACK_DATA data;
+	initCallbackData(data, path.c_str());
+
+	UINT64 start = nowNs();
+	HRESULT hr = instance->invoke(data.CommandId, [&] {
+		return instance->callbacks.StartDirectoryEnumerationCallback(&data, &enumerationId);
+	});
+	startEnumLatency.record(nowNs() - start);
+
+	if (FAILED(hr)) {
+		errors++;
+		return false;
+	}
+
+	bool ok = true;
+	for (;;) {
+		SimDirEntryBuffer buffer;
+		buffer.capacity = options.dir_buffer_bytes;
+
+		initCallbackData(data, path.c_str());
+		start = nowNs();
+		hr = instance->invoke(data.CommandId, [&] {
+			return instance->callbacks.GetDirectoryEnumerationCallback(&data, &enumerationId, nullptr, &buffer);
+		});
+		getEnumLatency.record(nowNs() - start);
+
+		if (FAILED(hr)) {
+			errors++;
+			ok = false;
+			break;
+		}
+
+		if (buffer.entries.empty())
+			break;
+
+		for (SimDirEntryBuffer::Entry& entry : buffer.entries) {
+			// ProjFS relies on the provider returning entries in PrjFileNameCompare order
+			if (!out.empty() && PrjFileNameCompare(out.back().name.c_str(), entry.name.c_str()) > 0)
+				instance->protocolErrors++;
+			out.push_back(std::move(entry));
+		}
+	}
+
+	initCallbackData(data, path.c_str());
+	start = nowNs();
+	hr = instance->invoke(data.CommandId, [&] {
+		return instance->callbacks.EndDirectoryEnumerationCallback(&data, &enumerationId);
+	});
+	endEnumLatency.record(nowNs() - start);
+
+	if (FAILED(hr)) {
+		errors++;
+		ok = false;
+	}
+
+	directoriesListed++;
+	entriesListed += out.size();
+	return ok;
+}
+
+bool SimHost::getPlaceholder(const std::wstring& path)
+{
+	PRJ_CALLBACK_DATA data;
+	initCallbackData(data, path.c_str());
+
+	UINT64 start = nowNs();
+	HRESULT hr = instance->invoke(data.CommandId, [&] {
+		return instance->callbacks.GetPlaceholderInfoCallback(&data);
+	});
+	placeholderLatency.record(nowNs() - start);
+
+	if (FAILED(hr)) {
+		errors++;
+		return false;
+	}
+	return true;
+}
+
+// Looks up a name that does not exist; anything but ERROR_FILE_NOT_FOUND is an error
+bool SimHost::probe(const std::wstring& path)
+{
+	PRJ_CALLBACK_DATA data;
+	initCallbackData(data, path.c_str());
+
+	UINT64 start = nowNs();
+	HRESULT hr = instance->invoke(data.CommandId, [&] {
+		return instance->callbacks.GetPlaceholderInfoCallback(&data);
+	});
+	probeLatency.record(nowNs() - start);
+
+	probesMade++;
+	if (hr != HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)) {
+		errors++;
+		return false;
+	}
+	return true;
+}
+
+// Requests the whole file, or read_size pieces of it, the way a reader opening the file would
+bool SimHost::hydrate(const std::wstring& path, INT64 fileSize)
+{
+	if (fileSize <= 0)
+		return true;
+
+	std::shared_ptr<SimVirtualizationInstance::Stream> stream = std::make_shared<SimVirtualizationInstance::Stream>();
+	stream->fileSize = fileSize;
+
+	PRJ_CALLBACK_DATA data;
+	initCallbackData(data, path.c_str());
+	makeGuid(data.DataStreamId);
+	instance->beginStream(data.DataStreamId, stream);
+
+	// Requests larger than 2 GB are split, keeping them aligned
+	UINT64 request = options.read_size ? options.read_size : 0x80000000ull;
+	request -= request % instance->write_alignment;
+	if (request == 0)
+		request = instance->write_alignment;
+
+	// Ranges the provider wrote ahead of earlier requests are not asked for again
+	bool ok = true;
+	bool cancelled = false;
+	UINT64 offset = 0;
+	while ((offset = stream->writtenThrough(offset)) < static_cast<UINT64>(fileSize)) {
+		UINT32 length = static_cast<UINT32>(std::min<UINT64>(request, fileSize - offset));
+		data.CommandId = nextCommandId.fetch_add(1);
+
+		UINT64 start = nowNs();
+		HRESULT hr = instance->invoke(data, options.cancel_after * 1000, [&] {
+			return instance->callbacks.GetFileDataCallback(&data, offset, length);
+		});
+		fileDataLatency.record(nowNs() - start);
+
+		// The reader gave up; the provider may still be writing what it already read
+		if (hr == HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED) && options.cancel_after != 0) {
+			cancelled = true;
+			break;
+		}
+
+		// Success means at least the requested range was written
+		if (FAILED(hr) || stream->writtenThrough(offset) < offset + length) {
+			ok = false;
+			break;
+		}
+	}
+
+	instance->endStream(data.DataStreamId, cancelled);
+	if (cancelled) {
+		filesCancelled++;
+		return true;
+	}
+
+	if (!ok || stream->writtenThrough(0) < static_cast<UINT64>(fileSize)) {
+		errors++;
+		return false;
+	}
+
+	filesHydrated++;
+	bytesHydrated += fileSize;
+	return true;
+}
+
+// Delivers a notification if the provider asked for it, as ProjFS does once the operation is done
+bool SimHost::notify(const std::wstring& path, bool isDirectory, PRJ_NOTIFICATION notification, PCWSTR destination)
+{
+	if ((instance->notificationMaskOf(path) & notification) == 0)
+		return true;
+
+	PRJ_CALLBACK_DATA data;
+	initCallbackData(data, path.c_str());
+	PRJ_NOTIFICATION_PARAMETERS parameters = {};
+
+	UINT64 start = nowNs();
+	HRESULT hr = instance->invoke(data.CommandId, [&] {
+		return instance->callbacks.NotificationCallback(&data, isDirectory, notification, destination, &parameters);
+	});
+	notificationLatency.record(nowNs() - start);
+
+	notificationsSent++;
+	if (FAILED(hr)) {
+		errors++;
+		return false;
+	}
+	return true;
+}
+
+// Writes to a file in the virtualization root and closes it, as an editor saving it does
+bool SimHost::modify(const std::wstring& path)
+{
+	std::wstring full = instance->root_path + L"\\" + path;
+	for (size_t end = instance->root_path.size() + 1; (end = full.find(L'\\', end)) != std::wstring::npos; end++)
+		SourceFileSystem::createDirectory(full.substr(0, end));
+
+	std::string text = "modified by the simulated host\n";
+	SourceFileSystem::FileHandle file;
+	HRESULT hr = SourceFileSystem::openForWriting(full, file);
+	if (SUCCEEDED(hr)) {
+		hr = SourceFileSystem::writeFile(file, 0, static_cast<UINT32>(text.size()), text.data());
+		SourceFileSystem::closeFile(file);
+	}
+	if (FAILED(hr)) {
+		errors++;
+		return false;
+	}
+	return notify(path, false, PRJ_NOTIFICATION_FILE_HANDLE_CLOSED_FILE_MODIFIED, nullptr);
+}
+
+void SimHost::worker(unsigned process)
+{
+	currentProcess = process;
+	for (;;) {
+		std::wstring path;
+		{
+			std::unique_lock<std::mutex> lock(queueMutex);
+			queueCondition.wait(lock, [this] { return !directories.empty() || directoriesBusy == 0; });
+			if (directories.empty())
+				return;
+
+			path = std::move(directories.back());
+			directories.pop_back();
+			directoriesBusy++;
+		}
+
+		std::vector<SimDirEntryBuffer::Entry> entries;
+		listDirectory(path, entries);
+
+		for (unsigned i = 0; i < options.probes; i++) {
+			std::wstring name = L"__probe" + std::to_wstring(i) + L".dll";
+			probe(path.empty() ? name : path + L"\\" + name);
+		}
+
+		unsigned modified = 0;
+		for (const SimDirEntryBuffer::Entry& entry : entries) {
+			std::wstring child = path.empty() ? entry.name : path + L"\\" + entry.name;
+
+			if (options.placeholders && !getPlaceholder(child))
+				continue;
+
+			if (entry.fileInfo.IsDirectory) {
+				{
+					std::lock_guard<std::mutex> lock(queueMutex);
+					directories.push_back(std::move(child));
+				}
+				queueCondition.notify_one();
+			} else if (options.hydrate && options.readers > 1) {
+				std::vector<std::thread> readers;
+				for (unsigned i = 1; i < options.readers; i++) {
+					readers.emplace_back([this, process, &child, &entry] {
+						currentProcess = process;
+						hydrate(child, entry.fileInfo.FileSize);
+					});
+				}
+				hydrate(child, entry.fileInfo.FileSize);
+				for (std::thread& reader : readers)
+					reader.join();
+			} else if (options.hydrate) {
+				hydrate(child, entry.fileInfo.FileSize);
+			}
+
+			if (!entry.fileInfo.IsDirectory && modified < options.modifies) {
+				modify(child);
+				modified++;
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			directoriesBusy--;
+		}
+		queueCondition.notify_all();
+	}
+}
+
+bool SimHost::run()
+{
+	UINT64 start = nowNs();
+
+	for (unsigned pass = 0; pass < options.passes; pass++) {
+		directories.clear();
+		directories.push_back(L"");
+		directoriesBusy = 0;
+
+		std::vector<std::thread> threads;
+		for (unsigned i = 0; i < (options.threads ? options.threads : 1); i++)
+			threads.emplace_back(&SimHost::worker, this, options.processes > 1 ? i % options.processes : 0);
+		for (std::thread& thread : threads)
+			thread.join();
+	}
+
+	elapsed = (nowNs() - start) / 1e9;
+	return errors.load() == 0 && instance->protocolErrors.load() == 0;
+}
+
+void SimHost::report(FILE* out) const
+{
+	fprintf(out, "SimHost: %u threads, %u passes, %.3fs\n", options.threads, options.passes, elapsed);
+	fprintf(out, "  directories %llu, entries %llu, placeholders %llu, files %llu, %.1f MB (%.1f MB/s)\n",
+		static_cast<unsigned long long>(directoriesListed.load()),
+		static_cast<unsigned long long>(entriesListed.load()),
+		static_cast<unsigned long long>(instance->placeholdersWritten.load()),
+		static_cast<unsigned long long>(filesHydrated.load()),
+		bytesHydrated.load() / 1048576.0,
+		elapsed > 0 ? bytesHydrated.load() / 1048576.0 / elapsed : 0.0);
+	fprintf(out, "  probes %llu, notifications %llu\n",
+		static_cast<unsigned long long>(probesMade.load()),
+		static_cast<unsigned long long>(notificationsSent.load()));
+	if (options.cancel_after != 0) {
+		fprintf(out, "  files abandoned %llu, commands cancelled %llu, writes after cancellation %llu\n",
+			static_cast<unsigned long long>(filesCancelled.load()),
+			static_cast<unsigned long long>(instance->commandsCancelled.load()),
+			static_cast<unsigned long long>(instance->lateWrites.load()));
+	}
+	fprintf(out, "  errors %llu, protocol errors %llu, pending completions %llu\n",
+		static_cast<unsigned long long>(errors.load()),
+		static_cast<unsigned long long>(instance->protocolErrors.load()),
+		static_cast<unsigned long long>(instance->commandsCompleted.load()));
+
+	startEnumLatency.report(out, "StartDirEnumeration", elapsed);
+	getEnumLatency.report(out, "GetDirEnumeration", elapsed);
+	endEnumLatency.report(out, "EndDirEnumeration", elapsed);
+	placeholderLatency.report(out, "GetPlaceholderInfo", elapsed);
+	probeLatency.report(out, "PlaceholderProbe", elapsed);
+	fileDataLatency.report(out, "GetFileData", elapsed);
+	notificationLatency.report(out, "Notification", elapsed);
+}
+
+#endif // _WIN32
@@ -0,0 +1,281 @@
+#pragma once
+
+#include "pch.h"
+
+#ifndef _WIN32
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// Orders GUIDs by their raw bytes so they can be used as map keys
+class SimGUIDComparer {
+public:
+	bool operator() (const GUID& left, const GUID& right) const;
+};
+
+// Holds the state of a virtualization instance started with PrjStartVirtualizing
+struct SimVirtualizationInstance {
+
+	// Tracks a file being hydrated so PrjWriteFileData can be validated
+	class Stream {
+	public:
+		INT64 fileSize;
+		std::atomic<UINT64> bytesWritten;
+
+		// Ranges written so far, by start offset, merged where they touch
+		std::mutex rangesMutex;
+		std::map<UINT64, UINT64> ranges;
+
+		Stream() : fileSize(0), bytesWritten(0) {}
+
+		void written(UINT64 offset, UINT64 length);
+
+		// Where the written range covering offset ends, or offset if it has not been written;
+		// like ProjFS, the host does not ask for data it already has
+		UINT64 writtenThrough(UINT64 offset);
+	};
+
+	std::wstring root_path;
+	PRJ_CALLBACKS callbacks;
+	void* instance_context;
+	GUID instance_id;
+	UINT32 write_alignment;
+	UINT32 concurrent_thread_count;
+
+	// The notifications the provider asked for, by the directory they apply below
+	std::vector<std::pair<std::wstring, PRJ_NOTIFY_TYPES>> notification_mappings;
+
+	// Limits the number of callbacks running at once, like the ProjFS thread pool does
+	std::mutex callbackMutex;
+	std::condition_variable callbackCondition;
+	UINT32 callbacksRunning;
+
+	// A command the host waits on after the provider returned ERROR_IO_PENDING
+	class PendingCommand {
+	public:
+		std::mutex mutex;
+		std::condition_variable condition;
+		bool completed;
+		HRESULT result;
+
+		PendingCommand() : completed(false), result(S_OK) {}
+
+		// Blocks until PrjCompleteCommand is called and returns its result
+		HRESULT wait();
+		// Waits up to ns nanoseconds; false if the command is still pending
+		bool waitFor(UINT64 ns);
+	};
+
+	// Streams are shared with PrjWriteFileData, which may still be writing when a reader gives up
+	std::mutex streamsMutex;
+	std::map<GUID, std::shared_ptr<Stream>, SimGUIDComparer> streams;
+	// Streams left after a cancelled request; writes to them fail, as they do to a closed file
+	std::set<GUID, SimGUIDComparer> abandonedStreams;
+
+	std::mutex commandsMutex;
+	std::map<INT32, PendingCommand*> commands;
+
+	std::atomic<UINT64> placeholdersWritten;
+	std::atomic<UINT64> commandsCompleted;
+	std::atomic<UINT64> fileDataWrites;
+	std::atomic<UINT64> fileDataBytes;
+	std::atomic<UINT64> protocolErrors;
+	std::atomic<UINT64> commandsCancelled;
+	std::atomic<UINT64> lateWrites;
+
+	SimVirtualizationInstance();
+
+	void enterCallback();
+	void leaveCallback();
+
+	// The mask of the deepest mapping whose root holds path, as ProjFS applies them
+	PRJ_NOTIFY_TYPES notificationMaskOf(const std::wstring& path) const;
+
+	void beginStream(const GUID& dataStreamId, const std::shared_ptr<Stream>& stream);
+	void endStream(const GUID& dataStreamId, bool abandoned = false);
+
+	// Commands are registered before their callback runs, since completion can race its return
+	void beginCommand(INT32 commandId, PendingCommand* command);
+	void endCommand(INT32 commandId);
+
+	// Forgets a pending command and has the provider cancel it, as ProjFS does when the process
+	// waiting on it goes away; false if the command was completed first
+	bool cancelCommand(const PRJ_CALLBACK_DATA& data);
+
+	// Issues a callback and, if it went pending, waits for its completion
+	template<typename Callback>
+	HRESULT invoke(INT32 commandId, Callback callback) {
+		PendingCommand command;
+		beginCommand(commandId, &command);
+
+		enterCallback();
+		HRESULT hr = callback();
+		leaveCallback();
+
+		if (hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING))
+			return command.wait();
+
+		endCommand(commandId);
+		return hr;
+	}
+
+	// As invoke, but a command still pending after cancelAfterNs is cancelled, returning
+	// ERROR_OPERATION_ABORTED; 0 waits for completion however long it takes
+	template<typename Callback>
+	HRESULT invoke(const PRJ_CALLBACK_DATA& data, UINT64 cancelAfterNs, Callback callback) {
+		PendingCommand command;
+		beginCommand(data.CommandId, &command);
+
+		enterCallback();
+		HRESULT hr = callback();
+		leaveCallback();
+
+		if (hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING)) {
+			if (cancelAfterNs != 0 && !command.waitFor(cancelAfterNs) && cancelCommand(data))
+				return HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+			return command.wait();
+		}
+
+		endCommand(data.CommandId);
+		return hr;
+	}
+};
+
+// Returns the instance started on rootPath, or nullptr if there is none
+SimVirtualizationInstance* SimFindInstance(PCWSTR rootPath);
+
+// Receives entries from PrjFillDirEntryBuffer
+struct SimDirEntryBuffer {
+	class Entry {
+	public:
+		std::wstring name;
+		PRJ_FILE_BASIC_INFO fileInfo;
+	};
+
+	size_t capacity;
+	size_t used;
+	bool single_entry;
+	std::vector<Entry> entries;
+
+	SimDirEntryBuffer() : capacity(0), used(0), single_entry(false) {}
+};
+
+// Log2-bucketed latency histogram which can be updated from many threads
+class SimLatencyHistogram {
+private:
+	static const int BUCKETS = 48;
+	std::atomic<UINT64> buckets[BUCKETS];
+	std::atomic<UINT64> count;
+	std::atomic<UINT64> total_ns;
+	std::atomic<UINT64> max_ns;
+
+public:
+	SimLatencyHistogram();
+
+	void record(UINT64 ns);
+	UINT64 samples() const { return count.load(); }
+	UINT64 percentile(double p) const;
+	void report(FILE* out, const char* name, double seconds) const;
+};
+
+/*
+	SimHost plays the role of the applications and the ProjFS driver. It walks the virtual namespace
+	the same way `dir /s` followed by reading every file would, issuing the provider's callbacks from
+	a number of threads, and measures each callback.
+*/
+class SimHost {
+public:
+	class Options {
+	public:
+		unsigned threads;
+		size_t dir_buffer_bytes;
+		UINT32 read_size;
+		unsigned passes;
+		bool placeholders;
+		bool hydrate;
+		// Lookups of names that do not exist made in each directory, as tools probing for files do
+		unsigned probes;
+		// Streams hydrating each file at once, as when several processes open it together
+		unsigned readers;
+		// Files in each directory then written to and closed, as a build touching its inputs does
+		unsigned modifies;
+		// Microseconds after which a pending GetFileData is cancelled, as when its reader is
+		// killed; 0 never cancels
+		UINT64 cancel_after;
+		// Processes the threads are spread over, each named SimProcess<n>.exe to the provider; 1
+		// runs every thread as the host itself
+		unsigned processes;
+
+		Options() :
+			threads(4),
+			dir_buffer_bytes(16 * 1024),
+			read_size(0),
+			passes(1),
+			placeholders(true),
+			hydrate(true),
+			probes(0),
+			readers(1),
+			modifies(0),
+			cancel_after(0),
+			processes(1)
+		{}
+	};
+
+private:
+	SimVirtualizationInstance* instance;
+	Options options;
+
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	std::vector<std::wstring> directories;
+	size_t directoriesBusy;
+
+	// The image path each simulated process reports
+	std::vector<std::wstring> processImages;
+
+	std::atomic<INT32> nextCommandId;
+	std::atomic<UINT32> nextGuid;
+
+	std::atomic<UINT64> directoriesListed;
+	std::atomic<UINT64> entriesListed;
+	std::atomic<UINT64> filesHydrated;
+	std::atomic<UINT64> filesCancelled;
+	std::atomic<UINT64> bytesHydrated;
+	std::atomic<UINT64> probesMade;
+	std::atomic<UINT64> notificationsSent;
+	std::atomic<UINT64> errors;
+	double elapsed;
+
+	SimLatencyHistogram startEnumLatency;
+	SimLatencyHistogram getEnumLatency;
+	SimLatencyHistogram endEnumLatency;
+	SimLatencyHistogram placeholderLatency;
+	SimLatencyHistogram probeLatency;
+	SimLatencyHistogram fileDataLatency;
+	SimLatencyHistogram notificationLatency;
+
+	void worker(unsigned process);
+	void makeGuid(GUID& guid);
+	void initCallbackData(PRJ_CALLBACK_DATA& data, PCWSTR path);
+	bool listDirectory(const std::wstring& path, std::vector<SimDirEntryBuffer::Entry>& out);
+	bool getPlaceholder(const std::wstring& path);
+	bool probe(const std::wstring& path);
+	bool hydrate(const std::wstring& path, INT64 fileSize);
+	bool notify(const std::wstring& path, bool isDirectory, PRJ_NOTIFICATION notification, PCWSTR destination);
+	bool modify(const std::wstring& path);
+
+public:
+	SimHost(SimVirtualizationInstance* instance, const Options& options);
+
+	// Walks the namespace options.passes times; returns false if any callback failed
+	bool run();
+	void report(FILE* out) const;
+};
+
+#endif // _WIN32
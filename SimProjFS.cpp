@@ -0,0 +1,519 @@
+#include "pch.h"
+
+#ifndef _WIN32
+
+#include "SimHost.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cwctype>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+// All running instances, so the harness can find the one a provider started
+static std::mutex instancesMutex;
+static std::vector<SimVirtualizationInstance*> instances;
+static std::atomic<UINT32> guidCounter(1);
+
+bool SimGUIDComparer::operator()(const GUID& left, const GUID& right) const
+{
+	return memcmp(&left, &right, sizeof(left)) < 0;
+}
+
+SimVirtualizationInstance::SimVirtualizationInstance() :
+	callbacks(),
+	instance_context(nullptr),
+	instance_id(),
+	write_alignment(4096),
+	concurrent_thread_count(1),
+	callbacksRunning(0),
+	placeholdersWritten(0),
+	commandsCompleted(0),
+	fileDataWrites(0),
+	fileDataBytes(0),
+	protocolErrors(0),
+	commandsCancelled(0),
+	lateWrites(0)
+{
+}
+
+void SimVirtualizationInstance::enterCallback()
+{
+	std::unique_lock<std::mutex> lock(callbackMutex);
+	callbackCondition.wait(lock, [this] { return callbacksRunning < concurrent_thread_count; });
+	callbacksRunning++;
+}
+
+void SimVirtualizationInstance::leaveCallback()
+{
+	{
+		std::lock_guard<std::mutex> lock(callbackMutex);
+		callbacksRunning--;
+	}
+	callbackCondition.notify_one();
+}
+
+PRJ_NOTIFY_TYPES SimVirtualizationInstance::notificationMaskOf(const std::wstring& path) const
+{
+	PRJ_NOTIFY_TYPES mask = PRJ_NOTIFY_NONE;
+	size_t depth = 0;
+	for (const auto& mapping : notification_mappings) {
+		const std::wstring& root = mapping.first;
+		bool holds = root.empty() || (path.compare(0, root.size(), root) == 0 &&
+			(path.size() == root.size() || path[root.size()] == L'\\'));
+		if (holds && root.size() >= depth) {
+			mask = mapping.second;
+			depth = root.size();
+		}
+	}
+	return mask;
+}
+
+void SimVirtualizationInstance::beginStream(const GUID& dataStreamId, const std::shared_ptr<Stream>& stream)
+{
+	std::lock_guard<std::mutex> lock(streamsMutex);
+	streams[dataStreamId] = stream;
+}
+
+void SimVirtualizationInstance::endStream(const GUID& dataStreamId, bool abandoned)
+{
+	std::lock_guard<std::mutex> lock(streamsMutex);
+	streams.erase(dataStreamId);
+	if (abandoned)
+		abandonedStreams.insert(dataStreamId);
+}
+
+void SimVirtualizationInstance::Stream::written(UINT64 offset, UINT64 length)
+{
+	std::lock_guard<std::mutex> lock(rangesMutex);
+	UINT64 end = offset + length;
+
+	auto it = ranges.upper_bound(offset);
+	if (it != ranges.begin() && std::prev(it)->second >= offset) {
+		--it;
+		offset = it->first;
+		end = std::max(end, it->second);
+		it = ranges.erase(it);
+	}
+	while (it != ranges.end() && it->first <= end) {
+		end = std::max(end, it->second);
+		it = ranges.erase(it);
+	}
+	ranges[offset] = end;
+}
+
+UINT64 SimVirtualizationInstance::Stream::writtenThrough(UINT64 offset)
+{
+	std::lock_guard<std::mutex> lock(rangesMutex);
+	auto it = ranges.upper_bound(offset);
+	if (it == ranges.begin())
+		return offset;
+	--it;
+	return std::max(it->second, offset);
+}
+
+HRESULT SimVirtualizationInstance::PendingCommand::wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	condition.wait(lock, [this] { return completed; });
+	return result;
+}
+
+bool SimVirtualizationInstance::PendingCommand::waitFor(UINT64 ns)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	return condition.wait_for(lock, std::chrono::nanoseconds(ns), [this] { return completed; });
+}
+
+void SimVirtualizationInstance::beginCommand(INT32 commandId, PendingCommand* command)
+{
+	std::lock_guard<std::mutex> lock(commandsMutex);
+	commands[commandId] = command;
+}
+
+void SimVirtualizationInstance::endCommand(INT32 commandId)
+{
+	std::lock_guard<std::mutex> lock(commandsMutex);
+	commands.erase(commandId);
+}
+
+bool SimVirtualizationInstance::cancelCommand(const PRJ_CALLBACK_DATA& data)
+{
+	// Once forgotten, the provider's PrjCompleteCommand for it fails like any unknown command
+	{
+		std::lock_guard<std::mutex> lock(commandsMutex);
+		if (commands.erase(data.CommandId) == 0)
+			return false;
+	}
+
+	commandsCancelled++;
+	if (callbacks.CancelCommandCallback != nullptr)
+		callbacks.CancelCommandCallback(&data);
+	return true;
+}
+
+// Providers normalize their roots to backslashes, so both separators compare equal here
+static std::wstring normalizeRoot(PCWSTR path)
+{
+	std::wstring normalized = path;
+	for (WCHAR& c : normalized) {
+		if (c == L'/')
+			c = L'\\';
+	}
+	while (!normalized.empty() && normalized.back() == L'\\')
+		normalized.pop_back();
+	return normalized;
+}
+
+SimVirtualizationInstance* SimFindInstance(PCWSTR rootPath)
+{
+	std::wstring normalized = normalizeRoot(rootPath);
+
+	std::lock_guard<std::mutex> lock(instancesMutex);
+	for (SimVirtualizationInstance* instance : instances) {
+		if (normalizeRoot(instance->root_path.c_str()) == normalized)
+			return instance;
+	}
+	return nullptr;
+}
+
+HRESULT CoCreateGuid(GUID* guid)
+{
+	*guid = GUID();
+	guid->Data1 = guidCounter.fetch_add(1);
+	guid->Data2 = 0x5349;
+	guid->Data3 = 0x4d46;
+	return S_OK;
+}
+
+HRESULT PrjMarkDirectoryAsPlaceholder(
+	PCWSTR rootPathName,
+	PCWSTR targetPathName,
+	const PRJ_PLACEHOLDER_VERSION_INFO* versionInfo,
+	const GUID* virtualizationInstanceID
+) {
+	UNREFERENCED_PARAMETER(targetPathName);
+	UNREFERENCED_PARAMETER(versionInfo);
+	UNREFERENCED_PARAMETER(virtualizationInstanceID);
+	return rootPathName == nullptr ? E_INVALIDARG : S_OK;
+}
+
+HRESULT PrjStartVirtualizing(
+	PCWSTR virtualizationRootPath,
+	const PRJ_CALLBACKS* callbacks,
+	const void* instanceContext,
+	const PRJ_STARTVIRTUALIZING_OPTIONS* options,
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT* namespaceVirtualizationContext
+) {
+	if (virtualizationRootPath == nullptr || callbacks == nullptr ||
+		callbacks->StartDirectoryEnumerationCallback == nullptr ||
+		callbacks->EndDirectoryEnumerationCallback == nullptr ||
+		callbacks->GetDirectoryEnumerationCallback == nullptr ||
+		callbacks->GetPlaceholderInfoCallback == nullptr ||
+		callbacks->GetFileDataCallback == nullptr
+	) {
+		return E_INVALIDARG;
+	}
+
+	SimVirtualizationInstance* instance = new SimVirtualizationInstance;
+	instance->root_path = virtualizationRootPath;
+	instance->callbacks = *callbacks;
+	instance->instance_context = const_cast<void*>(instanceContext);
+	CoCreateGuid(&instance->instance_id);
+
+	// ProjFS defaults both counts to the number of cores when they are zero
+	UINT32 cores = std::thread::hardware_concurrency();
+	instance->concurrent_thread_count = cores ? cores : 1;
+	if (options != nullptr && options->ConcurrentThreadCount != 0)
+		instance->concurrent_thread_count = options->ConcurrentThreadCount;
+
+	if (options != nullptr && options->NotificationMappingsCount != 0) {
+		if (options->NotificationMappings == nullptr || callbacks->NotificationCallback == nullptr) {
+			delete instance;
+			return E_INVALIDARG;
+		}
+		for (UINT32 i = 0; i < options->NotificationMappingsCount; i++) {
+			const PRJ_NOTIFICATION_MAPPING& mapping = options->NotificationMappings[i];
+			instance->notification_mappings.emplace_back(
+				normalizeRoot(mapping.NotificationRoot != nullptr ? mapping.NotificationRoot : L""),
+				mapping.NotificationBitMask);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(instancesMutex);
+		instances.push_back(instance);
+	}
+
+	*namespaceVirtualizationContext = instance;
+	return S_OK;
+}
+
+void PrjStopVirtualizing(
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT namespaceVirtualizationContext
+) {
+	std::lock_guard<std::mutex> lock(instancesMutex);
+	for (auto it = instances.begin(); it != instances.end(); ++it) {
+		if (*it == namespaceVirtualizationContext) {
+			instances.erase(it);
+			delete namespaceVirtualizationContext;
+			return;
+		}
+	}
+}
+
+HRESULT PrjGetVirtualizationInstanceInfo(
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT namespaceVirtualizationContext,
+	PRJ_VIRTUALIZATION_INSTANCE_INFO* virtualizationInstanceInfo
+) {
+	virtualizationInstanceInfo->InstanceID = namespaceVirtualizationContext->instance_id;
+	virtualizationInstanceInfo->WriteAlignment = namespaceVirtualizationContext->write_alignment;
+	return S_OK;
+}
+
+/*
+	Each entry costs roughly what a FILE_ID_BOTH_DIR_INFORMATION record would in the caller's
+	buffer, so buffer sizes given to the harness behave like real FindFirstFile buffers.
+*/
+HRESULT PrjFillDirEntryBuffer(
+	PCWSTR fileName,
+	PRJ_FILE_BASIC_INFO* fileBasicInfo,
+	PRJ_DIR_ENTRY_BUFFER_HANDLE dirEntryBufferHandle
+) {
+	if (fileName == nullptr || fileBasicInfo == nullptr || dirEntryBufferHandle == nullptr)
+		return E_INVALIDARG;
+
+	size_t cost = (104 + wcslen(fileName) * 2 + 7) & ~static_cast<size_t>(7);
+	if (dirEntryBufferHandle->used + cost > dirEntryBufferHandle->capacity ||
+		(dirEntryBufferHandle->single_entry && !dirEntryBufferHandle->entries.empty())
+	) {
+		return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+	}
+
+	dirEntryBufferHandle->used += cost;
+	dirEntryBufferHandle->entries.emplace_back();
+	dirEntryBufferHandle->entries.back().name = fileName;
+	dirEntryBufferHandle->entries.back().fileInfo = *fileBasicInfo;
+	return S_OK;
+}
+
+HRESULT PrjWritePlaceholderInfo(
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT namespaceVirtualizationContext,
+	PCWSTR destinationFileName,
+	const PRJ_PLACEHOLDER_INFO* placeholderInfo,
+	UINT32 placeholderInfoSize
+) {
+	if (destinationFileName == nullptr || placeholderInfo == nullptr ||
+		placeholderInfoSize < sizeof(PRJ_PLACEHOLDER_INFO)
+	) {
+		namespaceVirtualizationContext->protocolErrors++;
+		return E_INVALIDARG;
+	}
+
+	namespaceVirtualizationContext->placeholdersWritten++;
+	return S_OK;
+}
+
+void* PrjAllocateAlignedBuffer(
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT namespaceVirtualizationContext,
+	size_t size
+) {
+	size_t alignment = namespaceVirtualizationContext->write_alignment;
+	size_t rounded = (size + alignment - 1) / alignment * alignment;
+	return aligned_alloc(alignment, rounded ? rounded : alignment);
+}
+
+void PrjFreeAlignedBuffer(
+	void* buffer
+) {
+	free(buffer);
+}
+
+/*
+	Like ProjFS, the offset and length must be multiples of the write alignment unless the write
+	ends at the end of the file.
+*/
+HRESULT PrjWriteFileData(
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT namespaceVirtualizationContext,
+	const GUID* dataStreamId,
+	void* buffer,
+	UINT64 byteOffset,
+	UINT32 length
+) {
+	SimVirtualizationInstance* instance = namespaceVirtualizationContext;
+	std::shared_ptr<SimVirtualizationInstance::Stream> stream;
+	{
+		std::lock_guard<std::mutex> lock(instance->streamsMutex);
+		auto it = instance->streams.find(*dataStreamId);
+		if (it != instance->streams.end()) {
+			stream = it->second;
+		} else if (instance->abandonedStreams.count(*dataStreamId) != 0) {
+			instance->lateWrites++;
+			return HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+		}
+	}
+
+	UINT32 alignment = instance->write_alignment;
+	if (stream == nullptr || buffer == nullptr ||
+		byteOffset % alignment != 0 ||
+		byteOffset + length > static_cast<UINT64>(stream->fileSize) ||
+		(length % alignment != 0 && byteOffset + length != static_cast<UINT64>(stream->fileSize))
+	) {
+		instance->protocolErrors++;
+		return E_INVALIDARG;
+	}
+
+	stream->bytesWritten += length;
+	stream->written(byteOffset, length);
+	instance->fileDataWrites++;
+	instance->fileDataBytes += length;
+	return S_OK;
+}
+
+HRESULT PrjCompleteCommand(
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT namespaceVirtualizationContext,
+	INT32 commandId,
+	HRESULT completionResult,
+	PRJ_COMPLETE_COMMAND_EXTENDED_PARAMETERS* extendedParameters
+) {
+	UNREFERENCED_PARAMETER(extendedParameters);
+	SimVirtualizationInstance* instance = namespaceVirtualizationContext;
+	SimVirtualizationInstance::PendingCommand* command = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(instance->commandsMutex);
+		auto it = instance->commands.find(commandId);
+		if (it != instance->commands.end()) {
+			command = it->second;
+			instance->commands.erase(it);
+		}
+	}
+
+	// The command was already completed, or cancelled and forgotten by the host
+	if (command == nullptr)
+		return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+
+	instance->commandsCompleted++;
+
+	// Notify under the lock; the waiter owns the command and destroys it as soon as it wakes
+	std::lock_guard<std::mutex> lock(command->mutex);
+	command->result = completionResult;
+	command->completed = true;
+	command->condition.notify_all();
+	return S_OK;
+}
+
+static inline bool isWildCard(WCHAR c)
+{
+	return c == L'*' || c == L'?' || c == L'<' || c == L'>' || c == L'"';
+}
+
+BOOLEAN PrjDoesNameContainWildCards(
+	PCWSTR fileName
+) {
+	for (PCWSTR c = fileName; *c; c++) {
+		if (isWildCard(*c))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+	Evaluates the expression the way FsRtlIsNameInExpression does, including the DOS wildcards
+	< (DOS_STAR), > (DOS_QM) and " (DOS_DOT). memo holds -1 for unknown, 0 or 1 per (pattern, name)
+	position pair.
+*/
+static bool matchAt(
+	PCWSTR name, size_t nameLength, size_t lastDot,
+	PCWSTR pattern, size_t patternLength,
+	size_t p, size_t n,
+	std::vector<signed char>& memo
+) {
+	signed char& known = memo[p * (nameLength + 1) + n];
+	if (known >= 0)
+		return known != 0;
+
+	bool result;
+	if (p == patternLength) {
+		result = n == nameLength;
+	} else {
+		WCHAR c = pattern[p];
+		switch (c) {
+		case L'*':
+			result = matchAt(name, nameLength, lastDot, pattern, patternLength, p + 1, n, memo) ||
+				(n < nameLength && matchAt(name, nameLength, lastDot, pattern, patternLength, p, n + 1, memo));
+			break;
+		case L'?':
+			result = n < nameLength && matchAt(name, nameLength, lastDot, pattern, patternLength, p + 1, n + 1, memo);
+			break;
+		case L'<':
+			result = matchAt(name, nameLength, lastDot, pattern, patternLength, p + 1, n, memo) ||
+				(n < nameLength && n < lastDot &&
+					matchAt(name, nameLength, lastDot, pattern, patternLength, p, n + 1, memo));
+			break;
+		case L'>':
+			if (n < nameLength && name[n] != L'.') {
+				result = matchAt(name, nameLength, lastDot, pattern, patternLength, p + 1, n + 1, memo);
+			} else {
+				size_t q = p;
+				while (q < patternLength && pattern[q] == L'>')
+					q++;
+				result = matchAt(name, nameLength, lastDot, pattern, patternLength, q, n, memo);
+			}
+			break;
+		case L'"':
+			result = (n < nameLength && name[n] == L'.' &&
+					matchAt(name, nameLength, lastDot, pattern, patternLength, p + 1, n + 1, memo)) ||
+				(n == nameLength && matchAt(name, nameLength, lastDot, pattern, patternLength, p + 1, n, memo));
+			break;
+		default:
+			result = n < nameLength && towupper(name[n]) == towupper(c) &&
+				matchAt(name, nameLength, lastDot, pattern, patternLength, p + 1, n + 1, memo);
+			break;
+		}
+	}
+
+	known = result ? 1 : 0;
+	return result;
+}
+
+BOOLEAN PrjFileNameMatch(
+	PCWSTR fileNameToCheck,
+	PCWSTR pattern
+) {
+	if (pattern == nullptr || pattern[0] == L'\0')
+		return TRUE;
+
+	size_t nameLength = wcslen(fileNameToCheck);
+	size_t patternLength = wcslen(pattern);
+
+	// Names without a dot let DOS_STAR run to the end of the name
+	size_t lastDot = nameLength;
+	for (size_t i = nameLength; i > 0; i--) {
+		if (fileNameToCheck[i - 1] == L'.') {
+			lastDot = i - 1;
+			break;
+		}
+	}
+
+	std::vector<signed char> memo((patternLength + 1) * (nameLength + 1), -1);
+	return matchAt(fileNameToCheck, nameLength, lastDot, pattern, patternLength, 0, 0, memo) ? TRUE : FALSE;
+}
+
+int PrjFileNameCompare(
+	PCWSTR fileName1,
+	PCWSTR fileName2
+) {
+	for (;; fileName1++, fileName2++) {
+		wint_t a = towupper(*fileName1);
+		wint_t b = towupper(*fileName2);
+		if (a != b)
+			return a < b ? -1 : 1;
+		if (a == 0)
+			return 0;
+	}
+}
+
+#endif // _WIN32
@@ -0,0 +1,373 @@
+#pragma once
+
+/*
+	SimProjFS is a small, in-process stand-in for the parts of Windows.h and projectedfslib.h the
+	provider uses. It lets the provider core compile unchanged on POSIX systems, where the
+	callbacks are driven by SimHost instead of the ProjFS filter driver.
+
+	Only the subset of the API used by FileProvider is declared here. Behaviour follows the ProjFS
+	documentation closely enough for benchmarking; it is not meant to be a faithful emulation of
+	every corner of the real library.
+*/
+
+#ifndef _WIN32
+
+#include <cstdint>
+#include <cstddef>
+#include <cwchar>
+
+// SAL annotations are meaningless outside of MSVC
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Inout_
+#define _Outptr_
+
+#define __cdecl
+
+#define UNREFERENCED_PARAMETER(P) (void)(P)
+
+// Basic Windows types
+typedef wchar_t WCHAR;
+typedef WCHAR* PWSTR;
+typedef const WCHAR* PCWSTR;
+typedef unsigned char BOOLEAN;
+typedef unsigned char UINT8;
+typedef unsigned short USHORT;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int32_t INT32;
+typedef int64_t INT64;
+typedef uint32_t DWORD;
+typedef uint32_t ULONG;
+typedef int32_t HRESULT;
+typedef void* HANDLE;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define INVALID_HANDLE_VALUE (reinterpret_cast<HANDLE>(static_cast<intptr_t>(-1)))
+
+typedef union _LARGE_INTEGER {
+	struct {
+		DWORD LowPart;
+		INT32 HighPart;
+	} u;
+	INT64 QuadPart;
+} LARGE_INTEGER;
+
+typedef struct _GUID {
+	UINT32 Data1;
+	UINT16 Data2;
+	UINT16 Data3;
+	UINT8 Data4[8];
+} GUID;
+
+// Error codes
+#define S_OK                         ((HRESULT)0)
+#define E_NOTIMPL                    ((HRESULT)0x80004001L)
+#define E_FAIL                       ((HRESULT)0x80004005L)
+#define E_OUTOFMEMORY                ((HRESULT)0x8007000EL)
+#define E_INVALIDARG                 ((HRESULT)0x80070057L)
+#define E_UNEXPECTED                 ((HRESULT)0x8000FFFFL)
+
+#define ERROR_SUCCESS                0L
+#define ERROR_FILE_NOT_FOUND         2L
+#define ERROR_PATH_NOT_FOUND         3L
+#define ERROR_TOO_MANY_OPEN_FILES    4L
+#define ERROR_ACCESS_DENIED          5L
+#define ERROR_NOT_ENOUGH_MEMORY      8L
+#define ERROR_HANDLE_EOF             38L
+#define ERROR_NOT_SUPPORTED          50L
+#define ERROR_INVALID_PARAMETER      87L
+#define ERROR_INSUFFICIENT_BUFFER    122L
+#define ERROR_ALREADY_EXISTS         183L
+#define ERROR_OPERATION_ABORTED      995L
+#define ERROR_IO_PENDING             997L
+#define ERROR_WRITE_FAULT            29L
+#define ERROR_READ_FAULT             30L
+#define ERROR_GEN_FAILURE            31L
+#define ERROR_FILE_CORRUPT           1392L
+
+#define FACILITY_WIN32               7
+#define HRESULT_FROM_WIN32(x) \
+	((HRESULT)(x) <= 0 ? ((HRESULT)(x)) : ((HRESULT)(((x) & 0x0000FFFF) | (FACILITY_WIN32 << 16) | 0x80000000)))
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+
+// File attributes
+#define FILE_ATTRIBUTE_READONLY      0x00000001
+#define FILE_ATTRIBUTE_HIDDEN        0x00000002
+#define FILE_ATTRIBUTE_DIRECTORY     0x00000010
+#define FILE_ATTRIBUTE_ARCHIVE       0x00000020
+#define FILE_ATTRIBUTE_NORMAL        0x00000080
+#define INVALID_FILE_ATTRIBUTES      ((DWORD)-1)
+
+// ProjFS types
+typedef struct SimVirtualizationInstance* PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT;
+typedef struct SimDirEntryBuffer* PRJ_DIR_ENTRY_BUFFER_HANDLE;
+
+#define PRJ_PLACEHOLDER_ID_LENGTH 128
+
+typedef struct PRJ_PLACEHOLDER_VERSION_INFO {
+	UINT8 ProviderID[PRJ_PLACEHOLDER_ID_LENGTH];
+	UINT8 ContentID[PRJ_PLACEHOLDER_ID_LENGTH];
+} PRJ_PLACEHOLDER_VERSION_INFO;
+
+typedef enum PRJ_CALLBACK_DATA_FLAGS {
+	PRJ_CB_DATA_FLAG_ENUM_RESTART_SCAN = 0x00000001,
+	PRJ_CB_DATA_FLAG_ENUM_RETURN_SINGLE_ENTRY = 0x00000002
+} PRJ_CALLBACK_DATA_FLAGS;
+
+typedef struct PRJ_CALLBACK_DATA {
+	UINT32 Size;
+	PRJ_CALLBACK_DATA_FLAGS Flags;
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT NamespaceVirtualizationContext;
+	INT32 CommandId;
+	GUID FileId;
+	GUID DataStreamId;
+	PCWSTR FilePathName;
+	PRJ_PLACEHOLDER_VERSION_INFO* VersionInfo;
+	UINT32 TriggeringProcessId;
+	PCWSTR TriggeringProcessImageFileName;
+	void* InstanceContext;
+} PRJ_CALLBACK_DATA;
+
+typedef struct PRJ_FILE_BASIC_INFO {
+	BOOLEAN IsDirectory;
+	INT64 FileSize;
+	LARGE_INTEGER CreationTime;
+	LARGE_INTEGER LastAccessTime;
+	LARGE_INTEGER LastWriteTime;
+	LARGE_INTEGER ChangeTime;
+	UINT32 FileAttributes;
+} PRJ_FILE_BASIC_INFO;
+
+typedef struct PRJ_PLACEHOLDER_INFO {
+	PRJ_FILE_BASIC_INFO FileBasicInfo;
+	PRJ_PLACEHOLDER_VERSION_INFO VersionInfo;
+} PRJ_PLACEHOLDER_INFO;
+
+typedef struct PRJ_VIRTUALIZATION_INSTANCE_INFO {
+	GUID InstanceID;
+	UINT32 WriteAlignment;
+} PRJ_VIRTUALIZATION_INSTANCE_INFO;
+
+typedef enum PRJ_NOTIFY_TYPES {
+	PRJ_NOTIFY_NONE = 0x00000000,
+	PRJ_NOTIFY_SUPPRESS_NOTIFICATIONS = 0x00000001,
+	PRJ_NOTIFY_FILE_OPENED = 0x00000002,
+	PRJ_NOTIFY_NEW_FILE_CREATED = 0x00000004,
+	PRJ_NOTIFY_FILE_OVERWRITTEN = 0x00000008,
+	PRJ_NOTIFY_PRE_DELETE = 0x00000010,
+	PRJ_NOTIFY_PRE_RENAME = 0x00000020,
+	PRJ_NOTIFY_PRE_SET_HARDLINK = 0x00000040,
+	PRJ_NOTIFY_FILE_RENAMED = 0x00000080,
+	PRJ_NOTIFY_HARDLINK_CREATED = 0x00000100,
+	PRJ_NOTIFY_FILE_HANDLE_CLOSED_NO_MODIFICATION = 0x00000200,
+	PRJ_NOTIFY_FILE_HANDLE_CLOSED_FILE_MODIFIED = 0x00000400,
+	PRJ_NOTIFY_FILE_HANDLE_CLOSED_FILE_DELETED = 0x00000800,
+	PRJ_NOTIFY_FILE_PRE_CONVERT_TO_FULL = 0x00001000,
+	PRJ_NOTIFY_USE_EXISTING_MASK = 0xFFFFFFFF
+} PRJ_NOTIFY_TYPES;
+
+typedef enum PRJ_NOTIFICATION {
+	PRJ_NOTIFICATION_FILE_OPENED = 0x00000002,
+	PRJ_NOTIFICATION_NEW_FILE_CREATED = 0x00000004,
+	PRJ_NOTIFICATION_FILE_OVERWRITTEN = 0x00000008,
+	PRJ_NOTIFICATION_PRE_DELETE = 0x00000010,
+	PRJ_NOTIFICATION_PRE_RENAME = 0x00000020,
+	PRJ_NOTIFICATION_PRE_SET_HARDLINK = 0x00000040,
+	PRJ_NOTIFICATION_FILE_RENAMED = 0x00000080,
+	PRJ_NOTIFICATION_HARDLINK_CREATED = 0x00000100,
+	PRJ_NOTIFICATION_FILE_HANDLE_CLOSED_NO_MODIFICATION = 0x00000200,
+	PRJ_NOTIFICATION_FILE_HANDLE_CLOSED_FILE_MODIFIED = 0x00000400,
+	PRJ_NOTIFICATION_FILE_HANDLE_CLOSED_FILE_DELETED = 0x00000800,
+	PRJ_NOTIFICATION_FILE_PRE_CONVERT_TO_FULL = 0x00001000
+} PRJ_NOTIFICATION;
+
+typedef union PRJ_NOTIFICATION_PARAMETERS {
+	struct {
+		PRJ_NOTIFY_TYPES NotificationMask;
+	} PostCreate;
+	struct {
+		PRJ_NOTIFY_TYPES NotificationMask;
+	} FileRenamed;
+	struct {
+		BOOLEAN IsFileModified;
+	} FileDeletedOnHandleClose;
+} PRJ_NOTIFICATION_PARAMETERS;
+
+typedef struct PRJ_NOTIFICATION_MAPPING {
+	PRJ_NOTIFY_TYPES NotificationBitMask;
+	PCWSTR NotificationRoot;
+} PRJ_NOTIFICATION_MAPPING;
+
+typedef enum PRJ_STARTVIRTUALIZING_FLAGS {
+	PRJ_FLAG_NONE = 0x00000000,
+	PRJ_FLAG_USE_NEGATIVE_PATH_CACHE = 0x00000001
+} PRJ_STARTVIRTUALIZING_FLAGS;
+
+typedef struct PRJ_STARTVIRTUALIZING_OPTIONS {
+	PRJ_STARTVIRTUALIZING_FLAGS Flags;
+	UINT32 PoolThreadCount;
+	UINT32 ConcurrentThreadCount;
+	PRJ_NOTIFICATION_MAPPING* NotificationMappings;
+	UINT32 NotificationMappingsCount;
+} PRJ_STARTVIRTUALIZING_OPTIONS;
+
+typedef enum PRJ_COMPLETE_COMMAND_TYPE {
+	PRJ_COMPLETE_COMMAND_TYPE_NOTIFICATION = 1,
+	PRJ_COMPLETE_COMMAND_TYPE_ENUMERATION = 2
+} PRJ_COMPLETE_COMMAND_TYPE;
+
+typedef struct PRJ_COMPLETE_COMMAND_EXTENDED_PARAMETERS {
+	PRJ_COMPLETE_COMMAND_TYPE CommandType;
+	union {
+		struct {
+			PRJ_NOTIFY_TYPES NotificationMask;
+		} Notification;
+		struct {
+			PRJ_DIR_ENTRY_BUFFER_HANDLE DirEntryBufferHandle;
+		} Enumeration;
+	};
+} PRJ_COMPLETE_COMMAND_EXTENDED_PARAMETERS;
+
+typedef HRESULT (*PRJ_START_DIRECTORY_ENUMERATION_CB)(
+	const PRJ_CALLBACK_DATA* callbackData,
+	const GUID* enumerationId
+);
+
+typedef HRESULT (*PRJ_END_DIRECTORY_ENUMERATION_CB)(
+	const PRJ_CALLBACK_DATA* callbackData,
+	const GUID* enumerationId
+);
+
+typedef HRESULT (*PRJ_GET_DIRECTORY_ENUMERATION_CB)(
+	const PRJ_CALLBACK_DATA* callbackData,
+	const GUID* enumerationId,
+	PCWSTR searchExpression,
+	PRJ_DIR_ENTRY_BUFFER_HANDLE dirEntryBufferHandle
+);
+
+typedef HRESULT (*PRJ_GET_PLACEHOLDER_INFO_CB)(
+	const PRJ_CALLBACK_DATA* callbackData
+);
+
+typedef HRESULT (*PRJ_GET_FILE_DATA_CB)(
+	const PRJ_CALLBACK_DATA* callbackData,
+	UINT64 byteOffset,
+	UINT32 length
+);
+
+typedef HRESULT (*PRJ_QUERY_FILE_NAME_CB)(
+	const PRJ_CALLBACK_DATA* callbackData
+);
+
+typedef HRESULT (*PRJ_NOTIFICATION_CB)(
+	const PRJ_CALLBACK_DATA* callbackData,
+	BOOLEAN isDirectory,
+	PRJ_NOTIFICATION notification,
+	PCWSTR destinationFileName,
+	PRJ_NOTIFICATION_PARAMETERS* operationParameters
+);
+
+typedef void (*PRJ_CANCEL_COMMAND_CB)(
+	const PRJ_CALLBACK_DATA* callbackData
+);
+
+typedef struct PRJ_CALLBACKS {
+	PRJ_START_DIRECTORY_ENUMERATION_CB StartDirectoryEnumerationCallback;
+	PRJ_END_DIRECTORY_ENUMERATION_CB EndDirectoryEnumerationCallback;
+	PRJ_GET_DIRECTORY_ENUMERATION_CB GetDirectoryEnumerationCallback;
+	PRJ_GET_PLACEHOLDER_INFO_CB GetPlaceholderInfoCallback;
+	PRJ_GET_FILE_DATA_CB GetFileDataCallback;
+	PRJ_QUERY_FILE_NAME_CB QueryFileNameCallback;
+	PRJ_NOTIFICATION_CB NotificationCallback;
+	PRJ_CANCEL_COMMAND_CB CancelCommandCallback;
+} PRJ_CALLBACKS;
+
+// ProjFS API
+HRESULT CoCreateGuid(GUID* guid);
+
+HRESULT PrjMarkDirectoryAsPlaceholder(
+	PCWSTR rootPathName,
+	PCWSTR targetPathName,
+	const PRJ_PLACEHOLDER_VERSION_INFO* versionInfo,
+	const GUID* virtualizationInstanceID
+);
+
+HRESULT PrjStartVirtualizing(
+	PCWSTR virtualizationRootPath,
+	const PRJ_CALLBACKS* callbacks,
+	const void* instanceContext,
+	const PRJ_STARTVIRTUALIZING_OPTIONS* options,
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT* namespaceVirtualizationContext
+);
+
+void PrjStopVirtualizing(
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT namespaceVirtualizationContext
+);
+
+HRESULT PrjGetVirtualizationInstanceInfo(
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT namespaceVirtualizationContext,
+	PRJ_VIRTUALIZATION_INSTANCE_INFO* virtualizationInstanceInfo
+);
+
+HRESULT PrjFillDirEntryBuffer(
+	PCWSTR fileName,
+	PRJ_FILE_BASIC_INFO* fileBasicInfo,
+	PRJ_DIR_ENTRY_BUFFER_HANDLE dirEntryBufferHandle
+);
+
+HRESULT PrjWritePlaceholderInfo(
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT namespaceVirtualizationContext,
+	PCWSTR destinationFileName,
+	const PRJ_PLACEHOLDER_INFO* placeholderInfo,
+	UINT32 placeholderInfoSize
+);
+
+void* PrjAllocateAlignedBuffer(
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT namespaceVirtualizationContext,
+	size_t size
+);
+
+void PrjFreeAlignedBuffer(
+	void* buffer
+);
+
+HRESULT PrjWriteFileData(
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT namespaceVirtualizationContext,
+	const GUID* dataStreamId,
+	void* buffer,
+	UINT64 byteOffset,
+	UINT32 length
+);
+
+HRESULT PrjCompleteCommand(
+	PRJ_NAMESPACE_VIRTUALIZATION_CONTEXT namespaceVirtualizationContext,
+	INT32 commandId,
+	HRESULT completionResult,
+	PRJ_COMPLETE_COMMAND_EXTENDED_PARAMETERS* extendedParameters
+);
+
+BOOLEAN PrjDoesNameContainWildCards(
+	PCWSTR fileName
+);
+
+BOOLEAN PrjFileNameMatch(
+	PCWSTR fileNameToCheck,
+	PCWSTR pattern
+);
+
+int PrjFileNameCompare(
+	PCWSTR fileName1,
+	PCWSTR fileName2
+);
+
+#endif // _WIN32
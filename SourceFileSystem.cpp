@@ -0,0 +1,787 @@
+#include "pch.h"
+#include "SourceFileSystem.h"
+
+#include <atomic>
+#include <cwchar>
+
+#ifdef _WIN32
+
+// Helper functions used to convert types
+inline INT64 FT2I64(FILETIME ft) {
+	return static_cast<INT64>(ft.dwHighDateTime) << 32 | ft.dwLowDateTime;
+}
+inline INT64 MI32I32(DWORD LOW, DWORD HIGH) {
+	return static_cast<INT64>(HIGH) << 32 | LOW;
+}
+
+bool SourceFileSystem::createDirectory(const std::wstring& path)
+{
+	if (!CreateDirectoryW(path.c_str(), nullptr)) {
+		return GetLastError() == ERROR_ALREADY_EXISTS;
+	}
+	return true;
+}
+
+HRESULT SourceFileSystem::getFileInfo(const std::wstring& path, PRJ_FILE_BASIC_INFO& fileInfo)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, static_cast<LPVOID>(&attributes))) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	fileInfo = PRJ_FILE_BASIC_INFO();
+	fileInfo.IsDirectory = attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ? TRUE : FALSE;
+	fileInfo.FileSize = fileInfo.IsDirectory ? 0 : MI32I32(attributes.nFileSizeLow, attributes.nFileSizeHigh);
+	fileInfo.CreationTime.QuadPart = FT2I64(attributes.ftCreationTime);
+	fileInfo.LastAccessTime.QuadPart = FT2I64(attributes.ftLastAccessTime);
+	fileInfo.LastWriteTime.QuadPart = FT2I64(attributes.ftLastWriteTime);
+	fileInfo.ChangeTime.QuadPart = FT2I64(attributes.ftLastWriteTime);
+	fileInfo.FileAttributes = attributes.dwFileAttributes;
+	return S_OK;
+}
+
+HRESULT SourceFileSystem::getFileIdentity(const std::wstring& path, FileIdentity& identity)
+{
+	HANDLE file = CreateFileW(
+		path.c_str(),
+		FILE_READ_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS,
+		NULL
+	);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	HRESULT hr = getFileIdentity(file, identity);
+	CloseHandle(file);
+	return hr;
+}
+
+HRESULT SourceFileSystem::getFileIdentity(FileHandle file, FileIdentity& identity)
+{
+	BY_HANDLE_FILE_INFORMATION information;
+	if (!GetFileInformationByHandle(file, &information)) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	identity.volume = information.dwVolumeSerialNumber;
+	identity.file = static_cast<UINT64>(MI32I32(information.nFileIndexLow, information.nFileIndexHigh));
+	identity.version = FT2I64(information.ftLastWriteTime);
+	identity.size = MI32I32(information.nFileSizeLow, information.nFileSizeHigh);
+	return S_OK;
+}
+
+INT64 SourceFileSystem::currentFileTime()
+{
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+	return FT2I64(now);
+}
+
+HRESULT SourceFileSystem::listDirectory(const std::wstring& path, const EntryCallback& callback)
+{
+	WIN32_FIND_DATAW fileData;
+	std::wstring pattern = path + L"\\*";
+
+	HANDLE hFind = FindFirstFileExW(
+		pattern.c_str(),
+		FindExInfoBasic,
+		&fileData,
+		FindExSearchNameMatch,
+		NULL,
+		FIND_FIRST_EX_LARGE_FETCH
+	);
+
+	if (hFind == INVALID_HANDLE_VALUE) {
+		DWORD err = GetLastError();
+		// An empty directory still has . and .., so this means the directory is missing
+		return HRESULT_FROM_WIN32(err == ERROR_FILE_NOT_FOUND ? ERROR_PATH_NOT_FOUND : err);
+	}
+
+	do {
+		if (fileData.cFileName[0] == L'.' && (fileData.cFileName[1] == L'\0' ||
+			(fileData.cFileName[1] == L'.' && fileData.cFileName[2] == L'\0'))
+		) {
+			continue;
+		}
+
+		PRJ_FILE_BASIC_INFO fileInfo = {};
+		fileInfo.IsDirectory = (fileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? TRUE : FALSE;
+		fileInfo.FileSize = fileInfo.IsDirectory ? 0 : MI32I32(fileData.nFileSizeLow, fileData.nFileSizeHigh);
+		fileInfo.CreationTime.QuadPart = FT2I64(fileData.ftCreationTime);
+		fileInfo.LastAccessTime.QuadPart = FT2I64(fileData.ftLastAccessTime);
+		fileInfo.LastWriteTime.QuadPart = FT2I64(fileData.ftLastWriteTime);
+		fileInfo.ChangeTime.QuadPart = FT2I64(fileData.ftLastWriteTime);
+		fileInfo.FileAttributes = fileData.dwFileAttributes;
+
+		callback(fileData.cFileName, fileInfo);
+	} while (FindNextFileW(hFind, &fileData));
+
+	FindClose(hFind);
+	return S_OK;
+}
+
+HRESULT SourceFileSystem::readFile(const std::wstring& path, UINT64 offset, UINT32 length, void* buffer)
+{
+	HANDLE file;
+	HRESULT hr = openForReading(path, file);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	hr = readFile(file, offset, length, buffer);
+	CloseHandle(file);
+	return hr;
+}
+
+HRESULT SourceFileSystem::readFile(FileHandle file, UINT64 offset, UINT32 length, void* buffer)
+{
+	UINT32 done = 0;
+	while (done < length) {
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = static_cast<DWORD>(offset + done);
+		overlapped.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+
+		DWORD read = 0;
+		if (!ReadFile(file, static_cast<BYTE*>(buffer) + done, length - done, &read, &overlapped)) {
+			return HRESULT_FROM_WIN32(GetLastError());
+		}
+		if (read == 0) {
+			return HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+		}
+		done += read;
+	}
+	return S_OK;
+}
+
+HRESULT SourceFileSystem::openForReading(const std::wstring& path, FileHandle& file, bool asynchronous)
+{
+	file = CreateFileW(
+		path.c_str(),
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN | (asynchronous ? FILE_FLAG_OVERLAPPED : 0),
+		NULL
+	);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	return S_OK;
+}
+
+void SourceFileSystem::closeFile(FileHandle file)
+{
+	CloseHandle(file);
+}
+
+HRESULT SourceFileSystem::openForWriting(const std::wstring& path, FileHandle& file)
+{
+	file = CreateFileW(
+		path.c_str(),
+		GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_DELETE,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_FLAG_SEQUENTIAL_SCAN,
+		NULL
+	);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	return S_OK;
+}
+
+HRESULT SourceFileSystem::writeFile(FileHandle file, UINT64 offset, UINT32 length, const void* buffer)
+{
+	UINT32 done = 0;
+	while (done < length) {
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = static_cast<DWORD>(offset + done);
+		overlapped.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+
+		DWORD written = 0;
+		if (!WriteFile(file, static_cast<const BYTE*>(buffer) + done, length - done, &written, &overlapped)) {
+			return HRESULT_FROM_WIN32(GetLastError());
+		}
+		done += written;
+	}
+	return S_OK;
+}
+
+HRESULT SourceFileSystem::syncFile(FileHandle file)
+{
+	if (!FlushFileBuffers(file)) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	return S_OK;
+}
+
+HRESULT SourceFileSystem::syncVolume(const std::wstring& path)
+{
+	// Flushing a volume handle takes administrator rights
+	return E_NOTIMPL;
+}
+
+HRESULT SourceFileSystem::readFileUnbuffered(const std::wstring& path, UINT64 offset, UINT32 length, void* buffer)
+{
+	if (offset % UNBUFFERED_ALIGNMENT != 0 || reinterpret_cast<UINT_PTR>(buffer) % UNBUFFERED_ALIGNMENT != 0) {
+		return readFile(path, offset, length, buffer);
+	}
+
+	HANDLE file = CreateFileW(
+		path.c_str(),
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN,
+		NULL
+	);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	// Whole sectors are read; the last one may run past the end of the file
+	UINT64 rounded = (static_cast<UINT64>(length) + UNBUFFERED_ALIGNMENT - 1) / UNBUFFERED_ALIGNMENT * UNBUFFERED_ALIGNMENT;
+	HRESULT hr = S_OK;
+	UINT64 done = 0;
+	while (done < length) {
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = static_cast<DWORD>(offset + done);
+		overlapped.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+
+		DWORD read = 0;
+		DWORD request = static_cast<DWORD>(std::min<UINT64>(rounded - done, 0x80000000ull));
+		if (!ReadFile(file, static_cast<BYTE*>(buffer) + done, request, &read, &overlapped)) {
+			hr = HRESULT_FROM_WIN32(GetLastError());
+			break;
+		}
+		if (read == 0 || (read % UNBUFFERED_ALIGNMENT != 0 && done + read < length)) {
+			hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+			break;
+		}
+		done += read;
+	}
+
+	CloseHandle(file);
+	return hr;
+}
+
+std::wstring SourceFileSystem::temporaryDirectory()
+{
+	WCHAR buffer[MAX_PATH + 1];
+	DWORD length = GetTempPathW(MAX_PATH + 1, buffer);
+	std::wstring path(buffer, length);
+	while (!path.empty() && path.back() == L'\\')
+		path.pop_back();
+	return path;
+}
+
+std::wstring SourceFileSystem::uniqueFilePath(const std::wstring& directory, const WCHAR* prefix)
+{
+	static std::atomic<UINT32> counter(0);
+	WCHAR name[64];
+	swprintf(name, 64, L"%ls-%lu-%lu.tmp", prefix,
+		static_cast<unsigned long>(GetCurrentProcessId()),
+		static_cast<unsigned long>(counter.fetch_add(1)));
+	return directory + L"\\" + name;
+}
+
+FILE* SourceFileSystem::openFile(const std::wstring& path, const char* mode)
+{
+	WCHAR wideMode[8] = {};
+	for (size_t i = 0; i < 7 && mode[i] != '\0'; i++)
+		wideMode[i] = static_cast<WCHAR>(mode[i]);
+
+	FILE* file = nullptr;
+	if (_wfopen_s(&file, path.c_str(), wideMode) != 0)
+		return nullptr;
+	return file;
+}
+
+bool SourceFileSystem::removeFile(const std::wstring& path)
+{
+	return DeleteFileW(path.c_str()) != FALSE;
+}
+
+bool SourceFileSystem::replaceFile(const std::wstring& from, const std::wstring& to)
+{
+	return MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE;
+}
+
+HRESULT SourceFileSystem::mapFile(const std::wstring& path, MappedFile& mapped)
+{
+	mapped = MappedFile();
+
+	// Sharing delete lets the file be replaced once the view is unmapped
+	HANDLE file = CreateFileW(
+		path.c_str(),
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_FLAG_RANDOM_ACCESS,
+		NULL
+	);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT);
+	}
+
+	HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	// The view keeps the mapping, and the mapping the file, open
+	const void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	DWORD err = GetLastError();
+	CloseHandle(mapping);
+	if (view == NULL) {
+		return HRESULT_FROM_WIN32(err);
+	}
+
+	mapped.data = view;
+	mapped.size = static_cast<UINT64>(size.QuadPart);
+	return S_OK;
+}
+
+void SourceFileSystem::unmapFile(MappedFile& mapped)
+{
+	if (mapped.data != nullptr) {
+		UnmapViewOfFile(mapped.data);
+	}
+	mapped = MappedFile();
+}
+
+#else
+
+#include <cerrno>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Seconds between 1601-01-01 (FILETIME epoch) and 1970-01-01 (Unix epoch)
+static const INT64 FILETIME_UNIX_EPOCH = 11644473600LL;
+
+static inline INT64 timespecToFileTime(const struct timespec& ts) {
+	return (static_cast<INT64>(ts.tv_sec) + FILETIME_UNIX_EPOCH) * 10000000LL + ts.tv_nsec / 100;
+}
+
+static void statToBasicInfo(const struct stat& st, PRJ_FILE_BASIC_INFO& fileInfo) {
+	fileInfo = PRJ_FILE_BASIC_INFO();
+	fileInfo.IsDirectory = S_ISDIR(st.st_mode) ? TRUE : FALSE;
+	fileInfo.FileSize = fileInfo.IsDirectory ? 0 : static_cast<INT64>(st.st_size);
+	fileInfo.CreationTime.QuadPart = timespecToFileTime(st.st_mtim);
+	fileInfo.LastAccessTime.QuadPart = timespecToFileTime(st.st_atim);
+	fileInfo.LastWriteTime.QuadPart = timespecToFileTime(st.st_mtim);
+	fileInfo.ChangeTime.QuadPart = timespecToFileTime(st.st_ctim);
+	fileInfo.FileAttributes = fileInfo.IsDirectory ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+	if (!(st.st_mode & S_IWUSR))
+		fileInfo.FileAttributes = (fileInfo.FileAttributes & ~FILE_ATTRIBUTE_NORMAL) | FILE_ATTRIBUTE_READONLY;
+}
+
+/*
+	Paths are encoded as UTF-8. Bytes which are not valid UTF-8 are carried through as lone
+	surrogates U+DC80..U+DCFF, so every native name survives the round trip.
+*/
+std::string SourceFileSystem::toNativePath(const std::wstring& path)
+{
+	std::string out;
+	out.reserve(path.size());
+
+	for (wchar_t wc : path) {
+		UINT32 c = static_cast<UINT32>(wc);
+		if (c == L'\\') {
+			out += '/';
+		} else if (c < 0x80) {
+			out += static_cast<char>(c);
+		} else if (c >= 0xDC80 && c <= 0xDCFF) {
+			out += static_cast<char>(c - 0xDC00);
+		} else if (c < 0x800) {
+			out += static_cast<char>(0xC0 | (c >> 6));
+			out += static_cast<char>(0x80 | (c & 0x3F));
+		} else if (c < 0x10000) {
+			out += static_cast<char>(0xE0 | (c >> 12));
+			out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+			out += static_cast<char>(0x80 | (c & 0x3F));
+		} else {
+			out += static_cast<char>(0xF0 | (c >> 18));
+			out += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+			out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+			out += static_cast<char>(0x80 | (c & 0x3F));
+		}
+	}
+
+	return out;
+}
+
+std::wstring SourceFileSystem::fromNativePath(const char* path)
+{
+	std::wstring out;
+	const unsigned char* s = reinterpret_cast<const unsigned char*>(path);
+
+	while (*s) {
+		UINT32 c = *s;
+		int extra = c >= 0xF8 ? 0 : c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC2 ? 1 : 0;
+		if (c < 0x80) {
+			out += static_cast<wchar_t>(c);
+			s++;
+			continue;
+		}
+
+		UINT32 value = c & (0x3F >> extra);
+		int i = 1;
+		for (; extra && i <= extra; i++) {
+			if ((s[i] & 0xC0) != 0x80)
+				break;
+			value = value << 6 | (s[i] & 0x3F);
+		}
+
+		if (extra == 0 || i <= extra || value > 0x10FFFF || (value >= 0xD800 && value < 0xE000)) {
+			out += static_cast<wchar_t>(0xDC00 + c);
+			s++;
+		} else {
+			out += static_cast<wchar_t>(value);
+			s += extra + 1;
+		}
+	}
+
+	return out;
+}
+
+HRESULT SourceFileSystem::errorFromErrno(int err)
+{
+	switch (err) {
+	case 0:
+		return S_OK;
+	case ENOENT:
+		return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+	case ENOTDIR:
+		return HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND);
+	case EACCES:
+	case EPERM:
+		return HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED);
+	case EMFILE:
+	case ENFILE:
+		return HRESULT_FROM_WIN32(ERROR_TOO_MANY_OPEN_FILES);
+	case ENOMEM:
+		return E_OUTOFMEMORY;
+	case EINVAL:
+		return E_INVALIDARG;
+	case ECANCELED:
+		return HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+	default:
+		return HRESULT_FROM_WIN32(ERROR_GEN_FAILURE);
+	}
+}
+
+bool SourceFileSystem::createDirectory(const std::wstring& path)
+{
+	if (mkdir(toNativePath(path).c_str(), 0777) != 0) {
+		return errno == EEXIST;
+	}
+	return true;
+}
+
+HRESULT SourceFileSystem::getFileInfo(const std::wstring& path, PRJ_FILE_BASIC_INFO& fileInfo)
+{
+	struct stat st;
+	if (stat(toNativePath(path).c_str(), &st) != 0) {
+		return errorFromErrno(errno);
+	}
+
+	statToBasicInfo(st, fileInfo);
+	return S_OK;
+}
+
+// Any write to the file moves its ctime
+static void statToIdentity(const struct stat& st, SourceFileSystem::FileIdentity& identity) {
+	identity.volume = static_cast<UINT64>(st.st_dev);
+	identity.file = static_cast<UINT64>(st.st_ino);
+	identity.version = timespecToFileTime(st.st_ctim);
+	identity.size = static_cast<INT64>(st.st_size);
+}
+
+HRESULT SourceFileSystem::getFileIdentity(const std::wstring& path, FileIdentity& identity)
+{
+	struct stat st;
+	if (stat(toNativePath(path).c_str(), &st) != 0) {
+		return errorFromErrno(errno);
+	}
+
+	statToIdentity(st, identity);
+	return S_OK;
+}
+
+HRESULT SourceFileSystem::getFileIdentity(FileHandle file, FileIdentity& identity)
+{
+	struct stat st;
+	if (fstat(file, &st) != 0) {
+		return errorFromErrno(errno);
+	}
+
+	statToIdentity(st, identity);
+	return S_OK;
+}
+
+INT64 SourceFileSystem::currentFileTime()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return timespecToFileTime(now);
+}
+
+HRESULT SourceFileSystem::listDirectory(const std::wstring& path, const EntryCallback& callback)
+{
+	DIR* dir = opendir(toNativePath(path).c_str());
+	if (dir == nullptr) {
+		return errorFromErrno(errno);
+	}
+
+	int fd = dirfd(dir);
+	std::wstring name;
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != nullptr) {
+		if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0' ||
+			(entry->d_name[1] == '.' && entry->d_name[2] == '\0'))
+		) {
+			continue;
+		}
+
+		// Entries that vanish or dangle between readdir and fstatat are skipped
+		struct stat st;
+		if (fstatat(fd, entry->d_name, &st, 0) != 0)
+			continue;
+
+		PRJ_FILE_BASIC_INFO fileInfo;
+		statToBasicInfo(st, fileInfo);
+		name = fromNativePath(entry->d_name);
+		callback(name.c_str(), fileInfo);
+	}
+
+	closedir(dir);
+	return S_OK;
+}
+
+HRESULT SourceFileSystem::readFile(const std::wstring& path, UINT64 offset, UINT32 length, void* buffer)
+{
+	int fd;
+	HRESULT hr = openForReading(path, fd);
+	if (FAILED(hr)) {
+		return hr;
+	}
+
+	hr = readFile(fd, offset, length, buffer);
+	close(fd);
+	return hr;
+}
+
+HRESULT SourceFileSystem::readFile(FileHandle file, UINT64 offset, UINT32 length, void* buffer)
+{
+	UINT32 done = 0;
+	while (done < length) {
+		ssize_t got = pread(file, static_cast<char*>(buffer) + done, length - done, offset + done);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			return errorFromErrno(errno);
+		}
+		if (got == 0) {
+			return HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+		}
+		done += static_cast<UINT32>(got);
+	}
+	return S_OK;
+}
+
+HRESULT SourceFileSystem::openForReading(const std::wstring& path, FileHandle& file, bool asynchronous)
+{
+	// io_uring reads any descriptor, so a file read through the ring needs no special open flags
+	UNREFERENCED_PARAMETER(asynchronous);
+	file = open(toNativePath(path).c_str(), O_RDONLY | O_CLOEXEC);
+	if (file < 0) {
+		return errorFromErrno(errno);
+	}
+	return S_OK;
+}
+
+void SourceFileSystem::closeFile(FileHandle file)
+{
+	close(file);
+}
+
+HRESULT SourceFileSystem::openForWriting(const std::wstring& path, FileHandle& file)
+{
+	file = open(toNativePath(path).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (file < 0) {
+		return errorFromErrno(errno);
+	}
+	return S_OK;
+}
+
+HRESULT SourceFileSystem::writeFile(FileHandle file, UINT64 offset, UINT32 length, const void* buffer)
+{
+	UINT32 done = 0;
+	while (done < length) {
+		ssize_t wrote = pwrite(file, static_cast<const char*>(buffer) + done, length - done, offset + done);
+		if (wrote < 0) {
+			if (errno == EINTR)
+				continue;
+			return errorFromErrno(errno);
+		}
+		done += static_cast<UINT32>(wrote);
+	}
+	return S_OK;
+}
+
+HRESULT SourceFileSystem::syncFile(FileHandle file)
+{
+	if (fsync(file) != 0) {
+		return errorFromErrno(errno);
+	}
+	return S_OK;
+}
+
+HRESULT SourceFileSystem::syncVolume(const std::wstring& path)
+{
+#ifdef __linux__
+	int fd = open(toNativePath(path).c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return errorFromErrno(errno);
+	}
+	int result = syncfs(fd);
+	int err = errno;
+	close(fd);
+	return result == 0 ? S_OK : errorFromErrno(err);
+#else
+	return E_NOTIMPL;
+#endif
+}
+
+HRESULT SourceFileSystem::readFileUnbuffered(const std::wstring& path, UINT64 offset, UINT32 length, void* buffer)
+{
+	if (offset % UNBUFFERED_ALIGNMENT != 0 || reinterpret_cast<uintptr_t>(buffer) % UNBUFFERED_ALIGNMENT != 0) {
+		return readFile(path, offset, length, buffer);
+	}
+
+	// File systems without direct I/O, such as tmpfs, refuse O_DIRECT when the file is opened
+	int fd = open(toNativePath(path).c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+	if (fd < 0) {
+		return errno == EINVAL ? readFile(path, offset, length, buffer) : errorFromErrno(errno);
+	}
+
+	// Whole blocks are read; the last one may run past the end of the file
+	UINT64 rounded = (static_cast<UINT64>(length) + UNBUFFERED_ALIGNMENT - 1) / UNBUFFERED_ALIGNMENT * UNBUFFERED_ALIGNMENT;
+	HRESULT hr = S_OK;
+	UINT64 done = 0;
+	while (done < length) {
+		ssize_t got = pread(fd, static_cast<char*>(buffer) + done, static_cast<size_t>(rounded - done), offset + done);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			hr = errno == EINVAL ? readFile(path, offset, length, buffer) : errorFromErrno(errno);
+			break;
+		}
+		if (got == 0 || (got % UNBUFFERED_ALIGNMENT != 0 && done + got < length)) {
+			hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+			break;
+		}
+		done += static_cast<UINT64>(got);
+	}
+
+	close(fd);
+	return hr;
+}
+
+std::wstring SourceFileSystem::temporaryDirectory()
+{
+	const char* tmp = getenv("TMPDIR");
+	std::wstring path = fromNativePath(tmp != nullptr && tmp[0] != '\0' ? tmp : "/tmp");
+	while (path.size() > 1 && (path.back() == L'/' || path.back() == L'\\'))
+		path.pop_back();
+	return path;
+}
+
+std::wstring SourceFileSystem::uniqueFilePath(const std::wstring& directory, const WCHAR* prefix)
+{
+	static std::atomic<UINT32> counter(0);
+	WCHAR name[64];
+	swprintf(name, 64, L"%ls-%ld-%lu.tmp", prefix,
+		static_cast<long>(getpid()),
+		static_cast<unsigned long>(counter.fetch_add(1)));
+	return directory + L"\\" + name;
+}
+
+FILE* SourceFileSystem::openFile(const std::wstring& path, const char* mode)
+{
+	return fopen(toNativePath(path).c_str(), mode);
+}
+
+bool SourceFileSystem::removeFile(const std::wstring& path)
+{
+	return unlink(toNativePath(path).c_str()) == 0;
+}
+
+bool SourceFileSystem::replaceFile(const std::wstring& from, const std::wstring& to)
+{
+	return rename(toNativePath(from).c_str(), toNativePath(to).c_str()) == 0;
+}
+
+HRESULT SourceFileSystem::mapFile(const std::wstring& path, MappedFile& mapped)
+{
+	mapped = MappedFile();
+
+	int fd = open(toNativePath(path).c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return errorFromErrno(errno);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT);
+	}
+
+	// The mapping keeps the file alive after the descriptor is closed
+	void* view = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+	int err = errno;
+	close(fd);
+	if (view == MAP_FAILED) {
+		return errorFromErrno(err);
+	}
+
+	mapped.data = view;
+	mapped.size = static_cast<UINT64>(st.st_size);
+	return S_OK;
+}
+
+void SourceFileSystem::unmapFile(MappedFile& mapped)
+{
+	if (mapped.data != nullptr) {
+		munmap(const_cast<void*>(mapped.data), static_cast<size_t>(mapped.size));
+	}
+	mapped = MappedFile();
+}
+
+#endif // _WIN32
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "pch.h"
+#include <cstdio>
+#include <functional>
+#include <string>
+
+/*
+	SourceFileSystem is the thin platform layer between the provider and the source store. Paths
+	are given the way the provider builds them (backslash separated); the POSIX implementation
+	translates them to native paths.
+*/
+class SourceFileSystem
+{
+public:
+	// Receives one entry at a time from listDirectory; "." and ".." are never reported
+	typedef std::function<void(PCWSTR name, const PRJ_FILE_BASIC_INFO& fileInfo)> EntryCallback;
+
+	// Names a file's contents: which file it is, whatever path reaches it, and a version that
+	// changes whenever the contents do
+	class FileIdentity {
+	public:
+		UINT64 volume;
+		UINT64 file;
+		INT64 version;
+		INT64 size;
+	};
+
+	// An open source file, read at explicit offsets so one handle serves any number of threads
+#ifdef _WIN32
+	typedef HANDLE FileHandle;
+#else
+	typedef int FileHandle;
+#endif
+
+	// Creates a directory; returns true if it exists afterwards
+	static bool createDirectory(const std::wstring& path);
+
+	// Gets the basic information of a file or directory
+	static HRESULT getFileInfo(const std::wstring& path, PRJ_FILE_BASIC_INFO& fileInfo);
+
+	static HRESULT getFileIdentity(const std::wstring& path, FileIdentity& identity);
+	static HRESULT getFileIdentity(FileHandle file, FileIdentity& identity);
+
+	// Reports every entry in a directory, in no particular order
+	static HRESULT listDirectory(const std::wstring& path, const EntryCallback& callback);
+
+	// The current time in the units of PRJ_FILE_BASIC_INFO timestamps (FILETIME ticks)
+	static INT64 currentFileTime();
+
+	// Reads exactly length bytes at offset; running into the end of the file is an error
+	static HRESULT readFile(const std::wstring& path, UINT64 offset, UINT32 length, void* buffer);
+	static HRESULT readFile(FileHandle file, UINT64 offset, UINT32 length, void* buffer);
+
+	// Opens a file for reading without keeping others from changing, renaming or deleting it.
+	// An asynchronous handle is opened for overlapped I/O on Windows; POSIX descriptors serve both
+	static HRESULT openForReading(const std::wstring& path, FileHandle& file, bool asynchronous = false);
+	static void closeFile(FileHandle file);
+
+	// Creates or truncates a file to write the source through; others may read it meanwhile
+	static HRESULT openForWriting(const std::wstring& path, FileHandle& file);
+
+	// Writes all of length bytes at offset
+	static HRESULT writeFile(FileHandle file, UINT64 offset, UINT32 length, const void* buffer);
+
+	// Waits until what was written to the file is on stable storage
+	static HRESULT syncFile(FileHandle file);
+
+	// Syncs every file written on the volume holding path at once; E_NOTIMPL where that needs
+	// more than a user's rights, as on Windows, and each file must be synced instead
+	static HRESULT syncVolume(const std::wstring& path);
+
+	// Alignment of the offsets and buffers of unbuffered reads, which covers common sector sizes
+	static const UINT32 UNBUFFERED_ALIGNMENT = 4096;
+
+	/*
+		Reads like readFile but bypasses the system's file cache (FILE_FLAG_NO_BUFFERING, O_DIRECT).
+		offset and buffer must be multiples of UNBUFFERED_ALIGNMENT, and the buffer must have room
+		for length rounded up to one. A misaligned request, or a file system that cannot read
+		unbuffered, gets a buffered read instead.
+	*/
+	static HRESULT readFileUnbuffered(const std::wstring& path, UINT64 offset, UINT32 length, void* buffer);
+
+	// Local scratch files the provider keeps for itself, such as enumeration spill runs
+
+	// The system's directory for temporary files, without a trailing separator
+	static std::wstring temporaryDirectory();
+
+	// A path in directory no other thread or process will pick, starting with prefix
+	static std::wstring uniqueFilePath(const std::wstring& directory, const WCHAR* prefix);
+
+	// Opens a file with fopen modes; returns nullptr on failure
+	static FILE* openFile(const std::wstring& path, const char* mode);
+
+	static bool removeFile(const std::wstring& path);
+
+	// Renames from onto to, replacing to if it exists
+	static bool replaceFile(const std::wstring& from, const std::wstring& to);
+
+	// A whole file mapped read-only into memory
+	class MappedFile {
+	public:
+		const void* data;
+		UINT64 size;
+
+		MappedFile() : data(nullptr), size(0) {}
+	};
+
+	// Maps a file, which must not be empty; the view stays valid until unmapFile, even if the
+	// file is replaced or removed in the meantime on POSIX
+	static HRESULT mapFile(const std::wstring& path, MappedFile& mapped);
+	static void unmapFile(MappedFile& mapped);
+
+#ifndef _WIN32
+	// Conversions between provider paths and native UTF-8 paths
+	static std::string toNativePath(const std::wstring& path);
+	static std::wstring fromNativePath(const char* path);
+
+	// Maps an errno value to the HRESULT the Windows implementation would return
+	static HRESULT errorFromErrno(int err);
+#endif
+};
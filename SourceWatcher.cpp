@@ -0,0 +1,494 @@
+#include "pch.h"
+#include "SourceWatcher.h"
+#include "SourceFileSystem.h"
+
+#include <algorithm>
+
+// Bytes of events read from the system at once
+static const size_t WATCH_BUFFER_BYTES = 64 * 1024;
+
+SourceWatcher::~SourceWatcher()
+{
+	stop();
+}
+
+bool SourceWatcher::ignored(const WCHAR* name, size_t length) const
+{
+	const std::wstring& prefix = options.ignore_prefix;
+	return !prefix.empty() && length >= prefix.size() && prefix.compare(0, prefix.size(), name, prefix.size()) == 0;
+}
+
+void SourceWatcher::record(const std::wstring& path, UINT32 action, bool isDirectory, bool directoryKnown)
+{
+	events.fetch_add(1, std::memory_order_relaxed);
+
+	// Everything is rescanned after an overflow anyway
+	if (overflowed) {
+		return;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	if (batch.empty()) {
+		batch_opened = now;
+	}
+	last_event = now;
+
+	auto found = batched.find(path);
+	if (found != batched.end()) {
+		Change& change = batch[found->second];
+		change.actions |= action;
+		change.directory = change.directory || isDirectory;
+		change.directory_known = change.directory_known || directoryKnown;
+		return;
+	}
+
+	Change change;
+	change.path = path;
+	change.actions = action;
+	change.directory = isDirectory;
+	change.directory_known = directoryKnown;
+	batched.emplace(path, batch.size());
+	batch.push_back(std::move(change));
+}
+
+int SourceWatcher::msUntilDue() const
+{
+	if (overflowed || batch.size() >= options.max_batch) {
+		return 0;
+	}
+	if (batch.empty()) {
+		return -1;
+	}
+
+	auto due = std::min(
+		last_event + std::chrono::milliseconds(options.quiet_period),
+		batch_opened + std::chrono::milliseconds(options.max_latency));
+	auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(due - std::chrono::steady_clock::now()).count();
+	return wait > 0 ? static_cast<int>(wait) : 0;
+}
+
+void SourceWatcher::flush()
+{
+	if (overflowed) {
+		batch.clear();
+		batched.clear();
+		overflowed = false;
+		overflows.fetch_add(1, std::memory_order_relaxed);
+		if (onOverflow) {
+			onOverflow();
+		}
+		return;
+	}
+	if (batch.empty()) {
+		return;
+	}
+
+	batches.fetch_add(1, std::memory_order_relaxed);
+	changes.fetch_add(batch.size(), std::memory_order_relaxed);
+	if (onChange) {
+		onChange(batch);
+	}
+	batch.clear();
+	batched.clear();
+}
+
+void SourceWatcher::printStatistics(FILE* out)
+{
+	UINT64 changed = changes.load(std::memory_order_relaxed);
+	UINT64 seen = events.load(std::memory_order_relaxed);
+	fprintf(out, "  source watcher: %llu events coalesced into %llu changes (%.1f%%) in %llu batches, %llu overflows, %llu directories unwatched\n",
+		static_cast<unsigned long long>(seen),
+		static_cast<unsigned long long>(changed),
+		seen != 0 ? 100.0 * changed / seen : 0.0,
+		static_cast<unsigned long long>(batches.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(overflows.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(watch_failures.load(std::memory_order_relaxed)));
+}
+
+#ifdef _WIN32
+
+SourceWatcher::SourceWatcher() :
+	stopping(false),
+	overflowed(false),
+	events(0),
+	changes(0),
+	batches(0),
+	overflows(0),
+	watch_failures(0),
+	directory(INVALID_HANDLE_VALUE),
+	wake(NULL),
+	overlapped()
+{
+}
+
+HRESULT SourceWatcher::start(
+	const std::wstring& sourceRoot,
+	const Options& watchOptions,
+	const ChangeHandler& changed,
+	const OverflowHandler& overflow
+) {
+	stop();
+	root = sourceRoot;
+	options = watchOptions;
+	onChange = changed;
+	onOverflow = overflow;
+
+	directory = CreateFileW(
+		root.c_str(),
+		FILE_LIST_DIRECTORY,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+		NULL
+	);
+	if (directory == INVALID_HANDLE_VALUE) {
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+
+	overlapped = OVERLAPPED();
+	overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	wake = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (overlapped.hEvent == NULL || wake == NULL) {
+		HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+		stop();
+		return hr;
+	}
+
+	buffer.assign(WATCH_BUFFER_BYTES / sizeof(DWORD), 0);
+	stopping = false;
+	if (!readChanges()) {
+		HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+		stop();
+		return hr;
+	}
+	thread = std::thread(&SourceWatcher::run, this);
+	return S_OK;
+}
+
+void SourceWatcher::stop()
+{
+	if (thread.joinable()) {
+		stopping = true;
+		SetEvent(wake);
+		thread.join();
+	}
+
+	if (directory != INVALID_HANDLE_VALUE) {
+		// The read still outstanding must finish before its buffer goes away
+		DWORD bytes;
+		CancelIoEx(directory, &overlapped);
+		GetOverlappedResult(directory, &overlapped, &bytes, TRUE);
+		CloseHandle(directory);
+		directory = INVALID_HANDLE_VALUE;
+	}
+	if (overlapped.hEvent != NULL) {
+		CloseHandle(overlapped.hEvent);
+		overlapped.hEvent = NULL;
+	}
+	if (wake != NULL) {
+		CloseHandle(wake);
+		wake = NULL;
+	}
+	batch.clear();
+	batched.clear();
+	overflowed = false;
+}
+
+bool SourceWatcher::readChanges()
+{
+	ResetEvent(overlapped.hEvent);
+	return ReadDirectoryChangesW(
+		directory,
+		buffer.data(),
+		static_cast<DWORD>(buffer.size() * sizeof(DWORD)),
+		TRUE,
+		FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE |
+			FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_CREATION,
+		NULL,
+		&overlapped,
+		NULL
+	) != FALSE;
+}
+
+void SourceWatcher::parseChanges(DWORD bytes)
+{
+	const UINT8* next = reinterpret_cast<const UINT8*>(buffer.data());
+	const UINT8* end = next + bytes;
+	while (next + sizeof(FILE_NOTIFY_INFORMATION) <= end) {
+		const FILE_NOTIFY_INFORMATION* info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(next);
+		std::wstring relative(info->FileName, info->FileNameLength / sizeof(WCHAR));
+		size_t slash = relative.find_last_of(L'\\');
+		size_t nameStart = slash == std::wstring::npos ? 0 : slash + 1;
+		bool skip = ignored(relative.c_str() + nameStart, relative.size() - nameStart);
+		std::wstring path = root + L"\\" + relative;
+
+		UINT32 action = 0;
+		switch (info->Action) {
+		case FILE_ACTION_ADDED:
+		case FILE_ACTION_RENAMED_NEW_NAME:
+			action = ACTION_ADDED;
+			break;
+		case FILE_ACTION_REMOVED:
+		case FILE_ACTION_RENAMED_OLD_NAME:
+			action = ACTION_REMOVED;
+			break;
+		case FILE_ACTION_MODIFIED:
+			action = ACTION_MODIFIED;
+			break;
+		}
+
+		if (action != 0 && !skip) {
+			// A removed path can no longer be asked what it was
+			bool isDirectory = false;
+			if (action != ACTION_REMOVED) {
+				DWORD attributes = GetFileAttributesW(path.c_str());
+				isDirectory = attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+			}
+			record(path, action, isDirectory, action != ACTION_REMOVED);
+		}
+
+		if (info->NextEntryOffset == 0) {
+			break;
+		}
+		next += info->NextEntryOffset;
+	}
+}
+
+void SourceWatcher::run()
+{
+	HANDLE handles[2] = { overlapped.hEvent, wake };
+	while (!stopping) {
+		int due = msUntilDue();
+		DWORD waited = WaitForMultipleObjects(2, handles, FALSE, due < 0 ? INFINITE : static_cast<DWORD>(due));
+		if (waited == WAIT_OBJECT_0 + 1 || waited == WAIT_FAILED) {
+			break;
+		}
+
+		if (waited == WAIT_OBJECT_0) {
+			// No bytes means the system's buffer overflowed and the changes were dropped
+			DWORD bytes = 0;
+			if (GetOverlappedResult(directory, &overlapped, &bytes, FALSE) && bytes != 0) {
+				parseChanges(bytes);
+			} else {
+				overflowed = true;
+			}
+			if (!readChanges()) {
+				// The root itself went away; what the caches hold is rescanned one last time
+				overflowed = true;
+				flush();
+				break;
+			}
+		}
+
+		if (msUntilDue() == 0) {
+			flush();
+		}
+	}
+}
+
+#else
+
+#include <cerrno>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+// Creation, deletion and renames of entries, and changes to their data or metadata
+static const UINT32 INOTIFY_MASK =
+	IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_ONLYDIR;
+
+SourceWatcher::SourceWatcher() :
+	stopping(false),
+	overflowed(false),
+	events(0),
+	changes(0),
+	batches(0),
+	overflows(0),
+	watch_failures(0),
+	inotify_fd(-1),
+	wake_fd(-1)
+{
+}
+
+HRESULT SourceWatcher::start(
+	const std::wstring& sourceRoot,
+	const Options& watchOptions,
+	const ChangeHandler& changed,
+	const OverflowHandler& overflow
+) {
+	stop();
+	root = sourceRoot;
+	options = watchOptions;
+	onChange = changed;
+	onOverflow = overflow;
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (inotify_fd < 0 || wake_fd < 0) {
+		HRESULT hr = SourceFileSystem::errorFromErrno(errno);
+		stop();
+		return hr;
+	}
+
+	stopping = false;
+	thread = std::thread(&SourceWatcher::run, this);
+	return S_OK;
+}
+
+void SourceWatcher::stop()
+{
+	if (thread.joinable()) {
+		stopping = true;
+		UINT64 one = 1;
+		ssize_t written = write(wake_fd, &one, sizeof(one));
+		(void)written;
+		thread.join();
+	}
+
+	if (inotify_fd >= 0) {
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+	if (wake_fd >= 0) {
+		close(wake_fd);
+		wake_fd = -1;
+	}
+	watches.clear();
+	batch.clear();
+	batched.clear();
+	overflowed = false;
+}
+
+void SourceWatcher::watchTree(const std::wstring& path)
+{
+	std::vector<std::wstring> pending(1, path);
+	while (!pending.empty() && !stopping) {
+		std::wstring next = std::move(pending.back());
+		pending.pop_back();
+
+		int wd = inotify_add_watch(inotify_fd, SourceFileSystem::toNativePath(next).c_str(), INOTIFY_MASK);
+		if (wd < 0) {
+			// Most often the system's limit on watches; changes below go unnoticed
+			if (errno != ENOENT && errno != ENOTDIR) {
+				watch_failures.fetch_add(1, std::memory_order_relaxed);
+			}
+			continue;
+		}
+
+		// A directory reached again through a link keeps the watch, and path, it already has
+		if (!watches.emplace(wd, next).second) {
+			continue;
+		}
+
+		SourceFileSystem::listDirectory(next, [&](PCWSTR name, const PRJ_FILE_BASIC_INFO& fileInfo) {
+			if (fileInfo.IsDirectory) {
+				pending.push_back(next + L"\\" + name);
+			}
+		});
+	}
+}
+
+void SourceWatcher::unwatchTree(const std::wstring& path)
+{
+	for (auto it = watches.begin(); it != watches.end();) {
+		const std::wstring& watched = it->second;
+		if (watched.compare(0, path.size(), path) == 0 &&
+			(watched.size() == path.size() || watched[path.size()] == L'\\')) {
+			inotify_rm_watch(inotify_fd, it->first);
+			it = watches.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+void SourceWatcher::readEvents()
+{
+	alignas(inotify_event) char data[WATCH_BUFFER_BYTES];
+	for (;;) {
+		ssize_t bytes = read(inotify_fd, data, sizeof(data));
+		if (bytes <= 0) {
+			return;
+		}
+
+		for (char* next = data; next < data + bytes;) {
+			const inotify_event* event = reinterpret_cast<const inotify_event*>(next);
+			next += sizeof(inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				events.fetch_add(1, std::memory_order_relaxed);
+				overflowed = true;
+				continue;
+			}
+
+			auto watched = watches.find(event->wd);
+			if (event->mask & IN_IGNORED) {
+				if (watched != watches.end()) {
+					watches.erase(watched);
+				}
+				continue;
+			}
+			if (watched == watches.end()) {
+				continue;
+			}
+
+			// Events without a name are about the watched directory itself
+			if (event->len == 0 || event->name[0] == '\0') {
+				if (event->mask & IN_ATTRIB) {
+					record(watched->second, ACTION_MODIFIED, true);
+				}
+				continue;
+			}
+
+			std::wstring name = SourceFileSystem::fromNativePath(event->name);
+			if (ignored(name.c_str(), name.size())) {
+				continue;
+			}
+			std::wstring path = watched->second + L"\\" + name;
+			bool isDirectory = (event->mask & IN_ISDIR) != 0;
+			if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+				record(path, ACTION_ADDED, isDirectory);
+				if (isDirectory) {
+					watchTree(path);
+				}
+			} else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				record(path, ACTION_REMOVED, isDirectory);
+				if (isDirectory && (event->mask & IN_MOVED_FROM)) {
+					unwatchTree(path);
+				}
+			} else if (event->mask & (IN_MODIFY | IN_ATTRIB)) {
+				record(path, ACTION_MODIFIED, isDirectory);
+			}
+		}
+	}
+}
+
+void SourceWatcher::run()
+{
+	watchTree(root);
+
+	while (!stopping) {
+		pollfd fds[2] = {
+			{ inotify_fd, POLLIN, 0 },
+			{ wake_fd, POLLIN, 0 }
+		};
+		int ready = poll(fds, 2, msUntilDue());
+		if (ready < 0 && errno != EINTR) {
+			break;
+		}
+		if (fds[1].revents != 0) {
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			readEvents();
+		}
+		if (msUntilDue() == 0) {
+			flush();
+		}
+	}
+}
+
+#endif // _WIN32
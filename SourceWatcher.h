@@ -0,0 +1,140 @@
+#pragma once
+
+#include "pch.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+	Watches a source tree for changes made behind the provider's back: ReadDirectoryChangesW over
+	the whole tree on Windows, and inotify on Linux, where each directory needs a watch of its own
+	and is given one as it is found. Changes made before a directory is watched go unnoticed.
+
+	Events are gathered into batches, handed over once no event has come for a quiet period or
+	the batch has been open for the longest latency allowed. Repeated events for one path are
+	coalesced into a single change carrying every action seen, so a file written in many pieces
+	costs one change.
+
+	When the system drops events because the watcher fell behind, which paths changed is
+	unknown; the batch is discarded and the overflow handler is called instead, for the caller to
+	rescan what it holds.
+*/
+class SourceWatcher
+{
+public:
+	// What happened to a path; a change may carry several
+	enum Action {
+		ACTION_ADDED = 0x1,
+		ACTION_REMOVED = 0x2,
+		ACTION_MODIFIED = 0x4
+	};
+
+	class Change {
+	public:
+		std::wstring path;
+		UINT32 actions;
+		bool directory;
+		// False when the system could not say whether the path was a directory, as Windows cannot
+		// for a removed one; directory is false then
+		bool directory_known;
+	};
+
+	class Options {
+	public:
+		// Milliseconds without events after which a batch is handed over
+		UINT32 quiet_period;
+		// Milliseconds a batch may be held at most, however busy the source is
+		UINT32 max_latency;
+		// Distinct paths a batch holds before it is handed over early
+		size_t max_batch;
+		// Names starting with this are not reported, such as the temporary files of the watcher's
+		// own user; empty reports everything
+		std::wstring ignore_prefix;
+
+		Options() : quiet_period(20), max_latency(200), max_batch(4096) {}
+	};
+
+	// Called on the watcher's thread with each batch, and when events were lost
+	typedef std::function<void(const std::vector<Change>& changes)> ChangeHandler;
+	typedef std::function<void()> OverflowHandler;
+
+protected:
+	std::wstring root;
+	Options options;
+	ChangeHandler onChange;
+	OverflowHandler onOverflow;
+	std::thread thread;
+	std::atomic<bool> stopping;
+
+	// The batch being gathered, with where each path's change is in it
+	std::vector<Change> batch;
+	std::unordered_map<std::wstring, size_t> batched;
+	std::chrono::steady_clock::time_point batch_opened;
+	std::chrono::steady_clock::time_point last_event;
+	bool overflowed;
+
+	std::atomic<UINT64> events;
+	std::atomic<UINT64> changes;
+	std::atomic<UINT64> batches;
+	std::atomic<UINT64> overflows;
+	std::atomic<UINT64> watch_failures;
+
+#ifdef _WIN32
+	HANDLE directory;
+	HANDLE wake;
+	OVERLAPPED overlapped;
+	// DWORD aligned, as ReadDirectoryChangesW requires
+	std::vector<DWORD> buffer;
+
+	// Asks for the next batch of changes; false if the directory can no longer be watched
+	bool readChanges();
+	void parseChanges(DWORD bytes);
+#else
+	int inotify_fd;
+	int wake_fd;
+	// Watched directories by watch descriptor
+	std::unordered_map<int, std::wstring> watches;
+
+	// Watches path and every directory below it
+	void watchTree(const std::wstring& path);
+	// Drops the watches of path and every directory below it, once it has moved away
+	void unwatchTree(const std::wstring& path);
+	void readEvents();
+#endif
+
+	void run();
+
+	// Adds an event to the batch, coalescing it with the path's earlier ones
+	void record(const std::wstring& path, UINT32 action, bool isDirectory, bool directoryKnown = true);
+
+	// Whether name, the last component of a path, starts with options.ignore_prefix
+	bool ignored(const WCHAR* name, size_t length) const;
+
+	// Hands the batch, or the overflow, to the caller
+	void flush();
+
+	// Milliseconds until the batch is due, or -1 with nothing batched
+	int msUntilDue() const;
+
+public:
+	SourceWatcher();
+	~SourceWatcher();
+
+	SourceWatcher(const SourceWatcher&) = delete;
+	SourceWatcher& operator=(const SourceWatcher&) = delete;
+
+	// Starts watching sourceRoot on a thread of its own
+	HRESULT start(const std::wstring& sourceRoot, const Options& watchOptions, const ChangeHandler& changed, const OverflowHandler& overflow);
+
+	// Stops the thread; a batch still being gathered is dropped
+	void stop();
+
+	bool running() const { return thread.joinable(); }
+
+	void printStatistics(FILE* out);
+};
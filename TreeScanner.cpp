@@ -0,0 +1,288 @@
+#include "pch.h"
+#include "TreeScanner.h"
+#include "SourceFileSystem.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+// How long an idle worker waits for a push before looking around again
+static const std::chrono::milliseconds TREE_SCAN_IDLE_WAIT(2);
+
+TreeScanner::Options::Options() :
+	threads(std::max(1u, std::thread::hardware_concurrency())),
+	open_directories(0)
+{
+}
+
+void TreeScanner::Result::print(FILE* out) const
+{
+	double rate = seconds > 0 ? 1.0 / seconds : 0;
+	fprintf(out, "  tree scan: %llu directories read, %llu known, %llu files, %llu errors in %.3fs (%.0f dirs/s, %.0f files/s), %llu steals, peak %zu open\n",
+		static_cast<unsigned long long>(directories_read),
+		static_cast<unsigned long long>(directories_known),
+		static_cast<unsigned long long>(files),
+		static_cast<unsigned long long>(errors),
+		seconds,
+		(directories_read + directories_known) * rate,
+		files * rate,
+		static_cast<unsigned long long>(steals),
+		peak_open);
+}
+
+TreeScanner::TreeScanner(const Options& scanOptions) :
+	options(scanOptions),
+	pending(0),
+	cancelled(false),
+	open(0),
+	peak_open(0),
+	idle(0)
+{
+	options.threads = std::max(1u, options.threads);
+	if (options.open_directories == 0) {
+		options.open_directories = options.threads;
+	}
+}
+
+void TreeScanner::cancel()
+{
+	cancelled = true;
+	std::lock_guard<std::mutex> lock(idleMutex);
+	idleCondition.notify_all();
+}
+
+HRESULT TreeScanner::scan(
+	const std::wstring& root,
+	const KnownListing& knownListing,
+	const DirectoryRead& directoryRead,
+	Result& result
+) {
+	known = knownListing;
+	read = directoryRead;
+	cancelled = false;
+	peak_open = 0;
+	visited.clear();
+	workers.clear();
+	for (unsigned i = 0; i < options.threads; i++) {
+		workers.emplace_back(new Worker());
+		workers.back()->deque.reset(new WorkStealingDeque<Task>(DEQUE_CAPACITY));
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	Task* first = new Task();
+	first->path = root;
+	pending = 1;
+	push(0, first);
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < options.threads; i++) {
+		threads.emplace_back(&TreeScanner::run, this, i);
+	}
+	run(0);
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	// A cancelled scan leaves tasks behind
+	for (std::unique_ptr<Worker>& worker : workers) {
+		Task* task;
+		while ((task = worker->deque->steal()) != nullptr) {
+			delete task;
+		}
+		for (Task* overflowed : worker->overflow) {
+			delete overflowed;
+		}
+	}
+
+	result = Result();
+	for (const std::unique_ptr<Worker>& worker : workers) {
+		result.directories_read += worker->directories_read;
+		result.directories_known += worker->directories_known;
+		result.files += worker->files;
+		result.errors += worker->errors;
+		result.steals += worker->steals;
+	}
+	result.peak_open = peak_open;
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	workers.clear();
+	visited.clear();
+
+	if (cancelled) {
+		return HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+	}
+	return result.directories_read + result.directories_known == 0 ? HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND) : S_OK;
+}
+
+void TreeScanner::push(unsigned worker, Task* task)
+{
+	Worker& owner = *workers[worker];
+	if (!owner.deque->push(task)) {
+		owner.overflow.push_back(task);
+	}
+
+	// Pairs with the fence in run: either the sleeper sees the new task or we see the sleeper
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (idle.load() > 0) {
+		std::lock_guard<std::mutex> lock(idleMutex);
+		idleCondition.notify_one();
+	}
+}
+
+TreeScanner::Task* TreeScanner::findTask(unsigned worker)
+{
+	Worker& owner = *workers[worker];
+	Task* task = owner.deque->pop();
+	if (task != nullptr) {
+		return task;
+	}
+
+	// Move overflowed tasks back where thieves can reach them
+	if (!owner.overflow.empty()) {
+		task = owner.overflow.back();
+		owner.overflow.pop_back();
+		while (!owner.overflow.empty() && owner.deque->push(owner.overflow.back())) {
+			owner.overflow.pop_back();
+		}
+		return task;
+	}
+
+	size_t count = workers.size();
+	for (size_t i = 1; i < count; i++) {
+		task = workers[(worker + i) % count]->deque->steal();
+		if (task != nullptr) {
+			owner.steals++;
+			return task;
+		}
+	}
+	return nullptr;
+}
+
+void TreeScanner::run(unsigned worker)
+{
+	while (!cancelled) {
+		Task* task = findTask(worker);
+		if (task != nullptr) {
+			visit(worker, task);
+			continue;
+		}
+		if (pending.load() == 0) {
+			break;
+		}
+
+		// Register as idle and look once more before waiting. Tasks in another worker's overflow
+		// list are not announced when they become stealable, so the wait is bounded
+		std::unique_lock<std::mutex> lock(idleMutex);
+		idle++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		task = findTask(worker);
+		if (task == nullptr && pending.load() != 0 && !cancelled) {
+			idleCondition.wait_for(lock, TREE_SCAN_IDLE_WAIT);
+		}
+		idle--;
+		lock.unlock();
+
+		if (task != nullptr) {
+			visit(worker, task);
+		}
+	}
+
+	// The last directory finished; wake everyone so they see it
+	std::lock_guard<std::mutex> lock(idleMutex);
+	idleCondition.notify_all();
+}
+
+void TreeScanner::finishTask(Task* task)
+{
+	delete task;
+	pending.fetch_sub(1);
+}
+
+void TreeScanner::acquireOpen()
+{
+	std::unique_lock<std::mutex> lock(openMutex);
+	openCondition.wait(lock, [this] { return open < options.open_directories; });
+	open++;
+	peak_open = std::max(peak_open, open);
+}
+
+void TreeScanner::releaseOpen()
+{
+	{
+		std::lock_guard<std::mutex> lock(openMutex);
+		open--;
+	}
+	openCondition.notify_one();
+}
+
+void TreeScanner::visit(unsigned worker, Task* task)
+{
+	Worker& owner = *workers[worker];
+
+	// The identity gives the ChangeTime enumeration uses, and catches links that loop back
+	SourceFileSystem::FileIdentity identity;
+	if (FAILED(SourceFileSystem::getFileIdentity(task->path, identity))) {
+		owner.errors++;
+		finishTask(task);
+		return;
+	}
+	LARGE_INTEGER changeTime;
+	changeTime.QuadPart = identity.version;
+
+	{
+		std::lock_guard<std::mutex> lock(visitedMutex);
+		if (!visited.insert(std::make_pair(identity.volume, identity.file)).second) {
+			finishTask(task);
+			return;
+		}
+	}
+
+	std::shared_ptr<const DirectoryListing> listing = known ? known(task->path, changeTime) : nullptr;
+	std::unique_ptr<DirectoryStream> stream;
+	if (listing != nullptr) {
+		owner.directories_known++;
+	} else {
+		std::shared_ptr<DirectoryListing> loaded;
+		acquireOpen();
+		HRESULT hr = DirectoryStream::scan(options.stream_options, task->path, changeTime, loaded, stream);
+		releaseOpen();
+		if (FAILED(hr)) {
+			owner.errors++;
+			finishTask(task);
+			return;
+		}
+
+		owner.directories_read++;
+		if (loaded != nullptr) {
+			listing = loaded;
+			if (read) {
+				read(task->path, changeTime, listing);
+			}
+		}
+	}
+
+	auto found = [&](PCWSTR name, const PRJ_FILE_BASIC_INFO& fileInfo) {
+		if (!fileInfo.IsDirectory) {
+			owner.files++;
+			return;
+		}
+		Task* child = new Task();
+		child->path = task->path + L"\\" + name;
+		pending.fetch_add(1);
+		push(worker, child);
+	};
+
+	if (listing != nullptr) {
+		for (size_t i = 0; i < listing->size(); i++) {
+			found(listing->nameOf(i), listing->entryAt(i).fileInfo);
+		}
+	} else {
+		// Walking the whole stream persists its index for the enumerations to come
+		PCWSTR name;
+		const PRJ_FILE_BASIC_INFO* fileInfo;
+		while (stream->peek(name, fileInfo)) {
+			found(name, *fileInfo);
+			stream->next();
+		}
+	}
+	finishTask(task);
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "pch.h"
+#include "DirectoryListing.h"
+#include "DirectoryStream.h"
+#include "JobQueue.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/*
+	Parallel crawler of a source tree, for building and refreshing the provider's view of it
+	without one directory enumeration at a time. Each thread owns a work-stealing deque of
+	directories to visit: it pushes the subdirectories it finds onto its own deque and pops them
+	depth first, while idle threads steal from the other end of a busy thread's deque, which holds
+	the directories nearest the root and so the largest subtrees.
+
+	A directory is first checked against the caller's known listings at its current ChangeTime,
+	so a refresh of an unchanged tree costs a stat per directory. Otherwise it is read, and no
+	more than a bounded number of directories are open for reading at once, however many threads
+	there are. Directories too large to hold in memory are read as DirectoryStreams, which
+	persists their sorted index as they are walked.
+*/
+class TreeScanner
+{
+public:
+	class Options {
+	public:
+		unsigned threads;
+		// Directories open for reading at once; 0 allows one per thread
+		size_t open_directories;
+		// How directories too large for memory are spilled and indexed
+		DirectoryStream::Options stream_options;
+
+		Options();
+	};
+
+	class Result {
+	public:
+		UINT64 directories_read;
+		UINT64 directories_known;
+		UINT64 files;
+		UINT64 errors;
+		UINT64 steals;
+		size_t peak_open;
+		double seconds;
+
+		Result() :
+			directories_read(0),
+			directories_known(0),
+			files(0),
+			errors(0),
+			steals(0),
+			peak_open(0),
+			seconds(0)
+		{}
+
+		void print(FILE* out) const;
+	};
+
+	// A listing the caller already holds for a directory at changeTime, or nullptr to read it
+	typedef std::function<std::shared_ptr<const DirectoryListing>(
+		const std::wstring& path,
+		const LARGE_INTEGER& changeTime
+	)> KnownListing;
+
+	// Receives every directory read in memory, from the scanning threads
+	typedef std::function<void(
+		const std::wstring& path,
+		const LARGE_INTEGER& changeTime,
+		const std::shared_ptr<const DirectoryListing>& listing
+	)> DirectoryRead;
+
+protected:
+	class Task {
+	public:
+		std::wstring path;
+	};
+
+	// Each worker's deque is backed by a private overflow list for when it fills up
+	class Worker {
+	public:
+		std::unique_ptr<WorkStealingDeque<Task>> deque;
+		std::vector<Task*> overflow;
+		UINT64 directories_read;
+		UINT64 directories_known;
+		UINT64 files;
+		UINT64 errors;
+		UINT64 steals;
+
+		Worker() : directories_read(0), directories_known(0), files(0), errors(0), steals(0) {}
+	};
+
+	// Files are named by volume and file ID
+	class IdentityHash {
+	public:
+		size_t operator() (const std::pair<UINT64, UINT64>& id) const {
+			return static_cast<size_t>(id.first * 0x9e3779b97f4a7c15ull ^ id.second);
+		}
+	};
+
+	static const size_t DEQUE_CAPACITY = 4096;
+
+	Options options;
+	KnownListing known;
+	DirectoryRead read;
+	std::vector<std::unique_ptr<Worker>> workers;
+
+	// Directories found but not yet finished; the scan is over when it drops to zero
+	std::atomic<UINT64> pending;
+	std::atomic<bool> cancelled;
+
+	// Directories already visited, so links which loop back are not followed around again
+	std::mutex visitedMutex;
+	std::unordered_set<std::pair<UINT64, UINT64>, IdentityHash> visited;
+
+	// Bounds the directories open for reading
+	std::mutex openMutex;
+	std::condition_variable openCondition;
+	size_t open;
+	size_t peak_open;
+
+	// Idle workers wait here for a push
+	std::mutex idleMutex;
+	std::condition_variable idleCondition;
+	std::atomic<unsigned> idle;
+
+	void run(unsigned worker);
+	Task* findTask(unsigned worker);
+	void push(unsigned worker, Task* task);
+	void visit(unsigned worker, Task* task);
+	void finishTask(Task* task);
+
+	void acquireOpen();
+	void releaseOpen();
+
+public:
+	explicit TreeScanner(const Options& options);
+
+	TreeScanner(const TreeScanner&) = delete;
+	TreeScanner& operator=(const TreeScanner&) = delete;
+
+	// Walks the tree below root, root included, and returns once every directory was visited or
+	// the scan was cancelled
+	HRESULT scan(const std::wstring& root, const KnownListing& known, const DirectoryRead& read, Result& result);
+
+	// Makes a running scan stop early; directories not yet visited are skipped
+	void cancel();
+};
@@ -0,0 +1,205 @@
+#include "pch.h"
+#include "WriteBackQueue.h"
+
+#include <algorithm>
+
+WriteBackQueue::WriteBackQueue() :
+	dirty_bytes(0),
+	stopping(false),
+	draining(false),
+	flushing(0),
+	marked(0),
+	coalesced(0),
+	batches(0),
+	files_written(0),
+	bytes_written(0),
+	failures(0),
+	forced(0),
+	peak_dirty_bytes(0)
+{
+}
+
+void WriteBackQueue::setOptions(const Options& queueOptions)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	options = queueOptions;
+	options.batch_files = std::max<size_t>(1, options.batch_files);
+	changed.notify_all();
+}
+
+void WriteBackQueue::markDirty(const std::wstring& path, UINT64 bytes)
+{
+	marked.fetch_add(1, std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto found = dirty.find(path);
+	if (found == dirty.end()) {
+		Dirty file;
+		file.bytes = bytes;
+		file.due = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.delay);
+		file.writing = false;
+		file.redirtied = false;
+		dirty.emplace(path, file);
+		dirty_bytes += bytes;
+	} else {
+		// The file keeps the time it first became dirty, so a busy file is still written back
+		coalesced.fetch_add(1, std::memory_order_relaxed);
+		Dirty& file = found->second;
+		dirty_bytes = dirty_bytes - file.bytes + bytes;
+		file.bytes = bytes;
+		if (file.writing) {
+			file.redirtied = true;
+		}
+	}
+
+	if (dirty_bytes > peak_dirty_bytes.load(std::memory_order_relaxed)) {
+		peak_dirty_bytes.store(dirty_bytes, std::memory_order_relaxed);
+	}
+	changed.notify_all();
+}
+
+void WriteBackQueue::rename(const std::wstring& from, const std::wstring& to)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	auto found = dirty.find(from);
+	if (found == dirty.end()) {
+		return;
+	}
+
+	// A copy under way goes to the old name; the new one is copied afresh
+	UINT64 bytes = found->second.bytes;
+	if (found->second.writing) {
+		found->second.redirtied = false;
+	} else {
+		dirty_bytes -= bytes;
+		dirty.erase(found);
+	}
+	lock.unlock();
+	markDirty(to, bytes);
+}
+
+void WriteBackQueue::forget(const std::wstring& path)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto found = dirty.find(path);
+	if (found == dirty.end()) {
+		return;
+	}
+	if (found->second.writing) {
+		found->second.redirtied = false;
+		return;
+	}
+	dirty_bytes -= found->second.bytes;
+	dirty.erase(found);
+}
+
+bool WriteBackQueue::takeable(const Dirty& file, std::chrono::steady_clock::time_point now) const
+{
+	return !file.writing && (draining || flushing != 0 || dirty_bytes > options.dirty_limit || file.due <= now);
+}
+
+bool WriteBackQueue::takeBatch(std::vector<Entry>& batch)
+{
+	batch.clear();
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		if (stopping && !draining) {
+			return false;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		auto next = std::chrono::steady_clock::time_point::max();
+		bool overLimit = dirty_bytes > options.dirty_limit;
+		for (auto& file : dirty) {
+			if (takeable(file.second, now)) {
+				Entry entry;
+				entry.path = file.first;
+				entry.bytes = file.second.bytes;
+				batch.push_back(std::move(entry));
+				file.second.writing = true;
+				if (batch.size() >= options.batch_files) {
+					break;
+				}
+			} else if (!file.second.writing) {
+				next = std::min(next, file.second.due);
+			}
+		}
+
+		if (!batch.empty()) {
+			batches.fetch_add(1, std::memory_order_relaxed);
+			if (overLimit) {
+				forced.fetch_add(1, std::memory_order_relaxed);
+			}
+			return true;
+		}
+		if (draining && dirty.empty()) {
+			return false;
+		}
+
+		if (next == std::chrono::steady_clock::time_point::max()) {
+			changed.wait(lock);
+		} else {
+			changed.wait_until(lock, next);
+		}
+	}
+}
+
+void WriteBackQueue::finished(const Entry& entry, HRESULT hr)
+{
+	if (SUCCEEDED(hr)) {
+		files_written.fetch_add(1, std::memory_order_relaxed);
+		bytes_written.fetch_add(entry.bytes, std::memory_order_relaxed);
+	} else {
+		failures.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto found = dirty.find(entry.path);
+	if (found == dirty.end()) {
+		return;
+	}
+
+	// A failed copy is not retried until the file is modified again
+	Dirty& file = found->second;
+	if (file.redirtied) {
+		file.writing = false;
+		file.redirtied = false;
+		file.due = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.delay);
+	} else {
+		dirty_bytes -= file.bytes;
+		dirty.erase(found);
+	}
+	changed.notify_all();
+}
+
+void WriteBackQueue::flush()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	flushing++;
+	changed.notify_all();
+	changed.wait(lock, [this] { return dirty.empty() || (stopping && !draining); });
+	flushing--;
+}
+
+void WriteBackQueue::stop(bool drain)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	stopping = true;
+	draining = drain;
+	changed.notify_all();
+}
+
+void WriteBackQueue::printStatistics(FILE* out)
+{
+	static const char* const policies[] = { "none", "per file", "per batch" };
+	fprintf(out, "  write-back: %llu modifications, %llu coalesced, %llu files (%.1f MB) in %llu batches, %llu forced by the dirty limit, %llu failed, peak dirty %.1f MB, sync %s\n",
+		static_cast<unsigned long long>(marked.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(coalesced.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(files_written.load(std::memory_order_relaxed)),
+		bytes_written.load(std::memory_order_relaxed) / (1024.0 * 1024.0),
+		static_cast<unsigned long long>(batches.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(forced.load(std::memory_order_relaxed)),
+		static_cast<unsigned long long>(failures.load(std::memory_order_relaxed)),
+		peak_dirty_bytes.load(std::memory_order_relaxed) / (1024.0 * 1024.0),
+		policies[options.sync]);
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "pch.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+	Files modified in the virtualization root which are still to be copied back to the source.
+	Marking a file dirty only records its path and size, so the ProjFS callback reporting the
+	modification never waits on the source disk; the copies are made later, in batches, by
+	whoever takes them.
+
+	A file is written back once it has been dirty for the write-back delay, so a file closed
+	modified many times in quick succession is copied once. A file marked again while its copy is
+	being made is copied again after it. Once the dirty files add up to more than the dirty limit,
+	they are handed out without waiting for their delay.
+*/
+class WriteBackQueue
+{
+public:
+	// When copies reach stable storage before they replace the source file
+	enum SyncPolicy {
+		// Left to the system's own write-back
+		SYNC_NONE,
+		// Each copy is synced by the worker which made it
+		SYNC_FILE,
+		// The copies of a batch are synced together once all of them are made
+		SYNC_BATCH
+	};
+
+	class Options {
+	public:
+		// Milliseconds a file stays dirty before it is written back
+		UINT32 delay;
+		// Bytes of dirty files beyond which they are written back at once
+		UINT64 dirty_limit;
+		// Files handed out together
+		size_t batch_files;
+		SyncPolicy sync;
+
+		Options() : delay(500), dirty_limit(256ull * 1024 * 1024), batch_files(64), sync(SYNC_BATCH) {}
+	};
+
+	class Entry {
+	public:
+		// Relative to the virtualization root
+		std::wstring path;
+		UINT64 bytes;
+	};
+
+protected:
+	class Dirty {
+	public:
+		UINT64 bytes;
+		std::chrono::steady_clock::time_point due;
+		// Being copied; dirtied again while it was
+		bool writing;
+		bool redirtied;
+	};
+
+	Options options;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::unordered_map<std::wstring, Dirty> dirty;
+	UINT64 dirty_bytes;
+	bool stopping;
+	bool draining;
+	// Callers of flush() waiting; files are handed out without their delay meanwhile
+	unsigned flushing;
+
+	std::atomic<UINT64> marked;
+	std::atomic<UINT64> coalesced;
+	std::atomic<UINT64> batches;
+	std::atomic<UINT64> files_written;
+	std::atomic<UINT64> bytes_written;
+	std::atomic<UINT64> failures;
+	std::atomic<UINT64> forced;
+	std::atomic<UINT64> peak_dirty_bytes;
+
+	// Whether a file not being copied may be handed out now; the caller holds mutex
+	bool takeable(const Dirty& file, std::chrono::steady_clock::time_point now) const;
+
+public:
+	WriteBackQueue();
+
+	WriteBackQueue(const WriteBackQueue&) = delete;
+	WriteBackQueue& operator=(const WriteBackQueue&) = delete;
+
+	void setOptions(const Options& queueOptions);
+	const Options& getOptions() const { return options; }
+
+	// Records that a file was modified and is now bytes long
+	void markDirty(const std::wstring& path, UINT64 bytes);
+
+	// Follows a dirty file to its new name, or drops it once deleted
+	void rename(const std::wstring& from, const std::wstring& to);
+	void forget(const std::wstring& path);
+
+	/*
+		Blocks until files are due and hands out up to a batch of them, which are then being
+		written until finished() is called for each. Returns false once stopped, or once drained
+		of every dirty file.
+	*/
+	bool takeBatch(std::vector<Entry>& batch);
+
+	// Reports how the copy of a file handed out by takeBatch went
+	void finished(const Entry& entry, HRESULT hr);
+
+	// Hands out every dirty file without waiting for its delay, and blocks until all are written
+	// back or the queue is stopped
+	void flush();
+
+	// Ends takeBatch, either at once or once every dirty file has been handed out
+	void stop(bool drain);
+
+	void printStatistics(FILE* out);
+};
@@ -10,8 +10,13 @@
 #define PCH_H
 
 // TODO: add headers that you want to pre-compile here
+#ifdef _WIN32
+#define NOMINMAX
 #include <Windows.h>
 #include <projectedfslib.h>
+#else
+#include "SimProjFS.h"
+#endif
 #include <cstdio>
 #include <cstring>
 #include <cwchar>